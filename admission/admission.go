@@ -0,0 +1,275 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Package admission limits the rate at which reports are accepted, per metric and per client, so
+// that a single runaway client can't saturate the pipeline. Limits are checked with lock-free token
+// buckets before a report is validated or enters the pipeline.
+package admission
+
+import (
+	"flag"
+	"fmt"
+	"sort"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/GoogleCloudPlatform/ubbagent/clock"
+	"github.com/GoogleCloudPlatform/ubbagent/config"
+)
+
+// LocalClient identifies reports added through an SDK agent rather than a network interface.
+const LocalClient = "local"
+
+var maxClients = flag.Int("admission_max_clients", 10000, "maximum number of clients whose rate limits are tracked; when exceeded, idle clients and then the clients admitted least recently are forgotten")
+
+// RateLimitedError is returned when a report is rejected by a rate limit. The report may be retried
+// after RetryAfter.
+type RateLimitedError struct {
+	// Limit names the limit that rejected the report: "metric <name>" or "client <id>".
+	Limit      string
+	RetryAfter time.Duration
+}
+
+func (e *RateLimitedError) Error() string {
+	return fmt.Sprintf("admission: rate limit exceeded for %v; retry after %v", e.Limit, e.RetryAfter)
+}
+
+// Controller admits or rejects reports according to configured per-metric and per-client rate
+// limits. A Controller is threadsafe, and a nil Controller admits everything.
+type Controller struct {
+	clock   clock.Clock
+	metrics map[string]*bucket
+
+	clientLimit    *config.RateLimit
+	clients        sync.Map // client id to *bucket
+	clientCount    int64
+	clientRejected int64
+	maxClients     int64
+	// Serializes adding and evicting clients. Admitting a tracked client doesn't take it.
+	clientMutex sync.Mutex
+}
+
+// NewController creates a Controller enforcing the limits in cfg. It returns nil if cfg has none.
+func NewController(cfg *config.Config) *Controller {
+	return newController(cfg, clock.NewClock(), *maxClients)
+}
+
+func newController(cfg *config.Config, clock clock.Clock, maxClients int) *Controller {
+	c := &Controller{clock: clock, metrics: make(map[string]*bucket), maxClients: int64(maxClients)}
+	for _, m := range cfg.Metrics {
+		if m.RateLimit != nil {
+			c.metrics[m.Name] = newBucket(*m.RateLimit)
+		}
+	}
+	if cfg.Admission != nil {
+		c.clientLimit = cfg.Admission.PerClient
+	}
+	if len(c.metrics) == 0 && c.clientLimit == nil {
+		return nil
+	}
+	return c
+}
+
+// Admit returns nil if a report for metric from client is within its limits, consuming a token from
+// each applicable bucket, or a *RateLimitedError if it is not. The client limit is checked first,
+// so a runaway client doesn't consume its metrics' shared capacity. A report rejected by its metric
+// limit gives the client's token back, so it consumes neither limit.
+func (c *Controller) Admit(client, metric string) error {
+	if c == nil {
+		return nil
+	}
+	now := c.clock.Now().UnixNano()
+	var cb *bucket
+	if c.clientLimit != nil {
+		cb = c.clientBucket(client, now)
+		if ok, retry := cb.take(now); !ok {
+			atomic.AddInt64(&c.clientRejected, 1)
+			return &RateLimitedError{Limit: "client " + client, RetryAfter: retry}
+		}
+	}
+	if b := c.metrics[metric]; b != nil {
+		if ok, retry := b.take(now); !ok {
+			if cb != nil {
+				cb.refund()
+			}
+			return &RateLimitedError{Limit: "metric " + metric, RetryAfter: retry}
+		}
+	}
+	return nil
+}
+
+// clientBucket returns client's bucket, adding one if the client isn't tracked. If maxClients are
+// tracked, some are evicted first; see evictClients.
+func (c *Controller) clientBucket(client string, now int64) *bucket {
+	if b, ok := c.clients.Load(client); ok {
+		return b.(*bucket)
+	}
+	c.clientMutex.Lock()
+	defer c.clientMutex.Unlock()
+	if b, ok := c.clients.Load(client); ok {
+		return b.(*bucket)
+	}
+	if atomic.LoadInt64(&c.clientCount) >= c.maxClients {
+		c.evictClients(now)
+	}
+	b := newBucket(*c.clientLimit)
+	c.clients.Store(client, b)
+	atomic.AddInt64(&c.clientCount, 1)
+	return b
+}
+
+// evictClients makes room for new clients. It forgets every idle client, whose bucket is full and
+// so the same as a new one. If that isn't enough, it also forgets the clients admitted least
+// recently, down to 7/8 of maxClients so that eviction is rare. Clients being limited are therefore
+// forgotten last, and a caller inventing client ids can't reset their limits. Must be called while
+// holding clientMutex.
+func (c *Controller) evictClients(now int64) {
+	type tracked struct {
+		client string
+		tat    int64
+	}
+	var active []tracked
+	c.clients.Range(func(k, v interface{}) bool {
+		tat := atomic.LoadInt64(&v.(*bucket).tat)
+		if tat <= now {
+			c.clients.Delete(k)
+			atomic.AddInt64(&c.clientCount, -1)
+		} else {
+			active = append(active, tracked{k.(string), tat})
+		}
+		return true
+	})
+	target := c.maxClients - c.maxClients/8 - 1
+	if excess := int(atomic.LoadInt64(&c.clientCount) - target); excess > 0 {
+		if excess > len(active) {
+			excess = len(active)
+		}
+		// A bucket's theoretical arrival time advances with each report it admits, so the smallest
+		// were admitted least recently.
+		sort.Slice(active, func(i, j int) bool { return active[i].tat < active[j].tat })
+		for _, t := range active[:excess] {
+			c.clients.Delete(t.client)
+			atomic.AddInt64(&c.clientCount, -1)
+		}
+	}
+}
+
+// Snapshot contains the configured limits and the number of reports each has rejected.
+type Snapshot struct {
+	Metrics   map[string]LimitSnapshot `json:"metrics"`
+	PerClient *ClientLimitSnapshot     `json:"perClient,omitempty"`
+}
+
+type LimitSnapshot struct {
+	ReportsPerSecond float64 `json:"reportsPerSecond"`
+	Burst            int64   `json:"burst"`
+	Rejected         int64   `json:"rejected"`
+}
+
+type ClientLimitSnapshot struct {
+	LimitSnapshot
+
+	// Clients is the number of clients currently tracked.
+	Clients int64 `json:"clients"`
+
+	// RejectedByClient counts rejections for each tracked client that has had any.
+	RejectedByClient map[string]int64 `json:"rejectedByClient,omitempty"`
+}
+
+// Snapshot returns the current rejection counts. It returns an empty Snapshot for a nil Controller.
+func (c *Controller) Snapshot() Snapshot {
+	s := Snapshot{Metrics: make(map[string]LimitSnapshot)}
+	if c == nil {
+		return s
+	}
+	for name, b := range c.metrics {
+		s.Metrics[name] = b.snapshot()
+	}
+	if c.clientLimit != nil {
+		cs := &ClientLimitSnapshot{
+			LimitSnapshot: LimitSnapshot{
+				ReportsPerSecond: c.clientLimit.ReportsPerSecond,
+				Burst:            c.clientLimit.BurstOrDefault(),
+				Rejected:         atomic.LoadInt64(&c.clientRejected),
+			},
+			Clients: atomic.LoadInt64(&c.clientCount),
+		}
+		c.clients.Range(func(k, v interface{}) bool {
+			if r := atomic.LoadInt64(&v.(*bucket).rejected); r > 0 {
+				if cs.RejectedByClient == nil {
+					cs.RejectedByClient = make(map[string]int64)
+				}
+				cs.RejectedByClient[k.(string)] = r
+			}
+			return true
+		})
+		s.PerClient = cs
+	}
+	return s
+}
+
+// bucket is a token bucket, implemented as the equivalent generic cell rate algorithm: rather than
+// a token count and refill time, it keeps a single "theoretical arrival time" (tat) that is advanced
+// by one interval per admitted report, and rejects a report that would advance it more than the
+// burst's worth of intervals past now. A single int64 can be updated with compare-and-swap, so
+// admission never takes a lock.
+type bucket struct {
+	limit     config.RateLimit
+	interval  int64 // nanoseconds per token
+	tolerance int64 // nanoseconds of burst
+	tat       int64
+	rejected  int64
+}
+
+func newBucket(limit config.RateLimit) *bucket {
+	interval := int64(float64(time.Second) / limit.ReportsPerSecond)
+	if interval < 1 {
+		interval = 1
+	}
+	return &bucket{limit: limit, interval: interval, tolerance: interval * limit.BurstOrDefault()}
+}
+
+// take consumes a token at time now (in nanoseconds), or returns false and the time until a token
+// is available.
+func (b *bucket) take(now int64) (bool, time.Duration) {
+	for {
+		tat := atomic.LoadInt64(&b.tat)
+		start := tat
+		if start < now {
+			start = now
+		}
+		next := start + b.interval
+		if over := next - now - b.tolerance; over > 0 {
+			atomic.AddInt64(&b.rejected, 1)
+			return false, time.Duration(over)
+		}
+		if atomic.CompareAndSwapInt64(&b.tat, tat, next) {
+			return true, 0
+		}
+	}
+}
+
+// refund returns a token consumed by take.
+func (b *bucket) refund() {
+	atomic.AddInt64(&b.tat, -b.interval)
+}
+
+func (b *bucket) snapshot() LimitSnapshot {
+	return LimitSnapshot{
+		ReportsPerSecond: b.limit.ReportsPerSecond,
+		Burst:            b.limit.BurstOrDefault(),
+		Rejected:         atomic.LoadInt64(&b.rejected),
+	}
+}
@@ -0,0 +1,209 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package admission
+
+import (
+	"fmt"
+	"sync"
+	"sync/atomic"
+	"testing"
+	"time"
+
+	"github.com/GoogleCloudPlatform/ubbagent/config"
+	"github.com/GoogleCloudPlatform/ubbagent/metrics"
+	"github.com/GoogleCloudPlatform/ubbagent/testlib"
+)
+
+func newTestConfig(metricLimit, clientLimit *config.RateLimit) *config.Config {
+	cfg := &config.Config{
+		Metrics: config.Metrics{
+			{Definition: metrics.Definition{Name: "limited", Type: "int"}, RateLimit: metricLimit},
+			{Definition: metrics.Definition{Name: "unlimited", Type: "int"}},
+		},
+	}
+	if clientLimit != nil {
+		cfg.Admission = &config.Admission{PerClient: clientLimit}
+	}
+	return cfg
+}
+
+func TestController(t *testing.T) {
+	t.Run("no limits", func(t *testing.T) {
+		c := newController(newTestConfig(nil, nil), testlib.NewMockClock(), 10)
+		if c != nil {
+			t.Fatalf("controller: want=nil, got=%+v", c)
+		}
+		if err := c.Admit("client", "limited"); err != nil {
+			t.Fatalf("nil controller: unexpected error: %+v", err)
+		}
+	})
+
+	t.Run("metric limit", func(t *testing.T) {
+		mc := testlib.NewMockClock()
+		mc.SetNow(time.Unix(1000, 0))
+		c := newController(newTestConfig(&config.RateLimit{ReportsPerSecond: 10, Burst: 3}, nil), mc, 10)
+
+		// The burst is admitted at once, then one report per 100ms.
+		for i := 0; i < 3; i++ {
+			if err := c.Admit("client", "limited"); err != nil {
+				t.Fatalf("report %v: unexpected error: %+v", i, err)
+			}
+		}
+		err := c.Admit("client", "limited")
+		rle, ok := err.(*RateLimitedError)
+		if !ok {
+			t.Fatalf("over limit: want=*RateLimitedError, got=%+v", err)
+		}
+		if want := "metric limited"; rle.Limit != want {
+			t.Fatalf("Limit: want=%v, got=%v", want, rle.Limit)
+		}
+		if want := 100 * time.Millisecond; rle.RetryAfter != want {
+			t.Fatalf("RetryAfter: want=%v, got=%v", want, rle.RetryAfter)
+		}
+		for i := 0; i < 100; i++ {
+			if err := c.Admit("client", "unlimited"); err != nil {
+				t.Fatalf("unlimited metric: unexpected error: %+v", err)
+			}
+		}
+
+		mc.SetNow(time.Unix(1000, 0).Add(100 * time.Millisecond))
+		if err := c.Admit("client", "limited"); err != nil {
+			t.Fatalf("after refill: unexpected error: %+v", err)
+		}
+		if err := c.Admit("client", "limited"); err == nil {
+			t.Fatal("after refill: expected error")
+		}
+
+		s := c.Snapshot()
+		if want, got := (LimitSnapshot{ReportsPerSecond: 10, Burst: 3, Rejected: 2}), s.Metrics["limited"]; want != got {
+			t.Fatalf("snapshot: want=%+v, got=%+v", want, got)
+		}
+		if s.PerClient != nil {
+			t.Fatalf("snapshot.PerClient: want=nil, got=%+v", s.PerClient)
+		}
+	})
+
+	t.Run("client limit", func(t *testing.T) {
+		mc := testlib.NewMockClock()
+		mc.SetNow(time.Unix(1000, 0))
+		c := newController(newTestConfig(nil, &config.RateLimit{ReportsPerSecond: 1, Burst: 2}), mc, 10)
+
+		for i := 0; i < 2; i++ {
+			if err := c.Admit("noisy", "unlimited"); err != nil {
+				t.Fatalf("report %v: unexpected error: %+v", i, err)
+			}
+		}
+		err := c.Admit("noisy", "unlimited")
+		if rle, ok := err.(*RateLimitedError); !ok || rle.Limit != "client noisy" {
+			t.Fatalf("over limit: want=client noisy, got=%+v", err)
+		}
+		// Other clients are unaffected.
+		if err := c.Admit("quiet", "unlimited"); err != nil {
+			t.Fatalf("other client: unexpected error: %+v", err)
+		}
+
+		s := c.Snapshot()
+		if s.PerClient == nil || s.PerClient.Rejected != 1 || s.PerClient.Clients != 2 {
+			t.Fatalf("snapshot.PerClient: want=(rejected 1, clients 2), got=%+v", s.PerClient)
+		}
+		if want, got := int64(1), s.PerClient.RejectedByClient["noisy"]; want != got || len(s.PerClient.RejectedByClient) != 1 {
+			t.Fatalf("RejectedByClient: want=map[noisy:1], got=%v", s.PerClient.RejectedByClient)
+		}
+	})
+
+	t.Run("client tracking is bounded", func(t *testing.T) {
+		c := newController(newTestConfig(nil, &config.RateLimit{ReportsPerSecond: 1}), testlib.NewMockClock(), 10)
+		for i := 0; i < 25; i++ {
+			c.Admit(string(rune('a'+i)), "unlimited")
+		}
+		if got := c.Snapshot().PerClient.Clients; got > 10 {
+			t.Fatalf("tracked clients: want<=10, got=%v", got)
+		}
+	})
+
+	t.Run("new clients don't reset limited clients", func(t *testing.T) {
+		mc := testlib.NewMockClock()
+		mc.SetNow(time.Unix(1000, 0))
+		c := newController(newTestConfig(nil, &config.RateLimit{ReportsPerSecond: 1, Burst: 2}), mc, 10)
+		for i := 0; i < 2; i++ {
+			c.Admit("noisy", "unlimited")
+		}
+		for i := 0; i < 100; i++ {
+			if err := c.Admit(fmt.Sprintf("rotating-%v", i), "unlimited"); err != nil {
+				t.Fatalf("new client %v: unexpected error: %+v", i, err)
+			}
+			if err := c.Admit("noisy", "unlimited"); err == nil {
+				t.Fatalf("limited client after %v new clients: expected error", i+1)
+			}
+		}
+		if got := c.Snapshot().PerClient.Clients; got > 10 {
+			t.Fatalf("tracked clients: want<=10, got=%v", got)
+		}
+	})
+
+	t.Run("a report rejected by its metric doesn't consume client quota", func(t *testing.T) {
+		mc := testlib.NewMockClock()
+		mc.SetNow(time.Unix(1000, 0))
+		c := newController(newTestConfig(&config.RateLimit{ReportsPerSecond: 1, Burst: 1}, &config.RateLimit{ReportsPerSecond: 1, Burst: 2}), mc, 10)
+		if err := c.Admit("client", "limited"); err != nil {
+			t.Fatalf("first report: unexpected error: %+v", err)
+		}
+		err := c.Admit("client", "limited")
+		if rle, ok := err.(*RateLimitedError); !ok || rle.Limit != "metric limited" {
+			t.Fatalf("over metric limit: want=metric limited, got=%+v", err)
+		}
+		// The client has one token left.
+		if err := c.Admit("client", "unlimited"); err != nil {
+			t.Fatalf("client's second token: unexpected error: %+v", err)
+		}
+		err = c.Admit("client", "unlimited")
+		if rle, ok := err.(*RateLimitedError); !ok || rle.Limit != "client client" {
+			t.Fatalf("over client limit: want=client client, got=%+v", err)
+		}
+	})
+
+	t.Run("concurrent admission", func(t *testing.T) {
+		mc := testlib.NewMockClock()
+		mc.SetNow(time.Unix(1000, 0))
+		c := newController(newTestConfig(&config.RateLimit{ReportsPerSecond: 1, Burst: 500}, nil), mc, 10)
+
+		var admitted int64
+		var wg sync.WaitGroup
+		for g := 0; g < 8; g++ {
+			wg.Add(1)
+			go func() {
+				defer wg.Done()
+				for i := 0; i < 200; i++ {
+					if c.Admit("client", "limited") == nil {
+						atomic.AddInt64(&admitted, 1)
+					}
+				}
+			}()
+		}
+		wg.Wait()
+		if want, got := int64(500), admitted; want != got {
+			t.Fatalf("admitted: want=%v, got=%v", want, got)
+		}
+	})
+}
+
+func BenchmarkAdmit(b *testing.B) {
+	c := NewController(newTestConfig(&config.RateLimit{ReportsPerSecond: 1e9}, &config.RateLimit{ReportsPerSecond: 1e9}))
+	b.RunParallel(func(pb *testing.PB) {
+		for pb.Next() {
+			c.Admit("client", "limited")
+		}
+	})
+}
@@ -0,0 +1,273 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Package archive reads and writes compacted, columnar archives of metric reports. An archive
+// holds one row group per metric. Each row group stores its report ids, start times, end times,
+// label sets, and values in separately compressed column chunks, so a reader decompresses only the
+// row groups and columns it needs. Label sets are dictionary-encoded across the whole archive.
+//
+// File layout:
+//
+//	magic | column chunks... | footer (JSON) | footer length (uint32, little endian) | magic
+//
+// The footer indexes each row group by metric name and time range, and records the offset and
+// length of each of its column chunks.
+package archive
+
+import (
+	"bytes"
+	"compress/flate"
+	"encoding/binary"
+	"encoding/json"
+	"errors"
+	"io"
+	"math"
+	"sort"
+	"time"
+
+	"github.com/GoogleCloudPlatform/ubbagent/metrics"
+)
+
+const (
+	magic = "UBAR"
+
+	// Suffix is the file name suffix used for archives.
+	Suffix = ".ubar"
+)
+
+// ErrCorrupt is returned when an archive is malformed.
+var ErrCorrupt = errors.New("archive: corrupt archive")
+
+// A Column identifies a set of columns that a Scan should decode. The metric name is always
+// available.
+type Column uint
+
+const (
+	ColumnId Column = 1 << iota
+	ColumnTimes
+	ColumnLabels
+	ColumnValue
+
+	ColumnAll = ColumnId | ColumnTimes | ColumnLabels | ColumnValue
+)
+
+// RowGroup describes the reports for a single metric within an archive.
+type RowGroup struct {
+	Metric   string
+	Rows     int
+	MinStart time.Time
+	MaxEnd   time.Time
+
+	Ids          chunk
+	StartTimes   chunk
+	EndTimes     chunk
+	Labels       chunk
+	Int64Values  chunk
+	DoubleValues chunk
+}
+
+type chunk struct {
+	Offset int64
+	Length int64
+}
+
+type footer struct {
+	LabelSets chunk
+	Groups    []RowGroup
+}
+
+// Write writes reports to w as an archive. Reports are grouped by metric and sorted by start time.
+func Write(w io.Writer, reports []metrics.StampedMetricReport) error {
+	sorted := make([]metrics.StampedMetricReport, len(reports))
+	copy(sorted, reports)
+	sort.SliceStable(sorted, func(i, j int) bool {
+		if sorted[i].Name != sorted[j].Name {
+			return sorted[i].Name < sorted[j].Name
+		}
+		return sorted[i].StartTime.Before(sorted[j].StartTime)
+	})
+
+	cw := &countingWriter{w: w}
+	if _, err := io.WriteString(cw, magic); err != nil {
+		return err
+	}
+
+	// Build the label set dictionary.
+	dict := newLabelDictionary()
+	labelIndexes := make([]uint64, len(sorted))
+	for i := range sorted {
+		labelIndexes[i] = dict.index(sorted[i].Labels)
+	}
+
+	var f footer
+	for start := 0; start < len(sorted); {
+		end := start
+		for end < len(sorted) && sorted[end].Name == sorted[start].Name {
+			end++
+		}
+		rows := sorted[start:end]
+		g := RowGroup{Metric: rows[0].Name, Rows: len(rows), MinStart: rows[0].StartTime.UTC()}
+		var ids, starts, ends, labels, ints, doubles encoder
+		prevStart := int64(0)
+		for i, r := range rows {
+			ids.string(r.Id)
+			s := r.StartTime.UnixNano()
+			starts.varint(s - prevStart)
+			prevStart = s
+			ends.varint(r.EndTime.UnixNano() - s)
+			labels.uvarint(labelIndexes[start+i])
+			ints.varint(r.Value.Int64Value)
+			doubles.uvarint(math.Float64bits(r.Value.DoubleValue))
+			if r.EndTime.After(g.MaxEnd) {
+				g.MaxEnd = r.EndTime.UTC()
+			}
+		}
+		var err error
+		for _, c := range []struct {
+			enc *encoder
+			ref *chunk
+		}{
+			{&ids, &g.Ids},
+			{&starts, &g.StartTimes},
+			{&ends, &g.EndTimes},
+			{&labels, &g.Labels},
+			{&ints, &g.Int64Values},
+			{&doubles, &g.DoubleValues},
+		} {
+			if *c.ref, err = writeChunk(cw, c.enc.buf.Bytes()); err != nil {
+				return err
+			}
+		}
+		f.Groups = append(f.Groups, g)
+		start = end
+	}
+
+	var err error
+	if f.LabelSets, err = writeChunk(cw, dict.encode()); err != nil {
+		return err
+	}
+
+	footerData, err := json.Marshal(f)
+	if err != nil {
+		return err
+	}
+	if _, err := cw.Write(footerData); err != nil {
+		return err
+	}
+	var trailer [4]byte
+	binary.LittleEndian.PutUint32(trailer[:], uint32(len(footerData)))
+	if _, err := cw.Write(trailer[:]); err != nil {
+		return err
+	}
+	_, err = io.WriteString(cw, magic)
+	return err
+}
+
+func writeChunk(cw *countingWriter, data []byte) (chunk, error) {
+	c := chunk{Offset: cw.n}
+	fw, err := flate.NewWriter(cw, flate.DefaultCompression)
+	if err != nil {
+		return c, err
+	}
+	if _, err := fw.Write(data); err != nil {
+		return c, err
+	}
+	if err := fw.Close(); err != nil {
+		return c, err
+	}
+	c.Length = cw.n - c.Offset
+	return c, nil
+}
+
+type countingWriter struct {
+	w io.Writer
+	n int64
+}
+
+func (cw *countingWriter) Write(p []byte) (int, error) {
+	n, err := cw.w.Write(p)
+	cw.n += int64(n)
+	return n, err
+}
+
+// labelDictionary assigns an index to each distinct label set.
+type labelDictionary struct {
+	indexes map[string]uint64
+	sets    []map[string]string
+}
+
+func newLabelDictionary() *labelDictionary {
+	return &labelDictionary{indexes: make(map[string]uint64)}
+}
+
+func (d *labelDictionary) index(labels map[string]string) uint64 {
+	keys := make([]string, 0, len(labels))
+	for k := range labels {
+		keys = append(keys, k)
+	}
+	sort.Strings(keys)
+	var canonical bytes.Buffer
+	for _, k := range keys {
+		canonical.WriteString(k)
+		canonical.WriteByte(0)
+		canonical.WriteString(labels[k])
+		canonical.WriteByte(0)
+	}
+	key := canonical.String()
+	if i, ok := d.indexes[key]; ok {
+		return i
+	}
+	i := uint64(len(d.sets))
+	d.indexes[key] = i
+	d.sets = append(d.sets, labels)
+	return i
+}
+
+func (d *labelDictionary) encode() []byte {
+	var e encoder
+	e.uvarint(uint64(len(d.sets)))
+	for _, set := range d.sets {
+		keys := make([]string, 0, len(set))
+		for k := range set {
+			keys = append(keys, k)
+		}
+		sort.Strings(keys)
+		e.uvarint(uint64(len(keys)))
+		for _, k := range keys {
+			e.string(k)
+			e.string(set[k])
+		}
+	}
+	return e.buf.Bytes()
+}
+
+type encoder struct {
+	buf     bytes.Buffer
+	scratch [binary.MaxVarintLen64]byte
+}
+
+func (e *encoder) uvarint(v uint64) {
+	n := binary.PutUvarint(e.scratch[:], v)
+	e.buf.Write(e.scratch[:n])
+}
+
+func (e *encoder) varint(v int64) {
+	n := binary.PutVarint(e.scratch[:], v)
+	e.buf.Write(e.scratch[:n])
+}
+
+func (e *encoder) string(s string) {
+	e.uvarint(uint64(len(s)))
+	e.buf.WriteString(s)
+}
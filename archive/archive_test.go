@@ -0,0 +1,226 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package archive_test
+
+import (
+	"bytes"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"testing"
+	"time"
+
+	"github.com/GoogleCloudPlatform/ubbagent/archive"
+	"github.com/GoogleCloudPlatform/ubbagent/metrics"
+)
+
+func testReports() []metrics.StampedMetricReport {
+	return []metrics.StampedMetricReport{
+		{
+			Id: "r1",
+			MetricReport: metrics.MetricReport{
+				Name:      "int-metric",
+				StartTime: time.Unix(100, 0).UTC(),
+				EndTime:   time.Unix(110, 0).UTC(),
+				Labels:    map[string]string{"foo": "bar"},
+				Value:     metrics.MetricValue{Int64Value: 10},
+			},
+		},
+		{
+			Id: "r2",
+			MetricReport: metrics.MetricReport{
+				Name:      "double-metric",
+				StartTime: time.Unix(50, 0).UTC(),
+				EndTime:   time.Unix(60, 0).UTC(),
+				Value:     metrics.MetricValue{DoubleValue: 1.5},
+			},
+		},
+		{
+			Id: "r3",
+			MetricReport: metrics.MetricReport{
+				Name:      "int-metric",
+				StartTime: time.Unix(0, 0).UTC(),
+				EndTime:   time.Unix(10, 0).UTC(),
+				Labels:    map[string]string{"foo": "bar"},
+				Value:     metrics.MetricValue{Int64Value: -3},
+			},
+		},
+	}
+}
+
+func writeReader(t testing.TB, reports []metrics.StampedMetricReport) *archive.Reader {
+	var buf bytes.Buffer
+	if err := archive.Write(&buf, reports); err != nil {
+		t.Fatalf("unexpected write error: %v", err)
+	}
+	r, err := archive.NewReader(bytes.NewReader(buf.Bytes()), int64(buf.Len()))
+	if err != nil {
+		t.Fatalf("unexpected open error: %v", err)
+	}
+	return r
+}
+
+func scanAll(t *testing.T, r *archive.Reader, q archive.Query) []metrics.StampedMetricReport {
+	var reports []metrics.StampedMetricReport
+	if err := r.Scan(q, func(report metrics.StampedMetricReport) error {
+		reports = append(reports, report)
+		return nil
+	}); err != nil {
+		t.Fatalf("unexpected scan error: %v", err)
+	}
+	return reports
+}
+
+func TestArchive(t *testing.T) {
+	in := testReports()
+	r := writeReader(t, in)
+
+	t.Run("round trip", func(t *testing.T) {
+		out := scanAll(t, r, archive.Query{Columns: archive.ColumnAll})
+		// Reports are grouped by metric and sorted by start time.
+		expected := []metrics.StampedMetricReport{in[1], in[2], in[0]}
+		if want, got := len(expected), len(out); want != got {
+			t.Fatalf("len(reports): want=%v, got=%v", want, got)
+		}
+		for i := range expected {
+			if !expected[i].Equal(out[i]) {
+				t.Fatalf("reports[%v]: want=%+v, got=%+v", i, expected[i], out[i])
+			}
+		}
+	})
+
+	t.Run("footer index", func(t *testing.T) {
+		groups := r.RowGroups()
+		if want, got := 2, len(groups); want != got {
+			t.Fatalf("len(groups): want=%v, got=%v", want, got)
+		}
+		g := groups[1]
+		if g.Metric != "int-metric" || g.Rows != 2 || !g.MinStart.Equal(time.Unix(0, 0)) || !g.MaxEnd.Equal(time.Unix(110, 0)) {
+			t.Fatalf("unexpected row group: %+v", g)
+		}
+	})
+
+	t.Run("only requested columns are decoded", func(t *testing.T) {
+		out := scanAll(t, r, archive.Query{Metric: "int-metric", Columns: archive.ColumnValue})
+		if want, got := 2, len(out); want != got {
+			t.Fatalf("len(reports): want=%v, got=%v", want, got)
+		}
+		for _, report := range out {
+			if report.Id != "" || report.Labels != nil || !report.StartTime.IsZero() {
+				t.Fatalf("unexpected decoded columns: %+v", report)
+			}
+		}
+		if want, got := int64(7), out[0].Value.Int64Value+out[1].Value.Int64Value; want != got {
+			t.Fatalf("sum: want=%v, got=%v", want, got)
+		}
+	})
+
+	t.Run("time filter", func(t *testing.T) {
+		out := scanAll(t, r, archive.Query{From: time.Unix(55, 0), To: time.Unix(105, 0), Columns: archive.ColumnId})
+		if want, got := 2, len(out); want != got {
+			t.Fatalf("len(reports): want=%v, got=%v", want, got)
+		}
+		if out[0].Id != "r2" || out[1].Id != "r1" {
+			t.Fatalf("unexpected reports: %+v", out)
+		}
+	})
+
+	t.Run("corrupt archive", func(t *testing.T) {
+		if _, err := archive.NewReader(bytes.NewReader([]byte("not an archive")), 14); err != archive.ErrCorrupt {
+			t.Fatalf("NewReader: want=%v, got=%v", archive.ErrCorrupt, err)
+		}
+	})
+}
+
+func TestScanDir(t *testing.T) {
+	dir, err := ioutil.TempDir("", "archive_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(dir)
+
+	in := testReports()
+	write := func(name string, reports []metrics.StampedMetricReport) {
+		var buf bytes.Buffer
+		if err := archive.Write(&buf, reports); err != nil {
+			t.Fatalf("unexpected write error: %v", err)
+		}
+		if err := ioutil.WriteFile(filepath.Join(dir, name), buf.Bytes(), 0644); err != nil {
+			t.Fatalf("unexpected write error: %v", err)
+		}
+	}
+	day := archive.Day(time.Unix(0, 0))
+	write(archive.DayFile(day), in)
+	// A segment that was merged but not yet removed duplicates a report.
+	write(archive.SegmentFile(day, time.Unix(0, 0), 1), in[:1])
+	write("unrelated.txt", nil)
+
+	count := 0
+	if err := archive.ScanDir(dir, archive.Query{}, func(metrics.StampedMetricReport) error {
+		count++
+		return nil
+	}); err != nil {
+		t.Fatalf("unexpected scan error: %v", err)
+	}
+	if want, got := 3, count; want != got {
+		t.Fatalf("count: want=%v, got=%v", want, got)
+	}
+}
+
+func TestFileDay(t *testing.T) {
+	for name, want := range map[string]string{
+		archive.DayFile("2018-01-02"):                                   "2018-01-02",
+		archive.SegmentFile("2018-01-02", time.Unix(0, 0), 3):           "2018-01-02",
+		"archive_bogus" + archive.Suffix:                                "",
+		"report_2018-01-02T00:00:00Z_abcde.json":                        "",
+		".tmp_" + archive.SegmentFile("2018-01-02", time.Unix(0, 0), 1): "",
+	} {
+		got, _ := archive.FileDay(name)
+		if want != got {
+			t.Fatalf("FileDay(%v): want=%v, got=%v", name, want, got)
+		}
+	}
+}
+
+// BenchmarkScanValues measures summing one metric's values over an archive of a day of reports
+// spread over several metrics and label sets.
+func BenchmarkScanValues(b *testing.B) {
+	const rows = 1000000
+	reports := make([]metrics.StampedMetricReport, rows)
+	start := time.Unix(1500000000, 0).UTC()
+	for i := range reports {
+		t := start.Add(time.Duration(i) * 86400 * time.Second / rows)
+		reports[i] = metrics.StampedMetricReport{
+			Id: fmt.Sprintf("report-%v", i),
+			MetricReport: metrics.MetricReport{
+				Name:      fmt.Sprintf("metric-%v", i%4),
+				StartTime: t,
+				EndTime:   t.Add(time.Minute),
+				Labels:    map[string]string{"consumer": fmt.Sprintf("c%v", i%100)},
+				Value:     metrics.MetricValue{Int64Value: int64(i % 10)},
+			},
+		}
+	}
+	r := writeReader(b, reports)
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		var sum int64
+		r.Scan(archive.Query{Metric: "metric-1", Columns: archive.ColumnValue}, func(report metrics.StampedMetricReport) error {
+			sum += report.Value.Int64Value
+			return nil
+		})
+	}
+}
@@ -0,0 +1,366 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package archive
+
+import (
+	"bytes"
+	"compress/flate"
+	"encoding/binary"
+	"encoding/json"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"math"
+	"os"
+	"path/filepath"
+	"sort"
+	"strings"
+	"time"
+
+	"github.com/GoogleCloudPlatform/ubbagent/metrics"
+)
+
+// Query selects reports from an archive. Zero-valued fields match everything.
+type Query struct {
+	// Metric restricts the scan to a single metric.
+	Metric string
+
+	// From and To restrict the scan to reports whose [StartTime, EndTime] range overlaps [From, To).
+	From time.Time
+	To   time.Time
+
+	// Columns lists the columns to decode. Fields of other columns are left zero-valued.
+	Columns Column
+}
+
+// Reader reads an archive file.
+type Reader struct {
+	r         io.ReaderAt
+	closer    io.Closer
+	footer    footer
+	labelSets []map[string]string
+}
+
+// Open opens the archive at path.
+func Open(path string) (*Reader, error) {
+	f, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	info, err := f.Stat()
+	if err != nil {
+		f.Close()
+		return nil, err
+	}
+	r, err := NewReader(f, info.Size())
+	if err != nil {
+		f.Close()
+		return nil, err
+	}
+	r.closer = f
+	return r, nil
+}
+
+// NewReader creates a Reader over an archive of the given size held in r.
+func NewReader(r io.ReaderAt, size int64) (*Reader, error) {
+	trailerLen := int64(4 + len(magic))
+	if size < int64(len(magic))+trailerLen {
+		return nil, ErrCorrupt
+	}
+	trailer := make([]byte, trailerLen)
+	if _, err := r.ReadAt(trailer, size-trailerLen); err != nil {
+		return nil, err
+	}
+	if string(trailer[4:]) != magic {
+		return nil, ErrCorrupt
+	}
+	footerLen := int64(binary.LittleEndian.Uint32(trailer[:4]))
+	if footerLen > size-trailerLen-int64(len(magic)) {
+		return nil, ErrCorrupt
+	}
+	footerData := make([]byte, footerLen)
+	if _, err := r.ReadAt(footerData, size-trailerLen-footerLen); err != nil {
+		return nil, err
+	}
+	reader := &Reader{r: r}
+	if err := json.Unmarshal(footerData, &reader.footer); err != nil {
+		return nil, ErrCorrupt
+	}
+	return reader, nil
+}
+
+// Close closes the underlying file, if the Reader was created with Open.
+func (r *Reader) Close() error {
+	if r.closer != nil {
+		return r.closer.Close()
+	}
+	return nil
+}
+
+// RowGroups returns the archive's footer index: one entry per metric.
+func (r *Reader) RowGroups() []RowGroup {
+	return r.footer.Groups
+}
+
+// Scan calls fn for each report matching q. Only the row groups and columns needed to evaluate
+// and answer q are read. Scan stops and returns the first error returned by fn. Reports with the
+// same labels share a single Labels map, which must not be modified.
+func (r *Reader) Scan(q Query, fn func(metrics.StampedMetricReport) error) error {
+	timeFilter := !q.From.IsZero() || !q.To.IsZero()
+	columns := q.Columns
+	if timeFilter {
+		columns |= ColumnTimes
+	}
+	if columns&ColumnLabels != 0 && r.labelSets == nil {
+		if err := r.loadLabelSets(); err != nil {
+			return err
+		}
+	}
+	for _, g := range r.footer.Groups {
+		if q.Metric != "" && q.Metric != g.Metric {
+			continue
+		}
+		if !q.From.IsZero() && !g.MaxEnd.After(q.From) {
+			continue
+		}
+		if !q.To.IsZero() && !g.MinStart.Before(q.To) {
+			continue
+		}
+		if err := r.scanGroup(g, q, columns, timeFilter, fn); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+func (r *Reader) scanGroup(g RowGroup, q Query, columns Column, timeFilter bool, fn func(metrics.StampedMetricReport) error) error {
+	var ids, starts, ends, labels, ints, doubles *decoder
+	var err error
+	load := func(want Column, c chunk) *decoder {
+		if err != nil || columns&want == 0 {
+			return nil
+		}
+		var d *decoder
+		d, err = r.readChunk(c)
+		return d
+	}
+	ids = load(ColumnId, g.Ids)
+	starts = load(ColumnTimes, g.StartTimes)
+	ends = load(ColumnTimes, g.EndTimes)
+	labels = load(ColumnLabels, g.Labels)
+	ints = load(ColumnValue, g.Int64Values)
+	doubles = load(ColumnValue, g.DoubleValues)
+	if err != nil {
+		return err
+	}
+
+	prevStart := int64(0)
+	for i := 0; i < g.Rows; i++ {
+		report := metrics.StampedMetricReport{MetricReport: metrics.MetricReport{Name: g.Metric}}
+		if ids != nil {
+			report.Id = ids.string()
+		}
+		if starts != nil {
+			s := prevStart + starts.varint()
+			prevStart = s
+			report.StartTime = time.Unix(0, s).UTC()
+			report.EndTime = time.Unix(0, s+ends.varint()).UTC()
+		}
+		if labels != nil {
+			idx := labels.uvarint()
+			if idx >= uint64(len(r.labelSets)) {
+				return ErrCorrupt
+			}
+			report.Labels = r.labelSets[idx]
+		}
+		if ints != nil {
+			report.Value.Int64Value = ints.varint()
+			report.Value.DoubleValue = math.Float64frombits(doubles.uvarint())
+		}
+		for _, d := range []*decoder{ids, starts, ends, labels, ints, doubles} {
+			if d != nil && d.err != nil {
+				return d.err
+			}
+		}
+		if timeFilter {
+			if !q.From.IsZero() && !report.EndTime.After(q.From) {
+				continue
+			}
+			if !q.To.IsZero() && !report.StartTime.Before(q.To) {
+				continue
+			}
+		}
+		if err := fn(report); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+func (r *Reader) loadLabelSets() error {
+	d, err := r.readChunk(r.footer.LabelSets)
+	if err != nil {
+		return err
+	}
+	n := d.uvarint()
+	sets := make([]map[string]string, 0, n)
+	for i := uint64(0); i < n && d.err == nil; i++ {
+		pairs := d.uvarint()
+		var set map[string]string
+		if pairs > 0 {
+			set = make(map[string]string, pairs)
+		}
+		for j := uint64(0); j < pairs && d.err == nil; j++ {
+			k := d.string()
+			set[k] = d.string()
+		}
+		sets = append(sets, set)
+	}
+	if d.err != nil {
+		return d.err
+	}
+	r.labelSets = sets
+	return nil
+}
+
+func (r *Reader) readChunk(c chunk) (*decoder, error) {
+	compressed := io.NewSectionReader(r.r, c.Offset, c.Length)
+	data, err := ioutil.ReadAll(flate.NewReader(compressed))
+	if err != nil {
+		return nil, err
+	}
+	return &decoder{r: bytes.NewReader(data)}, nil
+}
+
+// decoder reads varint-encoded values, remembering the first error.
+type decoder struct {
+	r   *bytes.Reader
+	err error
+}
+
+func (d *decoder) uvarint() uint64 {
+	if d.err != nil {
+		return 0
+	}
+	v, err := binary.ReadUvarint(d.r)
+	if err != nil {
+		d.err = ErrCorrupt
+	}
+	return v
+}
+
+func (d *decoder) varint() int64 {
+	if d.err != nil {
+		return 0
+	}
+	v, err := binary.ReadVarint(d.r)
+	if err != nil {
+		d.err = ErrCorrupt
+	}
+	return v
+}
+
+func (d *decoder) string() string {
+	n := d.uvarint()
+	if d.err != nil {
+		return ""
+	}
+	if n > uint64(d.r.Len()) {
+		d.err = ErrCorrupt
+		return ""
+	}
+	b := make([]byte, n)
+	d.r.Read(b)
+	return string(b)
+}
+
+// DayFile returns the name of the archive holding the given UTC day's reports.
+func DayFile(day string) string {
+	return "archive_" + day + Suffix
+}
+
+// SegmentFile returns the name of a segment of the given day's reports written at the given time.
+// The writer chooses seq to distinguish segments written at the same time. Segments are merged into
+// the day's archive once the day has ended.
+func SegmentFile(day string, written time.Time, seq int) string {
+	return fmt.Sprintf("segment_%v_%v-%v%v", day, written.UTC().Format("150405.000000000"), seq, Suffix)
+}
+
+// Day returns the UTC day, formatted as used in archive file names, that contains t.
+func Day(t time.Time) string {
+	return t.UTC().Format("2006-01-02")
+}
+
+// FileDay returns the day of an archive or segment file name, or false if name is not one.
+func FileDay(name string) (string, bool) {
+	if !strings.HasSuffix(name, Suffix) {
+		return "", false
+	}
+	parts := strings.Split(strings.TrimSuffix(name, Suffix), "_")
+	if (parts[0] == "archive" && len(parts) == 2) || (parts[0] == "segment" && len(parts) == 3) {
+		if _, err := time.Parse("2006-01-02", parts[1]); err == nil {
+			return parts[1], true
+		}
+	}
+	return "", false
+}
+
+// ScanDir scans every archive and segment in dir whose day may contain reports matching q. A report
+// can briefly be present in more than one file while segments are merged, so reports are
+// deduplicated by id; the id column is always read.
+func ScanDir(dir string, q Query, fn func(metrics.StampedMetricReport) error) error {
+	files, err := ioutil.ReadDir(dir)
+	if err != nil {
+		return err
+	}
+	var names []string
+	for _, f := range files {
+		day, ok := FileDay(f.Name())
+		if !ok {
+			continue
+		}
+		// A report is filed under the day of its end time, so earlier days cannot match. Later days
+		// may hold long reports that started before To; their footers are checked instead.
+		if !q.From.IsZero() && day < Day(q.From) {
+			continue
+		}
+		names = append(names, f.Name())
+	}
+	sort.Strings(names)
+
+	q.Columns |= ColumnId
+	seen := make(map[string]bool)
+	for _, name := range names {
+		r, err := Open(filepath.Join(dir, name))
+		if os.IsNotExist(err) {
+			// A segment removed by a concurrent merge; its reports are in the day's archive.
+			continue
+		} else if err != nil {
+			return err
+		}
+		err = r.Scan(q, func(report metrics.StampedMetricReport) error {
+			if seen[report.Id] {
+				return nil
+			}
+			seen[report.Id] = true
+			return fn(report)
+		})
+		r.Close()
+		if err != nil {
+			return err
+		}
+	}
+	return nil
+}
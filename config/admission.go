@@ -0,0 +1,66 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package config
+
+import (
+	"errors"
+	"fmt"
+	"math"
+)
+
+// Admission configures limits on the reports accepted by the agent.
+type Admission struct {
+	// PerClient limits the reports accepted from each client. Clients are identified by the agent's
+	// interface: the HTTP interface uses a Client-Id header, or the peer address.
+	PerClient *RateLimit `json:"perClient"`
+}
+
+func (a *Admission) Validate(c *Config) error {
+	if a.PerClient == nil {
+		return errors.New("admission: missing perClient rate limit")
+	}
+	if err := a.PerClient.Validate(); err != nil {
+		return fmt.Errorf("admission: perClient: %v", err)
+	}
+	return nil
+}
+
+// RateLimit is a token bucket limit on the number of reports accepted.
+type RateLimit struct {
+	// The sustained number of reports accepted per second.
+	ReportsPerSecond float64 `json:"reportsPerSecond"`
+
+	// The number of reports that may be accepted at once after a quiet period. Defaults to
+	// ReportsPerSecond, rounded up.
+	Burst int64 `json:"burst"`
+}
+
+func (l *RateLimit) Validate() error {
+	if l.ReportsPerSecond <= 0 {
+		return errors.New("reportsPerSecond must be > 0")
+	}
+	if l.Burst < 0 {
+		return errors.New("burst must be >= 0")
+	}
+	return nil
+}
+
+// BurstOrDefault returns Burst, or ReportsPerSecond rounded up if Burst is unset.
+func (l *RateLimit) BurstOrDefault() int64 {
+	if l.Burst > 0 {
+		return l.Burst
+	}
+	return int64(math.Ceil(l.ReportsPerSecond))
+}
@@ -0,0 +1,86 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package config_test
+
+import (
+	"testing"
+
+	"github.com/GoogleCloudPlatform/ubbagent/config"
+	"github.com/GoogleCloudPlatform/ubbagent/metrics"
+)
+
+func TestAdmission_Validate(t *testing.T) {
+	newConfig := func(metricLimit *config.RateLimit, admission *config.Admission) *config.Config {
+		return &config.Config{
+			Metrics: config.Metrics{
+				{
+					Definition:  metrics.Definition{Name: "int-metric", Type: "int"},
+					Endpoints:   []config.MetricEndpoint{{Name: "disk"}},
+					Passthrough: &config.Passthrough{},
+					RateLimit:   metricLimit,
+				},
+			},
+			Endpoints: config.Endpoints{
+				{
+					Name: "disk",
+					Disk: &config.DiskEndpoint{ReportDir: "/tmp/foo1", ExpireSeconds: 3600},
+				},
+			},
+			Admission: admission,
+		}
+	}
+
+	t.Run("valid", func(t *testing.T) {
+		c := newConfig(&config.RateLimit{ReportsPerSecond: 10, Burst: 100}, &config.Admission{PerClient: &config.RateLimit{ReportsPerSecond: 0.5}})
+		if err := c.Validate(); err != nil {
+			t.Fatalf("unexpected error: %+v", err)
+		}
+	})
+
+	tests := []struct {
+		name string
+		conf *config.Config
+		want string
+	}{
+		{"zero metric rate", newConfig(&config.RateLimit{}, nil), "metric int-metric: rateLimit: reportsPerSecond must be > 0"},
+		{"negative burst", newConfig(&config.RateLimit{ReportsPerSecond: 1, Burst: -1}, nil), "metric int-metric: rateLimit: burst must be >= 0"},
+		{"missing client limit", newConfig(nil, &config.Admission{}), "admission: missing perClient rate limit"},
+		{"zero client rate", newConfig(nil, &config.Admission{PerClient: &config.RateLimit{}}), "admission: perClient: reportsPerSecond must be > 0"},
+	}
+	for _, test := range tests {
+		t.Run(test.name, func(t *testing.T) {
+			err := test.conf.Validate()
+			if err == nil || err.Error() != test.want {
+				t.Fatalf("Validate: want=%v, got=%v", test.want, err)
+			}
+		})
+	}
+}
+
+func TestRateLimit_BurstOrDefault(t *testing.T) {
+	tests := []struct {
+		limit config.RateLimit
+		want  int64
+	}{
+		{config.RateLimit{ReportsPerSecond: 10, Burst: 3}, 3},
+		{config.RateLimit{ReportsPerSecond: 10}, 10},
+		{config.RateLimit{ReportsPerSecond: 0.5}, 1},
+	}
+	for _, test := range tests {
+		if got := test.limit.BurstOrDefault(); got != test.want {
+			t.Fatalf("BurstOrDefault(%+v): want=%v, got=%v", test.limit, test.want, got)
+		}
+	}
+}
@@ -28,6 +28,7 @@ type Config struct {
 	Endpoints  Endpoints  `json:"endpoints"`
 	Sources    Sources    `json:"sources"`
 	Filters    Filters    `json:"filters"`
+	Admission  *Admission `json:"admission"`
 }
 
 // Validation
@@ -73,6 +74,11 @@ func (c *Config) Validate() error {
 	if err := c.Filters.Validate(c); err != nil {
 		return err
 	}
+	if c.Admission != nil {
+		if err := c.Admission.Validate(c); err != nil {
+			return err
+		}
+	}
 
 	return nil
 }
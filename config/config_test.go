@@ -635,6 +635,35 @@ endpoints:
 			t.Fatalf("wanted: %+v, got: %+v", want, got)
 		}
 	})
+
+	t.Run("disk report directories", func(t *testing.T) {
+		tests := []struct {
+			disk config.DiskEndpoint
+			want string
+		}{
+			{config.DiskEndpoint{ReportDirs: []string{"/mnt/a", "/mnt/b"}}, ""},
+			{config.DiskEndpoint{ReportDir: "/tmp", ReportDirs: []string{"/mnt/a"}}, "disk: reportDir and reportDirs are mutually exclusive"},
+			{config.DiskEndpoint{ReportDirs: []string{"/mnt/a", ""}}, "disk: empty report directory"},
+			{config.DiskEndpoint{ReportDirs: []string{"/mnt/a", "/mnt/a/"}}, "disk: duplicate report directory: /mnt/a/"},
+		}
+		for _, test := range tests {
+			c := &config.Config{
+				Identities: goodIdentities,
+				Metrics:    goodMetrics,
+				Endpoints:  []config.Endpoint{{Name: "disk", Disk: &test.disk}},
+			}
+			err := c.Validate()
+			if test.want == "" && err != nil {
+				t.Fatalf("%+v: unexpected error: %+v", test.disk, err)
+			}
+			if test.want != "" && (err == nil || err.Error() != test.want) {
+				t.Fatalf("%+v: wanted: %+v, got: %+v", test.disk, test.want, err)
+			}
+		}
+		if want, got := []string{"/tmp"}, (&config.DiskEndpoint{ReportDir: "/tmp"}).Dirs(); !reflect.DeepEqual(want, got) {
+			t.Fatalf("Dirs: wanted: %+v, got: %+v", want, got)
+		}
+	})
 }
 
 func yamlEqual(want, got []byte) bool {
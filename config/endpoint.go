@@ -17,8 +17,10 @@ package config
 import (
 	"errors"
 	"fmt"
+	"path/filepath"
 	"reflect"
 	"strings"
+	"time"
 )
 
 // Type Endpoints is a Validatable collection of Endpoint objects.
@@ -85,20 +87,81 @@ func (e *Endpoint) Validate(c *Config) error {
 }
 
 type DiskEndpoint struct {
-	ReportDir     string `json:"reportDir"`
-	ExpireSeconds int64  `json:"expireSeconds"`
+	ReportDir string `json:"reportDir"`
+
+	// ReportDirs, used instead of ReportDir, stripes report files across several directories, which
+	// may be on separate devices. Each report is written to one directory chosen by its ID.
+	ReportDirs []string `json:"reportDirs"`
+
+	ExpireSeconds int64 `json:"expireSeconds"`
+
+	// Archive, if set, periodically compacts report files into daily columnar archives.
+	Archive *DiskArchive `json:"archive"`
 }
 
 func (e *DiskEndpoint) Validate(c *Config) error {
 	if e.ExpireSeconds < 0 {
 		return errors.New("disk: expireSeconds must not be negative")
 	}
-	if e.ReportDir == "" {
+	if e.ReportDir != "" && len(e.ReportDirs) > 0 {
+		return errors.New("disk: reportDir and reportDirs are mutually exclusive")
+	}
+	if e.ReportDir == "" && len(e.ReportDirs) == 0 {
 		return errors.New("disk: missing report directory")
 	}
+	seen := make(map[string]bool)
+	for _, dir := range e.ReportDirs {
+		if dir == "" {
+			return errors.New("disk: empty report directory")
+		}
+		clean := filepath.Clean(dir)
+		if seen[clean] {
+			return fmt.Errorf("disk: duplicate report directory: %v", dir)
+		}
+		seen[clean] = true
+	}
+	if e.Archive != nil && e.Archive.ArchiveDir == "" {
+		return errors.New("disk: missing archive directory")
+	}
+	if e.Archive != nil && e.Archive.RetentionDays < 0 {
+		return errors.New("disk: archive retentionDays must not be negative")
+	}
 	return nil
 }
 
+// Dirs returns the configured report directories: ReportDirs, or ReportDir alone.
+func (e *DiskEndpoint) Dirs() []string {
+	if len(e.ReportDirs) > 0 {
+		return e.ReportDirs
+	}
+	return []string{e.ReportDir}
+}
+
+// ArchiveRetention returns how long archived days are kept, or 0 if they're kept indefinitely.
+func (e *DiskEndpoint) ArchiveRetention() time.Duration {
+	if e.Archive == nil {
+		return 0
+	}
+	return time.Duration(e.Archive.RetentionDays) * 24 * time.Hour
+}
+
+// DiskArchive configures compaction of a DiskEndpoint's report files. See package archive.
+type DiskArchive struct {
+	ArchiveDir string `json:"archiveDir"`
+
+	// RetentionDays, if positive, removes each day's archive once the day ended more than this many
+	// days ago. Archived reports aren't subject to the endpoint's ExpireSeconds.
+	RetentionDays int64 `json:"retentionDays"`
+}
+
+// ArchiveDir returns the configured archive directory, or "" if archiving is disabled.
+func (e *DiskEndpoint) ArchiveDir() string {
+	if e.Archive == nil {
+		return ""
+	}
+	return e.Archive.ArchiveDir
+}
+
 type ServiceControlEndpoint struct {
 	Identity    string `json:"identity"`
 	ServiceName string `json:"serviceName"`
@@ -18,16 +18,18 @@ import (
 	"errors"
 	"fmt"
 	"reflect"
+	"regexp"
 )
 
 type Filter struct {
 	// oneof
 	AddLabels *AddLabels `json:"addLabels"`
+	Route     *Route     `json:"route"`
 }
 
 func (f *Filter) Validate(c *Config) error {
 	types := 0
-	for _, v := range []Validatable{f.AddLabels} {
+	for _, v := range []Validatable{f.AddLabels, f.Route} {
 		if reflect.ValueOf(v).IsNil() {
 			continue
 		}
@@ -83,3 +85,92 @@ func (f *AddLabels) IncludedLabels() map[string]string {
 	}
 	return included
 }
+
+// Route restricts which reports are sent to a set of endpoints. A report of one of the listed
+// metrics (or of any metric, if none are listed) is sent to the listed endpoints only if its labels
+// satisfy every predicate. If several routes govern the same metric and endpoint, a report is sent
+// when any of them matches. Endpoints not governed by a route receive every report as usual.
+type Route struct {
+	Metrics   []string         `json:"metrics"`
+	Endpoints []string         `json:"endpoints"`
+	Labels    []LabelPredicate `json:"labels"`
+}
+
+func (r *Route) Validate(c *Config) error {
+	if len(r.Endpoints) == 0 {
+		return errors.New("route: missing endpoints")
+	}
+	for _, e := range r.Endpoints {
+		if !c.Endpoints.exists(e) {
+			return fmt.Errorf("route: endpoint does not exist: %v", e)
+		}
+	}
+	for _, m := range r.Metrics {
+		if c.Metrics.GetMetricDefinition(m) == nil {
+			return fmt.Errorf("route: metric does not exist: %v", m)
+		}
+	}
+	if len(r.Labels) == 0 {
+		return errors.New("route: missing labels")
+	}
+	for i := range r.Labels {
+		if err := r.Labels[i].Validate(c); err != nil {
+			return fmt.Errorf("route: %v", err)
+		}
+	}
+	return nil
+}
+
+// Governs returns whether this route applies to the given metric and endpoint.
+func (r *Route) Governs(metric, endpoint string) bool {
+	return (len(r.Metrics) == 0 || contains(r.Metrics, metric)) && contains(r.Endpoints, endpoint)
+}
+
+// LabelPredicate tests the value of a single label. A report without the label never matches.
+type LabelPredicate struct {
+	Key string `json:"key"`
+
+	// oneof
+	Equals *string  `json:"equals"`
+	In     []string `json:"in"`
+	Prefix *string  `json:"prefix"`
+	Regex  *string  `json:"regex"`
+}
+
+func (p *LabelPredicate) Validate(c *Config) error {
+	if p.Key == "" {
+		return errors.New("label predicate missing key")
+	}
+	types := 0
+	if p.Equals != nil {
+		types++
+	}
+	if p.In != nil {
+		types++
+	}
+	if p.Prefix != nil {
+		types++
+	}
+	if p.Regex != nil {
+		if _, err := regexp.Compile(*p.Regex); err != nil {
+			return fmt.Errorf("label %v: invalid regex: %v", p.Key, err)
+		}
+		types++
+	}
+	if types == 0 {
+		return fmt.Errorf("label %v: missing predicate", p.Key)
+	}
+	if types > 1 {
+		return fmt.Errorf("label %v: multiple predicates", p.Key)
+	}
+	return nil
+}
+
+func contains(list []string, s string) bool {
+	for _, v := range list {
+		if v == s {
+			return true
+		}
+	}
+	return false
+}
@@ -90,6 +90,121 @@ func TestFilters_Validate(t *testing.T) {
 			t.Fatalf("validate error: want=%v, got=%v", expected, err.Error())
 		}
 	})
+
+	tier := "gold"
+	prefix := "us-"
+	badRegex := "(["
+	tests := []struct {
+		name     string
+		route    config.Route
+		expected string
+	}{
+		{
+			name: "valid route",
+			route: config.Route{
+				Metrics:   []string{"int-metric"},
+				Endpoints: []string{"disk"},
+				Labels: []config.LabelPredicate{
+					{Key: "tier", Equals: &tier},
+					{Key: "region", Prefix: &prefix},
+					{Key: "zone", In: []string{"a", "b"}},
+				},
+			},
+		},
+		{
+			name:     "invalid route: missing endpoints",
+			route:    config.Route{Labels: []config.LabelPredicate{{Key: "tier", Equals: &tier}}},
+			expected: "route: missing endpoints",
+		},
+		{
+			name: "invalid route: unknown endpoint",
+			route: config.Route{
+				Endpoints: []string{"bogus"},
+				Labels:    []config.LabelPredicate{{Key: "tier", Equals: &tier}},
+			},
+			expected: "route: endpoint does not exist: bogus",
+		},
+		{
+			name: "invalid route: unknown metric",
+			route: config.Route{
+				Metrics:   []string{"bogus"},
+				Endpoints: []string{"disk"},
+				Labels:    []config.LabelPredicate{{Key: "tier", Equals: &tier}},
+			},
+			expected: "route: metric does not exist: bogus",
+		},
+		{
+			name:     "invalid route: missing labels",
+			route:    config.Route{Endpoints: []string{"disk"}},
+			expected: "route: missing labels",
+		},
+		{
+			name: "invalid route: missing key",
+			route: config.Route{
+				Endpoints: []string{"disk"},
+				Labels:    []config.LabelPredicate{{Equals: &tier}},
+			},
+			expected: "route: label predicate missing key",
+		},
+		{
+			name: "invalid route: missing predicate",
+			route: config.Route{
+				Endpoints: []string{"disk"},
+				Labels:    []config.LabelPredicate{{Key: "tier"}},
+			},
+			expected: "route: label tier: missing predicate",
+		},
+		{
+			name: "invalid route: multiple predicates",
+			route: config.Route{
+				Endpoints: []string{"disk"},
+				Labels:    []config.LabelPredicate{{Key: "tier", Equals: &tier, Prefix: &prefix}},
+			},
+			expected: "route: label tier: multiple predicates",
+		},
+		{
+			name: "invalid route: bad regex",
+			route: config.Route{
+				Endpoints: []string{"disk"},
+				Labels:    []config.LabelPredicate{{Key: "tier", Regex: &badRegex}},
+			},
+			expected: "route: label tier: invalid regex: error parsing regexp: missing closing ]: `[`",
+		},
+	}
+	for _, tc := range tests {
+		t.Run(tc.name, func(t *testing.T) {
+			c := conf
+			route := tc.route
+			c.Filters = config.Filters{{Route: &route}}
+			err := c.Validate()
+			if tc.expected == "" {
+				if err != nil {
+					t.Fatalf("unexpected validate error: %v", err)
+				}
+			} else if err == nil {
+				t.Fatal("expected validate error, got nil")
+			} else if err.Error() != tc.expected {
+				t.Fatalf("validate error: want=%v, got=%v", tc.expected, err.Error())
+			}
+		})
+	}
+}
+
+func TestRoute_Governs(t *testing.T) {
+	r := config.Route{Metrics: []string{"m1"}, Endpoints: []string{"e1"}}
+	if !r.Governs("m1", "e1") {
+		t.Fatal("Governs(m1, e1): want=true, got=false")
+	}
+	if r.Governs("m2", "e1") {
+		t.Fatal("Governs(m2, e1): want=false, got=true")
+	}
+	if r.Governs("m1", "e2") {
+		t.Fatal("Governs(m1, e2): want=false, got=true")
+	}
+	r.Metrics = nil
+	if !r.Governs("m2", "e1") {
+		t.Fatal("Governs(m2, e1) with no metrics: want=true, got=false")
+	}
 }
 
 func TestAddLabels_IncludedLabels(t *testing.T) {
@@ -33,6 +33,9 @@ type Metric struct {
 	// oneof - buffering configuration
 	Aggregation *Aggregation `json:"aggregation"`
 	Passthrough *Passthrough `json:"passthrough"`
+
+	// RateLimit optionally limits the reports accepted for this metric.
+	RateLimit *RateLimit `json:"rateLimit"`
 }
 
 func (m *Metric) Validate(c *Config) error {
@@ -62,6 +65,12 @@ func (m *Metric) Validate(c *Config) error {
 		return fmt.Errorf("metric %v: no endpoints defined", m.Name)
 	}
 
+	if m.RateLimit != nil {
+		if err := m.RateLimit.Validate(); err != nil {
+			return fmt.Errorf("metric %v: rateLimit: %v", m.Name, err)
+		}
+	}
+
 	usedEndpoints := make(map[string]bool)
 	for _, e := range m.Endpoints {
 		if e.Name == "" {
@@ -115,12 +124,20 @@ type MetricEndpoint struct {
 type Aggregation struct {
 	// The number of seconds that metrics should be aggregated prior to forwarding
 	BufferSeconds int64 `json:"bufferSeconds"`
+
+	// Optional: if greater than BufferSeconds, the aggregation period stretches towards this many
+	// seconds while the metric's endpoints are failing or backlogged, and shrinks back to
+	// BufferSeconds when they recover.
+	MaxBufferSeconds int64 `json:"maxBufferSeconds"`
 }
 
 func (rm *Aggregation) Validate(m *Metric, c *Config) error {
 	if rm.BufferSeconds <= 0 {
 		return fmt.Errorf("bufferSeconds must be > 0")
 	}
+	if rm.MaxBufferSeconds != 0 && rm.MaxBufferSeconds < rm.BufferSeconds {
+		return fmt.Errorf("maxBufferSeconds must be >= bufferSeconds")
+	}
 	return nil
 }
 
@@ -221,6 +221,38 @@ func TestMetrics_Validate(t *testing.T) {
 			}
 		}
 	})
+
+	t.Run("aggregation: maxBufferSeconds must be >= bufferSeconds", func(t *testing.T) {
+		cases := []struct {
+			val int64
+			msg string
+		}{
+			{5, "metric int-metric: maxBufferSeconds must be >= bufferSeconds"},
+			{0, ""},
+			{10, ""},
+			{600, ""},
+		}
+		for _, c := range cases {
+			invalidType := config.Metrics{
+				{
+					Definition: metrics.Definition{Name: "int-metric", Type: "int"},
+					Endpoints:  goodEndpoints,
+					Aggregation: &config.Aggregation{
+						BufferSeconds:    10,
+						MaxBufferSeconds: c.val,
+					},
+				},
+			}
+
+			err := invalidType.Validate(&conf)
+			if c.msg == "" && err != nil {
+				t.Fatalf("Unexpected error: %v", err)
+			}
+			if c.msg != "" && (err == nil || err.Error() != c.msg) {
+				t.Fatalf("Expected error, got: %v", err)
+			}
+		}
+	})
 }
 
 func TestMetrics_GetMetricDefinition(t *testing.T) {
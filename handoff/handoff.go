@@ -0,0 +1,279 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Package handoff implements the protocol by which a running agent daemon hands its listening
+// sockets and state over to a new daemon, so that the daemon can be upgraded without refusing
+// connections or sending partially aggregated reports early.
+//
+// The running daemon (the predecessor) listens on a Unix socket. The new daemon (the successor)
+// connects to it, and then:
+//
+//  1. The predecessor sends duplicates of its listening sockets, and stops accepting connections.
+//     Connections made meanwhile wait in the sockets' backlogs.
+//  2. The predecessor finishes in-flight requests, releases its pipeline without completing
+//     aggregation periods, flushes its state directory, and sends Ready.
+//  3. The successor loads the state directory, starts serving on the received sockets, and sends
+//     Ack.
+//  4. The predecessor exits. If the successor reports a failure, or the connection ends without an
+//     Ack, it resumes instead. Once Ready is sent, the predecessor waits for the successor however
+//     long it takes to start, and a successor whose Ack isn't delivered exits, so that the two
+//     daemons never both use the state directory.
+package handoff
+
+import (
+	"encoding/json"
+	"errors"
+	"fmt"
+	"net"
+	"os"
+	"syscall"
+	"time"
+)
+
+// maxListeners bounds the number of sockets handed over.
+const maxListeners = 64
+
+// message is one message of the protocol. Each is sent as a single packet; a message with
+// Listeners > 0 carries that many file descriptors.
+type message struct {
+	Listeners int    `json:"listeners,omitempty"`
+	Ready     bool   `json:"ready,omitempty"`
+	Ack       bool   `json:"ack,omitempty"`
+	Error     string `json:"error,omitempty"`
+}
+
+// Server accepts a successor on behalf of a running daemon.
+type Server struct {
+	listener *net.UnixListener
+}
+
+// Listen listens for a successor on the Unix socket at path, replacing a socket file left by an
+// earlier daemon.
+func Listen(path string) (*Server, error) {
+	if err := os.Remove(path); err != nil && !os.IsNotExist(err) {
+		return nil, err
+	}
+	l, err := net.ListenUnix("unixpacket", &net.UnixAddr{Name: path, Net: "unixpacket"})
+	if err != nil {
+		return nil, err
+	}
+	return &Server{listener: l}, nil
+}
+
+// Accept waits for a successor to connect.
+func (s *Server) Accept() (*Successor, error) {
+	conn, err := s.listener.AcceptUnix()
+	if err != nil {
+		return nil, err
+	}
+	return &Successor{conn: conn}, nil
+}
+
+// Close stops listening. The socket file is left in place if unlink is false, since a successor
+// may already have replaced it with its own.
+func (s *Server) Close(unlink bool) error {
+	s.listener.SetUnlinkOnClose(unlink)
+	return s.listener.Close()
+}
+
+// Successor is the predecessor's side of a handoff.
+type Successor struct {
+	conn *net.UnixConn
+}
+
+// SendListeners sends the successor duplicates of the given listening sockets, of which there may be
+// none. The files may be closed once SendListeners returns.
+func (s *Successor) SendListeners(files []*os.File) error {
+	if len(files) > maxListeners {
+		return fmt.Errorf("handoff: can't hand over %v listeners", len(files))
+	}
+	if len(files) == 0 {
+		return send(s.conn, message{}, nil)
+	}
+	fds := make([]int, len(files))
+	for i, f := range files {
+		fds[i] = int(f.Fd())
+	}
+	return send(s.conn, message{Listeners: len(files)}, syscall.UnixRights(fds...))
+}
+
+// Ready tells the successor that the state directory is flushed and released.
+func (s *Successor) Ready() error {
+	return send(s.conn, message{Ready: true}, nil)
+}
+
+// Abort tells the successor that the handoff failed, so it should exit.
+func (s *Successor) Abort(reason error) error {
+	defer s.conn.Close()
+	return send(s.conn, message{Error: reason.Error()}, nil)
+}
+
+// WaitAck waits for the successor to acknowledge that it has taken over. It has no deadline: a
+// successor that is slow to start may still take over, so the predecessor must not resume until the
+// successor fails or exits. An error means it has, and the predecessor should resume.
+func (s *Successor) WaitAck() error {
+	defer s.conn.Close()
+	msg, _, err := receive(s.conn, 0)
+	if err != nil {
+		return err
+	}
+	if !msg.Ack {
+		return fmt.Errorf("handoff: successor failed: %v", msg.Error)
+	}
+	return nil
+}
+
+// Predecessor is the successor's side of a handoff.
+type Predecessor struct {
+	conn *net.UnixConn
+}
+
+// Dial connects to a running daemon's handoff socket at path. It returns an error satisfying
+// IsNoPredecessor if no daemon is listening there.
+func Dial(path string) (*Predecessor, error) {
+	conn, err := net.DialUnix("unixpacket", nil, &net.UnixAddr{Name: path, Net: "unixpacket"})
+	if err != nil {
+		return nil, err
+	}
+	return &Predecessor{conn: conn}, nil
+}
+
+// IsNoPredecessor returns whether err, returned by Dial, means that no daemon is running.
+func IsNoPredecessor(err error) bool {
+	if oe, ok := err.(*net.OpError); ok {
+		if se, ok := oe.Err.(*os.SyscallError); ok {
+			return se.Err == syscall.ENOENT || se.Err == syscall.ECONNREFUSED
+		}
+	}
+	return false
+}
+
+// ReceiveListeners waits up to timeout for the predecessor's listening sockets. The predecessor
+// stops accepting connections on them once they're sent.
+func (p *Predecessor) ReceiveListeners(timeout time.Duration) ([]net.Listener, error) {
+	msg, files, err := receive(p.conn, timeout)
+	if err != nil {
+		return nil, err
+	}
+	// FileListener duplicates each descriptor.
+	defer closeAll(files)
+	if msg.Error != "" {
+		return nil, errors.New("handoff: predecessor failed: " + msg.Error)
+	}
+	if len(files) != msg.Listeners {
+		return nil, fmt.Errorf("handoff: expected %v listeners, received %v", msg.Listeners, len(files))
+	}
+	var listeners []net.Listener
+	for _, f := range files {
+		l, err := net.FileListener(f)
+		if err != nil {
+			for _, l := range listeners {
+				l.Close()
+			}
+			return nil, err
+		}
+		listeners = append(listeners, l)
+	}
+	return listeners, nil
+}
+
+// WaitReady waits up to timeout for the predecessor to release the state directory.
+func (p *Predecessor) WaitReady(timeout time.Duration) error {
+	msg, _, err := receive(p.conn, timeout)
+	if err != nil {
+		return err
+	}
+	if !msg.Ready {
+		return errors.New("handoff: predecessor failed: " + msg.Error)
+	}
+	return nil
+}
+
+// Ack tells the predecessor that this daemon has taken over, or, if err is non-nil, that it
+// failed and the predecessor should resume. If Ack(nil) returns an error, the predecessor may
+// resume, so this daemon must exit without using the state directory further.
+func (p *Predecessor) Ack(err error) error {
+	defer p.conn.Close()
+	if err != nil {
+		return send(p.conn, message{Error: err.Error()}, nil)
+	}
+	return send(p.conn, message{Ack: true}, nil)
+}
+
+// Close abandons the handoff. A predecessor waiting for an Ack resumes.
+func (p *Predecessor) Close() error {
+	return p.conn.Close()
+}
+
+func send(conn *net.UnixConn, msg message, oob []byte) error {
+	data, err := json.Marshal(msg)
+	if err != nil {
+		return err
+	}
+	_, _, err = conn.WriteMsgUnix(data, oob, nil)
+	return err
+}
+
+// receive reads one message, and any files sent with it.
+func receive(conn *net.UnixConn, timeout time.Duration) (message, []*os.File, error) {
+	var msg message
+	if timeout > 0 {
+		conn.SetReadDeadline(time.Now().Add(timeout))
+		defer conn.SetReadDeadline(time.Time{})
+	}
+	buf := make([]byte, 4096)
+	oob := make([]byte, syscall.CmsgSpace(maxListeners*4))
+	n, oobn, _, _, err := conn.ReadMsgUnix(buf, oob)
+	if err != nil {
+		return msg, nil, err
+	}
+	files, err := parseRights(oob[:oobn])
+	if err != nil {
+		return msg, nil, err
+	}
+	if n == 0 {
+		closeAll(files)
+		return msg, nil, errors.New("handoff: connection closed")
+	}
+	if err := json.Unmarshal(buf[:n], &msg); err != nil {
+		closeAll(files)
+		return msg, nil, err
+	}
+	return msg, files, nil
+}
+
+func parseRights(oob []byte) ([]*os.File, error) {
+	cmsgs, err := syscall.ParseSocketControlMessage(oob)
+	if err != nil {
+		return nil, err
+	}
+	var files []*os.File
+	for _, cmsg := range cmsgs {
+		fds, err := syscall.ParseUnixRights(&cmsg)
+		if err != nil {
+			closeAll(files)
+			return nil, err
+		}
+		for _, fd := range fds {
+			files = append(files, os.NewFile(uintptr(fd), "handoff"))
+		}
+	}
+	return files, nil
+}
+
+func closeAll(files []*os.File) {
+	for _, f := range files {
+		f.Close()
+	}
+}
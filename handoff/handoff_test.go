@@ -0,0 +1,219 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package handoff
+
+import (
+	"errors"
+	"io/ioutil"
+	"net"
+	"os"
+	"path"
+	"testing"
+	"time"
+)
+
+const testTimeout = 5 * time.Second
+
+// predecessor accepts a successor on server, hands over l, and returns the result of waiting for
+// the Ack.
+func predecessor(t *testing.T, server *Server, l *net.TCPListener) chan error {
+	result := make(chan error, 1)
+	go func() {
+		successor, err := server.Accept()
+		if err != nil {
+			result <- err
+			return
+		}
+		f, err := l.File()
+		if err != nil {
+			result <- err
+			return
+		}
+		err = successor.SendListeners([]*os.File{f})
+		f.Close()
+		if err != nil {
+			result <- err
+			return
+		}
+		// Stop serving, as the daemon does before releasing its state.
+		l.Close()
+		if err := successor.Ready(); err != nil {
+			result <- err
+			return
+		}
+		result <- successor.WaitAck()
+	}()
+	return result
+}
+
+func TestHandoff(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "handoff_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+	socket := path.Join(tmpdir, "handoff.sock")
+
+	t.Run("No predecessor", func(t *testing.T) {
+		if _, err := Dial(socket); !IsNoPredecessor(err) {
+			t.Fatalf("Dial: want no predecessor, got %+v", err)
+		}
+		server, err := Listen(socket)
+		if err != nil {
+			t.Fatalf("Listen: %+v", err)
+		}
+		server.Close(false)
+		if _, err := Dial(socket); !IsNoPredecessor(err) {
+			t.Fatalf("Dial to a stale socket: want no predecessor, got %+v", err)
+		}
+	})
+
+	t.Run("Sockets are handed over and acknowledged", func(t *testing.T) {
+		server, err := Listen(socket)
+		if err != nil {
+			t.Fatalf("Listen: %+v", err)
+		}
+		defer server.Close(true)
+		l, err := net.ListenTCP("tcp", &net.TCPAddr{IP: net.IPv4(127, 0, 0, 1)})
+		if err != nil {
+			t.Fatalf("ListenTCP: %+v", err)
+		}
+		addr := l.Addr().String()
+		result := predecessor(t, server, l)
+
+		p, err := Dial(socket)
+		if err != nil {
+			t.Fatalf("Dial: %+v", err)
+		}
+		listeners, err := p.ReceiveListeners(testTimeout)
+		if err != nil || len(listeners) != 1 {
+			t.Fatalf("ReceiveListeners: want 1 listener, got %v, %+v", len(listeners), err)
+		}
+		defer listeners[0].Close()
+		if err := p.WaitReady(testTimeout); err != nil {
+			t.Fatalf("WaitReady: %+v", err)
+		}
+
+		// The predecessor has closed its listener, but the socket is still open.
+		conn, err := net.Dial("tcp", addr)
+		if err != nil {
+			t.Fatalf("Dial after handoff: %+v", err)
+		}
+		conn.Close()
+		accepted, err := listeners[0].Accept()
+		if err != nil {
+			t.Fatalf("Accept: %+v", err)
+		}
+		accepted.Close()
+
+		if err := p.Ack(nil); err != nil {
+			t.Fatalf("Ack: %+v", err)
+		}
+		if err := <-result; err != nil {
+			t.Fatalf("WaitAck: %+v", err)
+		}
+	})
+
+	t.Run("The predecessor waits for a slow successor", func(t *testing.T) {
+		server, err := Listen(socket)
+		if err != nil {
+			t.Fatalf("Listen: %+v", err)
+		}
+		defer server.Close(true)
+		l, err := net.ListenTCP("tcp", &net.TCPAddr{IP: net.IPv4(127, 0, 0, 1)})
+		if err != nil {
+			t.Fatalf("ListenTCP: %+v", err)
+		}
+		result := predecessor(t, server, l)
+		p, err := Dial(socket)
+		if err != nil {
+			t.Fatalf("Dial: %+v", err)
+		}
+		listeners, err := p.ReceiveListeners(testTimeout)
+		if err != nil {
+			t.Fatalf("ReceiveListeners: %+v", err)
+		}
+		listeners[0].Close()
+		if err := p.WaitReady(testTimeout); err != nil {
+			t.Fatalf("WaitReady: %+v", err)
+		}
+		select {
+		case err := <-result:
+			t.Fatalf("WaitAck: returned %+v before the successor acknowledged", err)
+		case <-time.After(200 * time.Millisecond):
+		}
+		if err := p.Ack(nil); err != nil {
+			t.Fatalf("Ack: %+v", err)
+		}
+		if err := <-result; err != nil {
+			t.Fatalf("WaitAck: %+v", err)
+		}
+	})
+
+	t.Run("The predecessor resumes if the successor fails", func(t *testing.T) {
+		for name, fail := range map[string]func(p *Predecessor){
+			"error": func(p *Predecessor) { p.Ack(errors.New("bad config")) },
+			"exit":  func(p *Predecessor) { p.Close() },
+		} {
+			server, err := Listen(socket)
+			if err != nil {
+				t.Fatalf("Listen: %+v", err)
+			}
+			l, err := net.ListenTCP("tcp", &net.TCPAddr{IP: net.IPv4(127, 0, 0, 1)})
+			if err != nil {
+				t.Fatalf("ListenTCP: %+v", err)
+			}
+			result := predecessor(t, server, l)
+			p, err := Dial(socket)
+			if err != nil {
+				t.Fatalf("Dial: %+v", err)
+			}
+			listeners, err := p.ReceiveListeners(testTimeout)
+			if err != nil {
+				t.Fatalf("ReceiveListeners: %+v", err)
+			}
+			listeners[0].Close()
+			if err := p.WaitReady(testTimeout); err != nil {
+				t.Fatalf("WaitReady: %+v", err)
+			}
+			fail(p)
+			if err := <-result; err == nil {
+				t.Fatalf("%v: WaitAck: expected an error", name)
+			}
+			server.Close(true)
+		}
+	})
+
+	t.Run("An aborted handoff is reported to the successor", func(t *testing.T) {
+		server, err := Listen(socket)
+		if err != nil {
+			t.Fatalf("Listen: %+v", err)
+		}
+		defer server.Close(true)
+		go func() {
+			if successor, err := server.Accept(); err == nil {
+				successor.Abort(errors.New("not started"))
+			}
+		}()
+		p, err := Dial(socket)
+		if err != nil {
+			t.Fatalf("Dial: %+v", err)
+		}
+		defer p.Close()
+		if _, err := p.ReceiveListeners(testTimeout); err == nil {
+			t.Fatalf("ReceiveListeners: expected an error")
+		}
+	})
+}
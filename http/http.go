@@ -16,27 +16,65 @@ package http
 
 import (
 	"context"
+	"encoding/json"
 	"errors"
 	"fmt"
 	"io/ioutil"
+	"math"
+	"net"
 	"net/http"
+	"os"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
 
+	"github.com/GoogleCloudPlatform/ubbagent/admission"
+	"github.com/GoogleCloudPlatform/ubbagent/metrics"
+	"github.com/GoogleCloudPlatform/ubbagent/pipeline/endpoints"
+	"github.com/GoogleCloudPlatform/ubbagent/pipeline/senders"
 	"github.com/GoogleCloudPlatform/ubbagent/sdk"
 )
 
+const (
+	// queryFlushInterval is the number of streamed query results written between flushes.
+	queryFlushInterval = 100
+
+	// maxStatusWait bounds how long a /status request waits for a change.
+	maxStatusWait = 5 * time.Minute
+
+	// statusKeepAlive is the longest a status stream goes without writing, so that idle streams
+	// aren't closed by intermediaries.
+	statusKeepAlive = 30 * time.Second
+)
+
 type HttpInterface struct {
 	agent *sdk.Agent
 	port  int
 	mux   http.ServeMux
 	srv   *http.Server
+	// The sockets srv serves on.
+	listeners []net.Listener
+
+	// stopping is closed when Shutdown is called, ending long-lived requests.
+	stopping chan struct{}
 }
 
 // NewHttpInterface creates a new agent interface that listens on the given port. The interface
 // must be started with a call to ListenAndServe().
 func NewHttpInterface(agent *sdk.Agent, port int) *HttpInterface {
 	h := &HttpInterface{agent: agent, port: port}
-	h.mux.HandleFunc("/report", h.handleAdd)
+	h.mux.HandleFunc("/report", limitConcurrency(*httpMaxReports, h.handleAdd))
 	h.mux.HandleFunc("/status", h.handleStatus)
+	h.mux.HandleFunc("/status/stream", h.handleStatusStream)
+	h.mux.HandleFunc("/debug/cardinality", h.handleCardinality)
+	h.mux.HandleFunc("/debug/dedup", h.handleDedup)
+	h.mux.HandleFunc("/debug/admission", h.handleAdmission)
+	h.mux.HandleFunc("/debug/captures", h.handleCaptures)
+	h.mux.HandleFunc("/query", h.handleQuery)
+	h.mux.HandleFunc("/deadletters", h.handleDeadLetters)
+	h.mux.HandleFunc("/deadletters/replay", h.handleReplay)
 	return h
 }
 
@@ -51,18 +89,71 @@ func (h *HttpInterface) handleAdd(w http.ResponseWriter, r *http.Request) {
 		return
 	}
 
-	err = h.agent.AddReportJson(reportData)
+	report, err := sdk.ParseReport(reportData)
 	if err != nil {
 		w.WriteHeader(500)
 		w.Write([]byte(err.Error()))
 		return
 	}
+	if key := r.Header.Get("Idempotency-Key"); key != "" {
+		report.IdempotencyKey = key
+	}
+
+	err = h.agent.AddReportFrom(clientId(r), report)
+	if rle, ok := err.(*admission.RateLimitedError); ok {
+		w.Header().Set("Retry-After", fmt.Sprint(int64(math.Ceil(rle.RetryAfter.Seconds()))))
+		w.WriteHeader(http.StatusTooManyRequests)
+		w.Write([]byte(err.Error()))
+		return
+	} else if err != nil {
+		w.WriteHeader(500)
+		w.Write([]byte(err.Error()))
+		return
+	}
 
 	w.WriteHeader(http.StatusOK)
 }
 
+// clientId identifies the client making a request for admission control: the Client-Id header if
+// present, or else the peer's address.
+func clientId(r *http.Request) string {
+	if id := r.Header.Get("Client-Id"); id != "" {
+		return id
+	}
+	if host, _, err := net.SplitHostPort(r.RemoteAddr); err == nil {
+		return host
+	}
+	return r.RemoteAddr
+}
+
+// handleStatus returns the agent's status. If the waitForChange parameter is given, the request
+// waits until the status version differs from it, or until the wait parameter (a duration,
+// default 30s) elapses, and then returns the current status.
 func (h *HttpInterface) handleStatus(w http.ResponseWriter, r *http.Request) {
-	text, err := h.agent.GetStatusJson()
+	status := h.agent.GetStatus()
+	if v := r.URL.Query().Get("waitForChange"); v != "" {
+		version, err := strconv.ParseUint(v, 10, 64)
+		if err != nil {
+			http.Error(w, fmt.Sprintf("invalid waitForChange: %v", v), http.StatusBadRequest)
+			return
+		}
+		wait := statusKeepAlive
+		if d := r.URL.Query().Get("wait"); d != "" {
+			if wait, err = time.ParseDuration(d); err != nil || wait < 0 {
+				http.Error(w, fmt.Sprintf("invalid wait: %v", d), http.StatusBadRequest)
+				return
+			}
+			if wait > maxStatusWait {
+				wait = maxStatusWait
+			}
+		}
+		ctx, cancel := h.requestContext(r)
+		defer cancel()
+		ctx, cancelWait := context.WithTimeout(ctx, wait)
+		defer cancelWait()
+		status = h.agent.WaitForStatusChange(ctx, version)
+	}
+	text, err := sdk.SerializeStatus(status)
 	if err != nil {
 		w.WriteHeader(http.StatusInternalServerError)
 		w.Write([]byte(err.Error()))
@@ -72,27 +163,387 @@ func (h *HttpInterface) handleStatus(w http.ResponseWriter, r *http.Request) {
 	}
 }
 
-// Start starts the HttpInterface in the background. It returns an error immediately if background
-// starting fails, but otherwise returns nil. The errHandler callback receives any errors returned
-// by the underlying call to ListenAndServe(). Note that the background service may fail quickly
-// after startup, such as in the case of a port already in use.
+// handleStatusStream streams the agent's status as server-sent events: the current status first,
+// then each change as it happens. Each event's ID is the status version, so a reconnecting client's
+// Last-Event-ID header resumes the stream without repeating an unchanged status.
+func (h *HttpInterface) handleStatusStream(w http.ResponseWriter, r *http.Request) {
+	flusher, ok := w.(http.Flusher)
+	if !ok {
+		http.Error(w, "streaming unsupported", http.StatusInternalServerError)
+		return
+	}
+	var version uint64
+	if id := r.Header.Get("Last-Event-ID"); id != "" {
+		version, _ = strconv.ParseUint(id, 10, 64)
+	}
+	ctx, cancel := h.requestContext(r)
+	defer cancel()
+
+	w.Header().Set("Content-Type", "text/event-stream")
+	w.Header().Set("Cache-Control", "no-cache")
+	w.WriteHeader(http.StatusOK)
+	flusher.Flush()
+	for {
+		waitCtx, cancelWait := context.WithTimeout(ctx, statusKeepAlive)
+		status := h.agent.WaitForStatusChange(waitCtx, version)
+		cancelWait()
+		if ctx.Err() != nil {
+			return
+		}
+		if status.Version == version {
+			if _, err := w.Write([]byte(": keepalive\n\n")); err != nil {
+				return
+			}
+		} else {
+			text, err := sdk.SerializeStatus(status)
+			if err != nil {
+				return
+			}
+			if _, err := fmt.Fprintf(w, "id: %v\ndata: %s\n\n", status.Version, text); err != nil {
+				return
+			}
+			version = status.Version
+		}
+		flusher.Flush()
+	}
+}
+
+// requestContext returns a context that is done when r's is, or when the interface shuts down, so
+// that long-lived requests don't hold up a graceful shutdown.
+func (h *HttpInterface) requestContext(r *http.Request) (context.Context, context.CancelFunc) {
+	ctx, cancel := context.WithCancel(r.Context())
+	go func() {
+		select {
+		case <-h.stopping:
+			cancel()
+		case <-ctx.Done():
+		}
+	}()
+	return ctx, cancel
+}
+
+func (h *HttpInterface) handleCardinality(w http.ResponseWriter, r *http.Request) {
+	text, err := h.agent.GetCardinalityJson()
+	if err != nil {
+		w.WriteHeader(http.StatusInternalServerError)
+		w.Write([]byte(err.Error()))
+	} else {
+		w.WriteHeader(http.StatusOK)
+		w.Write(text)
+	}
+}
+
+func (h *HttpInterface) handleDedup(w http.ResponseWriter, r *http.Request) {
+	text, err := h.agent.GetDedupJson()
+	if err != nil {
+		w.WriteHeader(http.StatusInternalServerError)
+		w.Write([]byte(err.Error()))
+	} else {
+		w.WriteHeader(http.StatusOK)
+		w.Write(text)
+	}
+}
+
+func (h *HttpInterface) handleAdmission(w http.ResponseWriter, r *http.Request) {
+	text, err := h.agent.GetAdmissionJson()
+	if err != nil {
+		w.WriteHeader(http.StatusInternalServerError)
+		w.Write([]byte(err.Error()))
+	} else {
+		w.WriteHeader(http.StatusOK)
+		w.Write(text)
+	}
+}
+
+// handleCaptures returns the requests recently sampled by endpoints that capture them, such as
+// servicecontrol. The optional endpoint parameter selects a single endpoint.
+func (h *HttpInterface) handleCaptures(w http.ResponseWriter, r *http.Request) {
+	text, err := h.agent.GetCapturesJson(r.URL.Query().Get("endpoint"))
+	if err != nil {
+		w.WriteHeader(http.StatusBadRequest)
+		w.Write([]byte(err.Error()))
+	} else {
+		w.WriteHeader(http.StatusOK)
+		w.Write(text)
+	}
+}
+
+// handleQuery searches the reports retained by a disk endpoint. The endpoint parameter names the
+// endpoint, and may be omitted if only one endpoint retains reports. The metric, from and to
+// (RFC3339), and label (key=value, repeatable) parameters select reports. If sum=true, totals are
+// returned instead of reports, grouped by metric and by the values of any groupBy label keys.
+// Results are streamed as newline-delimited JSON.
+func (h *HttpInterface) handleQuery(w http.ResponseWriter, r *http.Request) {
+	params := r.URL.Query()
+	q := endpoints.ReportQuery{Metric: params.Get("metric")}
+	var err error
+	if q.From, err = parseQueryTime(params.Get("from")); err != nil {
+		http.Error(w, "invalid from: "+err.Error(), http.StatusBadRequest)
+		return
+	}
+	if q.To, err = parseQueryTime(params.Get("to")); err != nil {
+		http.Error(w, "invalid to: "+err.Error(), http.StatusBadRequest)
+		return
+	}
+	for _, l := range params["label"] {
+		kv := strings.SplitN(l, "=", 2)
+		if len(kv) != 2 {
+			http.Error(w, "invalid label (want key=value): "+l, http.StatusBadRequest)
+			return
+		}
+		if q.Labels == nil {
+			q.Labels = make(map[string]string)
+		}
+		q.Labels[kv[0]] = kv[1]
+	}
+
+	w.Header().Set("Content-Type", "application/x-ndjson")
+	enc := json.NewEncoder(w)
+	flusher, _ := w.(http.Flusher)
+	written := 0
+	started := false
+	write := func(v interface{}) error {
+		started = true
+		if err := enc.Encode(v); err != nil {
+			return err
+		}
+		if written++; flusher != nil && written%queryFlushInterval == 0 {
+			flusher.Flush()
+		}
+		return nil
+	}
+
+	if params.Get("sum") == "true" {
+		totals := newQueryTotals(params["groupBy"])
+		err = h.agent.Query(params.Get("endpoint"), q, func(report metrics.StampedMetricReport) error {
+			totals.add(report.MetricReport)
+			return nil
+		})
+		if err == nil {
+			for _, t := range totals.sorted() {
+				if err = write(t); err != nil {
+					break
+				}
+			}
+		}
+	} else {
+		err = h.agent.Query(params.Get("endpoint"), q, func(report metrics.StampedMetricReport) error {
+			return write(report)
+		})
+	}
+	if err != nil && !started {
+		http.Error(w, err.Error(), http.StatusBadRequest)
+	}
+}
+
+// handleDeadLetters lists the reports that endpoints gave up sending and that have not been
+// replayed, as newline-delimited JSON. The endpoint, metric, from and to (RFC3339), and errorClass
+// parameters select dead letters.
+func (h *HttpInterface) handleDeadLetters(w http.ResponseWriter, r *http.Request) {
+	f, err := parseDeadLetterFilter(r)
+	if err != nil {
+		http.Error(w, err.Error(), http.StatusBadRequest)
+		return
+	}
+	w.Header().Set("Content-Type", "application/x-ndjson")
+	enc := json.NewEncoder(w)
+	started := false
+	err = h.agent.DeadLetters(r.URL.Query().Get("endpoint"), f, func(d senders.DeadLetter) error {
+		started = true
+		return enc.Encode(d)
+	})
+	if err != nil && !started {
+		http.Error(w, err.Error(), http.StatusBadRequest)
+	}
+}
+
+// handleReplay re-sends the dead letters selected by the same parameters as handleDeadLetters. The
+// rate parameter overrides the maximum number of reports sent per second. It responds once all
+// selected reports have been queued.
+func (h *HttpInterface) handleReplay(w http.ResponseWriter, r *http.Request) {
+	if r.Method != http.MethodPost {
+		http.Error(w, "replay requires POST", http.StatusMethodNotAllowed)
+		return
+	}
+	f, err := parseDeadLetterFilter(r)
+	if err != nil {
+		http.Error(w, err.Error(), http.StatusBadRequest)
+		return
+	}
+	rate := senders.ReplayRate()
+	if s := r.URL.Query().Get("rate"); s != "" {
+		if rate, err = strconv.ParseFloat(s, 64); err != nil || rate < 0 {
+			http.Error(w, "invalid rate: "+s, http.StatusBadRequest)
+			return
+		}
+	}
+	n, err := h.agent.ReplayDeadLetters(r.URL.Query().Get("endpoint"), f, rate)
+	if err != nil {
+		http.Error(w, fmt.Sprintf("replayed %v reports: %v", n, err), http.StatusInternalServerError)
+		return
+	}
+	w.WriteHeader(http.StatusOK)
+	json.NewEncoder(w).Encode(struct {
+		Replayed int `json:"replayed"`
+	}{n})
+}
+
+func parseDeadLetterFilter(r *http.Request) (senders.DeadLetterFilter, error) {
+	params := r.URL.Query()
+	f := senders.DeadLetterFilter{Metric: params.Get("metric"), ErrorClass: params.Get("errorClass")}
+	var err error
+	if f.From, err = parseQueryTime(params.Get("from")); err != nil {
+		return f, errors.New("invalid from: " + err.Error())
+	}
+	if f.To, err = parseQueryTime(params.Get("to")); err != nil {
+		return f, errors.New("invalid to: " + err.Error())
+	}
+	return f, nil
+}
+
+func parseQueryTime(s string) (time.Time, error) {
+	if s == "" {
+		return time.Time{}, nil
+	}
+	return time.Parse(time.RFC3339, s)
+}
+
+// queryTotal is a sum of the reports of a metric sharing the values of the groupBy labels.
+type queryTotal struct {
+	Metric    string              `json:"metric"`
+	Labels    map[string]string   `json:"labels,omitempty"`
+	Reports   int64               `json:"reports"`
+	StartTime time.Time           `json:"startTime"`
+	EndTime   time.Time           `json:"endTime"`
+	Value     metrics.MetricValue `json:"value"`
+}
+
+type queryTotals struct {
+	groupBy []string
+	totals  map[string]*queryTotal
+}
+
+func newQueryTotals(groupBy []string) *queryTotals {
+	return &queryTotals{groupBy: groupBy, totals: make(map[string]*queryTotal)}
+}
+
+func (t *queryTotals) add(report metrics.MetricReport) {
+	key := report.Name
+	for _, k := range t.groupBy {
+		key += "\x00" + report.Labels[k]
+	}
+	total, ok := t.totals[key]
+	if !ok {
+		total = &queryTotal{Metric: report.Name, StartTime: report.StartTime, EndTime: report.EndTime}
+		if len(t.groupBy) > 0 {
+			total.Labels = make(map[string]string, len(t.groupBy))
+			for _, k := range t.groupBy {
+				total.Labels[k] = report.Labels[k]
+			}
+		}
+		t.totals[key] = total
+	}
+	total.Reports++
+	total.Value.Int64Value += report.Value.Int64Value
+	total.Value.DoubleValue += report.Value.DoubleValue
+	if report.StartTime.Before(total.StartTime) {
+		total.StartTime = report.StartTime
+	}
+	if report.EndTime.After(total.EndTime) {
+		total.EndTime = report.EndTime
+	}
+}
+
+func (t *queryTotals) sorted() []*queryTotal {
+	keys := make([]string, 0, len(t.totals))
+	for k := range t.totals {
+		keys = append(keys, k)
+	}
+	sort.Strings(keys)
+	sorted := make([]*queryTotal, len(keys))
+	for i, k := range keys {
+		sorted[i] = t.totals[k]
+	}
+	return sorted
+}
+
+// Start starts the HttpInterface in the background. It returns an error immediately if the port
+// can't be bound or background starting fails, but otherwise returns nil. The errHandler callback
+// receives the first error returned by the underlying calls to Serve().
 func (h *HttpInterface) Start(errHandler func(error)) error {
 	if h.srv != nil {
 		return errors.New("already started")
 	}
-	h.srv = &http.Server{Addr: fmt.Sprintf("localhost:%v", h.port), Handler: &h.mux}
-	go func() {
-		errHandler(h.srv.ListenAndServe())
-	}()
+	listeners, err := listen(fmt.Sprintf("localhost:%v", h.port), *httpListeners)
+	if err != nil {
+		return err
+	}
+	if err := h.StartListeners(listeners, errHandler); err != nil {
+		for _, l := range listeners {
+			l.Close()
+		}
+		return err
+	}
 	return nil
 }
 
+// StartListeners is like Start, but serves on listeners that are already bound, such as those
+// handed over by a previous daemon.
+func (h *HttpInterface) StartListeners(listeners []net.Listener, errHandler func(error)) error {
+	if h.srv != nil {
+		return errors.New("already started")
+	}
+	srv, err := newServer(&h.mux, *httpH2C)
+	if err != nil {
+		return err
+	}
+	h.srv = srv
+	h.listeners = listeners
+	h.stopping = make(chan struct{})
+	var once sync.Once
+	for _, l := range listeners {
+		go func(l net.Listener) {
+			err := srv.Serve(l)
+			once.Do(func() { errHandler(err) })
+		}(l)
+	}
+	return nil
+}
+
+// ListenerFiles returns duplicates of the started HttpInterface's listening sockets, which remain
+// open after Shutdown closes its own.
+func (h *HttpInterface) ListenerFiles() ([]*os.File, error) {
+	if h.srv == nil {
+		return nil, errors.New("not started")
+	}
+	var files []*os.File
+	for _, l := range h.listeners {
+		tl, ok := l.(*net.TCPListener)
+		var f *os.File
+		var err error
+		if ok {
+			f, err = tl.File()
+		} else {
+			err = fmt.Errorf("listener %v isn't a TCP listener", l.Addr())
+		}
+		if err != nil {
+			for _, f := range files {
+				f.Close()
+			}
+			return nil, err
+		}
+		files = append(files, f)
+	}
+	return files, nil
+}
+
 // Shutdown initiates a graceful shutdown of the HttpInterface and blocks until the operation
 // finishes.
 func (h *HttpInterface) Shutdown() error {
 	if h.srv == nil {
 		return errors.New("not started")
 	}
+	close(h.stopping)
 	err := h.srv.Shutdown(context.Background())
 	h.srv = nil
 	return err
@@ -0,0 +1,153 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package http
+
+import (
+	"flag"
+	"io"
+	"net"
+	"net/http"
+	"strings"
+	"time"
+
+	"golang.org/x/net/http2"
+)
+
+var (
+	httpListeners         = flag.Int("http_listeners", 1, "number of sockets accepting connections on the local port; more than 1 binds each with SO_REUSEPORT so that the kernel spreads connections across them (Linux only)")
+	httpH2C               = flag.Bool("http_h2c", false, "also serve HTTP/2 over cleartext to clients that start with the HTTP/2 preface, so that one connection multiplexes many concurrent reports")
+	httpMaxStreams        = flag.Int("http_max_concurrent_streams", 250, "the most concurrent streams on one HTTP/2 connection")
+	httpMaxReports        = flag.Int("http_max_concurrent_reports", 1000, "if positive, the most /report requests handled at once; further requests are rejected with status 503")
+	httpReadHeaderTimeout = flag.Duration("http_read_header_timeout", 10*time.Second, "how long a client may take to send request headers; 0 for no limit")
+	httpReadTimeout       = flag.Duration("http_read_timeout", 0, "if positive, how long a client may take to send a whole request; this also ends /status waits and streams that last longer")
+	httpWriteTimeout      = flag.Duration("http_write_timeout", 0, "if positive, how long a response may take to write; this also ends /status waits and streams that last longer")
+	httpIdleTimeout       = flag.Duration("http_idle_timeout", 2*time.Minute, "how long an idle keep-alive or HTTP/2 connection is kept open; 0 for no limit")
+)
+
+// h2cPrefaceRequest is the part of the HTTP/2 client preface that an HTTP/1 server reads as a
+// request line and headers. The rest, "SM\r\n\r\n", is left unread.
+const h2cPrefaceRequest = "PRI * HTTP/2.0\r\n\r\n"
+
+// newServer returns an http.Server with timeouts set by flags that serves handler, and also serves
+// HTTP/2 over cleartext if h2c is true.
+func newServer(handler http.Handler, h2c bool) (*http.Server, error) {
+	srv := &http.Server{
+		ReadHeaderTimeout: *httpReadHeaderTimeout,
+		ReadTimeout:       *httpReadTimeout,
+		WriteTimeout:      *httpWriteTimeout,
+		IdleTimeout:       *httpIdleTimeout,
+	}
+	if h2c {
+		h2 := &http2.Server{MaxConcurrentStreams: uint32(*httpMaxStreams), IdleTimeout: *httpIdleTimeout}
+		// Registers h2 to send GOAWAY to its connections when srv shuts down.
+		if err := http2.ConfigureServer(srv, h2); err != nil {
+			return nil, err
+		}
+		handler = &h2cHandler{next: handler, srv: srv, h2: h2}
+	}
+	srv.Handler = handler
+	return srv, nil
+}
+
+// h2cHandler serves HTTP/2 over cleartext to clients with prior knowledge (RFC 7540 section 3.4),
+// and passes all other requests to next. An HTTP/1 server reads the start of such a client's
+// preface as a request, so the connection is hijacked and handed to the HTTP/2 server.
+type h2cHandler struct {
+	next http.Handler
+	srv  *http.Server
+	h2   *http2.Server
+}
+
+func (h *h2cHandler) ServeHTTP(w http.ResponseWriter, r *http.Request) {
+	if r.Method != "PRI" || r.RequestURI != "*" || r.ProtoMajor != 2 {
+		h.next.ServeHTTP(w, r)
+		return
+	}
+	hijacker, ok := w.(http.Hijacker)
+	if !ok {
+		http.Error(w, "h2c unsupported", http.StatusInternalServerError)
+		return
+	}
+	conn, rw, err := hijacker.Hijack()
+	if err != nil {
+		return
+	}
+	// The HTTP/2 server sets its own deadlines.
+	conn.SetDeadline(time.Time{})
+	h.h2.ServeConn(&prefacedConn{
+		Conn:   conn,
+		reader: io.MultiReader(strings.NewReader(h2cPrefaceRequest), rw),
+	}, &http2.ServeConnOpts{Handler: h.next, BaseConfig: h.srv})
+}
+
+// prefacedConn is a connection whose reads come from reader, which replays what the HTTP/1 server
+// already read before the rest of the connection.
+type prefacedConn struct {
+	net.Conn
+	reader io.Reader
+}
+
+func (c *prefacedConn) Read(b []byte) (int, error) {
+	return c.reader.Read(b)
+}
+
+// limitConcurrency returns a handler that passes at most n requests at a time to next, and rejects
+// the rest with status 503 and a Retry-After header. A non-positive n returns next.
+func limitConcurrency(n int, next http.HandlerFunc) http.HandlerFunc {
+	if n <= 0 {
+		return next
+	}
+	slots := make(chan struct{}, n)
+	return func(w http.ResponseWriter, r *http.Request) {
+		select {
+		case slots <- struct{}{}:
+			defer func() { <-slots }()
+			next(w, r)
+		default:
+			w.Header().Set("Retry-After", "1")
+			http.Error(w, "too many concurrent requests", http.StatusServiceUnavailable)
+		}
+	}
+}
+
+// listen returns n listeners accepting connections on address. More than one listener requires
+// SO_REUSEPORT.
+func listen(address string, n int) ([]net.Listener, error) {
+	if n <= 1 {
+		l, err := net.Listen("tcp", address)
+		if err != nil {
+			return nil, err
+		}
+		return []net.Listener{l}, nil
+	}
+	addr, err := net.ResolveTCPAddr("tcp", address)
+	if err != nil {
+		return nil, err
+	}
+	var listeners []net.Listener
+	for i := 0; i < n; i++ {
+		l, err := listenReusePort(addr)
+		if err != nil {
+			for _, l := range listeners {
+				l.Close()
+			}
+			return nil, err
+		}
+		listeners = append(listeners, l)
+		// If the port was chosen by the kernel, the rest share it.
+		addr.Port = l.Addr().(*net.TCPAddr).Port
+	}
+	return listeners, nil
+}
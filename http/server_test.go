@@ -0,0 +1,207 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package http
+
+import (
+	"crypto/tls"
+	"fmt"
+	"io/ioutil"
+	"net"
+	"net/http"
+	"runtime"
+	"strings"
+	"sync"
+	"testing"
+
+	"golang.org/x/net/http2"
+)
+
+const testReport = `{"name": "requests", "startTime": "2018-01-01T00:00:00Z", "endTime": "2018-01-01T00:00:00Z", "value": {"int64Value": 10}}`
+
+// testServer serves handler on listeners and returns the base URL.
+func testServer(t testing.TB, handler http.Handler, h2c bool, listeners int) (string, func()) {
+	srv, err := newServer(handler, h2c)
+	if err != nil {
+		t.Fatalf("newServer: %+v", err)
+	}
+	ls, err := listen("127.0.0.1:0", listeners)
+	if err != nil {
+		t.Fatalf("listen: %+v", err)
+	}
+	for _, l := range ls {
+		go srv.Serve(l)
+	}
+	return "http://" + ls[0].Addr().String(), func() { srv.Close() }
+}
+
+// h2cClient returns a client that speaks HTTP/2 over cleartext with prior knowledge.
+func h2cClient() *http.Client {
+	return &http.Client{Transport: &http2.Transport{
+		AllowHTTP: true,
+		DialTLS: func(network, addr string, cfg *tls.Config) (net.Conn, error) {
+			return net.Dial(network, addr)
+		},
+	}}
+}
+
+// ingestHandler reads the request body and responds like a successful /report.
+func ingestHandler(w http.ResponseWriter, r *http.Request) {
+	ioutil.ReadAll(r.Body)
+	w.WriteHeader(http.StatusOK)
+}
+
+func TestServer(t *testing.T) {
+	protos := func(w http.ResponseWriter, r *http.Request) {
+		fmt.Fprint(w, r.Proto)
+	}
+
+	t.Run("HTTP/1.1 and h2c are served on one port", func(t *testing.T) {
+		url, stop := testServer(t, http.HandlerFunc(protos), true, 1)
+		defer stop()
+		for client, want := range map[*http.Client]string{http.DefaultClient: "HTTP/1.1", h2cClient(): "HTTP/2.0"} {
+			resp, err := client.Get(url)
+			if err != nil {
+				t.Fatalf("Get: %+v", err)
+			}
+			body, _ := ioutil.ReadAll(resp.Body)
+			resp.Body.Close()
+			if string(body) != want || resp.Proto != want {
+				t.Fatalf("protocol: want=%v, got=%v (response %v)", want, string(body), resp.Proto)
+			}
+		}
+	})
+
+	t.Run("h2c is refused unless enabled", func(t *testing.T) {
+		url, stop := testServer(t, http.HandlerFunc(protos), false, 1)
+		defer stop()
+		if resp, err := h2cClient().Get(url); err == nil {
+			resp.Body.Close()
+			t.Fatalf("Get: expected an error")
+		}
+	})
+
+	t.Run("Multiple listeners share a port", func(t *testing.T) {
+		if runtime.GOOS != "linux" {
+			t.Skip("SO_REUSEPORT listeners are only supported on Linux")
+		}
+		url, stop := testServer(t, http.HandlerFunc(protos), false, 4)
+		defer stop()
+		for i := 0; i < 20; i++ {
+			// Each request on a new connection, so that connections reach different listeners.
+			resp, err := http.Post(url, "application/json", strings.NewReader(testReport))
+			if err != nil {
+				t.Fatalf("Post: %+v", err)
+			}
+			resp.Body.Close()
+			http.DefaultTransport.(*http.Transport).CloseIdleConnections()
+		}
+	})
+}
+
+func TestLimitConcurrency(t *testing.T) {
+	entered := make(chan struct{})
+	release := make(chan struct{})
+	handler := limitConcurrency(2, func(w http.ResponseWriter, r *http.Request) {
+		entered <- struct{}{}
+		<-release
+	})
+	url, stop := testServer(t, handler, false, 1)
+	defer stop()
+
+	var wg sync.WaitGroup
+	for i := 0; i < 2; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			resp, err := http.Get(url)
+			if err != nil {
+				t.Errorf("Get: %+v", err)
+				return
+			}
+			resp.Body.Close()
+			if resp.StatusCode != http.StatusOK {
+				t.Errorf("status: want=200, got=%v", resp.StatusCode)
+			}
+		}()
+		<-entered
+	}
+
+	resp, err := http.Get(url)
+	if err != nil {
+		t.Fatalf("Get: %+v", err)
+	}
+	resp.Body.Close()
+	if resp.StatusCode != http.StatusServiceUnavailable || resp.Header.Get("Retry-After") == "" {
+		t.Fatalf("request over the limit: want=503 with Retry-After, got=%v %v", resp.StatusCode, resp.Header)
+	}
+
+	close(release)
+	wg.Wait()
+	go func() { <-entered }()
+	resp, err = http.Get(url)
+	if err != nil {
+		t.Fatalf("Get: %+v", err)
+	}
+	resp.Body.Close()
+	if resp.StatusCode != http.StatusOK {
+		t.Fatalf("request after release: want=200, got=%v", resp.StatusCode)
+	}
+}
+
+// BenchmarkIngest compares posting reports with many concurrent clients over HTTP/1.1 keep-alive
+// connections, which need a connection per concurrent request, and over HTTP/2 cleartext, which
+// multiplexes them over few connections.
+func BenchmarkIngest(b *testing.B) {
+	const parallelism = 64
+	conns := parallelism * runtime.GOMAXPROCS(0)
+	clients := []struct {
+		name   string
+		client func() *http.Client
+	}{
+		{"http1", func() *http.Client {
+			return &http.Client{Transport: &http.Transport{MaxIdleConnsPerHost: conns}}
+		}},
+		{"h2c", h2cClient},
+	}
+	for _, listeners := range []int{1, 4} {
+		if listeners > 1 && runtime.GOOS != "linux" {
+			continue
+		}
+		for _, c := range clients {
+			b.Run(fmt.Sprintf("%v/listeners=%v", c.name, listeners), func(b *testing.B) {
+				url, stop := testServer(b, limitConcurrency(conns, ingestHandler), true, listeners)
+				defer stop()
+				client := c.client()
+				b.SetParallelism(parallelism)
+				b.ResetTimer()
+				b.RunParallel(func(pb *testing.PB) {
+					for pb.Next() {
+						resp, err := client.Post(url+"/report", "application/json", strings.NewReader(testReport))
+						if err != nil {
+							b.Errorf("Post: %+v", err)
+							return
+						}
+						ioutil.ReadAll(resp.Body)
+						resp.Body.Close()
+						if resp.StatusCode != http.StatusOK {
+							b.Errorf("status: want=200, got=%v", resp.StatusCode)
+							return
+						}
+					}
+				})
+			})
+		}
+	}
+}
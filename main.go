@@ -18,10 +18,13 @@ import (
 	"flag"
 	"fmt"
 	"io/ioutil"
+	"net"
 	httplib "net/http"
 	"os"
 	"os/signal"
+	"time"
 
+	"github.com/GoogleCloudPlatform/ubbagent/handoff"
 	"github.com/GoogleCloudPlatform/ubbagent/http"
 	"github.com/GoogleCloudPlatform/ubbagent/sdk"
 	"github.com/golang/glog"
@@ -32,10 +35,13 @@ var stateDir = flag.String("state-dir", "", "persistent state directory")
 var noState = flag.Bool("no-state", false, "do not store persistent state")
 var localPort = flag.Int("local-port", 0, "local HTTP daemon port")
 var noHttp = flag.Bool("no-http", false, "do not start the HTTP daemon")
+var handoffSocket = flag.String("handoff-socket", "", "Unix socket on which the daemon waits for a new daemon to take over its HTTP port and state directory; a daemon started while another listens here takes over from it")
+var handoffTimeout = flag.Duration("handoff-timeout", 30*time.Second, "how long a new daemon waits for the running one to hand over its sockets and state directory")
 
 // main is the entry point to the standalone agent. It constructs a new app.App with the config file
 // specified using the --config flag, and it starts the http interface. SIGINT will initiate a
-// graceful shutdown.
+// graceful shutdown. With --handoff-socket, a new daemon started on the same socket takes over
+// instead, after which this one exits.
 func main() {
 	flag.Parse()
 
@@ -62,39 +68,189 @@ func main() {
 		exitf("startup: failed to read configuration file: %+v", err)
 	}
 
-	agent, err := sdk.NewAgent(configData, *stateDir)
+	// Take over from a running daemon, if there is one.
+	var handedOver []net.Listener
+	var predecessor *handoff.Predecessor
+	if *handoffSocket != "" {
+		if predecessor, err = handoff.Dial(*handoffSocket); err == nil {
+			infof("Taking over from the running daemon")
+			if handedOver, err = predecessor.ReceiveListeners(*handoffTimeout); err == nil {
+				err = predecessor.WaitReady(*handoffTimeout)
+			}
+			if err != nil {
+				// The predecessor resumes when the connection closes.
+				exitf("handoff: %+v", err)
+			}
+		} else if !handoff.IsNoPredecessor(err) {
+			exitf("handoff: %+v", err)
+		}
+	}
+
+	agent, rest, err := start(configData, handedOver)
+	if predecessor != nil {
+		if ackErr := predecessor.Ack(err); ackErr != nil && err == nil {
+			// The predecessor may resume, so this daemon must not continue on the same state directory.
+			exitf("handoff: acknowledging: %+v", ackErr)
+		}
+	}
 	if err != nil {
-		exitf("startup: failed to create agent: %+v", err)
+		exitf("startup: %+v", err)
+	}
+
+	var successors chan *handoff.Successor
+	var handoffServer *handoff.Server
+	if *handoffSocket != "" {
+		handoffServer, successors = listenForSuccessors()
 	}
 
-	var rest *http.HttpInterface
-	if *localPort > 0 {
-		rest = http.NewHttpInterface(agent, *localPort)
-		if err := rest.Start(func(err error) {
-			// Process async http errors (which may be an immediate port in use error).
-			if err != httplib.ErrServerClosed {
-				exitf("http: %+v", err)
+	c := make(chan os.Signal, 1)
+	signal.Notify(c, os.Interrupt)
+	for {
+		select {
+		case <-c:
+			infof("Shutting down...")
+			if handoffServer != nil {
+				handoffServer.Close(true)
+			}
+			if rest != nil {
+				rest.Shutdown()
+			}
+			if err := agent.Shutdown(); err != nil {
+				glog.Warningf("shutdown: %+v", err)
+			}
+			glog.Flush()
+			return
+		case successor := <-successors:
+			infof("Handing over to a new daemon...")
+			files, stopped, err := handOver(successor, agent, rest)
+			if err == nil {
+				handoffServer.Close(false)
+				glog.Flush()
+				return
+			}
+			glog.Warningf("handoff: %+v", err)
+			if !stopped {
+				continue
+			}
+			infof("Resuming")
+			listeners, err := fileListeners(files)
+			if err != nil {
+				exitf("handoff: resuming: %+v", err)
+			}
+			if agent, rest, err = start(configData, listeners); err != nil {
+				exitf("handoff: resuming: %+v", err)
 			}
-		}); err != nil {
-			exitf("startup: %+v", err)
 		}
-		infof("Listening locally on port %v", *localPort)
-	} else {
+	}
+}
+
+// start creates the agent and, unless --no-http is given, its HTTP interface. The interface serves
+// on listeners if there are any, or else binds the local port.
+func start(configData []byte, listeners []net.Listener) (*sdk.Agent, *http.HttpInterface, error) {
+	agent, err := sdk.NewAgent(configData, *stateDir)
+	if err != nil {
+		return nil, nil, fmt.Errorf("failed to create agent: %+v", err)
+	}
+	if *localPort <= 0 {
+		for _, l := range listeners {
+			l.Close()
+		}
 		infof("Not starting HTTP daemon")
+		return agent, nil, nil
+	}
+	rest := http.NewHttpInterface(agent, *localPort)
+	errHandler := func(err error) {
+		// Process async http errors.
+		if err != httplib.ErrServerClosed {
+			exitf("http: %+v", err)
+		}
 	}
+	if len(listeners) > 0 {
+		err = rest.StartListeners(listeners, errHandler)
+	} else {
+		err = rest.Start(errHandler)
+	}
+	if err != nil {
+		// Leave aggregated reports for a predecessor that resumes.
+		agent.ShutdownForHandoff()
+		return nil, nil, err
+	}
+	infof("Listening locally on port %v", *localPort)
+	return agent, rest, nil
+}
 
-	c := make(chan os.Signal, 1)
-	signal.Notify(c, os.Interrupt)
-	<-c
+// listenForSuccessors listens on the handoff socket, and returns each new daemon that connects on
+// the returned channel.
+func listenForSuccessors() (*handoff.Server, chan *handoff.Successor) {
+	server, err := handoff.Listen(*handoffSocket)
+	if err != nil {
+		exitf("startup: %+v", err)
+	}
+	successors := make(chan *handoff.Successor)
+	go func() {
+		for {
+			successor, err := server.Accept()
+			if err != nil {
+				return
+			}
+			successors <- successor
+		}
+	}()
+	return server, successors
+}
 
-	infof("Shutting down...")
+// handOver hands the HTTP interface's sockets and the agent's state directory over to successor,
+// stopping both. If the successor takes over, handOver returns nil. Otherwise it returns the error,
+// and whether the agent was stopped, in which case this daemon resumes serving on the returned
+// sockets. Once the state directory is released, handOver waits for the successor to take over or
+// fail, however long its startup takes.
+func handOver(successor *handoff.Successor, agent *sdk.Agent, rest *http.HttpInterface) (files []*os.File, stopped bool, err error) {
+	if rest != nil {
+		if files, err = rest.ListenerFiles(); err != nil {
+			successor.Abort(err)
+			return nil, false, err
+		}
+	}
+	if err := successor.SendListeners(files); err != nil {
+		successor.Abort(err)
+		closeFiles(files)
+		return nil, false, err
+	}
+
+	// Connections made from here on wait in the sockets' backlogs for the successor.
 	if rest != nil {
 		rest.Shutdown()
 	}
-	if err := agent.Shutdown(); err != nil {
+	if err := agent.ShutdownForHandoff(); err != nil {
 		glog.Warningf("shutdown: %+v", err)
 	}
-	glog.Flush()
+	if err = successor.Ready(); err == nil {
+		err = successor.WaitAck()
+	}
+	if err != nil {
+		return files, true, err
+	}
+	closeFiles(files)
+	return nil, true, nil
+}
+
+func fileListeners(files []*os.File) ([]net.Listener, error) {
+	defer closeFiles(files)
+	var listeners []net.Listener
+	for _, f := range files {
+		l, err := net.FileListener(f)
+		if err != nil {
+			return nil, err
+		}
+		listeners = append(listeners, l)
+	}
+	return listeners, nil
+}
+
+func closeFiles(files []*os.File) {
+	for _, f := range files {
+		f.Close()
+	}
 }
 
 // infof prints a message to stdout and also logs it to the INFO log.
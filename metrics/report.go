@@ -53,6 +53,10 @@ type MetricReport struct {
 	EndTime   time.Time         `json:"endTime"`
 	Labels    map[string]string `json:"labels"`
 	Value     MetricValue       `json:"value"`
+
+	// IdempotencyKey is an optional client-supplied key. Reports that repeat a recently-accepted key
+	// are dropped; see inputs.DedupInput. The key is cleared once the report has been deduplicated.
+	IdempotencyKey string `json:"idempotencyKey,omitempty"`
 }
 
 // Equal returns if the two MetricReports are the same.
@@ -0,0 +1,248 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package persistence
+
+import (
+	"encoding/json"
+	"errors"
+	"flag"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"path"
+	"sync"
+	"time"
+
+	"github.com/golang/glog"
+)
+
+var checkpointInterval = flag.Duration("persistence_checkpoint_interval", 0, "if positive, state is kept in memory and a snapshot of all of it is written to the state directory at most this long after it changes, and restored at startup; 0 writes each change to its own file")
+
+// checkpointFile holds a checkpointPersistence's snapshot, relative to its directory. Its extension
+// differs from those of value and log files, so a diskPersistence never reads it.
+const checkpointFile = "state.checkpoint"
+
+// checkpointPersistence is a Persistence that keeps values, queues and logs in a memoryPersistence
+// and periodically writes a snapshot of all of them to a single file, from which they are restored
+// when it's created. A change waits at most the checkpoint interval to be written, so a crash loses
+// at most that interval of changes; Flush writes one immediately, and Commit doesn't.
+//
+// Stored json text and log records are never modified in place, so a snapshot only copies the
+// memoryPersistence's maps while holding its lock, and is encoded and written without it. A
+// checkpoint is scheduled by the first change after the last one, so an idle persistence writes
+// nothing and runs no goroutine.
+type checkpointPersistence struct {
+	*memoryPersistence
+	file     string
+	interval time.Duration
+
+	// Serializes checkpoints.
+	writeMutex sync.Mutex
+
+	// Protects dirty, timer and err. Acquired while holding memoryPersistence.mutex, so it must not be
+	// held while acquiring that.
+	mutex sync.Mutex
+	// Whether there are changes since the last snapshot was taken.
+	dirty bool
+	// The timer of the next scheduled checkpoint, or nil.
+	timer *time.Timer
+	// The error of the last checkpoint, reported by commit until one succeeds.
+	err error
+}
+
+// checkpoint is the contents of a checkpoint file.
+type checkpoint struct {
+	Values map[string]json.RawMessage   `json:"values,omitempty"`
+	Logs   map[string][]json.RawMessage `json:"logs,omitempty"`
+}
+
+func newCheckpointPersistence(directory string, interval time.Duration) (*checkpointPersistence, error) {
+	p := &checkpointPersistence{
+		memoryPersistence: newMemoryPersistence(),
+		file:              path.Join(directory, checkpointFile),
+		interval:          interval,
+	}
+	if err := p.restore(); err != nil {
+		return nil, err
+	}
+	if err := p.importFiles(); err != nil {
+		return nil, errors.New("persistence: could not import files: " + err.Error())
+	}
+	p.memoryPersistence.changed = p.changed
+	return p, nil
+}
+
+// readCheckpoint reads the checkpoint file, returning nil if there is none. A corrupt checkpoint is
+// moved to the quarantine directory, and nil is returned.
+func readCheckpoint(file string) (*checkpoint, error) {
+	data, err := ioutil.ReadFile(file)
+	if os.IsNotExist(err) {
+		return nil, nil
+	} else if err != nil {
+		return nil, err
+	}
+	jsontext, err := decodeValue(data)
+	if err == errCorrupt {
+		dest := path.Join(path.Dir(file), quarantineDir, fmt.Sprintf("%v.%v", checkpointFile, time.Now().UnixNano()))
+		glog.Warningf("persistence: quarantining corrupt checkpoint to %v", dest)
+		if err := os.MkdirAll(path.Dir(dest), directoryMode); err != nil {
+			return nil, err
+		}
+		return nil, os.Rename(file, dest)
+	}
+	if len(jsontext) == 0 {
+		return nil, nil
+	}
+	var c checkpoint
+	if err := json.Unmarshal(jsontext, &c); err != nil {
+		return nil, errors.New("persistence: could not decode checkpoint: " + err.Error())
+	}
+	return &c, nil
+}
+
+// restore loads the checkpoint file, if there is one. A corrupt checkpoint is moved to the
+// quarantine directory, and the persistence starts empty.
+func (p *checkpointPersistence) restore() error {
+	c, err := readCheckpoint(p.file)
+	if c == nil || err != nil {
+		return err
+	}
+	for name, v := range c.Values {
+		p.items[name] = v
+	}
+	for name, records := range c.Logs {
+		p.logs[name] = records
+	}
+	glog.V(1).Infof("persistence: restored %v values and %v logs from checkpoint", len(c.Values), len(c.Logs))
+	return nil
+}
+
+// importFiles moves value and log files written by a diskPersistence, such as before checkpointing
+// was turned on for the directory, into this persistence. Their contents are written to a
+// checkpoint before the files are removed, so an interrupted import is repeated by the next start.
+// The files are newer than any checkpoint beside them, so they replace data of the same name.
+func (p *checkpointPersistence) importFiles() error {
+	d := &diskPersistence{directory: path.Dir(p.file), memory: newMemoryPersistence()}
+	stats, err := d.verify()
+	if err != nil || stats.Files == 0 {
+		return err
+	}
+	for _, name := range stats.Values {
+		delete(p.items, name)
+		if v, ok := d.memory.items[name]; ok {
+			p.items[name] = v
+		}
+	}
+	for _, name := range stats.Logs {
+		var records []json.RawMessage
+		if err := d.Log(name).Read(func(record json.RawMessage) error {
+			records = append(records, record)
+			return nil
+		}); err != nil {
+			return err
+		}
+		p.logs[name] = records
+	}
+	// The persistence isn't shared yet, so it's encoded without locking.
+	c := checkpoint{Values: make(map[string]json.RawMessage), Logs: p.logs}
+	for name, v := range p.items {
+		c.Values[name] = v
+	}
+	jsontext, err := json.Marshal(c)
+	if err != nil {
+		return err
+	}
+	if err := writeFileAtomic(p.file, appendFrame(nil, jsontext)); err != nil {
+		return err
+	}
+	for _, name := range stats.Values {
+		if err := os.Remove(d.valueFile(name)); err != nil {
+			return err
+		}
+	}
+	for _, name := range stats.Logs {
+		if err := os.Remove(d.logFile(name)); err != nil {
+			return err
+		}
+	}
+	glog.Infof("persistence: imported %v values and %v logs into checkpoint", len(stats.Values), len(stats.Logs))
+	return nil
+}
+
+// Flush writes a checkpoint if anything has changed since the last one.
+func (p *checkpointPersistence) Flush() error {
+	return p.checkpoint()
+}
+
+// commit returns the error of the last checkpoint. Changes are already scheduled to be written
+// within the interval, which is the loss this persistence accepts.
+func (p *checkpointPersistence) commit() error {
+	p.mutex.Lock()
+	defer p.mutex.Unlock()
+	return p.err
+}
+
+// changed is called by the memoryPersistence after each change, and schedules a checkpoint.
+func (p *checkpointPersistence) changed() {
+	p.mutex.Lock()
+	defer p.mutex.Unlock()
+	p.dirty = true
+	if p.timer == nil {
+		p.timer = time.AfterFunc(p.interval, func() {
+			p.mutex.Lock()
+			p.timer = nil
+			p.mutex.Unlock()
+			p.checkpoint()
+		})
+	}
+}
+
+func (p *checkpointPersistence) checkpoint() error {
+	p.writeMutex.Lock()
+	defer p.writeMutex.Unlock()
+
+	// Changes made after dirty is cleared are in this snapshot or schedule another.
+	p.mutex.Lock()
+	dirty := p.dirty
+	p.dirty = false
+	p.mutex.Unlock()
+	if !dirty {
+		return nil
+	}
+
+	c := checkpoint{Values: make(map[string]json.RawMessage), Logs: make(map[string][]json.RawMessage)}
+	p.memoryPersistence.mutex.RLock()
+	for name, v := range p.items {
+		c.Values[name] = v
+	}
+	for name, records := range p.logs {
+		c.Logs[name] = records
+	}
+	p.memoryPersistence.mutex.RUnlock()
+
+	jsontext, err := json.Marshal(c)
+	if err == nil {
+		err = writeFileAtomic(p.file, appendFrame(nil, jsontext))
+	}
+	p.mutex.Lock()
+	p.err = err
+	p.mutex.Unlock()
+	if err != nil {
+		glog.Errorf("persistence: writing checkpoint: %+v", err)
+		// Retry after the interval.
+		p.changed()
+	}
+	return err
+}
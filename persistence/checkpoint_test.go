@@ -0,0 +1,352 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package persistence
+
+import (
+	"encoding/json"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"path"
+	"testing"
+	"time"
+)
+
+func TestCheckpointPersistence(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "persistence_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+	p, err := newCheckpointPersistence(tmpdir, time.Millisecond)
+	if err != nil {
+		t.Fatalf("Unexpected error creating checkpointPersistence: %+v", err)
+	}
+	testPersistence(p, t)
+	testQueue(p.Queue("test_queue"), t)
+}
+
+func TestCheckpointRestore(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "persistence_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+	filename := path.Join(tmpdir, checkpointFile)
+
+	// A long interval, so that only Flush writes.
+	p, err := newCheckpointPersistence(tmpdir, time.Hour)
+	if err != nil {
+		t.Fatalf("Unexpected error creating checkpointPersistence: %+v", err)
+	}
+
+	t.Run("Changes are written by Flush and restored", func(t *testing.T) {
+		if err := p.Value("value").Store(testStruct{Value: 1}); err != nil {
+			t.Fatalf("Store: %+v", err)
+		}
+		if err := p.Value("removed").Store(testStruct{Value: 2}); err != nil {
+			t.Fatalf("Store: %+v", err)
+		}
+		if err := p.Value("removed").Remove(); err != nil {
+			t.Fatalf("Remove: %+v", err)
+		}
+		for i := 0; i < 3; i++ {
+			if err := p.Queue("queue").Enqueue(testStruct{Value: i}); err != nil {
+				t.Fatalf("Enqueue: %+v", err)
+			}
+		}
+		if err := p.Log("log").Append(testStruct{Value: 3}); err != nil {
+			t.Fatalf("Append: %+v", err)
+		}
+		if _, err := os.Stat(filename); !os.IsNotExist(err) {
+			t.Fatalf("checkpoint written before Flush: %+v", err)
+		}
+		if err := p.Flush(); err != nil {
+			t.Fatalf("Flush: %+v", err)
+		}
+
+		restored, err := newCheckpointPersistence(tmpdir, time.Hour)
+		if err != nil {
+			t.Fatalf("Unexpected error creating checkpointPersistence: %+v", err)
+		}
+		var loaded testStruct
+		if err := restored.Value("value").Load(&loaded); err != nil || loaded.Value != 1 {
+			t.Fatalf("Load: got %+v, %+v; want 1", loaded, err)
+		}
+		if err := restored.Value("removed").Load(&loaded); err != ErrNotFound {
+			t.Fatalf("Load of removed value: got %+v, want ErrNotFound", err)
+		}
+		for i := 0; i < 3; i++ {
+			if err := restored.Queue("queue").Dequeue(&loaded); err != nil || loaded.Value != i {
+				t.Fatalf("Dequeue: got %+v, %+v; want %v", loaded, err, i)
+			}
+		}
+		var records []json.RawMessage
+		restored.Log("log").Read(func(record json.RawMessage) error {
+			records = append(records, record)
+			return nil
+		})
+		if len(records) != 1 || string(records[0]) != `{"Value":3}` {
+			t.Fatalf("Log: got %s", records)
+		}
+	})
+
+	t.Run("Flush without changes writes nothing", func(t *testing.T) {
+		if err := os.Remove(filename); err != nil {
+			t.Fatalf("Remove: %+v", err)
+		}
+		if err := p.Flush(); err != nil {
+			t.Fatalf("Flush: %+v", err)
+		}
+		if _, err := os.Stat(filename); !os.IsNotExist(err) {
+			t.Fatalf("checkpoint written without changes: %+v", err)
+		}
+	})
+
+	t.Run("A corrupt checkpoint is quarantined", func(t *testing.T) {
+		if err := ioutil.WriteFile(filename, appendFrame(nil, []byte(`{"values":{}}`))[1:], fileMode); err != nil {
+			t.Fatalf("WriteFile: %+v", err)
+		}
+		restored, err := newCheckpointPersistence(tmpdir, time.Hour)
+		if err != nil {
+			t.Fatalf("Unexpected error creating checkpointPersistence: %+v", err)
+		}
+		var loaded testStruct
+		if err := restored.Value("value").Load(&loaded); err != ErrNotFound {
+			t.Fatalf("Load: got %+v, want ErrNotFound", err)
+		}
+		files, err := ioutil.ReadDir(path.Join(tmpdir, quarantineDir))
+		if err != nil || len(files) != 1 {
+			t.Fatalf("quarantined checkpoints: want=1, got=(%v, %v)", len(files), err)
+		}
+	})
+}
+
+func TestCheckpointInterval(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "persistence_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+	p, err := newCheckpointPersistence(tmpdir, 10*time.Millisecond)
+	if err != nil {
+		t.Fatalf("Unexpected error creating checkpointPersistence: %+v", err)
+	}
+	if err := p.Value("value").Store(testStruct{Value: 1}); err != nil {
+		t.Fatalf("Store: %+v", err)
+	}
+	deadline := time.Now().Add(5 * time.Second)
+	for {
+		if _, err := os.Stat(path.Join(tmpdir, checkpointFile)); err == nil {
+			break
+		}
+		if time.Now().After(deadline) {
+			t.Fatalf("checkpoint not written after the interval")
+		}
+		time.Sleep(5 * time.Millisecond)
+	}
+}
+
+func TestCheckpointCommit(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "persistence_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+	filename := path.Join(tmpdir, checkpointFile)
+	p, err := newCheckpointPersistence(tmpdir, 50*time.Millisecond)
+	if err != nil {
+		t.Fatalf("Unexpected error creating checkpointPersistence: %+v", err)
+	}
+
+	t.Run("Commit leaves changes to the scheduled checkpoint", func(t *testing.T) {
+		if err := p.Queue("queue").Enqueue(testStruct{Value: 1}); err != nil {
+			t.Fatalf("Enqueue: %+v", err)
+		}
+		if err := Commit(p); err != nil {
+			t.Fatalf("Commit: %+v", err)
+		}
+		if _, err := os.Stat(filename); !os.IsNotExist(err) {
+			t.Fatalf("checkpoint written by Commit: %+v", err)
+		}
+		deadline := time.Now().Add(5 * time.Second)
+		for {
+			if _, err := os.Stat(filename); err == nil {
+				break
+			}
+			if time.Now().After(deadline) {
+				t.Fatalf("checkpoint not written after the interval")
+			}
+			time.Sleep(5 * time.Millisecond)
+		}
+	})
+
+	t.Run("Commit reports a failed checkpoint", func(t *testing.T) {
+		// The checkpoint file is a non-empty directory, so it can't be replaced.
+		if err := os.Remove(filename); err != nil {
+			t.Fatalf("Remove: %+v", err)
+		}
+		if err := os.Mkdir(filename, directoryMode); err != nil {
+			t.Fatalf("Mkdir: %+v", err)
+		}
+		if err := ioutil.WriteFile(path.Join(filename, "x"), nil, fileMode); err != nil {
+			t.Fatalf("WriteFile: %+v", err)
+		}
+		if err := p.Queue("queue").Enqueue(testStruct{Value: 2}); err != nil {
+			t.Fatalf("Enqueue: %+v", err)
+		}
+		if err := p.Flush(); err == nil {
+			t.Fatalf("Flush: expected an error")
+		}
+		if err := Commit(p); err == nil {
+			t.Fatalf("Commit: expected an error")
+		}
+
+		if err := os.RemoveAll(filename); err != nil {
+			t.Fatalf("RemoveAll: %+v", err)
+		}
+		p.Queue("queue").Enqueue(testStruct{Value: 3})
+		if err := p.Flush(); err != nil {
+			t.Fatalf("Flush after unblocking: %+v", err)
+		}
+		if err := Commit(p); err != nil {
+			t.Fatalf("Commit after unblocking: %+v", err)
+		}
+	})
+}
+
+// Turning checkpointing on or off for a directory converts its state, so queued entries aren't lost
+// and aren't resent after turning it back.
+func TestCheckpointModeChange(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "persistence_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+
+	// checkQueue dequeues the entries of p's queue, and checks that they're want.
+	checkQueue := func(p Persistence, want ...int) {
+		for _, w := range want {
+			var loaded testStruct
+			if err := p.Queue("queue").Dequeue(&loaded); err != nil || loaded.Value != w {
+				t.Fatalf("Dequeue: got %+v, %+v; want %v", loaded, err, w)
+			}
+		}
+		if err := p.Queue("queue").Dequeue(nil); err != ErrNotFound {
+			t.Fatalf("Dequeue: got %+v, want ErrNotFound", err)
+		}
+	}
+	// checkLog checks that p's log holds n records.
+	checkLog := func(p Persistence, n int) {
+		var records int
+		p.Log("dir/log").Read(func(record json.RawMessage) error {
+			records++
+			return nil
+		})
+		if records != n {
+			t.Fatalf("Log: got %v records, want %v", records, n)
+		}
+	}
+
+	disk, err := newDiskPersistence(tmpdir, 0)
+	if err != nil {
+		t.Fatalf("Unexpected error creating DiskPersistence: %+v", err)
+	}
+	for i := 0; i < 3; i++ {
+		if err := disk.Queue("queue").Enqueue(testStruct{Value: i}); err != nil {
+			t.Fatalf("Enqueue: %+v", err)
+		}
+	}
+	if err := disk.Value("dir/agentid").Store(testStruct{Value: 7}); err != nil {
+		t.Fatalf("Store: %+v", err)
+	}
+	if err := disk.Log("dir/log").Append(testStruct{Value: 8}); err != nil {
+		t.Fatalf("Append: %+v", err)
+	}
+
+	t.Run("Checkpointing imports files", func(t *testing.T) {
+		p, err := newCheckpointPersistence(tmpdir, time.Hour)
+		if err != nil {
+			t.Fatalf("Unexpected error creating checkpointPersistence: %+v", err)
+		}
+		for _, file := range []string{"queue.json", "dir/agentid.json", "dir/log.log"} {
+			if _, err := os.Stat(path.Join(tmpdir, file)); !os.IsNotExist(err) {
+				t.Fatalf("%v not removed by import: %+v", file, err)
+			}
+		}
+		var loaded testStruct
+		if err := p.Value("dir/agentid").Load(&loaded); err != nil || loaded.Value != 7 {
+			t.Fatalf("Load: got %+v, %+v; want 7", loaded, err)
+		}
+		checkLog(p, 1)
+		// The import was written to the checkpoint, so a restart without it loses nothing.
+		p, err = newCheckpointPersistence(tmpdir, time.Hour)
+		if err != nil {
+			t.Fatalf("Unexpected error creating checkpointPersistence: %+v", err)
+		}
+		checkQueue(p, 0, 1, 2)
+		for i := 3; i < 5; i++ {
+			if err := p.Queue("queue").Enqueue(testStruct{Value: i}); err != nil {
+				t.Fatalf("Enqueue: %+v", err)
+			}
+		}
+		if err := p.Flush(); err != nil {
+			t.Fatalf("Flush: %+v", err)
+		}
+	})
+
+	t.Run("Files import the checkpoint", func(t *testing.T) {
+		p, err := newDiskPersistence(tmpdir, 0)
+		if err != nil {
+			t.Fatalf("Unexpected error creating DiskPersistence: %+v", err)
+		}
+		if _, err := os.Stat(path.Join(tmpdir, checkpointFile)); !os.IsNotExist(err) {
+			t.Fatalf("checkpoint not removed by import: %+v", err)
+		}
+		var loaded testStruct
+		if err := p.Value("dir/agentid").Load(&loaded); err != nil || loaded.Value != 7 {
+			t.Fatalf("Load: got %+v, %+v; want 7", loaded, err)
+		}
+		checkLog(p, 1)
+		checkQueue(p, 3, 4)
+	})
+}
+
+// BenchmarkCheckpointValueStore measures storing one of many values with checkpointing, for
+// comparison with BenchmarkValueStore.
+func BenchmarkCheckpointValueStore(b *testing.B) {
+	tmpdir, err := ioutil.TempDir("", "persistence_test")
+	if err != nil {
+		b.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+	p, err := newCheckpointPersistence(tmpdir, time.Second)
+	if err != nil {
+		b.Fatalf("Unexpected error creating checkpointPersistence: %+v", err)
+	}
+	values := make([]Value, 100)
+	for i := range values {
+		values[i] = p.Value(fmt.Sprintf("value%v", i))
+	}
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if err := values[i%len(values)].Store(testStruct{Value: i}); err != nil {
+			b.Fatalf("Store: %+v", err)
+		}
+	}
+	if err := p.Flush(); err != nil {
+		b.Fatalf("Flush: %+v", err)
+	}
+}
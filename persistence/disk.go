@@ -17,29 +17,96 @@ package persistence
 import (
 	"encoding/json"
 	"errors"
+	"flag"
 	"io/ioutil"
 	"os"
 	"path"
 	"sync"
+	"time"
+
+	"github.com/golang/glog"
 )
 
+var flushInterval = flag.Duration("persistence_flush_interval", 0, "if positive, values are written to disk in the background at most this long after they are stored, with only the latest version of each written; 0 writes each store immediately")
+
 // Type diskPersistence is a Persistence implementation that stores values and queues as json text
-// files in a hierarchy under a specified filesystem directory. It utilizes a memory persistence
-// for normal operations: stored values are written to both memory and disk; values are loaded
-// from memory except for the first time where a load from disk is attempted.
+// files in a hierarchy under a specified filesystem directory. Each file's contents are framed with
+// a checksum (see record.go). It utilizes a memory persistence for normal operations: stored values
+// are written to both memory and disk; values are loaded from memory, which is filled when the
+// directory is verified at creation. With a positive --persistence_flush_interval, values are
+// written to disk by a diskWriter rather than by Store itself; see Flush.
 type diskPersistence struct {
 	directory string
 	memory    *memoryPersistence
 	mutex     sync.RWMutex
+	writer    *diskWriter // nil if values are written by Store
 }
 
 // NewDiskPersistence creates a diskPersistence that stores data under the given filesystem
-// directory.
+// directory. If --persistence_checkpoint_interval is positive, it instead creates a
+// checkpointPersistence, which keeps data in memory and periodically writes all of it to the
+// directory. The two store data differently; each converts data the other left in the directory
+// when it's created, so the flag can be changed for an existing directory.
 func NewDiskPersistence(directory string) (Persistence, error) {
+	if *checkpointInterval > 0 {
+		if err := os.MkdirAll(directory, directoryMode); err != nil {
+			return nil, errors.New("persistence: could not create directory: " + directory + ": " + err.Error())
+		}
+		return newCheckpointPersistence(directory, *checkpointInterval)
+	}
+	return newDiskPersistence(directory, *flushInterval)
+}
+
+func newDiskPersistence(directory string, flushInterval time.Duration) (Persistence, error) {
 	if err := os.MkdirAll(directory, directoryMode); err != nil {
 		return nil, errors.New("persistence: could not create directory: " + directory + ": " + err.Error())
 	}
-	return &diskPersistence{directory: directory, memory: newMemoryPersistence()}, nil
+	p := &diskPersistence{directory: directory, memory: newMemoryPersistence()}
+	if flushInterval > 0 {
+		p.writer = newDiskWriter(flushInterval)
+	}
+	if err := p.importCheckpoint(); err != nil {
+		return nil, errors.New("persistence: could not import checkpoint: " + directory + ": " + err.Error())
+	}
+	stats, err := p.verify()
+	if err != nil {
+		return nil, errors.New("persistence: could not verify directory: " + directory + ": " + err.Error())
+	}
+	if stats.Quarantined > 0 {
+		glog.Warningf("persistence: verified %v records in %v files; quarantined %v corrupt records under %v",
+			stats.Records, stats.Files, stats.Quarantined, path.Join(directory, quarantineDir))
+	} else {
+		glog.V(1).Infof("persistence: verified %v records in %v files", stats.Records, stats.Files)
+	}
+	return p, nil
+}
+
+// importCheckpoint converts a checkpoint left in the directory by a checkpointPersistence, such as
+// before checkpointing was turned off, into value and log files, and then removes it. The checkpoint
+// is removed only once every file is written, so an interrupted import is repeated by the next
+// start. The checkpoint is newer than any files beside it, so it replaces files of the same name.
+func (p *diskPersistence) importCheckpoint() error {
+	file := path.Join(p.directory, checkpointFile)
+	c, err := readCheckpoint(file)
+	if c == nil || err != nil {
+		return err
+	}
+	for name, v := range c.Values {
+		if err := writeFileAtomic(p.valueFile(name), appendFrame(nil, v)); err != nil {
+			return err
+		}
+	}
+	for name, records := range c.Logs {
+		var data []byte
+		for _, record := range records {
+			data = appendFrame(data, record)
+		}
+		if err := writeFileAtomic(p.logFile(name), data); err != nil {
+			return err
+		}
+	}
+	glog.Infof("persistence: imported %v values and %v logs from checkpoint", len(c.Values), len(c.Logs))
+	return os.Remove(file)
 }
 
 func (p *diskPersistence) Value(name string) Value {
@@ -50,6 +117,17 @@ func (p *diskPersistence) Queue(name string) Queue {
 	return &valueQueue{&diskValue{p: p, name: name, memValue: &lockingValue{p.memory.value(name)}}}
 }
 
+func (p *diskPersistence) Log(name string) Log {
+	return &diskLog{p: p, name: name}
+}
+
+func (p *diskPersistence) Flush() error {
+	if p.writer == nil {
+		return nil
+	}
+	return p.writer.flush()
+}
+
 type diskValue struct {
 	p        *diskPersistence
 	name     string
@@ -70,12 +148,22 @@ func (v *diskValue) load(obj interface{}) error {
 		return err
 	}
 
-	// If there exists no value, load from disk.
-	// If the value is restored from disk, store it to memory as well.
-	jsontext, err := v.loadBytes(v.name)
+	// If there exists no value, load from disk, unless the value was removed but its file is still
+	// waiting for the writer. If the value is restored from disk, store it to memory as well.
+	if v.p.writer != nil && v.p.writer.pendingRemoval(v.p.valueFile(v.name)) {
+		return ErrNotFound
+	}
+	data, err := v.loadBytes(v.name)
 	if err != nil {
 		return err
 	}
+	jsontext, err := decodeValue(data)
+	if err == errCorrupt {
+		if err := v.p.quarantineValue(v.name); err != nil {
+			return err
+		}
+		return ErrNotFound
+	}
 	if len(jsontext) == 0 {
 		return ErrNotFound
 	}
@@ -97,16 +185,11 @@ func (v *diskValue) store(obj interface{}) error {
 	if jsontext, err = json.Marshal(obj); err != nil {
 		return err
 	}
-	filename := v.jsonFile(v.name)
-	dirname := path.Dir(filename)
-
-	if err = os.MkdirAll(dirname, directoryMode); err != nil {
-		return err
-	}
-	if err = ioutil.WriteFile(filename, jsontext, fileMode); err != nil {
-		return err
+	if v.p.writer != nil {
+		v.p.writer.write(v.p.valueFile(v.name), appendFrame(nil, jsontext))
+		return nil
 	}
-	return nil
+	return writeFileAtomic(v.p.valueFile(v.name), appendFrame(nil, jsontext))
 }
 
 func (v *diskValue) remove() error {
@@ -115,7 +198,11 @@ func (v *diskValue) remove() error {
 		return err
 	}
 
-	filename := v.jsonFile(v.name)
+	filename := v.p.valueFile(v.name)
+	if v.p.writer != nil {
+		v.p.writer.remove(filename)
+		return nil
+	}
 	if err := os.Remove(filename); err != nil {
 		if os.IsNotExist(err) {
 			return ErrNotFound
@@ -126,7 +213,7 @@ func (v *diskValue) remove() error {
 }
 
 func (v *diskValue) loadBytes(name string) ([]byte, error) {
-	filename := v.jsonFile(name)
+	filename := v.p.valueFile(name)
 	if _, err := os.Stat(filename); os.IsNotExist(err) {
 		// object doesn't exist
 		return nil, ErrNotFound
@@ -138,6 +225,10 @@ func (v *diskValue) loadBytes(name string) ([]byte, error) {
 	return jsontext, nil
 }
 
-func (v *diskValue) jsonFile(name string) string {
-	return path.Join(v.p.directory, name+".json")
+func (p *diskPersistence) valueFile(name string) string {
+	return path.Join(p.directory, name+".json")
+}
+
+func (p *diskPersistence) logFile(name string) string {
+	return path.Join(p.directory, name+".log")
 }
@@ -0,0 +1,113 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package persistence
+
+import (
+	"encoding/json"
+	"io/ioutil"
+	"os"
+	"path"
+)
+
+// Log is an append-only sequence of records. Unlike a Queue, appending a record does not rewrite
+// the records before it, so a Log can grow large cheaply. Each Log function is threadsafe within the
+// scope of the Persistence instance that created it.
+type Log interface {
+	// Append stores obj at the end of this Log. Returns nil if the object was stored, or an error if
+	// something failed.
+	Append(obj interface{}) error
+
+	// Read calls fn with the json text of each record in this Log, oldest first. Read returns nil if
+	// the Log is empty or does not exist, and stops and returns the first error returned by fn.
+	Read(fn func(record json.RawMessage) error) error
+}
+
+// memoryLog is a Log held in a memoryPersistence.
+type memoryLog struct {
+	p    *memoryPersistence
+	name string
+}
+
+func (l *memoryLog) Append(obj interface{}) error {
+	record, err := json.Marshal(obj)
+	if err != nil {
+		return err
+	}
+	l.p.mutex.Lock()
+	defer l.p.mutex.Unlock()
+	l.p.logs[l.name] = append(l.p.logs[l.name], record)
+	l.p.notify()
+	return nil
+}
+
+func (l *memoryLog) Read(fn func(record json.RawMessage) error) error {
+	l.p.mutex.RLock()
+	// Records are never modified once appended, so a copy of the slice header is a stable snapshot.
+	records := l.p.logs[l.name]
+	l.p.mutex.RUnlock()
+	for _, r := range records {
+		if err := fn(r); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// diskLog is a Log stored as a file of checksummed frames, one per record. Records are read
+// directly from disk rather than cached in memory.
+type diskLog struct {
+	p    *diskPersistence
+	name string
+}
+
+func (l *diskLog) Append(obj interface{}) error {
+	record, err := json.Marshal(obj)
+	if err != nil {
+		return err
+	}
+	frame := appendFrame(nil, record)
+	filename := l.p.logFile(l.name)
+	l.p.mutex.Lock()
+	defer l.p.mutex.Unlock()
+	if err := os.MkdirAll(path.Dir(filename), directoryMode); err != nil {
+		return err
+	}
+	f, err := os.OpenFile(filename, os.O_CREATE|os.O_APPEND|os.O_WRONLY, fileMode)
+	if err != nil {
+		return err
+	}
+	_, err = f.Write(frame)
+	if closeErr := f.Close(); err == nil {
+		err = closeErr
+	}
+	return err
+}
+
+func (l *diskLog) Read(fn func(record json.RawMessage) error) error {
+	l.p.mutex.RLock()
+	data, err := ioutil.ReadFile(l.p.logFile(l.name))
+	l.p.mutex.RUnlock()
+	if os.IsNotExist(err) {
+		return nil
+	} else if err != nil {
+		return err
+	}
+	// Corrupt regions were quarantined when the persistence was created; any found now were torn by
+	// a failed Append since then, and are skipped.
+	_, err = decodeLog(data, func(record []byte) error {
+		return fn(json.RawMessage(record))
+	})
+	return err
+}
@@ -0,0 +1,118 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package persistence
+
+import (
+	"encoding/json"
+	"errors"
+	"io/ioutil"
+	"os"
+	"path"
+	"reflect"
+	"testing"
+)
+
+func TestMemoryLog(t *testing.T) {
+	testLog(NewMemoryPersistence(), t)
+}
+
+func TestDiskLog(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "persistence_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+	p, err := NewDiskPersistence(tmpdir)
+	if err != nil {
+		t.Fatalf("Unexpected error creating DiskPersistence: %+v", err)
+	}
+	testLog(p, t)
+
+	t.Run("Records survive a restart", func(t *testing.T) {
+		p2, err := NewDiskPersistence(tmpdir)
+		if err != nil {
+			t.Fatalf("Unexpected error creating DiskPersistence: %+v", err)
+		}
+		if got := readLog(p2.Log("test/log"), t); len(got) != 3 {
+			t.Fatalf("records after restart: want=3, got=%v", len(got))
+		}
+	})
+
+	t.Run("Torn records are skipped", func(t *testing.T) {
+		var data []byte
+		data = appendFrame(data, []byte(`{"Value1":1}`))
+		torn := appendFrame(nil, []byte(`{"Value1":99}`))
+		data = append(data, torn[:len(torn)-3]...)
+		data = appendFrame(data, []byte(`{"Value1":2}`))
+		if err := ioutil.WriteFile(path.Join(tmpdir, "torn.log"), data, fileMode); err != nil {
+			t.Fatalf("Unexpected error writing log: %+v", err)
+		}
+		got := readLog(p.Log("torn"), t)
+		want := []Outer{{Value1: 1}, {Value1: 2}}
+		if !reflect.DeepEqual(got, want) {
+			t.Fatalf("records: want=%+v, got=%+v", want, got)
+		}
+	})
+}
+
+func testLog(p Persistence, t *testing.T) {
+	l := p.Log("test/log")
+	if got := readLog(l, t); len(got) != 0 {
+		t.Fatalf("records in new log: want=0, got=%v", len(got))
+	}
+
+	want := []Outer{
+		{Value1: 1, Foo: Inner{ValueMap: map[string]string{"foo": "bar"}}},
+		{Value1: 2},
+		{Value1: 3},
+	}
+	for _, o := range want {
+		if err := l.Append(o); err != nil {
+			t.Fatalf("Unexpected error appending: %+v", err)
+		}
+	}
+
+	// A second instance with the same name sees the same records.
+	if got := readLog(p.Log("test/log"), t); !reflect.DeepEqual(got, want) {
+		t.Fatalf("records: want=%+v, got=%+v", want, got)
+	}
+
+	// Read stops at the first error returned by the callback.
+	stop := errors.New("stop")
+	calls := 0
+	err := l.Read(func(json.RawMessage) error {
+		calls++
+		return stop
+	})
+	if err != stop || calls != 1 {
+		t.Fatalf("Read with error: want=(%v, 1), got=(%v, %v)", stop, err, calls)
+	}
+}
+
+func readLog(l Log, t *testing.T) []Outer {
+	var records []Outer
+	err := l.Read(func(record json.RawMessage) error {
+		var o Outer
+		if err := json.Unmarshal(record, &o); err != nil {
+			return err
+		}
+		records = append(records, o)
+		return nil
+	})
+	if err != nil {
+		t.Fatalf("Unexpected error reading log: %+v", err)
+	}
+	return records
+}
@@ -23,7 +23,10 @@ import (
 // data in an in-memory map. This implementations does not offer persistence across restarts.
 type memoryPersistence struct {
 	items map[string][]byte
+	logs  map[string][]json.RawMessage
 	mutex sync.RWMutex
+	// If not nil, called after each change, while holding mutex.
+	changed func()
 }
 
 // NewMemoryPersistence constructs a new Persistence that stores objects in memory.
@@ -34,6 +37,7 @@ func NewMemoryPersistence() Persistence {
 func newMemoryPersistence() *memoryPersistence {
 	var mp memoryPersistence
 	mp.items = make(map[string][]byte)
+	mp.logs = make(map[string][]json.RawMessage)
 	return &mp
 }
 
@@ -45,6 +49,21 @@ func (p *memoryPersistence) Queue(name string) Queue {
 	return &valueQueue{p.value(name)}
 }
 
+func (p *memoryPersistence) Log(name string) Log {
+	return &memoryLog{p: p, name: name}
+}
+
+func (p *memoryPersistence) Flush() error {
+	return nil
+}
+
+// notify calls changed, if set. Must be called while holding mutex.
+func (p *memoryPersistence) notify() {
+	if p.changed != nil {
+		p.changed()
+	}
+}
+
 func (p *memoryPersistence) value(name string) *memoryValue {
 	return &memoryValue{p: p, name: name}
 }
@@ -75,6 +94,7 @@ func (v *memoryValue) store(obj interface{}) error {
 	} else {
 		v.p.items[v.name] = buff
 	}
+	v.p.notify()
 	return nil
 }
 
@@ -83,5 +103,6 @@ func (v *memoryValue) remove() error {
 		return ErrNotFound
 	}
 	delete(v.p.items, v.name)
+	v.p.notify()
 	return nil
 }
@@ -41,6 +41,36 @@ type Persistence interface {
 	// times with the same name and all returned instances will operate on the same data in a
 	// threadsafe manner.
 	Queue(name string) Queue
+
+	// Log creates a Log instance associated with the given name. Names should not contain file
+	// extensions. Within the scope of a single Persistence instance, Log can be called multiple
+	// times with the same name and all returned instances will operate on the same data in a
+	// threadsafe manner.
+	Log(name string) Log
+
+	// Flush blocks until every Value and Queue change made before it was called is durable, and
+	// returns an error if one couldn't be written. Implementations may write changes in the
+	// background, coalescing repeated stores of the same value, so callers that hand off
+	// responsibility for stored data, such as by acknowledging a queued entry, should flush first.
+	Flush() error
+}
+
+// committer is implemented by a Persistence whose configuration accepts losing recent changes in
+// a crash, so that Commit needn't flush it.
+type committer interface {
+	commit() error
+}
+
+// Commit makes the changes made before it was called as durable as p's configuration promises,
+// for a caller that is about to take responsibility for them, such as by acknowledging a queued
+// entry. Most persistences are flushed. A checkpointing persistence, which accepts losing its
+// checkpoint interval of changes, writes them with its next scheduled checkpoint instead, so that
+// each commit doesn't rewrite its whole state.
+func Commit(p Persistence) error {
+	if c, ok := p.(committer); ok {
+		return c.commit()
+	}
+	return p.Flush()
 }
 
 // Value stores and loads a single value.
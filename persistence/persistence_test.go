@@ -15,6 +15,7 @@
 package persistence
 
 import (
+	"encoding/json"
 	"io/ioutil"
 	"os"
 	"reflect"
@@ -186,6 +187,22 @@ func testQueue(q Queue, t *testing.T) {
 	}
 
 	// At this point we should still have value 2 and value 3 in the queue.
+	for n, want := range map[int][]value{1: {value2}, 2: {value2, value3}, 3: {value2, value3}} {
+		texts, err := q.PeekN(n)
+		if err != nil {
+			t.Fatalf("Unexpected error getting first %v queue values: %+v", n, err)
+		}
+		var got []value
+		for _, text := range texts {
+			if err := json.Unmarshal(text, &v); err != nil {
+				t.Fatalf("Unexpected error decoding queue value: %+v", err)
+			}
+			got = append(got, v)
+		}
+		if !reflect.DeepEqual(got, want) {
+			t.Fatalf("Unexpected first %v queue values: %+v", n, got)
+		}
+	}
 	if err := q.Peek(&v); err != nil {
 		t.Fatalf("Unexpected error getting queue value 2: %+v", err)
 	}
@@ -217,4 +234,32 @@ func testQueue(q Queue, t *testing.T) {
 	if err := q.Peek(&v); err != ErrNotFound {
 		t.Fatalf("Expected ErrNotFound, got %+v", err)
 	}
+	if _, err := q.PeekN(1); err != ErrNotFound {
+		t.Fatalf("Expected ErrNotFound, got %+v", err)
+	}
+	if _, err := q.DequeueN(1); err != ErrNotFound {
+		t.Fatalf("Expected ErrNotFound, got %+v", err)
+	}
+
+	// DequeueN removes several entries at once, and no more than the queue holds.
+	for _, value := range []value{value1, value2, value3} {
+		if err := q.Enqueue(&value); err != nil {
+			t.Fatalf("Unexpected error adding queue value: %+v", err)
+		}
+	}
+	if n, err := q.DequeueN(2); err != nil || n != 2 {
+		t.Fatalf("DequeueN(2): got %v, %+v; want 2", n, err)
+	}
+	if err := q.Peek(&v); err != nil {
+		t.Fatalf("Unexpected error getting queue value 3: %+v", err)
+	}
+	if !reflect.DeepEqual(v, value3) {
+		t.Fatalf("Unexpected value for value 3: %+v", v)
+	}
+	if n, err := q.DequeueN(5); err != nil || n != 1 {
+		t.Fatalf("DequeueN(5): got %v, %+v; want 1", n, err)
+	}
+	if err := q.Peek(&v); err != ErrNotFound {
+		t.Fatalf("Expected ErrNotFound, got %+v", err)
+	}
 }
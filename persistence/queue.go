@@ -28,11 +28,22 @@ type Queue interface {
 	// I/O errors may be returned in the event of I/O failures.
 	Peek(obj interface{}) error
 
+	// PeekN returns the json text of up to n objects at the front of this Queue, in order.
+	// ErrNotFound is returned if the queue is empty or does not exist. Other I/O errors may be
+	// returned in the event of I/O failures.
+	PeekN(n int) ([]json.RawMessage, error)
+
 	// Dequeue removes the front of this Queue. If successful, nil is returned. ErrNotFound is
 	// returned if the queue is empty or does not exist. Other I/O errors may be returned in the event
 	// of I/O failures. If obj is non-nil, it will contain removed value upon success.
 	Dequeue(obj interface{}) error
 
+	// DequeueN removes up to n objects from the front of this Queue in one operation, and returns
+	// the number removed. Either all of them are removed or, on error, none are. ErrNotFound is
+	// returned if the queue is empty or does not exist. Other I/O errors may be returned in the event
+	// of I/O failures.
+	DequeueN(n int) (int, error)
+
 	// Enqueue stores obj at the back of this Queue. Returns nil if the object was stored, or an error
 	// if something failed.
 	Enqueue(obj interface{}) error
@@ -64,6 +75,23 @@ func (vq *valueQueue) Peek(obj interface{}) error {
 	return nil
 }
 
+func (vq *valueQueue) PeekN(n int) ([]json.RawMessage, error) {
+	var queue []json.RawMessage
+	vq.value.mutex().RLock()
+	err := vq.value.load(&queue)
+	vq.value.mutex().RUnlock()
+	if err != nil {
+		return nil, err
+	}
+	if len(queue) == 0 {
+		return nil, ErrNotFound
+	}
+	if len(queue) > n {
+		queue = queue[:n]
+	}
+	return queue, nil
+}
+
 func (vq *valueQueue) Dequeue(obj interface{}) error {
 	var queue []json.RawMessage
 	// Grab the value's associated persistence lock
@@ -97,6 +125,32 @@ func (vq *valueQueue) Dequeue(obj interface{}) error {
 	return nil
 }
 
+func (vq *valueQueue) DequeueN(n int) (int, error) {
+	var queue []json.RawMessage
+	vq.value.mutex().Lock()
+	defer vq.value.mutex().Unlock()
+	if err := vq.value.load(&queue); err != nil {
+		return 0, err
+	}
+	if len(queue) == 0 {
+		return 0, ErrNotFound
+	}
+	if n > len(queue) {
+		n = len(queue)
+	}
+	// Store the remainder once, or remove the backing value if nothing remains.
+	if newq := queue[n:]; len(newq) > 0 {
+		if err := vq.value.store(newq); err != nil {
+			return 0, err
+		}
+	} else {
+		if err := vq.value.remove(); err != nil {
+			return 0, err
+		}
+	}
+	return n, nil
+}
+
 func (vq *valueQueue) Enqueue(obj interface{}) error {
 	var queue []json.RawMessage
 	var err error
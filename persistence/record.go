@@ -0,0 +1,267 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package persistence
+
+import (
+	"bytes"
+	"encoding/binary"
+	"encoding/json"
+	"errors"
+	"fmt"
+	"hash/crc32"
+	"io/ioutil"
+	"os"
+	"path"
+	"path/filepath"
+	"strings"
+	"time"
+
+	"github.com/golang/glog"
+)
+
+// Records are stored on disk in frames:
+//
+//	magic (1 byte) | payload length (uint32, little endian) | CRC-32C of payload (uint32, little endian) | payload
+//
+// A value file holds a single frame; a log file holds a sequence of them. The magic byte is never
+// the first byte of json text, so files written before framing was introduced are still readable.
+// CRC-32C is computed with the SSE 4.2 or ARMv8 CRC instructions where available.
+const (
+	frameMagic     = 0xc5
+	frameHeaderLen = 9
+
+	// quarantineDir holds corrupt records, relative to the persistence directory.
+	quarantineDir = "quarantine"
+
+	tmpSuffix = ".tmp"
+)
+
+var castagnoli = crc32.MakeTable(crc32.Castagnoli)
+
+// errCorrupt is returned when a frame fails verification.
+var errCorrupt = errors.New("persistence: corrupt record")
+
+// appendFrame appends a frame holding payload to dst.
+func appendFrame(dst, payload []byte) []byte {
+	var header [frameHeaderLen]byte
+	header[0] = frameMagic
+	binary.LittleEndian.PutUint32(header[1:5], uint32(len(payload)))
+	binary.LittleEndian.PutUint32(header[5:9], crc32.Checksum(payload, castagnoli))
+	dst = append(dst, header[:]...)
+	return append(dst, payload...)
+}
+
+// parseFrame verifies the frame at the start of data. It returns the frame's payload and total
+// length, or errCorrupt.
+func parseFrame(data []byte) ([]byte, int, error) {
+	if len(data) < frameHeaderLen || data[0] != frameMagic {
+		return nil, 0, errCorrupt
+	}
+	n := binary.LittleEndian.Uint32(data[1:5])
+	if uint64(n) > uint64(len(data)-frameHeaderLen) {
+		return nil, 0, errCorrupt
+	}
+	payload := data[frameHeaderLen : frameHeaderLen+int(n)]
+	if crc32.Checksum(payload, castagnoli) != binary.LittleEndian.Uint32(data[5:9]) {
+		return nil, 0, errCorrupt
+	}
+	return payload, frameHeaderLen + int(n), nil
+}
+
+// decodeValue returns the json text held in the contents of a value file. An empty file holds no
+// value and yields nil.
+func decodeValue(data []byte) ([]byte, error) {
+	if len(data) == 0 {
+		return nil, nil
+	}
+	if data[0] != frameMagic {
+		// Unframed json written by an earlier version.
+		if !json.Valid(data) {
+			return nil, errCorrupt
+		}
+		return data, nil
+	}
+	payload, n, err := parseFrame(data)
+	if err != nil || n != len(data) {
+		return nil, errCorrupt
+	}
+	return payload, nil
+}
+
+// decodeLog calls fn with each intact record in the contents of a log file. Corrupt regions, such
+// as a record torn by a crash during an append, are skipped by searching for the next intact frame;
+// they are returned as bad.
+func decodeLog(data []byte, fn func(record []byte) error) (bad [][]byte, err error) {
+	for i := 0; i < len(data); {
+		payload, n, perr := parseFrame(data[i:])
+		if perr == nil {
+			if err := fn(payload); err != nil {
+				return bad, err
+			}
+			i += n
+			continue
+		}
+		j := i + 1
+		for ; j < len(data); j++ {
+			if data[j] == frameMagic {
+				if _, _, err := parseFrame(data[j:]); err == nil {
+					break
+				}
+			}
+		}
+		bad = append(bad, data[i:j])
+		i = j
+	}
+	return bad, nil
+}
+
+// verifyStats describes the result of verifying a persistence directory.
+type verifyStats struct {
+	Files       int
+	Records     int
+	Bytes       int64
+	Quarantined int
+	// The names of the values and logs verified, excluding quarantined values.
+	Values []string
+	Logs   []string
+}
+
+// verify checks every value and log file under the persistence directory, and is called once when
+// a diskPersistence is created. Verified values are cached in memory, so loading them later doesn't
+// read them again. Corrupt values are moved aside, and corrupt regions of logs are copied aside and
+// removed from the log, so that a single damaged record costs only that record. Everything moved
+// aside is kept under the quarantine directory for inspection.
+func (p *diskPersistence) verify() (verifyStats, error) {
+	var stats verifyStats
+	quarantine := filepath.Join(p.directory, quarantineDir)
+	err := filepath.Walk(p.directory, func(file string, info os.FileInfo, err error) error {
+		if err != nil {
+			return err
+		}
+		if info.IsDir() {
+			if file == quarantine {
+				return filepath.SkipDir
+			}
+			return nil
+		}
+		rel, err := filepath.Rel(p.directory, file)
+		if err != nil {
+			return err
+		}
+		rel = filepath.ToSlash(rel)
+		switch {
+		case strings.HasSuffix(rel, tmpSuffix):
+			// An interrupted write; the previous contents are still in place.
+			return os.Remove(file)
+		case strings.HasSuffix(rel, ".json"):
+			return p.verifyValue(strings.TrimSuffix(rel, ".json"), &stats)
+		case strings.HasSuffix(rel, ".log"):
+			return p.verifyLog(strings.TrimSuffix(rel, ".log"), &stats)
+		}
+		return nil
+	})
+	return stats, err
+}
+
+func (p *diskPersistence) verifyValue(name string, stats *verifyStats) error {
+	file := p.valueFile(name)
+	data, err := ioutil.ReadFile(file)
+	if err != nil {
+		return err
+	}
+	stats.Files++
+	stats.Bytes += int64(len(data))
+	payload, err := decodeValue(data)
+	if err != nil {
+		stats.Quarantined++
+		return p.quarantineValue(name)
+	}
+	stats.Values = append(stats.Values, name)
+	if payload != nil {
+		stats.Records++
+		p.memory.items[name] = payload
+	}
+	return nil
+}
+
+func (p *diskPersistence) verifyLog(name string, stats *verifyStats) error {
+	file := p.logFile(name)
+	data, err := ioutil.ReadFile(file)
+	if err != nil {
+		return err
+	}
+	stats.Files++
+	stats.Bytes += int64(len(data))
+	stats.Logs = append(stats.Logs, name)
+	bad, err := decodeLog(data, func(record []byte) error {
+		stats.Records++
+		return nil
+	})
+	if err != nil || len(bad) == 0 {
+		return err
+	}
+	stats.Quarantined += len(bad)
+	glog.Warningf("persistence: quarantining %v corrupt regions of log %v", len(bad), name)
+	if err := p.appendQuarantine(name+".log", bytes.Join(bad, nil)); err != nil {
+		return err
+	}
+	var valid []byte
+	decodeLog(data, func(record []byte) error {
+		valid = appendFrame(valid, record)
+		return nil
+	})
+	return writeFileAtomic(file, valid)
+}
+
+// quarantineValue moves a corrupt value file into the quarantine directory.
+func (p *diskPersistence) quarantineValue(name string) error {
+	glog.Warningf("persistence: quarantining corrupt value %v", name)
+	dest := path.Join(p.directory, quarantineDir, fmt.Sprintf("%v.json.%v", name, time.Now().UnixNano()))
+	if err := os.MkdirAll(path.Dir(dest), directoryMode); err != nil {
+		return err
+	}
+	return os.Rename(p.valueFile(name), dest)
+}
+
+// appendQuarantine appends data to the named file in the quarantine directory.
+func (p *diskPersistence) appendQuarantine(name string, data []byte) error {
+	dest := path.Join(p.directory, quarantineDir, name)
+	if err := os.MkdirAll(path.Dir(dest), directoryMode); err != nil {
+		return err
+	}
+	f, err := os.OpenFile(dest, os.O_CREATE|os.O_APPEND|os.O_WRONLY, fileMode)
+	if err != nil {
+		return err
+	}
+	_, err = f.Write(data)
+	if closeErr := f.Close(); err == nil {
+		err = closeErr
+	}
+	return err
+}
+
+// writeFileAtomic replaces file's contents with data, so that a crash leaves either the old or the
+// new contents in place.
+func writeFileAtomic(file string, data []byte) error {
+	if err := os.MkdirAll(path.Dir(file), directoryMode); err != nil {
+		return err
+	}
+	tmp := file + tmpSuffix
+	if err := ioutil.WriteFile(tmp, data, fileMode); err != nil {
+		os.Remove(tmp)
+		return err
+	}
+	return os.Rename(tmp, file)
+}
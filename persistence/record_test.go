@@ -0,0 +1,203 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package persistence
+
+import (
+	"bytes"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"path"
+	"reflect"
+	"testing"
+)
+
+func TestFrames(t *testing.T) {
+	payload := []byte(`{"Value":10}`)
+	frame := appendFrame(nil, payload)
+
+	got, n, err := parseFrame(frame)
+	if err != nil || n != len(frame) || !bytes.Equal(got, payload) {
+		t.Fatalf("parseFrame: want=(%s, %v, nil), got=(%s, %v, %v)", payload, len(frame), got, n, err)
+	}
+	for i := range frame {
+		damaged := append([]byte(nil), frame...)
+		damaged[i] ^= 0x40
+		if _, _, err := parseFrame(damaged); err != errCorrupt {
+			t.Fatalf("parseFrame with byte %v damaged: want=%v, got=%v", i, errCorrupt, err)
+		}
+	}
+	if _, _, err := parseFrame(frame[:len(frame)-1]); err != errCorrupt {
+		t.Fatalf("parseFrame of truncated frame: want=%v, got=%v", errCorrupt, err)
+	}
+}
+
+func TestDecodeValue(t *testing.T) {
+	tests := []struct {
+		data []byte
+		want []byte
+		err  error
+	}{
+		{nil, nil, nil},
+		{appendFrame(nil, []byte(`{"Value":10}`)), []byte(`{"Value":10}`), nil},
+		{[]byte(`{"Value":10}`), []byte(`{"Value":10}`), nil},
+		{[]byte(`{"Value":1`), nil, errCorrupt},
+		{append(appendFrame(nil, []byte(`1`)), 0), nil, errCorrupt},
+	}
+	for i, test := range tests {
+		got, err := decodeValue(test.data)
+		if err != test.err || !bytes.Equal(got, test.want) {
+			t.Fatalf("decodeValue %v: want=(%s, %v), got=(%s, %v)", i, test.want, test.err, got, err)
+		}
+	}
+}
+
+func TestQuarantine(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "persistence_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+
+	p, err := NewDiskPersistence(tmpdir)
+	if err != nil {
+		t.Fatalf("Unexpected error creating DiskPersistence: %+v", err)
+	}
+	for _, name := range []string{"good", "dir/bad"} {
+		if err := p.Value(name).Store(testStruct{Value: 10}); err != nil {
+			t.Fatalf("Unexpected error storing %v: %+v", name, err)
+		}
+	}
+	l := p.Log("log")
+	for i := 1; i <= 3; i++ {
+		if err := l.Append(Outer{Value1: i}); err != nil {
+			t.Fatalf("Unexpected error appending: %+v", err)
+		}
+	}
+
+	// Damage the stored value, and the log's second record.
+	damage := func(file string, offset int) {
+		data, err := ioutil.ReadFile(file)
+		if err != nil {
+			t.Fatalf("Unexpected error reading %v: %+v", file, err)
+		}
+		data[offset] ^= 0xff
+		if err := ioutil.WriteFile(file, data, fileMode); err != nil {
+			t.Fatalf("Unexpected error writing %v: %+v", file, err)
+		}
+	}
+	damage(path.Join(tmpdir, "dir/bad.json"), frameHeaderLen+2)
+	recordLen := len(appendFrame(nil, []byte(`{"Value1":1,"Value2":0,"Foo":{"ValueMap":null}}`)))
+	damage(path.Join(tmpdir, "log.log"), recordLen+frameHeaderLen+2)
+
+	p, err = NewDiskPersistence(tmpdir)
+	if err != nil {
+		t.Fatalf("Unexpected error creating DiskPersistence: %+v", err)
+	}
+	var v testStruct
+	if err := p.Value("good").Load(&v); err != nil || v.Value != 10 {
+		t.Fatalf("good value: want=(10, nil), got=(%v, %v)", v.Value, err)
+	}
+	if err := p.Value("dir/bad").Load(&v); err != ErrNotFound {
+		t.Fatalf("bad value: want=%v, got=%v", ErrNotFound, err)
+	}
+	var values []int
+	l = p.Log("log")
+	for _, o := range readLog(l, t) {
+		values = append(values, o.Value1)
+	}
+	if want := []int{1, 3}; !reflect.DeepEqual(want, values) {
+		t.Fatalf("log records: want=%v, got=%v", want, values)
+	}
+	if err := l.Append(Outer{Value1: 4}); err != nil {
+		t.Fatalf("Unexpected error appending: %+v", err)
+	}
+
+	// Corrupt records are kept aside, and the rest of the log stays intact.
+	files, err := ioutil.ReadDir(path.Join(tmpdir, quarantineDir, "dir"))
+	if err != nil || len(files) != 1 {
+		t.Fatalf("quarantined values: want=1, got=(%v, %v)", len(files), err)
+	}
+	if data, err := ioutil.ReadFile(path.Join(tmpdir, quarantineDir, "log.log")); err != nil || len(data) != recordLen {
+		t.Fatalf("quarantined log bytes: want=%v, got=(%v, %v)", recordLen, len(data), err)
+	}
+	p, err = NewDiskPersistence(tmpdir)
+	if err != nil {
+		t.Fatalf("Unexpected error creating DiskPersistence: %+v", err)
+	}
+	if want, got := 3, len(readLog(p.Log("log"), t)); want != got {
+		t.Fatalf("log records after restart: want=%v, got=%v", want, got)
+	}
+}
+
+func TestLegacyValue(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "persistence_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+
+	if err := ioutil.WriteFile(path.Join(tmpdir, "legacy.json"), []byte(`{"Value":7}`), fileMode); err != nil {
+		t.Fatalf("Unexpected error writing value: %+v", err)
+	}
+	p, err := NewDiskPersistence(tmpdir)
+	if err != nil {
+		t.Fatalf("Unexpected error creating DiskPersistence: %+v", err)
+	}
+	var v testStruct
+	if err := p.Value("legacy").Load(&v); err != nil || v.Value != 7 {
+		t.Fatalf("legacy value: want=(7, nil), got=(%v, %v)", v.Value, err)
+	}
+}
+
+// BenchmarkVerify measures the cost of verifying a state directory holding 1000 values of about
+// 10KB each and a log of 100000 records, as done when a disk persistence is created.
+func BenchmarkVerify(b *testing.B) {
+	tmpdir, err := ioutil.TempDir("", "persistence_bench")
+	if err != nil {
+		b.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+
+	p, err := NewDiskPersistence(tmpdir)
+	if err != nil {
+		b.Fatalf("Unexpected error creating DiskPersistence: %+v", err)
+	}
+	entries := make([]Outer, 100)
+	for i := range entries {
+		entries[i] = Outer{Value1: i, Foo: Inner{ValueMap: map[string]string{"label": "some-label-value", "other": "other-label-value"}}}
+	}
+	for i := 0; i < 1000; i++ {
+		if err := p.Value(fmt.Sprintf("values/%v", i)).Store(entries); err != nil {
+			b.Fatalf("Unexpected error storing value: %+v", err)
+		}
+	}
+	l := p.Log("log")
+	for i := 0; i < 100000; i++ {
+		if err := l.Append(entries[i%len(entries)]); err != nil {
+			b.Fatalf("Unexpected error appending: %+v", err)
+		}
+	}
+
+	b.ResetTimer()
+	var stats verifyStats
+	for i := 0; i < b.N; i++ {
+		dp := &diskPersistence{directory: tmpdir, memory: newMemoryPersistence()}
+		if stats, err = dp.verify(); err != nil {
+			b.Fatalf("Unexpected error verifying: %+v", err)
+		}
+	}
+	b.SetBytes(stats.Bytes)
+}
@@ -0,0 +1,165 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package persistence
+
+import (
+	"os"
+	"sync"
+	"time"
+
+	"github.com/golang/glog"
+)
+
+// diskWriter writes value files on its own goroutine. Callers record the latest contents of each
+// file and return; the writer writes them in rounds, at most interval after a file is first
+// recorded, and only the latest contents recorded before a round starts are written. A value stored
+// many times between rounds is therefore written once. The writer's goroutine runs only while there
+// are files to write.
+type diskWriter struct {
+	interval time.Duration
+
+	mutex sync.Mutex
+	// The contents of each file to write, keyed by path. Nil contents remove the file.
+	dirty   map[string][]byte
+	running bool
+	// Rounds started and completed, and the error of the last completed round.
+	started, completed uint64
+	err                error
+	roundDone          *sync.Cond
+	// The round that callers of flush are waiting for. The writer doesn't stop until it completes.
+	flushed uint64
+	// Wakes the writer to start a round early.
+	flushNow chan struct{}
+}
+
+func newDiskWriter(interval time.Duration) *diskWriter {
+	w := &diskWriter{
+		interval: interval,
+		dirty:    make(map[string][]byte),
+		flushNow: make(chan struct{}, 1),
+	}
+	w.roundDone = sync.NewCond(&w.mutex)
+	return w
+}
+
+// write records contents to be written to filename, replacing any not yet written.
+func (w *diskWriter) write(filename string, contents []byte) {
+	w.mutex.Lock()
+	defer w.mutex.Unlock()
+	w.dirty[filename] = contents
+	w.start()
+}
+
+// remove records that filename is to be removed.
+func (w *diskWriter) remove(filename string) {
+	w.write(filename, nil)
+}
+
+// pendingRemoval returns whether filename is to be removed but hasn't been yet.
+func (w *diskWriter) pendingRemoval(filename string) bool {
+	w.mutex.Lock()
+	defer w.mutex.Unlock()
+	contents, ok := w.dirty[filename]
+	return ok && contents == nil
+}
+
+// flush starts a round and waits for it, so that every write and remove recorded before flush was
+// called is on disk. Returns the round's error, if any; files that failed are retried in later
+// rounds.
+func (w *diskWriter) flush() error {
+	w.mutex.Lock()
+	defer w.mutex.Unlock()
+	if !w.running {
+		return nil
+	}
+	target := w.started + 1
+	if target > w.flushed {
+		w.flushed = target
+	}
+	select {
+	case w.flushNow <- struct{}{}:
+	default:
+	}
+	for w.completed < target {
+		w.roundDone.Wait()
+	}
+	return w.err
+}
+
+// start starts the writer's goroutine if it isn't running. Must be called while holding mutex.
+func (w *diskWriter) start() {
+	if !w.running {
+		w.running = true
+		go w.run()
+	}
+}
+
+func (w *diskWriter) run() {
+	for {
+		select {
+		case <-time.After(w.interval):
+		case <-w.flushNow:
+		}
+
+		w.mutex.Lock()
+		batch := w.dirty
+		w.dirty = make(map[string][]byte)
+		w.started++
+		w.mutex.Unlock()
+
+		failed, err := writeBatch(batch)
+
+		w.mutex.Lock()
+		for filename, contents := range failed {
+			// Retry unless newer contents have been recorded.
+			if _, ok := w.dirty[filename]; !ok {
+				w.dirty[filename] = contents
+			}
+		}
+		w.completed = w.started
+		w.err = err
+		w.roundDone.Broadcast()
+		if len(w.dirty) == 0 && w.completed >= w.flushed {
+			w.running = false
+			w.mutex.Unlock()
+			return
+		}
+		w.mutex.Unlock()
+	}
+}
+
+// writeBatch writes or removes each file in batch. Returns the files that failed and the first
+// error.
+func writeBatch(batch map[string][]byte) (failed map[string][]byte, err error) {
+	for filename, contents := range batch {
+		var werr error
+		if contents == nil {
+			if werr = os.Remove(filename); os.IsNotExist(werr) {
+				werr = nil
+			}
+		} else {
+			werr = writeFileAtomic(filename, contents)
+		}
+		if werr != nil {
+			glog.Errorf("persistence: writing %v: %+v", filename, werr)
+			if failed == nil {
+				failed = make(map[string][]byte)
+				err = werr
+			}
+			failed[filename] = contents
+		}
+	}
+	return
+}
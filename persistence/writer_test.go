@@ -0,0 +1,231 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package persistence
+
+import (
+	"fmt"
+	"io/ioutil"
+	"os"
+	"path"
+	"syscall"
+	"testing"
+	"time"
+)
+
+func TestCoalescingDiskPersistence(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "persistence_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+	p, err := newDiskPersistence(tmpdir, time.Millisecond)
+	if err != nil {
+		t.Fatalf("Unexpected error creating DiskPersistence: %+v", err)
+	}
+	testPersistence(p, t)
+	testQueue(p.Queue("test_queue"), t)
+}
+
+func TestDiskWriter(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "persistence_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+
+	// A long interval, so that only Flush writes.
+	p, err := newDiskPersistence(tmpdir, time.Hour)
+	if err != nil {
+		t.Fatalf("Unexpected error creating DiskPersistence: %+v", err)
+	}
+	filename := path.Join(tmpdir, "key.json")
+
+	t.Run("Store is written by Flush, with the latest value", func(t *testing.T) {
+		for i := 1; i <= 100; i++ {
+			if err := p.Value("key").Store(testStruct{Value: i}); err != nil {
+				t.Fatalf("Store: %+v", err)
+			}
+		}
+		var loaded testStruct
+		if err := p.Value("key").Load(&loaded); err != nil || loaded.Value != 100 {
+			t.Fatalf("Load: got %+v, %+v; want 100", loaded, err)
+		}
+		if _, err := os.Stat(filename); !os.IsNotExist(err) {
+			t.Fatalf("value file written before Flush: %+v", err)
+		}
+
+		if err := p.Flush(); err != nil {
+			t.Fatalf("Flush: %+v", err)
+		}
+		restored, err := NewDiskPersistence(tmpdir)
+		if err != nil {
+			t.Fatalf("Unexpected error creating DiskPersistence: %+v", err)
+		}
+		if err := restored.Value("key").Load(&loaded); err != nil || loaded.Value != 100 {
+			t.Fatalf("Load after restart: got %+v, %+v; want 100", loaded, err)
+		}
+	})
+
+	t.Run("Remove is written by Flush, and hides the file until then", func(t *testing.T) {
+		if err := p.Value("key").Remove(); err != nil {
+			t.Fatalf("Remove: %+v", err)
+		}
+		var loaded testStruct
+		if err := p.Value("key").Load(&loaded); err != ErrNotFound {
+			t.Fatalf("Load: got %+v, want ErrNotFound", err)
+		}
+		if _, err := os.Stat(filename); err != nil {
+			t.Fatalf("value file removed before Flush: %+v", err)
+		}
+
+		if err := p.Flush(); err != nil {
+			t.Fatalf("Flush: %+v", err)
+		}
+		if _, err := os.Stat(filename); !os.IsNotExist(err) {
+			t.Fatalf("value file not removed by Flush: %+v", err)
+		}
+	})
+
+	t.Run("Flush with nothing to write", func(t *testing.T) {
+		if err := p.Flush(); err != nil {
+			t.Fatalf("Flush: %+v", err)
+		}
+	})
+
+	t.Run("Write failures are reported by Flush and retried", func(t *testing.T) {
+		// The value's file is a non-empty directory, so it can't be replaced.
+		if err := os.Mkdir(path.Join(tmpdir, "blocked.json"), directoryMode); err != nil {
+			t.Fatalf("Mkdir: %+v", err)
+		}
+		if err := ioutil.WriteFile(path.Join(tmpdir, "blocked.json", "x"), nil, fileMode); err != nil {
+			t.Fatalf("WriteFile: %+v", err)
+		}
+		if err := p.Value("blocked").Store(testStruct{Value: 1}); err != nil {
+			t.Fatalf("Store: %+v", err)
+		}
+		if err := p.Flush(); err == nil {
+			t.Fatalf("Flush: expected an error")
+		}
+
+		if err := os.RemoveAll(path.Join(tmpdir, "blocked.json")); err != nil {
+			t.Fatalf("RemoveAll: %+v", err)
+		}
+		if err := p.Flush(); err != nil {
+			t.Fatalf("Flush after unblocking: %+v", err)
+		}
+		if _, err := os.Stat(path.Join(tmpdir, "blocked.json")); err != nil {
+			t.Fatalf("value file not written on retry: %+v", err)
+		}
+	})
+
+	t.Run("The interval bounds how long a store waits", func(t *testing.T) {
+		p, err := newDiskPersistence(tmpdir, 10*time.Millisecond)
+		if err != nil {
+			t.Fatalf("Unexpected error creating DiskPersistence: %+v", err)
+		}
+		if err := p.Value("timed").Store(testStruct{Value: 1}); err != nil {
+			t.Fatalf("Store: %+v", err)
+		}
+		deadline := time.Now().Add(5 * time.Second)
+		for {
+			if _, err := os.Stat(path.Join(tmpdir, "timed.json")); err == nil {
+				break
+			}
+			if time.Now().After(deadline) {
+				t.Fatalf("value file not written after the interval")
+			}
+			time.Sleep(5 * time.Millisecond)
+		}
+	})
+}
+
+// A flush that lands in a round started by another flush, as with several RetryingSenders sharing a
+// persistence, must not wait for a round that never starts.
+func TestDiskWriterConcurrentFlush(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "persistence_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+
+	// Writing the file blocks until the FIFO is read, which holds the first round in progress.
+	filename := path.Join(tmpdir, "slow.json")
+	if err := syscall.Mkfifo(filename+tmpSuffix, fileMode); err != nil {
+		t.Fatalf("Mkfifo: %+v", err)
+	}
+	w := newDiskWriter(time.Hour)
+	w.write(filename, []byte("{}"))
+
+	first := make(chan error, 1)
+	go func() { first <- w.flush() }()
+	for {
+		w.mutex.Lock()
+		started := w.started
+		w.mutex.Unlock()
+		if started == 1 {
+			break
+		}
+		time.Sleep(time.Millisecond)
+	}
+
+	// Nothing is written after the second flush, so the first round ends with nothing dirty.
+	second := make(chan error, 1)
+	go func() { second <- w.flush() }()
+	fifo, err := os.Open(filename + tmpSuffix)
+	if err != nil {
+		t.Fatalf("Open: %+v", err)
+	}
+	ioutil.ReadAll(fifo)
+	fifo.Close()
+
+	for i, done := range []chan error{first, second} {
+		select {
+		case err := <-done:
+			if err != nil {
+				t.Fatalf("flush %v: %+v", i+1, err)
+			}
+		case <-time.After(5 * time.Second):
+			t.Fatalf("flush %v: still waiting after 5 seconds", i+1)
+		}
+	}
+}
+
+// BenchmarkValueStore compares storing one value repeatedly with each store written immediately
+// and with stores coalesced by a diskWriter.
+func BenchmarkValueStore(b *testing.B) {
+	for _, interval := range []time.Duration{0, time.Second} {
+		b.Run(fmt.Sprintf("interval=%v", interval), func(b *testing.B) {
+			tmpdir, err := ioutil.TempDir("", "persistence_test")
+			if err != nil {
+				b.Fatalf("Unable to create temp directory: %+v", err)
+			}
+			defer os.RemoveAll(tmpdir)
+			p, err := newDiskPersistence(tmpdir, interval)
+			if err != nil {
+				b.Fatalf("Unexpected error creating DiskPersistence: %+v", err)
+			}
+			v := p.Value("key")
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				if err := v.Store(testStruct{Value: i}); err != nil {
+					b.Fatalf("Store: %+v", err)
+				}
+			}
+			if err := p.Flush(); err != nil {
+				b.Fatalf("Flush: %+v", err)
+			}
+		})
+	}
+}
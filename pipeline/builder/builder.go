@@ -31,35 +31,88 @@ import (
 )
 
 // Build builds pipeline containing a configured Aggregator and all of the resources
-// (persistence, endpoints) behind it. It returns the pipeline.Input.
-func Build(cfg *config.Config, p persistence.Persistence, r stats.Recorder) (pipeline.Input, error) {
+// (persistence, endpoints) behind it. It returns the pipeline.Input and the RetryingSender created
+// for each endpoint, which are owned by the pipeline. If c is non-nil, reports accepted for each
+// metric are recorded in c's cardinality sketches. If handoff is non-nil, aggregators released
+// after it begins leave their buckets in p.
+func Build(cfg *config.Config, p persistence.Persistence, r stats.Recorder, c *stats.Cardinality, handoff *pipeline.Handoff) (pipeline.Input, []*senders.RetryingSender, error) {
+	// Compile each route filter once; matchers for each metric and endpoint share them. This is done
+	// first, so that a failure doesn't leave endpoints and senders running.
+	var routes []*config.Route
+	var rules []*senders.LabelRule
+	for _, f := range cfg.Filters {
+		if f.Route != nil {
+			rule, err := senders.NewLabelRule(f.Route.Labels)
+			if err != nil {
+				return nil, nil, err
+			}
+			routes = append(routes, f.Route)
+			rules = append(rules, rule)
+		}
+	}
+
 	agentId, err := agentid.CreateOrGet(p)
 	if err != nil {
-		return nil, err
+		return nil, nil, err
 	}
 	endpointList, err := createEndpoints(cfg, agentId)
 	if err != nil {
-		return nil, err
+		return nil, nil, err
 	}
 	endpointSenders := make(map[string]pipeline.Sender)
+	var retrying []*senders.RetryingSender
 	for i := range endpointList {
-		endpointSenders[endpointList[i].Name()] = senders.NewRetryingSender(endpointList[i], p, r)
+		rs := senders.NewRetryingSender(endpointList[i], p, r)
+		endpointSenders[endpointList[i].Name()] = rs
+		retrying = append(retrying, rs)
 	}
 
 	// Inputs for the resultant Selector.
 	selectorInputs := make(map[string]pipeline.Input)
 	for _, metric := range cfg.Metrics {
 		var msenders []pipeline.Sender
+		var matchers []*senders.LabelMatcher
 		for _, me := range metric.Endpoints {
 			msenders = append(msenders, endpointSenders[me.Name])
+			var mrules []*senders.LabelRule
+			for i, route := range routes {
+				if route.Governs(metric.Name, me.Name) {
+					mrules = append(mrules, rules[i])
+				}
+			}
+			var matcher *senders.LabelMatcher
+			if len(mrules) > 0 {
+				matcher = senders.NewLabelMatcher(mrules...)
+			}
+			matchers = append(matchers, matcher)
 		}
-		di := &pipeline.InputAdapter{Sender: senders.NewDispatcher(msenders, r)}
-		if metric.Aggregation != nil {
+		if len(routes) == 0 {
+			matchers = nil
+		}
+		di := &pipeline.InputAdapter{Sender: senders.NewRoutingDispatcher(msenders, matchers, r)}
+		if metric.Aggregation != nil && metric.Aggregation.MaxBufferSeconds > metric.Aggregation.BufferSeconds {
+			bufferTime := time.Duration(metric.Aggregation.BufferSeconds) * time.Second
+			maxBufferTime := time.Duration(metric.Aggregation.MaxBufferSeconds) * time.Second
+			var health []pipeline.HealthReporter
+			for _, s := range msenders {
+				if hr, ok := s.(pipeline.HealthReporter); ok {
+					health = append(health, hr)
+				}
+			}
+			agg := inputs.NewAdaptiveAggregator(metric.Definition, bufferTime, maxBufferTime, health, di, p)
+			agg.SetHandoff(handoff)
+			selectorInputs[metric.Name] = agg
+		} else if metric.Aggregation != nil {
 			bufferTime := time.Duration(metric.Aggregation.BufferSeconds) * time.Second
-			selectorInputs[metric.Name] = inputs.NewAggregator(metric.Definition, bufferTime, di, p)
+			agg := inputs.NewAggregator(metric.Definition, bufferTime, di, p)
+			agg.SetHandoff(handoff)
+			selectorInputs[metric.Name] = agg
 		} else if metric.Passthrough != nil {
 			selectorInputs[metric.Name] = di
 		}
+		if c != nil {
+			selectorInputs[metric.Name] = inputs.NewCardinalityInput(selectorInputs[metric.Name], c.Metric(metric.Name))
+		}
 	}
 
 	head := inputs.NewSelector(selectorInputs)
@@ -89,7 +142,7 @@ func Build(cfg *config.Config, p persistence.Persistence, r stats.Recorder) (pip
 		return err.ErrorOrNil()
 	}
 
-	return inputs.NewCallbackInput(head, cb), nil
+	return inputs.NewCallbackInput(head, cb), retrying, nil
 }
 
 func createEndpoints(config *config.Config, agentId string) ([]pipeline.Endpoint, error) {
@@ -97,7 +150,10 @@ func createEndpoints(config *config.Config, agentId string) ([]pipeline.Endpoint
 	for _, cfgep := range config.Endpoints {
 		ep, err := createEndpoint(config, &cfgep, agentId)
 		if err != nil {
-			// TODO(volkman): close already-created endpoints in event of error?
+			// Release already-created endpoints, so that they give up any shared clients.
+			for _, ep := range eps {
+				ep.Release()
+			}
 			return nil, err
 		}
 		eps = append(eps, ep)
@@ -109,8 +165,10 @@ func createEndpoint(config *config.Config, cfgep *config.Endpoint, agentId strin
 	if cfgep.Disk != nil {
 		return endpoints.NewDiskEndpoint(
 			cfgep.Name,
-			cfgep.Disk.ReportDir,
+			cfgep.Disk.Dirs(),
 			time.Duration(cfgep.Disk.ExpireSeconds)*time.Second,
+			cfgep.Disk.ArchiveDir(),
+			cfgep.Disk.ArchiveRetention(),
 		), nil
 	}
 	if cfgep.ServiceControl != nil {
@@ -18,7 +18,9 @@ import (
 	"io/ioutil"
 	"os"
 	"path/filepath"
+	"runtime"
 	"testing"
+	"time"
 
 	"github.com/GoogleCloudPlatform/ubbagent/config"
 	"github.com/GoogleCloudPlatform/ubbagent/metrics"
@@ -89,10 +91,66 @@ func TestBuild(t *testing.T) {
 		},
 	}
 
-	a, err := Build(cfg, p, stats.NewNoopRecorder())
+	a, rs, err := Build(cfg, p, stats.NewNoopRecorder(), stats.NewCardinality(), nil)
 	if err != nil {
 		t.Fatalf("unexpected error creating App: %+v", err)
 	}
+	if want, got := 1, len(rs); want != got {
+		t.Fatalf("len(senders): want=%v, got=%v", want, got)
+	}
 
 	a.Release()
 }
+
+// TestBuildInvalidRoute tests that a route that fails to compile leaves nothing running.
+func TestBuildInvalidRoute(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "build_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+
+	regex := "("
+	cfg := &config.Config{
+		Metrics: config.Metrics{
+			{
+				Definition: metrics.Definition{
+					Name: "int-metric",
+					Type: "int",
+				},
+				Passthrough: &config.Passthrough{},
+				Endpoints: []config.MetricEndpoint{
+					{Name: "on_disk"},
+				},
+			},
+		},
+		Endpoints: []config.Endpoint{
+			{
+				Name: "on_disk",
+				Disk: &config.DiskEndpoint{
+					ReportDir:     filepath.Join(tmpdir, "reports"),
+					ExpireSeconds: 3600,
+				},
+			},
+		},
+		Filters: config.Filters{
+			{
+				Route: &config.Route{
+					Endpoints: []string{"on_disk"},
+					Labels:    []config.LabelPredicate{{Key: "foo", Regex: &regex}},
+				},
+			},
+		},
+	}
+
+	goroutines := runtime.NumGoroutine()
+	if _, _, err := Build(cfg, persistence.NewMemoryPersistence(), stats.NewNoopRecorder(), nil, nil); err == nil {
+		t.Fatalf("expected an error from an invalid route regex")
+	}
+	for i := 0; runtime.NumGoroutine() > goroutines; i++ {
+		if i == 100 {
+			t.Fatalf("goroutines: want<=%v, got=%v", goroutines, runtime.NumGoroutine())
+		}
+		time.Sleep(10 * time.Millisecond)
+	}
+}
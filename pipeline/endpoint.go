@@ -15,6 +15,7 @@
 package pipeline
 
 import (
+	"context"
 	"encoding/json"
 
 	"github.com/GoogleCloudPlatform/ubbagent/metrics"
@@ -24,7 +25,8 @@ import (
 // that can be used to help ensure idempotence across retries. For example, if a reporting service
 // requires a unique ID or timestamp that remains the same during each retry so that requests can
 // be deduplicated, that identifier can be generated in BuildReport, persisted in the
-// EndpointReport's context, and resent with each retry.
+// EndpointReport's context, and resent with each retry. An endpoint can likewise store the
+// encoded request it sends, so that a retry doesn't rebuild it.
 type EndpointReport struct {
 	metrics.StampedMetricReport `json:",inline"`
 	Context                     json.RawMessage
@@ -59,8 +61,9 @@ type Endpoint interface {
 	Name() string
 
 	// Send sends the given EndpointReport - previously built by this endpoint - to the reporting
-	// service.
-	Send(EndpointReport) error
+	// service. If ctx is done before the report is sent, Send should give up promptly and return
+	// ctx's error; the report may or may not have been received.
+	Send(ctx context.Context, report EndpointReport) error
 
 	// BuildReport builds an EndpointReport from the given StampedMetricReport, optionally attaching
 	// context.
@@ -70,3 +73,20 @@ type Endpoint interface {
 	// transient error and can be retried.
 	IsTransient(error) bool
 }
+
+// PackingEndpoint is an Endpoint that can send several reports as one unit - for example, several
+// metrics in a single Service Control operation - to reduce request size and quota use. A
+// RetryingSender packs reports that are queued together.
+type PackingEndpoint interface {
+	Endpoint
+
+	// CanPack returns true if report can be sent in the same unit as the reports in pack, which is
+	// non-empty and was itself accepted by CanPack.
+	CanPack(pack []EndpointReport, report EndpointReport) bool
+
+	// SendPack sends the given EndpointReports - previously built by this endpoint - to the reporting
+	// service as one unit, which succeeds or fails as a whole. The unit must be identified by its
+	// reports alone, so that a retried pack can be deduplicated like a retried report. ctx is as for
+	// Send.
+	SendPack(ctx context.Context, reports []EndpointReport) error
+}
@@ -0,0 +1,104 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package endpoints
+
+import (
+	"encoding/json"
+	"flag"
+	"math"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/GoogleCloudPlatform/ubbagent/pipeline"
+)
+
+var (
+	captureRate = flag.Float64("endpoint_capture_rate", 0.01, "fraction of endpoint requests whose payloads are captured for debugging; 0 disables capture")
+	captureSize = flag.Int("endpoint_capture_size", 50, "number of captured endpoint requests retained per endpoint")
+)
+
+// Capture is a sampled request sent by an endpoint, along with its response or error.
+type Capture struct {
+	Time     time.Time       `json:"time"`
+	Request  json.RawMessage `json:"request"`
+	Response json.RawMessage `json:"response,omitempty"`
+	Error    string          `json:"error,omitempty"`
+}
+
+// CapturingEndpoint is an Endpoint that retains a sample of the requests it sends, for debugging.
+type CapturingEndpoint interface {
+	pipeline.Endpoint
+
+	// Captures returns the retained captures, oldest first.
+	Captures() []Capture
+}
+
+// captureRing retains the most recent sampled captures. Requests are sampled deterministically, one
+// in every period, so deciding not to capture costs a single atomic increment; payloads are
+// serialized only for sampled requests.
+type captureRing struct {
+	period  uint64 // 0 disables capture
+	count   uint64
+	mutex   sync.Mutex
+	entries []Capture
+	next    int
+	full    bool
+}
+
+func newCaptureRing(rate float64, size int) *captureRing {
+	r := &captureRing{}
+	if rate > 0 && size > 0 {
+		r.period = uint64(math.Max(1, math.Floor(1/math.Min(rate, 1)+0.5)))
+		r.entries = make([]Capture, size)
+	}
+	return r
+}
+
+// sample reports whether the next request should be captured.
+func (r *captureRing) sample() bool {
+	if r.period == 0 {
+		return false
+	}
+	return (atomic.AddUint64(&r.count, 1)-1)%r.period == 0
+}
+
+// add serializes and retains a request and either its response or the error it produced.
+func (r *captureRing) add(now time.Time, req, resp interface{}, err error) {
+	c := Capture{Time: now}
+	c.Request, _ = json.Marshal(req)
+	if err != nil {
+		c.Error = err.Error()
+	} else if resp != nil {
+		c.Response, _ = json.Marshal(resp)
+	}
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+	r.entries[r.next] = c
+	r.next = (r.next + 1) % len(r.entries)
+	if r.next == 0 {
+		r.full = true
+	}
+}
+
+func (r *captureRing) captures() []Capture {
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+	var out []Capture
+	if r.full {
+		out = append(out, r.entries[r.next:]...)
+	}
+	return append(out, r.entries[:r.next]...)
+}
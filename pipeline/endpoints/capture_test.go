@@ -0,0 +1,81 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package endpoints
+
+import (
+	"errors"
+	"testing"
+	"time"
+)
+
+func TestCaptureRing(t *testing.T) {
+	t.Run("disabled", func(t *testing.T) {
+		r := newCaptureRing(0, 10)
+		for i := 0; i < 100; i++ {
+			if r.sample() {
+				t.Fatal("sample: want=false, got=true")
+			}
+		}
+		if got := r.captures(); len(got) != 0 {
+			t.Fatalf("captures: want=0, got=%v", len(got))
+		}
+	})
+
+	t.Run("sampling", func(t *testing.T) {
+		r := newCaptureRing(0.25, 10)
+		sampled := 0
+		for i := 0; i < 100; i++ {
+			if r.sample() {
+				sampled++
+			}
+		}
+		if sampled != 25 {
+			t.Fatalf("sampled: want=25, got=%v", sampled)
+		}
+	})
+
+	t.Run("wraps around", func(t *testing.T) {
+		r := newCaptureRing(1, 3)
+		for i := 0; i < 5; i++ {
+			r.add(time.Unix(int64(i), 0), i, map[string]int{"n": i}, nil)
+		}
+		r.add(time.Unix(5, 0), 5, nil, errors.New("failed"))
+		got := r.captures()
+		if len(got) != 3 {
+			t.Fatalf("captures: want=3, got=%v", len(got))
+		}
+		for i, c := range got {
+			if want := time.Unix(int64(i+3), 0); !c.Time.Equal(want) {
+				t.Fatalf("capture %v time: want=%v, got=%v", i, want, c.Time)
+			}
+		}
+		if want := `{"n":4}`; string(got[1].Response) != want {
+			t.Fatalf("capture response: want=%v, got=%s", want, got[1].Response)
+		}
+		if got[2].Error != "failed" || got[2].Response != nil || string(got[2].Request) != "5" {
+			t.Fatalf("error capture: want=(5, failed), got=%+v", got[2])
+		}
+	})
+}
+
+// BenchmarkCaptureSample measures the cost of the sampling decision made for every request.
+func BenchmarkCaptureSample(b *testing.B) {
+	r := newCaptureRing(0.01, 50)
+	b.RunParallel(func(pb *testing.PB) {
+		for pb.Next() {
+			r.sample()
+		}
+	})
+}
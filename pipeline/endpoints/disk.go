@@ -15,7 +15,9 @@
 package endpoints
 
 import (
+	"context"
 	"encoding/json"
+	"hash/fnv"
 	"io/ioutil"
 	"os"
 	"path"
@@ -36,12 +38,16 @@ const (
 	cleanupInterval = 1 * time.Minute
 	reportPrefix    = "report"
 	reportSuffix    = ".json"
+	tmpPrefix       = ".tmp_"
 	randomLength    = 5
 )
 
 type DiskEndpoint struct {
 	name       string
-	path       string
+	paths      []string
+	archiveDir string
+	segmentSeq int
+	index      *reportIndex
 	expiration time.Duration
 	quit       chan bool
 	closeOnce  sync.Once
@@ -49,6 +55,9 @@ type DiskEndpoint struct {
 	wait       sync.WaitGroup
 	tracker    pipeline.UsageTracker
 	closed     bool // used for testing
+
+	// How long archived days are kept, or 0 to keep them indefinitely.
+	archiveRetention time.Duration
 }
 
 type diskContext struct {
@@ -56,19 +65,27 @@ type diskContext struct {
 }
 
 // NewDiskEndpoint creates a new DiskEndpoint and starts a goroutine that cleans up expired reports
-// on disk.
-func NewDiskEndpoint(name string, path string, expiration time.Duration) *DiskEndpoint {
-	return newDiskEndpoint(name, path, expiration, clock.NewClock())
+// on disk. Report files are striped across paths by report ID, so that several directories (on
+// separate devices, for example) share the write load. If archiveDir is not empty, the same
+// goroutine also rolls report files into daily archives in archiveDir; see package archive.
+// Archived reports are no longer subject to expiration; instead, days that ended more than
+// archiveRetention ago are removed from the archive, unless archiveRetention is 0.
+func NewDiskEndpoint(name string, paths []string, expiration time.Duration, archiveDir string, archiveRetention time.Duration) *DiskEndpoint {
+	return newDiskEndpoint(name, paths, expiration, archiveDir, archiveRetention, clock.NewClock())
 }
 
-func newDiskEndpoint(name string, path string, expiration time.Duration, clock clock.Clock) *DiskEndpoint {
+func newDiskEndpoint(name string, paths []string, expiration time.Duration, archiveDir string, archiveRetention time.Duration, clock clock.Clock) *DiskEndpoint {
 	ep := &DiskEndpoint{
-		name:       name,
-		path:       path,
-		expiration: expiration,
-		clock:      clock,
-		quit:       make(chan bool, 1),
+		name:             name,
+		paths:            paths,
+		archiveDir:       archiveDir,
+		archiveRetention: archiveRetention,
+		index:            newReportIndex(),
+		expiration:       expiration,
+		clock:            clock,
+		quit:             make(chan bool, 1),
 	}
+	go ep.index.load(paths)
 	ep.wait.Add(1)
 	go ep.run(clock.Now())
 	return ep
@@ -82,7 +99,12 @@ func (ep *DiskEndpoint) BuildReport(r metrics.StampedMetricReport) (pipeline.End
 	return pipeline.NewEndpointReport(r, diskContext{Name: reportName(r, ep.clock.Now())})
 }
 
-func (ep *DiskEndpoint) Send(r pipeline.EndpointReport) error {
+// Send writes the report's file. Writing isn't interrupted, but a report isn't written once ctx is
+// done.
+func (ep *DiskEndpoint) Send(ctx context.Context, r pipeline.EndpointReport) error {
+	if err := ctx.Err(); err != nil {
+		return err
+	}
 	dctx := diskContext{}
 	err := r.UnmarshalContext(&dctx)
 	if err != nil {
@@ -92,17 +114,40 @@ func (ep *DiskEndpoint) Send(r pipeline.EndpointReport) error {
 	if err != nil {
 		return err
 	}
-	if err := os.MkdirAll(ep.path, directoryMode); err != nil {
+	dir := ep.stripe(r.Id)
+	if err := os.MkdirAll(dir, directoryMode); err != nil {
 		return err
 	}
-	file := path.Join(ep.path, dctx.Name)
+	file := path.Join(dir, dctx.Name)
 
-	if err := ioutil.WriteFile(file, jsontext, fileMode); err != nil {
+	// Write to a temporary name first so that compaction never reads a partial report.
+	tmp := path.Join(dir, tmpPrefix+dctx.Name)
+	if err := ioutil.WriteFile(tmp, jsontext, fileMode); err != nil {
+		return err
+	}
+	// The file is indexed before it appears, so that compaction or cleanup, which may remove it as
+	// soon as it does, always finds an entry to remove.
+	added := ep.index.add(file, r.MetricReport)
+	if err := os.Rename(tmp, file); err != nil {
+		if added {
+			ep.index.remove(file)
+		}
 		return err
 	}
 	return nil
 }
 
+// stripe returns the directory that holds the report with the given ID. The choice depends only on
+// the ID, so a retried send overwrites the same file rather than duplicating it in another stripe.
+func (ep *DiskEndpoint) stripe(id string) string {
+	if len(ep.paths) == 1 {
+		return ep.paths[0]
+	}
+	h := fnv.New32a()
+	h.Write([]byte(id))
+	return ep.paths[h.Sum32()%uint32(len(ep.paths))]
+}
+
 // Use increments the DiskEndpoint's usage count.
 // See pipeline.Component.Use.
 func (ep *DiskEndpoint) Use() {
@@ -130,6 +175,9 @@ func (ep *DiskEndpoint) run(start time.Time) {
 		t := ep.clock.NewTimerAt(nextFire)
 		select {
 		case <-t.GetC():
+			if ep.archiveDir != "" {
+				ep.compact()
+			}
 			ep.cleanup()
 		case <-ep.quit:
 			ep.wait.Done()
@@ -140,17 +188,31 @@ func (ep *DiskEndpoint) run(start time.Time) {
 	}
 }
 
+// cleanup removes expired reports. Each stripe is cleaned up concurrently, so a slow device
+// doesn't hold up the others.
 func (ep *DiskEndpoint) cleanup() {
 	// compute time before which files are expired.
 	cutoff := ep.clock.Now().Add(-ep.expiration)
-	files, _ := ioutil.ReadDir(ep.path)
-	for _, f := range files {
-		if isExpired(f.Name(), cutoff) {
-			if err := os.Remove(filepath.Join(ep.path, f.Name())); err != nil {
-				glog.Warningf("error removing expired disk report: %v", f)
+	var wg sync.WaitGroup
+	for _, dir := range ep.paths {
+		wg.Add(1)
+		go func(dir string) {
+			defer wg.Done()
+			files, _ := ioutil.ReadDir(dir)
+			for _, f := range files {
+				if isExpired(f.Name(), cutoff) {
+					file := filepath.Join(dir, f.Name())
+					if err := os.Remove(file); err != nil {
+						glog.Warningf("error removing expired disk report: %v", file)
+					} else {
+						ep.index.remove(file)
+					}
+				}
 			}
-		}
+		}(dir)
 	}
+	wg.Wait()
+	ep.index.compact()
 }
 
 func reportName(report metrics.StampedMetricReport, reportTime time.Time) string {
@@ -0,0 +1,212 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package endpoints
+
+import (
+	"encoding/json"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"sort"
+	"strings"
+
+	"github.com/GoogleCloudPlatform/ubbagent/archive"
+	"github.com/GoogleCloudPlatform/ubbagent/metrics"
+	"github.com/golang/glog"
+)
+
+// maxSegmentReports bounds the number of reports held in memory while writing a single segment.
+const maxSegmentReports = 100000
+
+// compact rolls the report files in the endpoint's directories into archive segments, filed by the
+// UTC day of each report's end time, and removes them. Reports from every stripe share segments.
+// Segments of days that have ended are then merged into a single archive per day, and days past the
+// archive retention are removed.
+func (ep *DiskEndpoint) compact() {
+	now := ep.clock.Now()
+	if err := os.MkdirAll(ep.archiveDir, directoryMode); err != nil {
+		glog.Errorf("disk: error creating archive directory: %+v", err)
+		return
+	}
+	days := make(map[string]*pendingSegment)
+	flush := func(day string, seg *pendingSegment) {
+		if len(seg.reports) == 0 {
+			return
+		}
+		ep.segmentSeq++
+		name := archive.SegmentFile(day, now, ep.segmentSeq)
+		if err := writeArchiveFile(ep.archiveDir, name, seg.reports); err != nil {
+			glog.Errorf("disk: error writing archive segment: %+v", err)
+		} else {
+			for _, f := range seg.files {
+				if err := os.Remove(f); err != nil {
+					glog.Warningf("disk: error removing archived report: %v", f)
+				} else {
+					ep.index.remove(f)
+				}
+			}
+		}
+		seg.reports, seg.files = nil, nil
+	}
+	for _, dir := range ep.paths {
+		files, _ := ioutil.ReadDir(dir)
+		for _, f := range files {
+			if !isReportFile(f.Name()) {
+				continue
+			}
+			file := filepath.Join(dir, f.Name())
+			data, err := ioutil.ReadFile(file)
+			if err != nil {
+				glog.Warningf("disk: error reading report for archive: %v: %+v", file, err)
+				continue
+			}
+			var report metrics.StampedMetricReport
+			if err := json.Unmarshal(data, &report); err != nil {
+				glog.Warningf("disk: error parsing report for archive: %v: %+v", file, err)
+				continue
+			}
+			day := archive.Day(report.EndTime)
+			seg := days[day]
+			if seg == nil {
+				seg = &pendingSegment{}
+				days[day] = seg
+			}
+			seg.reports = append(seg.reports, report)
+			seg.files = append(seg.files, file)
+			if len(seg.reports) >= maxSegmentReports {
+				flush(day, seg)
+			}
+		}
+	}
+	for day, seg := range days {
+		flush(day, seg)
+	}
+	ep.mergeClosedDays(archive.Day(now))
+	if ep.archiveRetention > 0 {
+		ep.expireDays(archive.Day(now.Add(-ep.archiveRetention)))
+	}
+}
+
+type pendingSegment struct {
+	reports []metrics.StampedMetricReport
+	files   []string
+}
+
+// mergeClosedDays merges the segments of each day before today into that day's archive.
+func (ep *DiskEndpoint) mergeClosedDays(today string) {
+	files, err := ioutil.ReadDir(ep.archiveDir)
+	if err != nil {
+		glog.Errorf("disk: error listing archive directory: %+v", err)
+		return
+	}
+	segments := make(map[string][]string)
+	for _, f := range files {
+		day, ok := archive.FileDay(f.Name())
+		if ok && day < today && strings.HasPrefix(f.Name(), "segment_") {
+			segments[day] = append(segments[day], filepath.Join(ep.archiveDir, f.Name()))
+		}
+	}
+	var days []string
+	for day := range segments {
+		days = append(days, day)
+	}
+	sort.Strings(days)
+	for _, day := range days {
+		if err := mergeDay(ep.archiveDir, day, segments[day]); err != nil {
+			glog.Errorf("disk: error merging archive for %v: %+v", day, err)
+		}
+	}
+}
+
+// expireDays removes the archives and segments of each day before cutoff. The day containing the
+// retention cutoff is kept, since some of its reports are still within the retention.
+func (ep *DiskEndpoint) expireDays(cutoff string) {
+	files, err := ioutil.ReadDir(ep.archiveDir)
+	if err != nil {
+		glog.Errorf("disk: error listing archive directory: %+v", err)
+		return
+	}
+	for _, f := range files {
+		if day, ok := archive.FileDay(f.Name()); ok && day < cutoff {
+			file := filepath.Join(ep.archiveDir, f.Name())
+			if err := os.Remove(file); err != nil {
+				glog.Warningf("disk: error removing expired archive: %v", file)
+			}
+		}
+	}
+}
+
+// mergeDay rewrites a day's archive to include the given segments, then removes them. A report
+// that is already present, such as after an interrupted merge, is kept only once.
+func mergeDay(dir, day string, segments []string) error {
+	files := segments
+	dayFile := filepath.Join(dir, archive.DayFile(day))
+	if _, err := os.Stat(dayFile); err == nil {
+		files = append([]string{dayFile}, segments...)
+	}
+	var reports []metrics.StampedMetricReport
+	seen := make(map[string]bool)
+	for _, file := range files {
+		r, err := archive.Open(file)
+		if err != nil {
+			return err
+		}
+		err = r.Scan(archive.Query{Columns: archive.ColumnAll}, func(report metrics.StampedMetricReport) error {
+			if !seen[report.Id] {
+				seen[report.Id] = true
+				reports = append(reports, report)
+			}
+			return nil
+		})
+		r.Close()
+		if err != nil {
+			return err
+		}
+	}
+	if err := writeArchiveFile(dir, archive.DayFile(day), reports); err != nil {
+		return err
+	}
+	for _, s := range segments {
+		if err := os.Remove(s); err != nil {
+			glog.Warningf("disk: error removing merged archive segment: %v", s)
+		}
+	}
+	return nil
+}
+
+// writeArchiveFile writes reports to a temporary file, syncs it, and renames it into place.
+func writeArchiveFile(dir, name string, reports []metrics.StampedMetricReport) error {
+	tmp := filepath.Join(dir, tmpPrefix+name)
+	f, err := os.OpenFile(tmp, os.O_CREATE|os.O_TRUNC|os.O_WRONLY, fileMode)
+	if err != nil {
+		return err
+	}
+	err = archive.Write(f, reports)
+	if err == nil {
+		err = f.Sync()
+	}
+	if closeErr := f.Close(); err == nil {
+		err = closeErr
+	}
+	if err != nil {
+		os.Remove(tmp)
+		return err
+	}
+	return os.Rename(tmp, filepath.Join(dir, name))
+}
+
+func isReportFile(name string) bool {
+	return strings.HasPrefix(name, reportPrefix) && strings.HasSuffix(name, reportSuffix)
+}
@@ -0,0 +1,162 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package endpoints
+
+import (
+	"context"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"sort"
+	"testing"
+	"time"
+
+	"github.com/GoogleCloudPlatform/ubbagent/archive"
+	"github.com/GoogleCloudPlatform/ubbagent/metrics"
+	"github.com/GoogleCloudPlatform/ubbagent/testlib"
+)
+
+func TestDiskEndpointArchive(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "disk_archive_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+	reportDir := filepath.Join(tmpdir, "reports")
+	archiveDir := filepath.Join(tmpdir, "archive")
+
+	mc := testlib.NewMockClock()
+	mc.SetNow(parseTime("2017-06-19T23:59:00Z"))
+	ep := newDiskEndpoint("disk", []string{reportDir}, time.Hour, archiveDir, 0, mc)
+	// Stop the background goroutine so that compaction runs only when the test calls it.
+	ep.Release()
+
+	// Report file names include the first five characters of the id, so ids must differ there.
+	send := func(id string, end string) {
+		report, err := ep.BuildReport(metrics.StampedMetricReport{
+			Id: id,
+			MetricReport: metrics.MetricReport{
+				Name:      "int-metric",
+				StartTime: parseTime(end).Add(-time.Minute),
+				EndTime:   parseTime(end),
+				Labels:    map[string]string{"foo": "bar"},
+				Value:     metrics.MetricValue{Int64Value: 10},
+			},
+		})
+		if err != nil {
+			t.Fatalf("error building report: %+v", err)
+		}
+		if err := ep.Send(context.Background(), report); err != nil {
+			t.Fatalf("error sending report: %+v", err)
+		}
+	}
+	listDir := func(dir string) (names []string) {
+		files, _ := ioutil.ReadDir(dir)
+		for _, f := range files {
+			names = append(names, f.Name())
+		}
+		sort.Strings(names)
+		return
+	}
+
+	send("id001", "2017-06-19T23:58:00Z")
+	send("id002", "2017-06-19T23:59:00Z")
+	ep.compact()
+	if want, got := 0, len(listDir(reportDir)); want != got {
+		t.Fatalf("report files after compaction: want=%v, got=%v", want, got)
+	}
+	if names := listDir(archiveDir); len(names) != 1 || names[0][:len("segment_2017-06-19")] != "segment_2017-06-19" {
+		t.Fatalf("unexpected archive files: %v", names)
+	}
+
+	// The day ends; a late report for it arrives along with one for the new day.
+	mc.SetNow(parseTime("2017-06-20T00:01:00Z"))
+	send("id003", "2017-06-19T23:59:30Z")
+	send("id004", "2017-06-20T00:01:00Z")
+	ep.compact()
+	names := listDir(archiveDir)
+	if len(names) != 2 || names[0] != archive.DayFile("2017-06-19") || names[1][:len("segment_2017-06-20")] != "segment_2017-06-20" {
+		t.Fatalf("unexpected archive files: %v", names)
+	}
+
+	var ids []string
+	if err := archive.ScanDir(archiveDir, archive.Query{To: parseTime("2017-06-20T00:00:00Z")}, func(r metrics.StampedMetricReport) error {
+		ids = append(ids, r.Id)
+		return nil
+	}); err != nil {
+		t.Fatalf("unexpected scan error: %v", err)
+	}
+	sort.Strings(ids)
+	if want, got := "[id001 id002 id003]", fmt.Sprint(ids); want != got {
+		t.Fatalf("scanned ids: want=%v, got=%v", want, got)
+	}
+}
+
+func TestDiskEndpointArchiveRetention(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "disk_archive_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+	reportDir := filepath.Join(tmpdir, "reports")
+	archiveDir := filepath.Join(tmpdir, "archive")
+
+	mc := testlib.NewMockClock()
+	mc.SetNow(parseTime("2017-06-19T12:00:00Z"))
+	ep := newDiskEndpoint("disk", []string{reportDir}, time.Hour, archiveDir, 48*time.Hour, mc)
+	ep.Release()
+
+	send := func(id string, end string) {
+		report, err := ep.BuildReport(metrics.StampedMetricReport{
+			Id: id,
+			MetricReport: metrics.MetricReport{
+				Name:      "int-metric",
+				StartTime: parseTime(end).Add(-time.Minute),
+				EndTime:   parseTime(end),
+				Value:     metrics.MetricValue{Int64Value: 10},
+			},
+		})
+		if err != nil {
+			t.Fatalf("error building report: %+v", err)
+		}
+		if err := ep.Send(context.Background(), report); err != nil {
+			t.Fatalf("error sending report: %+v", err)
+		}
+	}
+	days := func() (days []string) {
+		files, _ := ioutil.ReadDir(archiveDir)
+		for _, f := range files {
+			if day, ok := archive.FileDay(f.Name()); ok {
+				days = append(days, day)
+			}
+		}
+		return
+	}
+
+	send("id001", "2017-06-18T12:00:00Z")
+	send("id002", "2017-06-19T11:00:00Z")
+	ep.compact()
+	if want, got := "[2017-06-18 2017-06-19]", fmt.Sprint(days()); want != got {
+		t.Fatalf("archived days: want=%v, got=%v", want, got)
+	}
+
+	// The cutoff falls within 2017-06-19, so only the day before it is removed.
+	mc.SetNow(parseTime("2017-06-21T12:00:00Z"))
+	ep.compact()
+	if want, got := "[2017-06-19]", fmt.Sprint(days()); want != got {
+		t.Fatalf("archived days after retention: want=%v, got=%v", want, got)
+	}
+}
@@ -0,0 +1,253 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package endpoints
+
+import (
+	"encoding/json"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"sort"
+	"sync"
+	"time"
+
+	"github.com/GoogleCloudPlatform/ubbagent/archive"
+	"github.com/GoogleCloudPlatform/ubbagent/metrics"
+	"github.com/golang/glog"
+)
+
+// ReportQuery selects reports retained by a QueryableEndpoint. Zero-valued fields match everything.
+type ReportQuery struct {
+	Metric string
+
+	// From and To select reports whose [StartTime, EndTime] range overlaps [From, To).
+	From time.Time
+	To   time.Time
+
+	// Labels selects reports having all of the given label values.
+	Labels map[string]string
+}
+
+// QueryableEndpoint is implemented by endpoints that retain the reports they send and can search
+// them.
+type QueryableEndpoint interface {
+	Name() string
+
+	// Query calls fn for each retained report matching q. It stops and returns the first error
+	// returned by fn.
+	Query(q ReportQuery, fn func(metrics.StampedMetricReport) error) error
+}
+
+// reportIndex indexes a DiskEndpoint's report files by metric and end time, so that a query reads
+// only the files that can match it. Files are identified by path, so a single index covers every
+// stripe.
+type reportIndex struct {
+	mutex   sync.RWMutex
+	ready   chan struct{}
+	metrics map[string]*metricIndex
+	files   map[string]*indexEntry
+}
+
+// metricIndex holds one metric's entries ordered by end time. maxDuration, the longest span of
+// any entry, bounds how far past a query's end an overlapping entry can end.
+type metricIndex struct {
+	entries     []*indexEntry
+	maxDuration time.Duration
+	removed     int
+}
+
+type indexEntry struct {
+	file    string
+	start   time.Time
+	end     time.Time
+	removed bool
+}
+
+func newReportIndex() *reportIndex {
+	return &reportIndex{
+		ready:   make(chan struct{}),
+		metrics: make(map[string]*metricIndex),
+		files:   make(map[string]*indexEntry),
+	}
+}
+
+// load indexes the report files already present in dirs, reading each directory concurrently.
+// Queries wait until it finishes.
+func (idx *reportIndex) load(dirs []string) {
+	defer close(idx.ready)
+	var wg sync.WaitGroup
+	for _, dir := range dirs {
+		wg.Add(1)
+		go func(dir string) {
+			defer wg.Done()
+			files, _ := ioutil.ReadDir(dir)
+			for _, f := range files {
+				if !isReportFile(f.Name()) {
+					continue
+				}
+				file := filepath.Join(dir, f.Name())
+				data, err := ioutil.ReadFile(file)
+				if err != nil {
+					continue
+				}
+				var report metrics.StampedMetricReport
+				if err := json.Unmarshal(data, &report); err != nil {
+					glog.Warningf("disk: error indexing report %v: %+v", file, err)
+					continue
+				}
+				idx.add(file, report.MetricReport)
+			}
+		}(dir)
+	}
+	wg.Wait()
+}
+
+// add indexes file, and returns false if it was already indexed.
+func (idx *reportIndex) add(file string, report metrics.MetricReport) bool {
+	idx.mutex.Lock()
+	defer idx.mutex.Unlock()
+	if _, exists := idx.files[file]; exists {
+		return false
+	}
+	m := idx.metrics[report.Name]
+	if m == nil {
+		m = &metricIndex{}
+		idx.metrics[report.Name] = m
+	}
+	e := &indexEntry{file: file, start: report.StartTime, end: report.EndTime}
+	idx.files[file] = e
+	if d := e.end.Sub(e.start); d > m.maxDuration {
+		m.maxDuration = d
+	}
+	// Reports usually arrive in end time order, so this is normally an append.
+	i := len(m.entries)
+	for i > 0 && m.entries[i-1].end.After(e.end) {
+		i--
+	}
+	m.entries = append(m.entries, nil)
+	copy(m.entries[i+1:], m.entries[i:])
+	m.entries[i] = e
+	return true
+}
+
+func (idx *reportIndex) remove(file string) {
+	idx.mutex.Lock()
+	defer idx.mutex.Unlock()
+	if e, ok := idx.files[file]; ok {
+		e.removed = true
+		delete(idx.files, file)
+	}
+}
+
+// compact drops removed entries. It is called periodically rather than on each removal so that
+// removing a file stays cheap.
+func (idx *reportIndex) compact() {
+	idx.mutex.Lock()
+	defer idx.mutex.Unlock()
+	for name, m := range idx.metrics {
+		kept := m.entries[:0]
+		for _, e := range m.entries {
+			if !e.removed {
+				kept = append(kept, e)
+			}
+		}
+		for i := len(kept); i < len(m.entries); i++ {
+			m.entries[i] = nil
+		}
+		m.entries = kept
+		if len(kept) == 0 {
+			delete(idx.metrics, name)
+		}
+	}
+}
+
+// find returns the files whose reports may match q. The cost is proportional to the number of
+// entries within the query's time range, not to the total number of files.
+func (idx *reportIndex) find(q ReportQuery) []string {
+	<-idx.ready
+	idx.mutex.RLock()
+	defer idx.mutex.RUnlock()
+	var files []string
+	for name, m := range idx.metrics {
+		if q.Metric != "" && q.Metric != name {
+			continue
+		}
+		i := 0
+		if !q.From.IsZero() {
+			i = sort.Search(len(m.entries), func(i int) bool { return m.entries[i].end.After(q.From) })
+		}
+		for ; i < len(m.entries); i++ {
+			e := m.entries[i]
+			if !q.To.IsZero() {
+				if !e.end.Before(q.To.Add(m.maxDuration)) {
+					break
+				}
+				if !e.start.Before(q.To) {
+					continue
+				}
+			}
+			if !e.removed {
+				files = append(files, e.file)
+			}
+		}
+	}
+	return files
+}
+
+// Query searches the endpoint's report files and, if archiving is enabled, its archives.
+func (ep *DiskEndpoint) Query(q ReportQuery, fn func(metrics.StampedMetricReport) error) error {
+	seen := make(map[string]bool)
+	emit := func(report metrics.StampedMetricReport) error {
+		if seen[report.Id] || !matchesLabels(report.Labels, q.Labels) {
+			return nil
+		}
+		seen[report.Id] = true
+		return fn(report)
+	}
+	for _, file := range ep.index.find(q) {
+		data, err := ioutil.ReadFile(file)
+		if os.IsNotExist(err) {
+			// Expired or archived since it was found.
+			continue
+		} else if err != nil {
+			return err
+		}
+		var report metrics.StampedMetricReport
+		if err := json.Unmarshal(data, &report); err != nil {
+			return err
+		}
+		if err := emit(report); err != nil {
+			return err
+		}
+	}
+	if ep.archiveDir == "" {
+		return nil
+	}
+	aq := archive.Query{Metric: q.Metric, From: q.From, To: q.To, Columns: archive.ColumnAll}
+	err := archive.ScanDir(ep.archiveDir, aq, emit)
+	if os.IsNotExist(err) {
+		return nil
+	}
+	return err
+}
+
+func matchesLabels(labels, want map[string]string) bool {
+	for k, v := range want {
+		if actual, ok := labels[k]; !ok || actual != v {
+			return false
+		}
+	}
+	return true
+}
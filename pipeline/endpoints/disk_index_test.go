@@ -0,0 +1,190 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package endpoints
+
+import (
+	"context"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"sort"
+	"testing"
+	"time"
+
+	"github.com/GoogleCloudPlatform/ubbagent/metrics"
+	"github.com/GoogleCloudPlatform/ubbagent/testlib"
+)
+
+func TestDiskEndpointQuery(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "disk_index_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+	reportDir := filepath.Join(tmpdir, "reports")
+
+	mc := testlib.NewMockClock()
+	mc.SetNow(parseTime("2017-06-19T12:00:00Z"))
+	ep := newDiskEndpoint("disk", []string{reportDir}, time.Hour, filepath.Join(tmpdir, "archive"), 0, mc)
+	// Stop the background goroutine so that cleanup and compaction run only when the test calls them.
+	ep.Release()
+
+	send := func(id, metric, consumer string, start, end int64, value int64) {
+		report, err := ep.BuildReport(metrics.StampedMetricReport{
+			Id: id,
+			MetricReport: metrics.MetricReport{
+				Name:      metric,
+				StartTime: time.Unix(start, 0),
+				EndTime:   time.Unix(end, 0),
+				Labels:    map[string]string{"consumer": consumer},
+				Value:     metrics.MetricValue{Int64Value: value},
+			},
+		})
+		if err != nil {
+			t.Fatalf("error building report: %+v", err)
+		}
+		if err := ep.Send(context.Background(), report); err != nil {
+			t.Fatalf("error sending report: %+v", err)
+		}
+	}
+	query := func(q ReportQuery) string {
+		var ids []string
+		if err := ep.Query(q, func(r metrics.StampedMetricReport) error {
+			ids = append(ids, r.Id)
+			return nil
+		}); err != nil {
+			t.Fatalf("unexpected query error: %+v", err)
+		}
+		sort.Strings(ids)
+		return fmt.Sprint(ids)
+	}
+
+	send("id001", "requests", "a", 0, 10, 1)
+	send("id002", "requests", "b", 10, 20, 2)
+	send("id003", "requests", "a", 20, 30, 3)
+	send("id004", "cpu", "a", 5, 25, 4)
+	// A long report that starts early but ends late.
+	send("id005", "requests", "b", 0, 100, 5)
+
+	tests := []struct {
+		name string
+		q    ReportQuery
+		want string
+	}{
+		{"all", ReportQuery{}, "[id001 id002 id003 id004 id005]"},
+		{"metric", ReportQuery{Metric: "requests"}, "[id001 id002 id003 id005]"},
+		{"time range", ReportQuery{Metric: "requests", From: time.Unix(12, 0), To: time.Unix(20, 0)}, "[id002 id005]"},
+		{"to only", ReportQuery{To: time.Unix(10, 0)}, "[id001 id004 id005]"},
+		{"labels", ReportQuery{Labels: map[string]string{"consumer": "a"}}, "[id001 id003 id004]"},
+	}
+	for _, tc := range tests {
+		if got := query(tc.q); tc.want != got {
+			t.Fatalf("%v: want=%v, got=%v", tc.name, tc.want, got)
+		}
+	}
+
+	// Reports remain queryable after they are rolled into the archive.
+	ep.compact()
+	if got := query(ReportQuery{Metric: "requests"}); got != "[id001 id002 id003 id005]" {
+		t.Fatalf("after compaction: want=[id001 id002 id003 id005], got=%v", got)
+	}
+	if want, got := 0, len(ep.index.files); want != got {
+		t.Fatalf("index entries after compaction: want=%v, got=%v", want, got)
+	}
+}
+
+// Reports sent while compaction runs are archived without leaving index entries behind.
+func TestDiskEndpointSendDuringCompaction(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "disk_index_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+
+	mc := testlib.NewMockClock()
+	mc.SetNow(parseTime("2017-06-19T12:00:00Z"))
+	ep := newDiskEndpoint("disk", []string{filepath.Join(tmpdir, "reports")}, time.Hour, filepath.Join(tmpdir, "archive"), 0, mc)
+	ep.Release()
+
+	const n = 500
+	done := make(chan struct{})
+	go func() {
+		defer close(done)
+		for i := 0; i < n; i++ {
+			report, err := ep.BuildReport(metrics.StampedMetricReport{
+				Id:           fmt.Sprintf("%05d", i),
+				MetricReport: metrics.MetricReport{Name: "requests", StartTime: time.Unix(0, 0), EndTime: time.Unix(1, 0)},
+			})
+			if err != nil {
+				t.Errorf("error building report: %+v", err)
+				return
+			}
+			if err := ep.Send(context.Background(), report); err != nil {
+				t.Errorf("error sending report: %+v", err)
+				return
+			}
+		}
+	}()
+	for running := true; running; {
+		select {
+		case <-done:
+			running = false
+		default:
+		}
+		ep.compact()
+	}
+
+	if want, got := 0, len(ep.index.files); want != got {
+		t.Fatalf("index entries after compaction: want=%v, got=%v", want, got)
+	}
+	var count int
+	if err := ep.Query(ReportQuery{Metric: "requests"}, func(r metrics.StampedMetricReport) error {
+		count++
+		return nil
+	}); err != nil {
+		t.Fatalf("unexpected query error: %+v", err)
+	}
+	if count != n {
+		t.Fatalf("queried reports: want=%v, got=%v", n, count)
+	}
+}
+
+func TestReportIndexLoad(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "disk_index_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+
+	mc := testlib.NewMockClock()
+	mc.SetNow(parseTime("2017-06-19T12:00:00Z"))
+	ep := newDiskEndpoint("disk", []string{tmpdir}, time.Hour, "", 0, mc)
+	report, _ := ep.BuildReport(metrics.StampedMetricReport{
+		Id:           "id001",
+		MetricReport: metrics.MetricReport{Name: "requests", StartTime: time.Unix(0, 0), EndTime: time.Unix(1, 0)},
+	})
+	if err := ep.Send(context.Background(), report); err != nil {
+		t.Fatalf("error sending report: %+v", err)
+	}
+	ep.Release()
+
+	// A new endpoint over the same directory indexes the existing file.
+	ep2 := newDiskEndpoint("disk", []string{tmpdir}, time.Hour, "", 0, mc)
+	defer ep2.Release()
+	if want, got := 1, len(ep2.index.find(ReportQuery{Metric: "requests"})); want != got {
+		t.Fatalf("indexed files: want=%v, got=%v", want, got)
+	}
+}
@@ -15,9 +15,12 @@
 package endpoints
 
 import (
+	"context"
 	"errors"
+	"fmt"
 	"io/ioutil"
 	"os"
+	"path/filepath"
 	"testing"
 	"time"
 
@@ -34,7 +37,7 @@ func TestDiskEndpoint(t *testing.T) {
 
 	mc := testlib.NewMockClock()
 	mc.SetNow(parseTime("2017-06-19T12:00:00Z"))
-	ep := newDiskEndpoint("disk", tmpdir, 10*time.Minute, mc)
+	ep := newDiskEndpoint("disk", []string{tmpdir}, 10*time.Minute, "", 0, mc)
 
 	// Make sure we start with an empty dir
 	if files, err := ioutil.ReadDir(tmpdir); err != nil {
@@ -58,7 +61,7 @@ func TestDiskEndpoint(t *testing.T) {
 	if err != nil {
 		t.Fatalf("error building report: %+v", err)
 	}
-	if err := ep.Send(report1); err != nil {
+	if err := ep.Send(context.Background(), report1); err != nil {
 		t.Fatalf("error sending report: %+v", err)
 	}
 	if err := waitForReportCount(tmpdir, 1); err != nil {
@@ -85,7 +88,7 @@ func TestDiskEndpoint(t *testing.T) {
 	if report2.Id != "report2" {
 		t.Fatalf("expected report ID to be 'report2', got: %v", report2.Id)
 	}
-	if err := ep.Send(report2); err != nil {
+	if err := ep.Send(context.Background(), report2); err != nil {
 		t.Fatalf("error sending report: %+v", err)
 	}
 	if err := waitForReportCount(tmpdir, 2); err != nil {
@@ -114,6 +117,78 @@ func TestDiskEndpoint(t *testing.T) {
 	}
 }
 
+func TestDiskEndpoint_Stripes(t *testing.T) {
+	tmpdir, err := ioutil.TempDir("", "disk_endpoint_test")
+	if err != nil {
+		t.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+
+	dirs := []string{filepath.Join(tmpdir, "a"), filepath.Join(tmpdir, "b"), filepath.Join(tmpdir, "c")}
+	mc := testlib.NewMockClock()
+	mc.SetNow(parseTime("2017-06-19T12:00:00Z"))
+	ep := newDiskEndpoint("disk", dirs, 10*time.Minute, "", 0, mc)
+	defer ep.Release()
+
+	const count = 30
+	for i := 0; i < count; i++ {
+		report, err := ep.BuildReport(metrics.StampedMetricReport{
+			Id: fmt.Sprintf("%05d", i),
+			MetricReport: metrics.MetricReport{
+				Name:      "int-metric1",
+				StartTime: time.Unix(int64(i), 0),
+				EndTime:   time.Unix(int64(i+1), 0),
+				Value:     metrics.MetricValue{Int64Value: 10},
+			},
+		})
+		if err != nil {
+			t.Fatalf("error building report: %+v", err)
+		}
+		if err := ep.Send(context.Background(), report); err != nil {
+			t.Fatalf("error sending report: %+v", err)
+		}
+		// A retried send lands in the same stripe.
+		if err := ep.Send(context.Background(), report); err != nil {
+			t.Fatalf("error resending report: %+v", err)
+		}
+	}
+
+	total := 0
+	for _, dir := range dirs {
+		files, err := ioutil.ReadDir(dir)
+		if err != nil {
+			t.Fatalf("error listing %v: %+v", dir, err)
+		}
+		if len(files) == 0 {
+			t.Fatalf("stripe %v: want>0 files, got=0", dir)
+		}
+		total += len(files)
+	}
+	if total != count {
+		t.Fatalf("report files: want=%v, got=%v", count, total)
+	}
+
+	// Queries merge reports from every stripe.
+	queried := 0
+	if err := ep.Query(ReportQuery{Metric: "int-metric1"}, func(metrics.StampedMetricReport) error {
+		queried++
+		return nil
+	}); err != nil {
+		t.Fatalf("error querying: %+v", err)
+	}
+	if queried != count {
+		t.Fatalf("queried reports: want=%v, got=%v", count, queried)
+	}
+
+	// Expired reports are removed from every stripe.
+	mc.SetNow(parseTime("2017-06-19T12:11:00Z"))
+	for _, dir := range dirs {
+		if err := waitForReportCount(dir, 0); err != nil {
+			t.Fatalf("error waiting for 0 files in %v: %+v", dir, err)
+		}
+	}
+}
+
 func parseTime(ts string) time.Time {
 	t, err := time.Parse(time.RFC3339, ts)
 	if err != nil {
@@ -0,0 +1,80 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package endpoints
+
+import (
+	"context"
+	"crypto/sha256"
+	"net/http"
+	"sync"
+
+	"golang.org/x/oauth2/google"
+	"google.golang.org/api/servicecontrol/v1"
+)
+
+// serviceControlClient is an authenticated ServiceControl client, shared by every
+// ServiceControlEndpoint in the process that uses the same service account key. Its token source
+// refreshes one token for all of them, and its requests share one connection pool.
+type serviceControlClient struct {
+	key     [sha256.Size]byte
+	client  *http.Client
+	service *servicecontrol.Service
+	// The number of endpoints using the client. Guarded by serviceControlClients.mutex.
+	refs int
+}
+
+// serviceControlClients is the process-wide registry of serviceControlClients, keyed by a hash of
+// their service account keys. Agents created in one process, such as one per product by a host
+// embedding the SDK, share a client when their endpoints use the same identity. A client is
+// removed when the last endpoint using it is released.
+var serviceControlClients = struct {
+	mutex   sync.Mutex
+	clients map[[sha256.Size]byte]*serviceControlClient
+}{clients: make(map[[sha256.Size]byte]*serviceControlClient)}
+
+// acquireServiceControlClient returns the shared client for jsonKey, creating it if no endpoint is
+// using one. Each call must be matched by a call to release.
+func acquireServiceControlClient(jsonKey []byte) (*serviceControlClient, error) {
+	key := sha256.Sum256(jsonKey)
+	serviceControlClients.mutex.Lock()
+	defer serviceControlClients.mutex.Unlock()
+	if c, ok := serviceControlClients.clients[key]; ok {
+		c.refs++
+		return c, nil
+	}
+	config, err := google.JWTConfigFromJSON(jsonKey, servicecontrol.ServicecontrolScope)
+	if err != nil {
+		return nil, err
+	}
+	client := config.Client(context.Background())
+	client.Timeout = timeout
+	service, err := servicecontrol.New(client)
+	if err != nil {
+		return nil, err
+	}
+	c := &serviceControlClient{key: key, client: client, service: service, refs: 1}
+	serviceControlClients.clients[key] = c
+	return c, nil
+}
+
+// release decrements the client's usage count, and removes it from the registry when no endpoint
+// is using it.
+func (c *serviceControlClient) release() {
+	serviceControlClients.mutex.Lock()
+	defer serviceControlClients.mutex.Unlock()
+	if c.refs--; c.refs == 0 {
+		delete(serviceControlClients.clients, c.key)
+	}
+}
@@ -0,0 +1,101 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package endpoints
+
+import (
+	"crypto/sha256"
+	"testing"
+)
+
+func registered(jsonKey string) bool {
+	serviceControlClients.mutex.Lock()
+	defer serviceControlClients.mutex.Unlock()
+	_, ok := serviceControlClients.clients[sha256.Sum256([]byte(jsonKey))]
+	return ok
+}
+
+func TestServiceControlClientRegistry(t *testing.T) {
+	const key1 = `{"type": "service_account", "client_email": "one@bogus.com"}`
+	const key2 = `{"type": "service_account", "client_email": "two@bogus.com"}`
+	newEndpoint := func(agentId, jsonKey string) *ServiceControlEndpoint {
+		ep, err := NewServiceControlEndpoint("servicecontrol", "test-service.appspot.com", agentId, "project_number:1234567", []byte(jsonKey))
+		if err != nil {
+			t.Fatalf("NewServiceControlEndpoint: %+v", err)
+		}
+		ep.Use()
+		return ep
+	}
+
+	t.Run("Endpoints with the same key share a client", func(t *testing.T) {
+		ep1 := newEndpoint("agent-1", key1)
+		ep2 := newEndpoint("agent-2", key1)
+		ep3 := newEndpoint("agent-3", key2)
+		if ep1.shared != ep2.shared || ep1.service != ep2.service || ep1.client != ep2.client {
+			t.Fatalf("endpoints with the same key don't share a client")
+		}
+		if ep1.shared == ep3.shared {
+			t.Fatalf("endpoints with different keys share a client")
+		}
+		if ep1.agentId == ep2.agentId {
+			t.Fatalf("endpoints sharing a client share an agent id")
+		}
+
+		ep1.Release()
+		if !registered(key1) {
+			t.Fatalf("client removed while still in use")
+		}
+		ep2.Release()
+		if registered(key1) {
+			t.Fatalf("client not removed after its last endpoint was released")
+		}
+		ep3.Release()
+		if registered(key2) {
+			t.Fatalf("client not removed after its last endpoint was released")
+		}
+	})
+
+	t.Run("A client is recreated after it's removed", func(t *testing.T) {
+		ep1 := newEndpoint("agent-1", key1)
+		ep1.Release()
+		ep2 := newEndpoint("agent-2", key1)
+		defer ep2.Release()
+		if ep1.shared == ep2.shared {
+			t.Fatalf("removed client reused")
+		}
+		if !registered(key1) {
+			t.Fatalf("client not registered")
+		}
+	})
+
+	t.Run("Releasing twice releases the client once", func(t *testing.T) {
+		ep1 := newEndpoint("agent-1", key1)
+		ep2 := newEndpoint("agent-2", key1)
+		ep1.Release()
+		ep1.Release()
+		if !registered(key1) {
+			t.Fatalf("client removed while still in use")
+		}
+		ep2.Release()
+	})
+
+	t.Run("An invalid key is rejected", func(t *testing.T) {
+		if _, err := NewServiceControlEndpoint("servicecontrol", "test-service.appspot.com", "agent-1", "project_number:1234567", []byte("not json")); err == nil {
+			t.Fatalf("NewServiceControlEndpoint: expected an error")
+		}
+		if registered("not json") {
+			t.Fatalf("client registered for an invalid key")
+		}
+	})
+}
@@ -15,9 +15,14 @@
 package endpoints
 
 import (
+	"bytes"
 	"context"
+	"encoding/json"
 	"fmt"
 	"net"
+	"net/http"
+	"sort"
+	"strings"
 	"time"
 
 	"github.com/GoogleCloudPlatform/ubbagent/metrics"
@@ -25,11 +30,17 @@ import (
 	"github.com/GoogleCloudPlatform/ubbagent/clock"
 	"github.com/GoogleCloudPlatform/ubbagent/pipeline"
 	"github.com/golang/glog"
-	"golang.org/x/oauth2/google"
+	"github.com/google/uuid"
 	"google.golang.org/api/googleapi"
 	"google.golang.org/api/servicecontrol/v1"
 )
 
+// A ReportRequest's json text, around that of its operation.
+const (
+	reportRequestPrefix = `{"operations":[`
+	reportRequestSuffix = `]}`
+)
+
 const (
 	agentIdLabel      = "goog-ubb-agent-id"
 	timeout           = 60 * time.Second
@@ -43,34 +54,37 @@ type ServiceControlEndpoint struct {
 	agentId     string
 	keyData     string
 	service     *servicecontrol.Service
+	client      *http.Client
 	tracker     pipeline.UsageTracker
 	nextCheck   time.Time
 	clock       clock.Clock
+	captures    *captureRing
+	// The process-wide client this endpoint uses, released with it. Nil if the client isn't shared.
+	shared *serviceControlClient
 }
 
-// NewServiceControlEndpoint creates a new ServiceControlEndpoint.
+// NewServiceControlEndpoint creates a new ServiceControlEndpoint. Endpoints in the same process
+// with the same jsonKey share an authenticated client until they are released.
 func NewServiceControlEndpoint(name, serviceName, agentId string, consumerId string, jsonKey []byte) (*ServiceControlEndpoint, error) {
-	config, err := google.JWTConfigFromJSON(jsonKey, servicecontrol.ServicecontrolScope)
+	shared, err := acquireServiceControlClient(jsonKey)
 	if err != nil {
 		return nil, err
 	}
-	client := config.Client(context.Background())
-	client.Timeout = timeout
-	service, err := servicecontrol.New(client)
-	if err != nil {
-		return nil, err
-	}
-	return newServiceControlEndpoint(name, serviceName, agentId, consumerId, service, clock.NewClock()), nil
+	ep := newServiceControlEndpoint(name, serviceName, agentId, consumerId, shared.service, shared.client, clock.NewClock())
+	ep.shared = shared
+	return ep, nil
 }
 
-func newServiceControlEndpoint(name, serviceName, agentId, consumerId string, service *servicecontrol.Service, clock clock.Clock) *ServiceControlEndpoint {
+func newServiceControlEndpoint(name, serviceName, agentId, consumerId string, service *servicecontrol.Service, client *http.Client, clock clock.Clock) *ServiceControlEndpoint {
 	ep := &ServiceControlEndpoint{
 		name:        name,
 		serviceName: serviceName,
 		agentId:     agentId,
 		consumerId:  consumerId,
 		service:     service,
+		client:      client,
 		clock:       clock,
+		captures:    newCaptureRing(*captureRate, *captureSize),
 	}
 	return ep
 }
@@ -79,32 +93,80 @@ func (ep *ServiceControlEndpoint) Name() string {
 	return ep.name
 }
 
-func (ep *ServiceControlEndpoint) Send(report pipeline.EndpointReport) error {
-	operation := ep.format(report)
-	req := &servicecontrol.ReportRequest{
-		Operations: []*servicecontrol.Operation{operation},
+func (ep *ServiceControlEndpoint) Send(ctx context.Context, report pipeline.EndpointReport) error {
+	glog.V(2).Infof("ServiceControlEndpoint:Send(): serviceName: %v, report: %v", ep.serviceName, report.Id)
+	if len(report.Context) == 0 {
+		// The report was queued before BuildReport built its operation.
+		op := ep.format(report.StampedMetricReport)
+		opJson, err := json.Marshal(op)
+		if err != nil {
+			return err
+		}
+		return ep.send(ctx, opJson, op)
 	}
-	glog.V(2).Infoln("ServiceControlEndpoint:Send(): serviceName: ", ep.serviceName, " body: ", func() string {
-		reqJson, _ := req.MarshalJSON()
-		return string(reqJson)
-	}())
+	return ep.send(ctx, report.Context, nil)
+}
+
+// SendPack sends the given reports as a single operation, with a MetricValueSet for each.
+// See PackingEndpoint.
+func (ep *ServiceControlEndpoint) SendPack(ctx context.Context, reports []pipeline.EndpointReport) error {
+	glog.V(2).Infof("ServiceControlEndpoint:SendPack(): serviceName: %v, reports: %v", ep.serviceName, len(reports))
+	ops := make([]*servicecontrol.Operation, len(reports))
+	for i, r := range reports {
+		if len(r.Context) == 0 {
+			ops[i] = ep.format(r.StampedMetricReport)
+			continue
+		}
+		ops[i] = &servicecontrol.Operation{}
+		if err := json.Unmarshal(r.Context, ops[i]); err != nil {
+			return err
+		}
+	}
+	op := pack(ops, reports)
+	opJson, err := json.Marshal(op)
+	if err != nil {
+		return err
+	}
+	return ep.send(ctx, opJson, op)
+}
+
+// send sends an operation, given as the json text built by BuildReport, to Service Control. The
+// text is sent verbatim, so that a retried report costs no formatting or encoding. op is the
+// decoded operation, if the caller has it; otherwise it's decoded only if a Check is due. Requests
+// in flight are cancelled when ctx is done.
+func (ep *ServiceControlEndpoint) send(ctx context.Context, opJson json.RawMessage, op *servicecontrol.Operation) error {
+	capture := ep.captures.sample()
 
 	// Check only every 60 seconds, following recommendation from https://godoc.org/google.golang.org/api/servicecontrol/v1#ServicesService.Check
 	if ep.clock.Now().After(ep.nextCheck) {
+		if op == nil {
+			op = &servicecontrol.Operation{}
+			if err := json.Unmarshal(opJson, op); err != nil {
+				return err
+			}
+		}
 		// Check requests can not have user labels.
-		opNoLabels := *operation
+		opNoLabels := *op
 		opNoLabels.UserLabels = nil
 		checkReq := &servicecontrol.CheckRequest{
 			Operation: &opNoLabels,
 		}
-		_, err := ep.service.Services.Check(ep.serviceName, checkReq).Do()
+		_, err := ep.service.Services.Check(ep.serviceName, checkReq).Context(ctx).Do()
 		if err != nil && !googleapi.IsNotModified(err) {
+			if capture {
+				ep.captures.add(ep.clock.Now(), checkReq, nil, err)
+			}
 			return err
 		}
 		ep.nextCheck = ep.clock.Now().Add(checkCacheTimeout)
 	}
 
-	_, err := ep.service.Services.Report(ep.serviceName, req).Do()
+	body := make([]byte, 0, len(reportRequestPrefix)+len(opJson)+len(reportRequestSuffix))
+	body = append(append(append(body, reportRequestPrefix...), opJson...), reportRequestSuffix...)
+	resp, err := ep.report(ctx, body)
+	if capture {
+		ep.captures.add(ep.clock.Now(), json.RawMessage(body), resp, err)
+	}
 	if err != nil && !googleapi.IsNotModified(err) {
 		return err
 	}
@@ -113,11 +175,58 @@ func (ep *ServiceControlEndpoint) Send(report pipeline.EndpointReport) error {
 	return nil
 }
 
+// report posts body, the json text of a ReportRequest, to Service Control's report method. It's
+// equivalent to Services.Report, which would encode the request itself.
+func (ep *ServiceControlEndpoint) report(ctx context.Context, body []byte) (*servicecontrol.ReportResponse, error) {
+	url := strings.TrimRight(ep.service.BasePath, "/") + "/v1/services/" + ep.serviceName + ":report"
+	req, err := http.NewRequest("POST", url, bytes.NewReader(body))
+	if err != nil {
+		return nil, err
+	}
+	req.Header.Set("Content-Type", "application/json")
+	res, err := ep.client.Do(req.WithContext(ctx))
+	if err != nil {
+		return nil, err
+	}
+	defer res.Body.Close()
+	if err := googleapi.CheckResponse(res); err != nil {
+		return nil, err
+	}
+	resp := &servicecontrol.ReportResponse{}
+	if err := json.NewDecoder(res.Body).Decode(resp); err != nil {
+		return nil, err
+	}
+	return resp, nil
+}
+
+// BuildReport builds the report's operation and stores its json text, as sent to Service Control,
+// in the EndpointReport's context.
 func (ep *ServiceControlEndpoint) BuildReport(r metrics.StampedMetricReport) (pipeline.EndpointReport, error) {
-	return pipeline.NewEndpointReport(r, nil)
+	return pipeline.NewEndpointReport(r, ep.format(r))
+}
+
+// CanPack returns true if report has the same labels and interval as the reports in pack, and is
+// for a metric that none of them is for. See PackingEndpoint.
+func (ep *ServiceControlEndpoint) CanPack(pack []pipeline.EndpointReport, report pipeline.EndpointReport) bool {
+	for _, r := range pack {
+		if r.Name == report.Name {
+			return false
+		}
+	}
+	first := pack[0]
+	if !first.StartTime.Equal(report.StartTime) || !first.EndTime.Equal(report.EndTime) || len(first.Labels) != len(report.Labels) {
+		return false
+	}
+	for k, v := range first.Labels {
+		if other, ok := report.Labels[k]; !ok || other != v {
+			return false
+		}
+	}
+	return true
 }
 
-func (ep *ServiceControlEndpoint) format(r pipeline.EndpointReport) *servicecontrol.Operation {
+// format builds a report's operation.
+func (ep *ServiceControlEndpoint) format(r metrics.StampedMetricReport) *servicecontrol.Operation {
 	value := servicecontrol.MetricValue{
 		StartTime: r.StartTime.UTC().Format(time.RFC3339Nano),
 		EndTime:   r.EndTime.UTC().Format(time.RFC3339Nano),
@@ -135,7 +244,7 @@ func (ep *ServiceControlEndpoint) format(r pipeline.EndpointReport) *servicecont
 		StartTime:     r.StartTime.UTC().Format(time.RFC3339Nano),
 		EndTime:       r.EndTime.UTC().Format(time.RFC3339Nano),
 		ConsumerId:    ep.consumerId,
-		UserLabels:    r.Labels,
+		UserLabels:    make(map[string]string),
 		MetricValueSets: []*servicecontrol.MetricValueSet{
 			{
 				MetricName:   fmt.Sprintf("%v/%v", ep.serviceName, r.Name),
@@ -143,9 +252,8 @@ func (ep *ServiceControlEndpoint) format(r pipeline.EndpointReport) *servicecont
 			},
 		},
 	}
-
-	if op.UserLabels == nil {
-		op.UserLabels = make(map[string]string)
+	for k, v := range r.Labels {
+		op.UserLabels[k] = v
 	}
 
 	// Add the agent ID label
@@ -154,12 +262,55 @@ func (ep *ServiceControlEndpoint) format(r pipeline.EndpointReport) *servicecont
 	return op
 }
 
-// Use is a no-op. ServiceControlEndpoint doesn't track usage.
-func (ep *ServiceControlEndpoint) Use() {}
+// pack combines the operations of reports, which share labels and an interval, into one. A single
+// report's operation is unchanged; a pack's has an ID derived from those of its reports, so that
+// retries of the pack are deduplicated.
+func pack(ops []*servicecontrol.Operation, reports []pipeline.EndpointReport) *servicecontrol.Operation {
+	if len(ops) == 1 {
+		return ops[0]
+	}
+	op := *ops[0]
+	op.OperationId = packOperationId(reports)
+	op.MetricValueSets = nil
+	for _, o := range ops {
+		op.MetricValueSets = append(op.MetricValueSets, o.MetricValueSets...)
+	}
+	return &op
+}
+
+// packOperationId returns a name-based UUID derived from the IDs of reports, independent of their
+// order.
+func packOperationId(reports []pipeline.EndpointReport) string {
+	ids := make([]string, len(reports))
+	for i, r := range reports {
+		ids[i] = r.Id
+	}
+	sort.Strings(ids)
+	return uuid.NewSHA1(uuid.NameSpaceOID, []byte(strings.Join(ids, ","))).String()
+}
 
-// Release is a no-op. ServiceControlEndpoint doesn't track usage.
+// Captures returns a sample of the requests recently sent to Service Control.
+// See CapturingEndpoint.
+func (ep *ServiceControlEndpoint) Captures() []Capture {
+	return ep.captures.captures()
+}
+
+// Use increments the ServiceControlEndpoint's usage count.
+// See pipeline.Component.Use.
+func (ep *ServiceControlEndpoint) Use() {
+	ep.tracker.Use()
+}
+
+// Release decrements the ServiceControlEndpoint's usage count. If it reaches 0, the endpoint stops
+// using its shared client, which is discarded once no other endpoint uses it.
+// See pipeline.Component.Release.
 func (ep *ServiceControlEndpoint) Release() error {
-	return nil
+	return ep.tracker.Release(func() error {
+		if ep.shared != nil {
+			ep.shared.release()
+		}
+		return nil
+	})
 }
 
 func (ep *ServiceControlEndpoint) IsTransient(err error) bool {
@@ -15,6 +15,7 @@
 package endpoints
 
 import (
+	"context"
 	"encoding/json"
 	"errors"
 	"io/ioutil"
@@ -27,6 +28,7 @@ import (
 	"strings"
 
 	"github.com/GoogleCloudPlatform/ubbagent/metrics"
+	"github.com/GoogleCloudPlatform/ubbagent/pipeline"
 	"github.com/GoogleCloudPlatform/ubbagent/testlib"
 	"google.golang.org/api/googleapi"
 	"google.golang.org/api/servicecontrol/v1"
@@ -99,7 +101,7 @@ func TestServiceControlEndpoint(t *testing.T) {
 	now := time.Now()
 	mockClock := testlib.NewMockClock()
 	mockClock.SetNow(now)
-	ep := newServiceControlEndpoint("servicecontrol", "test-service.appspot.com", "unique-agent-id", "project_number:1234567", svc, mockClock)
+	ep := newServiceControlEndpoint("servicecontrol", "test-service.appspot.com", "unique-agent-id", "project_number:1234567", svc, http.DefaultClient, mockClock)
 
 	t.Run("Assert check is called first", func(t *testing.T) {
 		// Test a single report write
@@ -120,7 +122,7 @@ func TestServiceControlEndpoint(t *testing.T) {
 		if report1.Id != "report1" {
 			t.Fatalf("expected report ID to be 'report1', got: %v", report1.Id)
 		}
-		if err := ep.Send(report1); err != nil {
+		if err := ep.Send(context.Background(), report1); err != nil {
 			t.Fatalf("error sending report: %+v", err)
 		}
 
@@ -133,7 +135,7 @@ func TestServiceControlEndpoint(t *testing.T) {
 		}
 
 		mockClock.SetNow(now.Add(time.Second * 30))
-		if err := ep.Send(report1); err != nil {
+		if err := ep.Send(context.Background(), report1); err != nil {
 			t.Fatalf("error sending report: %+v", err)
 		}
 
@@ -146,7 +148,7 @@ func TestServiceControlEndpoint(t *testing.T) {
 		}
 
 		mockClock.SetNow(now.Add(time.Second * 61))
-		if err := ep.Send(report1); err != nil {
+		if err := ep.Send(context.Background(), report1); err != nil {
 			t.Fatalf("error sending report: %+v", err)
 		}
 
@@ -178,13 +180,13 @@ func TestServiceControlEndpoint(t *testing.T) {
 		if report1.Id != "report1" {
 			t.Fatalf("expected report ID to be 'report1', got: %v", report1.Id)
 		}
-		if err := ep.Send(report1); err != nil {
+		if err := ep.Send(context.Background(), report1); err != nil {
 			t.Fatalf("error sending report: %+v", err)
 		}
 
 		// Test that a second send of the same report sends the same body
 		body1, _ := ioutil.ReadAll(handler.req.Body)
-		if err := ep.Send(report1); err != nil {
+		if err := ep.Send(context.Background(), report1); err != nil {
 			t.Fatalf("error sending report: %+v", err)
 		}
 		body2, _ := ioutil.ReadAll(handler.req.Body)
@@ -212,7 +214,7 @@ func TestServiceControlEndpoint(t *testing.T) {
 		if err != nil {
 			t.Fatalf("error building report: %+v", err)
 		}
-		if err := ep.Send(report1); err != nil {
+		if err := ep.Send(context.Background(), report1); err != nil {
 			t.Fatalf("error sending report: %+v", err)
 		}
 
@@ -267,6 +269,152 @@ func TestServiceControlEndpoint(t *testing.T) {
 		}
 	})
 
+	t.Run("Built operations are sent verbatim", func(t *testing.T) {
+		stamped := metrics.StampedMetricReport{
+			Id: "prebuilt",
+			MetricReport: metrics.MetricReport{
+				Name:      "int-metric1",
+				StartTime: time.Unix(4, 0),
+				EndTime:   time.Unix(5, 0),
+				Value:     metrics.MetricValue{Int64Value: 10},
+			},
+		}
+		report, err := ep.BuildReport(stamped)
+		if err != nil {
+			t.Fatalf("error building report: %+v", err)
+		}
+		op := servicecontrol.Operation{}
+		if err := json.Unmarshal(report.Context, &op); err != nil {
+			t.Fatalf("unmarshalling context: %+v", err)
+		}
+		if op.OperationId != "prebuilt" || len(op.MetricValueSets) != 1 {
+			t.Fatalf("context: want the report's operation, got=%s", report.Context)
+		}
+
+		// Retries send the stored operation without rebuilding it.
+		report.Context = json.RawMessage(`{"operationId":"stored","consumerId":"project_number:1234567"}`)
+		if err := ep.Send(context.Background(), report); err != nil {
+			t.Fatalf("error sending report: %+v", err)
+		}
+		if want, got := `{"operations":[`+string(report.Context)+`]}`, string(handler.body); want != got {
+			t.Fatalf("request body: want=%s, got=%s", want, got)
+		}
+
+		// Reports queued without a built operation are formatted when sent.
+		legacy, err := pipeline.NewEndpointReport(stamped, nil)
+		if err != nil {
+			t.Fatalf("error building report: %+v", err)
+		}
+		if err := ep.Send(context.Background(), legacy); err != nil {
+			t.Fatalf("error sending report: %+v", err)
+		}
+		req := servicecontrol.ReportRequest{}
+		if err := json.Unmarshal(handler.body, &req); err != nil {
+			t.Fatalf("unmarshalling request: %+v", err)
+		}
+		if len(req.Operations) != 1 || req.Operations[0].OperationId != "prebuilt" {
+			t.Fatalf("request body: want operation prebuilt, got=%s", handler.body)
+		}
+	})
+
+	t.Run("Packed reports are sent as one operation", func(t *testing.T) {
+		build := func(id, name string, start int64, labels map[string]string) pipeline.EndpointReport {
+			r, err := ep.BuildReport(metrics.StampedMetricReport{
+				Id: id,
+				MetricReport: metrics.MetricReport{
+					Name:      name,
+					StartTime: time.Unix(start, 0),
+					EndTime:   time.Unix(start+1, 0),
+					Value:     metrics.MetricValue{Int64Value: 10},
+					Labels:    labels,
+				},
+			})
+			if err != nil {
+				t.Fatalf("error building report: %+v", err)
+			}
+			return r
+		}
+		labels := map[string]string{"foo": "bar"}
+		report1 := build("report1", "int-metric1", 6, labels)
+		report2 := build("report2", "int-metric2", 6, map[string]string{"foo": "bar"})
+
+		if !ep.CanPack([]pipeline.EndpointReport{report1}, report2) {
+			t.Fatal("CanPack: reports with the same labels and interval should pack")
+		}
+		for _, other := range []pipeline.EndpointReport{
+			build("same-metric", "int-metric1", 6, labels),
+			build("other-interval", "int-metric2", 7, labels),
+			build("other-labels", "int-metric2", 6, map[string]string{"foo": "baz"}),
+			build("no-labels", "int-metric2", 6, nil),
+		} {
+			if ep.CanPack([]pipeline.EndpointReport{report1}, other) {
+				t.Fatalf("CanPack: %v should not pack with report1", other.Id)
+			}
+		}
+
+		var ids []string
+		for _, pack := range [][]pipeline.EndpointReport{{report1, report2}, {report2, report1}} {
+			if err := ep.SendPack(context.Background(), pack); err != nil {
+				t.Fatalf("error sending pack: %+v", err)
+			}
+			req := servicecontrol.ReportRequest{}
+			if err := json.Unmarshal(handler.body, &req); err != nil {
+				t.Fatalf("unmarshalling request: %+v", err)
+			}
+			if len(req.Operations) != 1 {
+				t.Fatalf("operations: want=1, got=%v", len(req.Operations))
+			}
+			op := req.Operations[0]
+			if len(op.MetricValueSets) != 2 {
+				t.Fatalf("metric value sets: want=2, got=%v", len(op.MetricValueSets))
+			}
+			if want := map[string]string{"goog-ubb-agent-id": "unique-agent-id", "foo": "bar"}; !reflect.DeepEqual(op.UserLabels, want) {
+				t.Fatalf("user labels: want=%v, got=%v", want, op.UserLabels)
+			}
+			ids = append(ids, op.OperationId)
+		}
+		// The pack's ID depends only on its reports, so that retries are deduplicated.
+		if ids[0] != ids[1] || ids[0] == "report1" || ids[0] == "report2" {
+			t.Fatalf("pack operation IDs: got %v", ids)
+		}
+		if len(labels) != 1 {
+			t.Fatalf("report labels were modified: %v", labels)
+		}
+	})
+
+	t.Run("Sampled requests are captured", func(t *testing.T) {
+		ep.captures = newCaptureRing(1, 10)
+		report, err := ep.BuildReport(metrics.StampedMetricReport{
+			Id: "captured",
+			MetricReport: metrics.MetricReport{
+				Name:      "int-metric1",
+				StartTime: time.Unix(4, 0),
+				EndTime:   time.Unix(5, 0),
+				Value:     metrics.MetricValue{Int64Value: 10},
+			},
+		})
+		if err != nil {
+			t.Fatalf("error building report: %+v", err)
+		}
+		if err := ep.Send(context.Background(), report); err != nil {
+			t.Fatalf("error sending report: %+v", err)
+		}
+		captures := ep.Captures()
+		if len(captures) != 1 {
+			t.Fatalf("captures: want=1, got=%v", len(captures))
+		}
+		req := servicecontrol.ReportRequest{}
+		if err := json.Unmarshal(captures[0].Request, &req); err != nil {
+			t.Fatalf("unmarshalling captured request: %+v", err)
+		}
+		if len(req.Operations) != 1 || req.Operations[0].OperationId != "captured" {
+			t.Fatalf("captured request: want operation captured, got=%s", captures[0].Request)
+		}
+		if captures[0].Response == nil || captures[0].Error != "" {
+			t.Fatalf("captured response: want response and no error, got=%+v", captures[0])
+		}
+	})
+
 	t.Run("IsTransient tests", func(t *testing.T) {
 		cases := []struct {
 			err       error
@@ -15,6 +15,7 @@
 package inputs
 
 import (
+	"context"
 	"errors"
 	"fmt"
 	"reflect"
@@ -54,6 +55,14 @@ type Aggregator struct {
 	closeMutex    sync.RWMutex
 	wait          sync.WaitGroup
 	tracker       pipeline.UsageTracker
+
+	// If greater than bufferTime, the aggregation period stretches towards maxBufferTime as the
+	// downstream senders report pressure.
+	maxBufferTime time.Duration
+	health        []pipeline.HealthReporter
+
+	// If begun when the Aggregator is released, the current bucket is left in persistence.
+	handoff *pipeline.Handoff
 }
 
 // NewAggregator creates a new Aggregator instance and starts its goroutine.
@@ -61,15 +70,29 @@ func NewAggregator(metric metrics.Definition, bufferTime time.Duration, input pi
 	return newAggregator(metric, bufferTime, input, persistence, clock.NewClock())
 }
 
+// NewAdaptiveAggregator creates a new Aggregator instance whose aggregation period stretches from
+// bufferTime towards maxBufferTime in proportion to the greatest pressure reported by health, and
+// shrinks back as it subsides. While the senders that the Aggregator pushes to are failing or
+// backlogged, it pushes fewer, larger reports; aggregated reports are kept, so no usage is lost.
+func NewAdaptiveAggregator(metric metrics.Definition, bufferTime, maxBufferTime time.Duration, health []pipeline.HealthReporter, input pipeline.Input, persistence persistence.Persistence) *Aggregator {
+	return newAdaptiveAggregator(metric, bufferTime, maxBufferTime, health, input, persistence, clock.NewClock())
+}
+
 func newAggregator(metric metrics.Definition, bufferTime time.Duration, input pipeline.Input, persistence persistence.Persistence, clock clock.Clock) *Aggregator {
+	return newAdaptiveAggregator(metric, bufferTime, bufferTime, nil, input, persistence, clock)
+}
+
+func newAdaptiveAggregator(metric metrics.Definition, bufferTime, maxBufferTime time.Duration, health []pipeline.HealthReporter, input pipeline.Input, persistence persistence.Persistence, clock clock.Clock) *Aggregator {
 	agg := &Aggregator{
-		metric:      metric,
-		bufferTime:  bufferTime,
-		input:       input,
-		persistence: persistence,
-		clock:       clock,
-		push:        make(chan chan bool),
-		add:         make(chan addMsg),
+		metric:        metric,
+		bufferTime:    bufferTime,
+		input:         input,
+		persistence:   persistence,
+		clock:         clock,
+		push:          make(chan chan bool),
+		add:           make(chan addMsg),
+		maxBufferTime: maxBufferTime,
+		health:        health,
 	}
 	if !agg.loadState() {
 		agg.currentBucket = newBucket(clock.Now())
@@ -84,6 +107,14 @@ func newAggregator(metric metrics.Definition, bufferTime time.Duration, input pi
 // the Aggregator's config object. Two reports can be aggregated if they have the same name, contain
 // the same labels, and don't contain overlapping time ranges denoted by StartTime and EndTme.
 func (h *Aggregator) AddReport(report metrics.MetricReport) error {
+	return h.AddReportContext(context.Background(), report)
+}
+
+// AddReportContext is AddReport, but returns ctx's error if ctx is done before the Aggregator's
+// goroutine has added the report, such as while it persists state to a slow disk or pushes a bucket
+// downstream. If the goroutine had already taken the report, it is still added in the background.
+// See pipeline.ContextInput.
+func (h *Aggregator) AddReportContext(ctx context.Context, report metrics.MetricReport) error {
 	glog.V(2).Infof("aggregator: received report: %v", report.Name)
 	if err := report.Validate(h.metric); err != nil {
 		return err
@@ -93,12 +124,33 @@ func (h *Aggregator) AddReport(report metrics.MetricReport) error {
 	if h.closed {
 		return errors.New("aggregator: AddReport called on closed aggregator")
 	}
+	if err := ctx.Err(); err != nil {
+		return err
+	}
 	msg := addMsg{
 		report: report,
 		result: make(chan error, 1),
 	}
-	h.add <- msg
-	return <-msg.result
+	select {
+	case h.add <- msg:
+	case <-ctx.Done():
+		return ctx.Err()
+	}
+	select {
+	case err := <-msg.result:
+		return err
+	case <-ctx.Done():
+		return ctx.Err()
+	}
+}
+
+// SetHandoff makes the Aggregator leave its current bucket in persistence, with its aggregation
+// period in progress, if it's released after handoff has begun. The next Aggregator created on the
+// same persistence resumes the bucket instead of it being pushed early.
+func (h *Aggregator) SetHandoff(handoff *pipeline.Handoff) {
+	h.closeMutex.Lock()
+	defer h.closeMutex.Unlock()
+	h.handoff = handoff
 }
 
 // Use increments the Aggregator's usage count.
@@ -109,7 +161,8 @@ func (h *Aggregator) Use() {
 
 // Release decrements the Aggregator's usage count. If it reaches 0, Release instructs the
 // Aggregator's goroutine to shutdown. Any currently-aggregated metrics will
-// be reported to the downstream sender as part of this process. Release blocks until the operation
+// be reported to the downstream sender as part of this process, unless a handoff has begun (see
+// SetHandoff). Release blocks until the operation
 // has completed.
 // See pipeline.Component.Release.
 func (h *Aggregator) Release() error {
@@ -132,15 +185,19 @@ func (h *Aggregator) run() {
 	for running {
 		// Set a timer to fire when the current bucket should be pushed.
 		now := h.clock.Now()
-		nextFire := now.Add(h.bufferTime - now.Sub(h.currentBucket.CreateTime))
+		window := h.window()
+		nextFire := now.Add(window - now.Sub(h.currentBucket.CreateTime))
+		if window > h.bufferTime && nextFire.After(now.Add(h.bufferTime)) {
+			// The period is stretched. Check again after bufferTime, in case the senders have recovered.
+			nextFire = now.Add(h.bufferTime)
+		}
 		timer := h.clock.NewTimerAt(nextFire)
 		select {
 		case msg, ok := <-h.add:
 			if ok {
 				err := h.currentBucket.addReport(msg.report)
 				if err == nil {
-					// TODO(volkman): possibly rate-limit persistence, or flush to disk at a defined interval.
-					// Perhaps a benchmark to determine whether eager persistence is a bottleneck.
+					// Disk persistence can coalesce these stores; see --persistence_flush_interval.
 					h.persistState()
 				}
 				msg.result <- err
@@ -148,15 +205,40 @@ func (h *Aggregator) run() {
 				running = false
 			}
 		case now := <-timer.GetC():
-			// Time to push the current bucket.
-			h.pushBucket(now)
+			// Time to push the current bucket, unless the period has been stretched.
+			if h.maxBufferTime <= h.bufferTime || now.Sub(h.currentBucket.CreateTime) >= h.window() {
+				h.pushBucket(now)
+			}
 		}
 		timer.Stop()
 	}
-	h.pushBucket(h.clock.Now())
+	if h.handoff.Begun() {
+		// The next process resumes the bucket from persistence.
+		h.persistState()
+	} else {
+		h.pushBucket(h.clock.Now())
+	}
 	h.wait.Done()
 }
 
+// window returns the current aggregation period: bufferTime, stretched towards maxBufferTime in
+// proportion to the greatest pressure reported by the downstream senders.
+func (h *Aggregator) window() time.Duration {
+	if h.maxBufferTime <= h.bufferTime {
+		return h.bufferTime
+	}
+	var pressure float64
+	for _, hr := range h.health {
+		if p := hr.Pressure(); p > pressure {
+			pressure = p
+		}
+	}
+	if pressure > 1 {
+		pressure = 1
+	}
+	return h.bufferTime + time.Duration(pressure*float64(h.maxBufferTime-h.bufferTime))
+}
+
 func (h *Aggregator) loadState() bool {
 	err := h.persistence.Value(h.persistenceName()).Load(&h.currentBucket)
 	if err == persistence.ErrNotFound {
@@ -166,8 +248,11 @@ func (h *Aggregator) loadState() bool {
 		// We loaded state.
 		return true
 	}
-	// Some other error loading existing state.
-	panic(fmt.Sprintf("error loading aggregator state: %+v", err))
+	// Some other error loading existing state. Corrupt state is quarantined by the persistence layer,
+	// so this is a state that can't be decoded; start over rather than failing on every restart.
+	glog.Errorf("aggregator: error loading state; discarding it: %+v", err)
+	h.currentBucket = nil
+	return false
 }
 
 func (h *Aggregator) persistState() {
@@ -15,12 +15,15 @@
 package inputs
 
 import (
+	"context"
 	"strings"
+	"sync"
 	"testing"
 	"time"
 
 	"github.com/GoogleCloudPlatform/ubbagent/metrics"
 	"github.com/GoogleCloudPlatform/ubbagent/persistence"
+	"github.com/GoogleCloudPlatform/ubbagent/pipeline"
 	"github.com/GoogleCloudPlatform/ubbagent/testlib"
 )
 
@@ -127,6 +130,35 @@ func TestNewAggregator(t *testing.T) {
 			t.Fatalf("Aggregated reports: expected: %+v, got: %+v", expected, reports)
 		}
 	})
+
+	t.Run("Undecodable state is discarded", func(t *testing.T) {
+		p := persistence.NewMemoryPersistence()
+		metric := metrics.Definition{Name: "int-metric", Type: "int"}
+		if err := p.Value(persistencePrefix + metric.Name).Store("not a bucket"); err != nil {
+			t.Fatalf("Unexpected error storing state: %+v", err)
+		}
+
+		mi := testlib.NewMockInput()
+		mockClock := testlib.NewMockClock()
+		mockClock.SetNow(time.Unix(0, 0))
+		a := newAggregator(metric, 10*time.Second, mi, p, mockClock)
+
+		report := metrics.MetricReport{
+			Name:      "int-metric",
+			StartTime: time.Unix(0, 0),
+			EndTime:   time.Unix(1, 0),
+			Value:     metrics.MetricValue{Int64Value: 10},
+		}
+		if err := a.AddReport(report); err != nil {
+			t.Fatalf("Unexpected error when adding report: %+v", err)
+		}
+		mi.DoAndWait(t, 1, func() {
+			a.Release()
+		})
+		if want, got := []metrics.MetricReport{report}, mi.Reports(); !equalUnordered(got, want) {
+			t.Fatalf("Aggregated reports: want=%+v, got=%+v", want, got)
+		}
+	})
 }
 
 func TestAggregator_Use(t *testing.T) {
@@ -465,6 +497,77 @@ func TestAggregator_AddReport(t *testing.T) {
 		}
 	})
 
+	// Ensure that a caller's deadline bounds the wait for a busy aggregator.
+	t.Run("Deadline while busy", func(t *testing.T) {
+		mockClock := testlib.NewMockClock()
+		mockClock.SetNow(time.Unix(0, 0))
+		bi := &blockingInput{entered: make(chan bool, 1), unblock: make(chan bool)}
+		a := newAggregator(metric, bufTime, bi, persistence.NewMemoryPersistence(), mockClock)
+
+		report := func(start int64) metrics.MetricReport {
+			return metrics.MetricReport{
+				Name:      "int-metric",
+				StartTime: time.Unix(start, 0),
+				EndTime:   time.Unix(start+1, 0),
+				Value:     metrics.MetricValue{Int64Value: 10},
+			}
+		}
+		if err := a.AddReport(report(0)); err != nil {
+			t.Fatalf("Unexpected error when adding report: %+v", err)
+		}
+
+		// Block the aggregator's goroutine while it pushes the bucket downstream.
+		mockClock.SetNow(time.Unix(10, 0))
+		<-bi.entered
+
+		ctx, cancel := context.WithTimeout(context.Background(), 10*time.Millisecond)
+		defer cancel()
+		if err := a.AddReportContext(ctx, report(2)); err != context.DeadlineExceeded {
+			t.Fatalf("AddReportContext: want=%v, got=%v", context.DeadlineExceeded, err)
+		}
+
+		close(bi.unblock)
+		if err := a.AddReportContext(context.Background(), report(2)); err != nil {
+			t.Fatalf("Unexpected error when adding report: %+v", err)
+		}
+		a.Release()
+		if want, got := 2, len(bi.reports); want != got {
+			t.Fatalf("pushed reports: want=%v, got=%v", want, got)
+		}
+	})
+
+	// Ensure that a caller's deadline bounds the wait for slow persistence after hand-off, and that
+	// the report is still added in the background.
+	t.Run("Deadline while persisting", func(t *testing.T) {
+		mockClock := testlib.NewMockClock()
+		mockClock.SetNow(time.Unix(0, 0))
+		mi := testlib.NewMockInput()
+		bp := &blockingPersistence{Persistence: persistence.NewMemoryPersistence(), entered: make(chan bool, 1)}
+		a := newAggregator(metric, bufTime, mi, bp, mockClock)
+
+		report := metrics.MetricReport{
+			Name:      "int-metric",
+			StartTime: time.Unix(0, 0),
+			EndTime:   time.Unix(1, 0),
+			Value:     metrics.MetricValue{Int64Value: 10},
+		}
+		unblock := bp.block()
+		ctx, cancel := context.WithTimeout(context.Background(), 10*time.Millisecond)
+		defer cancel()
+		if err := a.AddReportContext(ctx, report); err != context.DeadlineExceeded {
+			t.Fatalf("AddReportContext: want=%v, got=%v", context.DeadlineExceeded, err)
+		}
+		<-bp.entered
+
+		close(unblock)
+		mi.DoAndWait(t, 1, func() {
+			a.Release()
+		})
+		if !equalUnordered(mi.Reports(), []metrics.MetricReport{report}) {
+			t.Fatalf("Pushed %+v, want %+v", mi.Reports(), report)
+		}
+	})
+
 	// Ensure that a push happens when the aggregator is Released
 	t.Run("Push after Release", func(t *testing.T) {
 		mockClock := testlib.NewMockClock()
@@ -489,6 +592,51 @@ func TestAggregator_AddReport(t *testing.T) {
 			t.Fatal("Expected push after Release, but sender contains no reports")
 		}
 	})
+
+	// Ensure that a bucket released during a handoff is resumed by the next aggregator.
+	t.Run("Bucket kept after Release during handoff", func(t *testing.T) {
+		mockClock := testlib.NewMockClock()
+		mockClock.SetNow(time.Unix(0, 0))
+		mi := testlib.NewMockInput()
+		p := persistence.NewMemoryPersistence()
+		handoff := &pipeline.Handoff{}
+		a := newAggregator(metric, bufTime, mi, p, mockClock)
+		a.SetHandoff(handoff)
+
+		report := metrics.MetricReport{
+			Name:      "int-metric",
+			StartTime: time.Unix(0, 0),
+			EndTime:   time.Unix(1, 0),
+			Value: metrics.MetricValue{
+				Int64Value: 10,
+			},
+		}
+		if err := a.AddReport(report); err != nil {
+			t.Fatalf("Unexpected error when adding report: %+v", err)
+		}
+		handoff.Begin()
+		a.Release()
+		if len(mi.Reports()) != 0 {
+			t.Fatalf("Expected no push after Release during handoff, got: %+v", mi.Reports())
+		}
+
+		var kept *bucket
+		if err := p.Value(persistencePrefix + metric.Name).Load(&kept); err != nil {
+			t.Fatalf("Loading kept bucket: %+v", err)
+		}
+		if !kept.CreateTime.Equal(time.Unix(0, 0)) {
+			t.Fatalf("Kept bucket created at %v, want %v", kept.CreateTime, time.Unix(0, 0))
+		}
+
+		mockClock.SetNow(time.Unix(1, 0))
+		next := newAggregator(metric, bufTime, mi, p, mockClock)
+		mi.DoAndWait(t, 1, func() {
+			next.Release()
+		})
+		if !equalUnordered(mi.Reports(), []metrics.MetricReport{report}) {
+			t.Fatalf("Resumed bucket pushed %+v, want %+v", mi.Reports(), report)
+		}
+	})
 }
 
 func equalUnordered(a, b []metrics.MetricReport) bool {
@@ -511,3 +659,160 @@ func equalUnordered(a, b []metrics.MetricReport) bool {
 	}
 	return count == len(a)
 }
+
+// blockingInput is a pipeline.Input whose AddReport blocks until unblock is closed.
+type blockingInput struct {
+	entered chan bool
+	unblock chan bool
+	reports []metrics.MetricReport
+}
+
+func (i *blockingInput) AddReport(report metrics.MetricReport) error {
+	select {
+	case i.entered <- true:
+	default:
+	}
+	<-i.unblock
+	i.reports = append(i.reports, report)
+	return nil
+}
+
+func (i *blockingInput) Use()           {}
+func (i *blockingInput) Release() error { return nil }
+
+func TestAdaptiveAggregator(t *testing.T) {
+	metric := metrics.Definition{
+		Name: "int-metric",
+		Type: "int",
+	}
+	bufTime := 10 * time.Second
+	maxBufTime := 100 * time.Second
+	report := func(start int64) metrics.MetricReport {
+		return metrics.MetricReport{
+			Name:      "int-metric",
+			StartTime: time.Unix(start, 0),
+			EndTime:   time.Unix(start+1, 0),
+			Value:     metrics.MetricValue{Int64Value: 10},
+		}
+	}
+
+	mockClock := testlib.NewMockClock()
+	mockClock.SetNow(time.Unix(0, 0))
+	mi := testlib.NewMockInput()
+	health := &mockHealth{}
+	health.set(1)
+	a := newAdaptiveAggregator(metric, bufTime, maxBufTime, []pipeline.HealthReporter{health}, mi, persistence.NewMemoryPersistence(), mockClock)
+	defer a.Release()
+
+	// advance sets the clock, and waits for the aggregator to set its next timer.
+	advance := func(now, nextFire int64) {
+		mockClock.SetNow(time.Unix(now, 0))
+		for i := 0; mockClock.GetNextFireTime() != time.Unix(nextFire, 0); i++ {
+			if i == 5000 {
+				t.Fatalf("No timer set for %v after advancing to %v", nextFire, now)
+			}
+			time.Sleep(time.Millisecond)
+		}
+	}
+
+	t.Run("Full pressure stretches the period to the maximum", func(t *testing.T) {
+		if err := a.AddReport(report(0)); err != nil {
+			t.Fatalf("Unexpected error when adding report: %+v", err)
+		}
+		// The aggregator checks its senders' health every bufTime.
+		for now := int64(10); now < 100; now += 10 {
+			advance(now, now+10)
+		}
+		if reports := mi.Reports(); len(reports) != 0 {
+			t.Fatalf("Expected no reports before the maximum period, got: %+v", reports)
+		}
+		mi.DoAndWait(t, 1, func() {
+			mockClock.SetNow(time.Unix(100, 0))
+		})
+	})
+
+	t.Run("Partial pressure stretches the period in proportion", func(t *testing.T) {
+		health.set(0.5)
+		if err := a.AddReport(report(100)); err != nil {
+			t.Fatalf("Unexpected error when adding report: %+v", err)
+		}
+		// The bucket was created at 100, and the period is 55 seconds.
+		for now := int64(110); now < 150; now += 10 {
+			advance(now, now+10)
+		}
+		advance(150, 155)
+		mi.DoAndWait(t, 2, func() {
+			mockClock.SetNow(time.Unix(155, 0))
+		})
+	})
+
+	t.Run("The period shrinks when pressure subsides", func(t *testing.T) {
+		health.set(1)
+		if err := a.AddReport(report(155)); err != nil {
+			t.Fatalf("Unexpected error when adding report: %+v", err)
+		}
+		advance(165, 175)
+		health.set(0)
+		mi.DoAndWait(t, 3, func() {
+			mockClock.SetNow(time.Unix(175, 0))
+		})
+	})
+}
+
+// mockHealth is a pipeline.HealthReporter with a settable pressure.
+type mockHealth struct {
+	mutex    sync.Mutex
+	pressure float64
+}
+
+func (h *mockHealth) set(pressure float64) {
+	h.mutex.Lock()
+	h.pressure = pressure
+	h.mutex.Unlock()
+}
+
+func (h *mockHealth) Pressure() float64 {
+	h.mutex.Lock()
+	defer h.mutex.Unlock()
+	return h.pressure
+}
+
+// blockingPersistence is a persistence.Persistence whose Value stores wait while blocked.
+type blockingPersistence struct {
+	persistence.Persistence
+	entered chan bool
+
+	mutex   sync.Mutex
+	unblock chan bool
+}
+
+// block makes subsequent stores wait until the returned channel is closed.
+func (p *blockingPersistence) block() chan bool {
+	p.mutex.Lock()
+	defer p.mutex.Unlock()
+	p.unblock = make(chan bool)
+	return p.unblock
+}
+
+func (p *blockingPersistence) Value(name string) persistence.Value {
+	return &blockingValue{Value: p.Persistence.Value(name), p: p}
+}
+
+type blockingValue struct {
+	persistence.Value
+	p *blockingPersistence
+}
+
+func (v *blockingValue) Store(obj interface{}) error {
+	v.p.mutex.Lock()
+	unblock := v.p.unblock
+	v.p.mutex.Unlock()
+	if unblock != nil {
+		select {
+		case v.p.entered <- true:
+		default:
+		}
+		<-unblock
+	}
+	return v.Value.Store(obj)
+}
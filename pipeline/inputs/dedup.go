@@ -0,0 +1,375 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package inputs
+
+import (
+	"context"
+	"flag"
+	"fmt"
+	"hash/fnv"
+	"sync"
+	"time"
+
+	"github.com/GoogleCloudPlatform/ubbagent/clock"
+	"github.com/GoogleCloudPlatform/ubbagent/metrics"
+	"github.com/GoogleCloudPlatform/ubbagent/persistence"
+	"github.com/GoogleCloudPlatform/ubbagent/pipeline"
+	"github.com/golang/glog"
+)
+
+var idempotencyWindow = flag.Duration("idempotency_window", time.Hour, "duration for which report idempotency keys are remembered")
+var idempotencyMaxKeys = flag.Int("idempotency_max_keys", 100000, "maximum number of report idempotency keys remembered")
+var idempotencyPersistInterval = flag.Duration("idempotency_persist_interval", time.Second, "how often newly remembered idempotency keys are persisted, or 0 to persist each as it is remembered; keys not yet persisted are forgotten by a crash")
+
+const (
+	dedupPersistencePrefix = "dedup/"
+
+	// The window is divided into this many buckets. Expiry drops a whole bucket at a time, so keys
+	// are remembered for between window and window*(1+1/dedupBuckets).
+	dedupBuckets = 8
+
+	// An approximation of the memory used by each remembered key: the 8-byte hash plus Go map
+	// overhead at a typical load factor.
+	dedupBytesPerKey = 40
+)
+
+// DedupInput is a pipeline.Input that drops reports whose IdempotencyKey was accepted within a
+// recent window. Keys are remembered as 64-bit hashes in a set of time buckets, each persisted
+// separately. Remembering a key only marks its bucket changed; changed buckets are persisted
+// periodically, outside the lock that reports take, so that adding a key doesn't wait for I/O. The
+// number of remembered keys is bounded; when the bound is reached the oldest bucket is discarded
+// early.
+type DedupInput struct {
+	pipeline.Component
+	delegate        pipeline.Input
+	persistence     persistence.Persistence
+	clock           clock.Clock
+	window          time.Duration
+	width           time.Duration
+	maxKeys         int
+	persistInterval time.Duration
+
+	mutex       sync.Mutex
+	buckets     []*dedupBucket // Oldest first
+	keys        int
+	inflight    map[uint64]bool
+	duplicates  int64
+	evictedKeys int64
+	// Changes not yet persisted: whether the bucket index changed, and the buckets dropped since.
+	indexChanged bool
+	dropped      []time.Time
+
+	// Serializes persist, so that a bucket's writes and removal are applied in order.
+	persistMutex sync.Mutex
+	stop         chan struct{}
+	stopped      chan struct{}
+	stopOnce     sync.Once
+}
+
+type dedupBucket struct {
+	start time.Time
+	keys  map[uint64]struct{}
+	// Whether keys changed since the bucket was last persisted.
+	changed bool
+}
+
+// persistedDedupBucket is the stored form of a dedupBucket.
+type persistedDedupBucket struct {
+	Keys []uint64
+}
+
+// DedupSnapshot describes the state and memory cost of a DedupInput.
+type DedupSnapshot struct {
+	// The configured deduplication window.
+	WindowSeconds int64 `json:"windowSeconds"`
+
+	// The number of keys currently remembered, and the limit.
+	Keys    int `json:"keys"`
+	MaxKeys int `json:"maxKeys"`
+
+	// The approximate memory used by remembered keys.
+	ApproxBytes int64 `json:"approxBytes"`
+
+	// The number of reports dropped as duplicates.
+	Duplicates int64 `json:"duplicates"`
+
+	// The number of keys forgotten before the end of the window because MaxKeys was reached.
+	EvictedKeys int64 `json:"evictedKeys"`
+}
+
+// NewDedupInput creates a DedupInput that forwards reports to delegate, using the window, key
+// limit and persistence interval given by the --idempotency_window, --idempotency_max_keys and
+// --idempotency_persist_interval flags. Previously-remembered keys are loaded from p.
+func NewDedupInput(delegate pipeline.Input, p persistence.Persistence) (*DedupInput, error) {
+	return newDedupInput(delegate, p, clock.NewClock(), *idempotencyWindow, *idempotencyMaxKeys, *idempotencyPersistInterval)
+}
+
+func newDedupInput(delegate pipeline.Input, p persistence.Persistence, clock clock.Clock, window time.Duration, maxKeys int, persistInterval time.Duration) (*DedupInput, error) {
+	d := &DedupInput{
+		Component:       delegate,
+		delegate:        delegate,
+		persistence:     p,
+		clock:           clock,
+		window:          window,
+		width:           window / dedupBuckets,
+		maxKeys:         maxKeys,
+		persistInterval: persistInterval,
+		inflight:        make(map[uint64]bool),
+	}
+	if d.width <= 0 {
+		d.width = 1
+	}
+	if err := d.loadState(); err != nil {
+		return nil, err
+	}
+	d.persist()
+	if persistInterval > 0 {
+		d.stop = make(chan struct{})
+		d.stopped = make(chan struct{})
+		go d.run()
+	}
+	return d, nil
+}
+
+// AddReport forwards a report to the delegate unless its IdempotencyKey was already accepted, in
+// which case the report is dropped and nil is returned. A report whose key is currently being
+// added by another caller is rejected with an error so that the client retries it later. A key is
+// remembered only if the delegate accepts the report.
+func (d *DedupInput) AddReport(report metrics.MetricReport) error {
+	return d.AddReportContext(context.Background(), report)
+}
+
+// AddReportContext is AddReport, passing ctx to the delegate. See pipeline.ContextInput.
+func (d *DedupInput) AddReportContext(ctx context.Context, report metrics.MetricReport) error {
+	if report.IdempotencyKey == "" {
+		return pipeline.AddReportContext(ctx, d.delegate, report)
+	}
+	key := hashIdempotencyKey(report.IdempotencyKey)
+	report.IdempotencyKey = ""
+
+	d.mutex.Lock()
+	d.expire(d.clock.Now())
+	if d.contains(key) {
+		d.duplicates++
+		d.mutex.Unlock()
+		glog.V(2).Infof("dedup: dropping duplicate report: %v", report.Name)
+		return nil
+	}
+	if d.inflight[key] {
+		d.mutex.Unlock()
+		return fmt.Errorf("dedup: report with the same idempotency key is already being added")
+	}
+	d.inflight[key] = true
+	d.mutex.Unlock()
+
+	err := pipeline.AddReportContext(ctx, d.delegate, report)
+
+	d.mutex.Lock()
+	delete(d.inflight, key)
+	if err == nil {
+		d.add(d.clock.Now(), key)
+	}
+	d.mutex.Unlock()
+	if err == nil && d.persistInterval <= 0 {
+		d.persist()
+	}
+	return err
+}
+
+// Release persists the remembered keys, and releases the delegate.
+// See pipeline.Component.Release.
+func (d *DedupInput) Release() error {
+	d.stopOnce.Do(func() {
+		if d.stop != nil {
+			close(d.stop)
+			<-d.stopped
+		}
+	})
+	d.persist()
+	return d.delegate.Release()
+}
+
+// Snapshot returns the DedupInput's current state.
+func (d *DedupInput) Snapshot() DedupSnapshot {
+	d.mutex.Lock()
+	defer d.mutex.Unlock()
+	return DedupSnapshot{
+		WindowSeconds: int64(d.window / time.Second),
+		Keys:          d.keys,
+		MaxKeys:       d.maxKeys,
+		ApproxBytes:   int64(d.keys) * dedupBytesPerKey,
+		Duplicates:    d.duplicates,
+		EvictedKeys:   d.evictedKeys,
+	}
+}
+
+func (d *DedupInput) contains(key uint64) bool {
+	for _, b := range d.buckets {
+		if _, ok := b.keys[key]; ok {
+			return true
+		}
+	}
+	return false
+}
+
+// add remembers key in the current bucket, creating it if necessary, and marks that bucket
+// changed.
+func (d *DedupInput) add(now time.Time, key uint64) {
+	start := now.Truncate(d.width)
+	var current *dedupBucket
+	if n := len(d.buckets); n > 0 && !d.buckets[n-1].start.Before(start) {
+		current = d.buckets[n-1]
+	} else {
+		current = &dedupBucket{start: start, keys: make(map[uint64]struct{})}
+		d.buckets = append(d.buckets, current)
+		d.indexChanged = true
+	}
+	for d.keys >= d.maxKeys && len(d.buckets) > 1 {
+		glog.Warningf("dedup: idempotency key limit reached; forgetting %v keys early", len(d.buckets[0].keys))
+		d.evictedKeys += int64(len(d.buckets[0].keys))
+		d.dropOldest()
+	}
+	if d.keys >= d.maxKeys {
+		// The current bucket alone holds maxKeys keys.
+		d.evictedKeys += int64(len(current.keys))
+		d.keys -= len(current.keys)
+		current.keys = make(map[uint64]struct{})
+	}
+	current.keys[key] = struct{}{}
+	current.changed = true
+	d.keys++
+}
+
+// expire drops buckets that lie entirely outside the window ending at now.
+func (d *DedupInput) expire(now time.Time) {
+	cutoff := now.Add(-d.window)
+	for len(d.buckets) > 0 && !d.buckets[0].start.Add(d.width).After(cutoff) {
+		d.dropOldest()
+	}
+}
+
+func (d *DedupInput) dropOldest() {
+	b := d.buckets[0]
+	d.buckets = d.buckets[1:]
+	d.keys -= len(b.keys)
+	d.indexChanged = true
+	d.dropped = append(d.dropped, b.start)
+}
+
+func (d *DedupInput) loadState() error {
+	var starts []time.Time
+	err := d.persistence.Value(dedupPersistencePrefix + "index").Load(&starts)
+	if err == persistence.ErrNotFound {
+		return nil
+	} else if err != nil {
+		return fmt.Errorf("dedup: error loading state: %v", err)
+	}
+	for _, start := range starts {
+		var pb persistedDedupBucket
+		err := d.bucketValue(start).Load(&pb)
+		if err == persistence.ErrNotFound {
+			continue
+		} else if err != nil {
+			return fmt.Errorf("dedup: error loading state: %v", err)
+		}
+		b := &dedupBucket{start: start, keys: make(map[uint64]struct{}, len(pb.Keys))}
+		for _, k := range pb.Keys {
+			b.keys[k] = struct{}{}
+		}
+		d.buckets = append(d.buckets, b)
+		d.keys += len(b.keys)
+	}
+	d.expire(d.clock.Now())
+	return nil
+}
+
+// run persists changes every persistInterval until Release.
+func (d *DedupInput) run() {
+	ticker := time.NewTicker(d.persistInterval)
+	defer ticker.Stop()
+	for {
+		select {
+		case <-ticker.C:
+			d.persist()
+		case <-d.stop:
+			close(d.stopped)
+			return
+		}
+	}
+}
+
+// persist writes the buckets and index changed since the last call, and removes dropped buckets.
+// The changes are collected while holding mutex and written after releasing it.
+//
+// Persistence failures are logged rather than returned: the report itself has already been
+// accepted, and the worst outcome of losing a key is a duplicate after restart.
+func (d *DedupInput) persist() {
+	d.persistMutex.Lock()
+	defer d.persistMutex.Unlock()
+
+	d.mutex.Lock()
+	stores := make(map[time.Time]persistedDedupBucket)
+	for _, b := range d.buckets {
+		if !b.changed {
+			continue
+		}
+		pb := persistedDedupBucket{Keys: make([]uint64, 0, len(b.keys))}
+		for k := range b.keys {
+			pb.Keys = append(pb.Keys, k)
+		}
+		stores[b.start] = pb
+		b.changed = false
+	}
+	var starts []time.Time
+	indexChanged := d.indexChanged
+	if indexChanged {
+		starts = make([]time.Time, len(d.buckets))
+		for i, b := range d.buckets {
+			starts[i] = b.start
+		}
+		d.indexChanged = false
+	}
+	dropped := d.dropped
+	d.dropped = nil
+	d.mutex.Unlock()
+
+	// Buckets are written before the index that lists them; loadState skips listed buckets that
+	// are missing.
+	for start, pb := range stores {
+		if err := d.bucketValue(start).Store(pb); err != nil {
+			glog.Errorf("dedup: error persisting bucket: %+v", err)
+		}
+	}
+	if indexChanged {
+		if err := d.persistence.Value(dedupPersistencePrefix + "index").Store(starts); err != nil {
+			glog.Errorf("dedup: error persisting index: %+v", err)
+		}
+	}
+	for _, start := range dropped {
+		if err := d.bucketValue(start).Remove(); err != nil && err != persistence.ErrNotFound {
+			glog.Errorf("dedup: error removing bucket: %+v", err)
+		}
+	}
+}
+
+func (d *DedupInput) bucketValue(start time.Time) persistence.Value {
+	return d.persistence.Value(fmt.Sprintf("%vbucket-%v", dedupPersistencePrefix, start.UnixNano()))
+}
+
+func hashIdempotencyKey(key string) uint64 {
+	h := fnv.New64a()
+	h.Write([]byte(key))
+	return h.Sum64()
+}
@@ -0,0 +1,244 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package inputs
+
+import (
+	"errors"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"testing"
+	"time"
+
+	"github.com/GoogleCloudPlatform/ubbagent/clock"
+	"github.com/GoogleCloudPlatform/ubbagent/metrics"
+	"github.com/GoogleCloudPlatform/ubbagent/persistence"
+	"github.com/GoogleCloudPlatform/ubbagent/testlib"
+)
+
+func TestDedupInput(t *testing.T) {
+	report := func(key string) metrics.MetricReport {
+		return metrics.MetricReport{
+			Name:           "metric",
+			StartTime:      time.Unix(10, 0),
+			EndTime:        time.Unix(11, 0),
+			Value:          metrics.MetricValue{Int64Value: 1},
+			IdempotencyKey: key,
+		}
+	}
+
+	t.Run("duplicates are dropped", func(t *testing.T) {
+		mi := testlib.NewMockInput()
+		mc := testlib.NewMockClock()
+		mc.SetNow(time.Unix(1000, 0))
+		d, err := newDedupInput(mi, persistence.NewMemoryPersistence(), mc, time.Hour, 100, 0)
+		if err != nil {
+			t.Fatalf("unexpected error: %v", err)
+		}
+
+		for _, key := range []string{"a", "b", "a", "", ""} {
+			if err := d.AddReport(report(key)); err != nil {
+				t.Fatalf("AddReport(%v): unexpected error: %v", key, err)
+			}
+		}
+		reports := mi.Reports()
+		if want, got := 4, len(reports); want != got {
+			t.Fatalf("len(reports): want=%v, got=%v", want, got)
+		}
+		for _, r := range reports {
+			if r.IdempotencyKey != "" {
+				t.Fatalf("report.IdempotencyKey: want=\"\", got=%v", r.IdempotencyKey)
+			}
+		}
+		snap := d.Snapshot()
+		if want, got := 2, snap.Keys; want != got {
+			t.Fatalf("snap.Keys: want=%v, got=%v", want, got)
+		}
+		if want, got := int64(1), snap.Duplicates; want != got {
+			t.Fatalf("snap.Duplicates: want=%v, got=%v", want, got)
+		}
+		if want, got := int64(2*dedupBytesPerKey), snap.ApproxBytes; want != got {
+			t.Fatalf("snap.ApproxBytes: want=%v, got=%v", want, got)
+		}
+	})
+
+	t.Run("rejected reports are not remembered", func(t *testing.T) {
+		mi := testlib.NewMockInput()
+		mc := testlib.NewMockClock()
+		d, err := newDedupInput(mi, persistence.NewMemoryPersistence(), mc, time.Hour, 100, 0)
+		if err != nil {
+			t.Fatalf("unexpected error: %v", err)
+		}
+		mi.SetAddError(errors.New("rejected"))
+		if err := d.AddReport(report("a")); err == nil {
+			t.Fatal("expected AddReport error, got nil")
+		}
+		mi.SetAddError(nil)
+		if err := d.AddReport(report("a")); err != nil {
+			t.Fatalf("unexpected error: %v", err)
+		}
+		if want, got := 1, len(mi.Reports()); want != got {
+			t.Fatalf("len(reports): want=%v, got=%v", want, got)
+		}
+	})
+
+	t.Run("keys expire after the window", func(t *testing.T) {
+		mi := testlib.NewMockInput()
+		mc := testlib.NewMockClock()
+		mc.SetNow(time.Unix(0, 0))
+		d, err := newDedupInput(mi, persistence.NewMemoryPersistence(), mc, 8*time.Second, 100, 0)
+		if err != nil {
+			t.Fatalf("unexpected error: %v", err)
+		}
+		d.AddReport(report("a"))
+		mc.SetNow(time.Unix(8, 0))
+		d.AddReport(report("a"))
+		if want, got := 1, len(mi.Reports()); want != got {
+			t.Fatalf("len(reports) within window: want=%v, got=%v", want, got)
+		}
+		mc.SetNow(time.Unix(9, 0))
+		d.AddReport(report("a"))
+		if want, got := 1, len(mi.Reports()); want != got {
+			t.Fatalf("len(reports) after window: want=%v, got=%v", want, got)
+		}
+	})
+
+	t.Run("key limit evicts oldest bucket", func(t *testing.T) {
+		mi := testlib.NewMockInput()
+		mc := testlib.NewMockClock()
+		mc.SetNow(time.Unix(0, 0))
+		d, err := newDedupInput(mi, persistence.NewMemoryPersistence(), mc, 8*time.Second, 2, 0)
+		if err != nil {
+			t.Fatalf("unexpected error: %v", err)
+		}
+		d.AddReport(report("a"))
+		d.AddReport(report("b"))
+		mc.SetNow(time.Unix(1, 0))
+		d.AddReport(report("c"))
+		snap := d.Snapshot()
+		if want, got := 1, snap.Keys; want != got {
+			t.Fatalf("snap.Keys: want=%v, got=%v", want, got)
+		}
+		if want, got := int64(2), snap.EvictedKeys; want != got {
+			t.Fatalf("snap.EvictedKeys: want=%v, got=%v", want, got)
+		}
+	})
+
+	t.Run("keys survive restart", func(t *testing.T) {
+		p := persistence.NewMemoryPersistence()
+		mc := testlib.NewMockClock()
+		mc.SetNow(time.Unix(0, 0))
+		d1, err := newDedupInput(testlib.NewMockInput(), p, mc, time.Hour, 100, 0)
+		if err != nil {
+			t.Fatalf("unexpected error: %v", err)
+		}
+		d1.AddReport(report("a"))
+		mc.SetNow(time.Unix(1000, 0))
+		d1.AddReport(report("b"))
+
+		mi := testlib.NewMockInput()
+		d2, err := newDedupInput(mi, p, mc, time.Hour, 100, 0)
+		if err != nil {
+			t.Fatalf("unexpected error: %v", err)
+		}
+		if want, got := 2, d2.Snapshot().Keys; want != got {
+			t.Fatalf("d2.Snapshot().Keys: want=%v, got=%v", want, got)
+		}
+		d2.AddReport(report("a"))
+		d2.AddReport(report("b"))
+		if want, got := 0, len(mi.Reports()); want != got {
+			t.Fatalf("len(reports): want=%v, got=%v", want, got)
+		}
+	})
+
+	t.Run("keys are persisted periodically and on release", func(t *testing.T) {
+		p := persistence.NewMemoryPersistence()
+		mc := testlib.NewMockClock()
+		mc.SetNow(time.Unix(0, 0))
+		d1, err := newDedupInput(testlib.NewMockInput(), p, mc, time.Hour, 100, time.Hour)
+		if err != nil {
+			t.Fatalf("unexpected error: %v", err)
+		}
+		d1.AddReport(report("a"))
+		d1.AddReport(report("b"))
+		d2, err := newDedupInput(testlib.NewMockInput(), p, mc, time.Hour, 100, 0)
+		if err != nil {
+			t.Fatalf("unexpected error: %v", err)
+		}
+		if want, got := 0, d2.Snapshot().Keys; want != got {
+			t.Fatalf("keys persisted before the interval: want=%v, got=%v", want, got)
+		}
+
+		if err := d1.Release(); err != nil {
+			t.Fatalf("Release: unexpected error: %v", err)
+		}
+		d3, err := newDedupInput(testlib.NewMockInput(), p, mc, time.Hour, 100, 0)
+		if err != nil {
+			t.Fatalf("unexpected error: %v", err)
+		}
+		if want, got := 2, d3.Snapshot().Keys; want != got {
+			t.Fatalf("keys persisted by Release: want=%v, got=%v", want, got)
+		}
+	})
+
+	t.Run("expired buckets are removed from persistence", func(t *testing.T) {
+		p := persistence.NewMemoryPersistence()
+		mc := testlib.NewMockClock()
+		mc.SetNow(time.Unix(0, 0))
+		d, err := newDedupInput(testlib.NewMockInput(), p, mc, 8*time.Second, 100, 0)
+		if err != nil {
+			t.Fatalf("unexpected error: %v", err)
+		}
+		d.AddReport(report("a"))
+		mc.SetNow(time.Unix(20, 0))
+		d.AddReport(report("b"))
+		var pb persistedDedupBucket
+		if err := d.bucketValue(time.Unix(0, 0)).Load(&pb); err != persistence.ErrNotFound {
+			t.Fatalf("expired bucket: want ErrNotFound, got %+v (%v keys)", err, len(pb.Keys))
+		}
+	})
+}
+
+// BenchmarkDedupInput measures adding reports with distinct keys to a DedupInput remembering up to
+// 100000 keys, which persists them in the background.
+func BenchmarkDedupInput(b *testing.B) {
+	tmpdir, err := ioutil.TempDir("", "dedup_test")
+	if err != nil {
+		b.Fatalf("Unable to create temp directory: %+v", err)
+	}
+	defer os.RemoveAll(tmpdir)
+	p, err := persistence.NewDiskPersistence(tmpdir)
+	if err != nil {
+		b.Fatalf("NewDiskPersistence: %+v", err)
+	}
+	d, err := newDedupInput(discardInput{}, p, clock.NewClock(), time.Hour, 100000, time.Second)
+	if err != nil {
+		b.Fatalf("unexpected error: %v", err)
+	}
+	defer d.Release()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if err := d.AddReport(metrics.MetricReport{Name: "int-metric", IdempotencyKey: fmt.Sprintf("key%v", i)}); err != nil {
+			b.Fatalf("AddReport: %+v", err)
+		}
+	}
+}
+
+// discardInput is a pipeline.Input that accepts and discards every report.
+type discardInput struct{}
+
+func (discardInput) AddReport(metrics.MetricReport) error { return nil }
+func (discardInput) Use()                                 {}
+func (discardInput) Release() error                       { return nil }
@@ -15,10 +15,12 @@
 package inputs
 
 import (
+	"context"
 	"fmt"
 
 	"github.com/GoogleCloudPlatform/ubbagent/metrics"
 	"github.com/GoogleCloudPlatform/ubbagent/pipeline"
+	"github.com/GoogleCloudPlatform/ubbagent/stats"
 	"github.com/golang/glog"
 	"github.com/hashicorp/go-multierror"
 )
@@ -32,11 +34,17 @@ type selector struct {
 }
 
 func (s *selector) AddReport(report metrics.MetricReport) error {
+	return s.AddReportContext(context.Background(), report)
+}
+
+// AddReportContext routes a report to its metric's Input, passing ctx along.
+// See pipeline.ContextInput.
+func (s *selector) AddReportContext(ctx context.Context, report metrics.MetricReport) error {
 	a, ok := s.inputs[report.Name]
 	if !ok {
 		return fmt.Errorf("selector: unknown metric: %v", report.Name)
 	}
-	return a.AddReport(report)
+	return pipeline.AddReportContext(ctx, a, report)
 }
 
 // Use increments the Selector's usage count.
@@ -79,6 +87,10 @@ func (p *callbackInput) AddReport(report metrics.MetricReport) error {
 	return p.delegate.AddReport(report)
 }
 
+func (p *callbackInput) AddReportContext(ctx context.Context, report metrics.MetricReport) error {
+	return pipeline.AddReportContext(ctx, p.delegate, report)
+}
+
 func (p *callbackInput) Use() {
 	p.tracker.Use()
 }
@@ -105,6 +117,10 @@ type labelingInput struct {
 }
 
 func (i *labelingInput) AddReport(report metrics.MetricReport) error {
+	return i.AddReportContext(context.Background(), report)
+}
+
+func (i *labelingInput) AddReportContext(ctx context.Context, report metrics.MetricReport) error {
 	for k, v := range i.labels {
 		if _, exists := report.Labels[k]; exists {
 			glog.Warningf("labelingInput: received report that already had label '%v'; skipping", k)
@@ -115,7 +131,7 @@ func (i *labelingInput) AddReport(report metrics.MetricReport) error {
 		}
 		report.Labels[k] = v
 	}
-	return i.delegate.AddReport(report)
+	return pipeline.AddReportContext(ctx, i.delegate, report)
 }
 
 // NewLabelingInput creates an Input that adds the given additional labels to incoming
@@ -124,3 +140,27 @@ func (i *labelingInput) AddReport(report metrics.MetricReport) error {
 func NewLabelingInput(delegate pipeline.Input, labels map[string]string) pipeline.Input {
 	return &labelingInput{Component: delegate, delegate: delegate, labels: labels}
 }
+
+type cardinalityInput struct {
+	pipeline.Component
+	delegate pipeline.Input
+	sketch   *stats.MetricCardinality
+}
+
+func (i *cardinalityInput) AddReport(report metrics.MetricReport) error {
+	return i.AddReportContext(context.Background(), report)
+}
+
+func (i *cardinalityInput) AddReportContext(ctx context.Context, report metrics.MetricReport) error {
+	if err := pipeline.AddReportContext(ctx, i.delegate, report); err != nil {
+		return err
+	}
+	i.sketch.Observe(report)
+	return nil
+}
+
+// NewCardinalityInput creates an Input that records each report accepted by the given delegate in
+// the given cardinality sketch. Rejected reports are not recorded.
+func NewCardinalityInput(delegate pipeline.Input, sketch *stats.MetricCardinality) pipeline.Input {
+	return &cardinalityInput{Component: delegate, delegate: delegate, sketch: sketch}
+}
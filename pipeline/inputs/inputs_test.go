@@ -15,12 +15,15 @@
 package inputs
 
 import (
+	"context"
+	"errors"
 	"reflect"
 	"testing"
 	"time"
 
 	"github.com/GoogleCloudPlatform/ubbagent/metrics"
 	"github.com/GoogleCloudPlatform/ubbagent/pipeline"
+	"github.com/GoogleCloudPlatform/ubbagent/stats"
 	"github.com/GoogleCloudPlatform/ubbagent/testlib"
 	"github.com/hashicorp/go-multierror"
 )
@@ -100,6 +103,17 @@ func TestSelector(t *testing.T) {
 		}
 	})
 
+	t.Run("done context", func(t *testing.T) {
+		ctx, cancel := context.WithCancel(context.Background())
+		cancel()
+		if err := pipeline.AddReportContext(ctx, s, report1); err != context.Canceled {
+			t.Fatalf("AddReportContext: want=%v, got=%v", context.Canceled, err)
+		}
+		if reports := mock1.Reports(); len(reports) != 0 {
+			t.Fatalf("mock1 should not have a report")
+		}
+	})
+
 	t.Run("inputs are used and released", func(t *testing.T) {
 		input1 := testlib.NewMockInput()
 		input2 := testlib.NewMockInput()
@@ -275,3 +289,43 @@ func TestLabelingInput(t *testing.T) {
 		}
 	})
 }
+
+func TestCardinalityInput(t *testing.T) {
+	report := metrics.MetricReport{
+		Name:      "metric1",
+		StartTime: time.Unix(10, 0),
+		EndTime:   time.Unix(11, 0),
+		Value: metrics.MetricValue{
+			Int64Value: 1,
+		},
+		Labels: map[string]string{"foo": "bar"},
+	}
+
+	t.Run("accepted reports are recorded", func(t *testing.T) {
+		c := stats.NewCardinality()
+		mockInput := testlib.NewMockInput()
+		input := NewCardinalityInput(mockInput, c.Metric("metric1"))
+		if err := input.AddReport(report); err != nil {
+			t.Fatalf("unexpected error adding report: %v", err)
+		}
+		if len(mockInput.Reports()) != 1 {
+			t.Fatalf("expected report to be passed to delegate")
+		}
+		if want, got := int64(1), c.Snapshot().Metrics["metric1"].Reports; want != got {
+			t.Fatalf("Reports: want=%v, got=%v", want, got)
+		}
+	})
+
+	t.Run("rejected reports are not recorded", func(t *testing.T) {
+		c := stats.NewCardinality()
+		mockInput := testlib.NewMockInput()
+		mockInput.SetAddError(errors.New("rejected"))
+		input := NewCardinalityInput(mockInput, c.Metric("metric1"))
+		if err := input.AddReport(report); err == nil {
+			t.Fatalf("expected error adding report")
+		}
+		if want, got := int64(0), c.Snapshot().Metrics["metric1"].Reports; want != got {
+			t.Fatalf("Reports: want=%v, got=%v", want, got)
+		}
+	})
+}
@@ -27,6 +27,7 @@
 package pipeline
 
 import (
+	"context"
 	"sync"
 
 	"github.com/GoogleCloudPlatform/ubbagent/metrics"
@@ -43,6 +44,30 @@ type Input interface {
 	AddReport(metrics.MetricReport) error
 }
 
+// ContextInput is an Input that can stop waiting for the pipeline to accept a report when a
+// context is done. Callers with a latency budget use it to shed reports under overload rather than
+// stall.
+type ContextInput interface {
+	Input
+
+	// AddReportContext adds a report like AddReport, but returns ctx's error if ctx is done before
+	// the report is added. If ctx is done before the report is handed off, it is not added; if ctx
+	// is done afterwards, the add finishes in the background and the report may still be applied.
+	AddReportContext(ctx context.Context, report metrics.MetricReport) error
+}
+
+// AddReportContext adds a report to input, honoring ctx if input is a ContextInput. Otherwise, the
+// report is added only if ctx isn't already done.
+func AddReportContext(ctx context.Context, input Input, report metrics.MetricReport) error {
+	if ci, ok := input.(ContextInput); ok {
+		return ci.AddReportContext(ctx, report)
+	}
+	if err := ctx.Err(); err != nil {
+		return err
+	}
+	return input.AddReport(report)
+}
+
 // Component represents a single component in a pipeline. Components can be used downstream of
 // multiple other components, enabling creation of fork/join pipeline patterns. Because of this,
 // components implement a reference counting strategy that determines when they should clean up
@@ -75,6 +100,32 @@ type Source interface {
 	Shutdown() error
 }
 
+// Handoff is shared by the components of a pipeline that is shutting down so that another process
+// can take over its persistence. Components released after Begin that would otherwise complete
+// in-progress work, such as an Aggregator pushing a partial bucket, leave it in persistence for the
+// next process to resume. A nil Handoff is never begun.
+type Handoff struct {
+	mu    sync.Mutex
+	begun bool
+}
+
+// Begin marks the handoff as begun.
+func (h *Handoff) Begin() {
+	h.mu.Lock()
+	defer h.mu.Unlock()
+	h.begun = true
+}
+
+// Begun returns whether Begin has been called.
+func (h *Handoff) Begun() bool {
+	if h == nil {
+		return false
+	}
+	h.mu.Lock()
+	defer h.mu.Unlock()
+	return h.begun
+}
+
 // Type UsageTracker is a utility that helps track the usage of a Component. It provides Use and
 // Release methods, and calls a close function when Release decrements the usage count to 0.
 type UsageTracker struct {
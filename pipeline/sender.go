@@ -38,6 +38,14 @@ type Sender interface {
 	Endpoints() []string
 }
 
+// HealthReporter is implemented by Senders that can report how well their endpoints are keeping up,
+// so that upstream components can send less often while they aren't.
+type HealthReporter interface {
+	// Pressure returns how degraded delivery is, from 0 while reports are sent promptly to 1 while
+	// the endpoint appears to be down or far behind.
+	Pressure() float64
+}
+
 // Type InputAdapter is an Input that converts incoming reports to StampedMetricReport
 // objects and sends them directly to a delegate Sender.
 type InputAdapter struct {
@@ -0,0 +1,244 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package senders
+
+import (
+	"encoding/json"
+	"errors"
+	"flag"
+	"path"
+	"time"
+
+	"github.com/GoogleCloudPlatform/ubbagent/pipeline"
+	"github.com/golang/glog"
+)
+
+const (
+	deadLetterPrefix = "deadletter"
+
+	// DeadLetterExpired is the error class of an entry that failed transiently until it reached its
+	// maximum queue time.
+	DeadLetterExpired = "expired"
+
+	// DeadLetterRejected is the error class of an entry that failed with a non-transient error.
+	DeadLetterRejected = "rejected"
+
+	// DeadLetterCorrupt is the error class of an entry that couldn't be read from the queue. Its
+	// report can't be replayed; its queued text is kept in Raw.
+	DeadLetterCorrupt = "corrupt"
+)
+
+var replayRate = flag.Float64("dead_letter_replay_rate", 1000, "default maximum rate, in reports per second, at which dead letters are replayed; 0 means unlimited")
+
+// DeadLetter is a report that a RetryingSender gave up sending, along with the reason.
+type DeadLetter struct {
+	Endpoint string                  `json:"endpoint"`
+	Report   pipeline.EndpointReport `json:"report"`
+
+	// SendTime is the time the report was originally queued.
+	SendTime time.Time `json:"sendTime"`
+
+	// DropTime is the time the report was given up on.
+	DropTime time.Time `json:"dropTime"`
+
+	ErrorClass string `json:"errorClass"`
+	Error      string `json:"error"`
+
+	// Raw is the queued text of a corrupt entry, whose Report holds at most its id.
+	Raw json.RawMessage `json:"raw,omitempty"`
+}
+
+// DeadLetterFilter selects dead letters. Zero-valued fields match everything.
+type DeadLetterFilter struct {
+	Metric string
+
+	// From and To select reports whose [StartTime, EndTime] range overlaps [From, To).
+	From time.Time
+	To   time.Time
+
+	ErrorClass string
+}
+
+// Matches returns true if d is selected by f.
+func (f DeadLetterFilter) Matches(d DeadLetter) bool {
+	r := d.Report
+	if f.Metric != "" && f.Metric != r.Name {
+		return false
+	}
+	if !f.From.IsZero() && !r.EndTime.After(f.From) {
+		return false
+	}
+	if !f.To.IsZero() && !r.StartTime.Before(f.To) {
+		return false
+	}
+	return f.ErrorClass == "" || f.ErrorClass == d.ErrorClass
+}
+
+// deadLetterRecord is a single record in an endpoint's dead letter log. A record either adds a dead
+// letter, or marks the dead letter with the given report id as replayed. The log is append-only, so
+// replaying a dead letter never rewrites it.
+type deadLetterRecord struct {
+	DeadLetter *DeadLetter `json:"deadLetter,omitempty"`
+	Replayed   string      `json:"replayed,omitempty"`
+}
+
+// deadLetter records entry, which is being dropped from the queue, as a dead letter.
+func (rs *RetryingSender) deadLetter(entry *queueEntry, now time.Time, class string, err error) {
+	d := &DeadLetter{
+		Endpoint:   rs.endpoint.Name(),
+		Report:     entry.Report,
+		SendTime:   entry.SendTime,
+		DropTime:   now,
+		ErrorClass: class,
+		Error:      err.Error(),
+	}
+	if err := rs.deadLetters.Append(deadLetterRecord{DeadLetter: d}); err != nil {
+		glog.Errorf("RetryingSender: error storing dead letter %v: %+v", entry.Report.Id, err)
+	}
+}
+
+// deadLetterCorrupt records the entry at the head of the queue, which can't be read and is being
+// dropped, as a dead letter holding its queued text. Its report is recorded as a failed send if its
+// id can be read.
+func (rs *RetryingSender) deadLetterCorrupt(now time.Time, err error) {
+	d := &DeadLetter{
+		Endpoint:   rs.endpoint.Name(),
+		DropTime:   now,
+		ErrorClass: DeadLetterCorrupt,
+		Error:      err.Error(),
+	}
+	if texts, perr := rs.queue.PeekN(1); perr == nil {
+		d.Raw = texts[0]
+		// Decoding stops at the first error, so the id is read on its own.
+		var partial struct{ Report struct{ Id string } }
+		json.Unmarshal(d.Raw, &partial)
+		d.Report.Id = partial.Report.Id
+	}
+	if err := rs.deadLetters.Append(deadLetterRecord{DeadLetter: d}); err != nil {
+		glog.Errorf("RetryingSender: error storing corrupt dead letter: %+v", err)
+	}
+	rs.recorder.SendFailed(d.Report.Id, rs.endpoint.Name())
+}
+
+// DeadLetters calls fn, oldest first, for each dead letter matching f that has not been replayed. It
+// stops and returns the first error returned by fn.
+func (rs *RetryingSender) DeadLetters(f DeadLetterFilter, fn func(DeadLetter) error) error {
+	pending, err := rs.pendingDeadLetters()
+	if err != nil {
+		return err
+	}
+	for _, d := range pending {
+		if !f.Matches(*d) {
+			continue
+		}
+		if err := fn(*d); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// Replay re-sends the dead letters matching f that have not already been replayed, at no more than
+// rate reports per second, or without limit if rate is 0. Replayed reports are queued like new
+// reports, so they are retried if sending them fails and dead-lettered again if they are dropped.
+// Corrupt dead letters have no report to re-send, and are skipped. Replay returns the number of
+// reports queued.
+func (rs *RetryingSender) Replay(f DeadLetterFilter, rate float64) (int, error) {
+	pending, err := rs.pendingDeadLetters()
+	if err != nil {
+		return 0, err
+	}
+	var interval time.Duration
+	if rate > 0 {
+		interval = time.Duration(float64(time.Second) / rate)
+	}
+	next := rs.clock.Now()
+	count := 0
+	for _, d := range pending {
+		if !f.Matches(*d) || d.ErrorClass == DeadLetterCorrupt {
+			continue
+		}
+		if interval > 0 && count > 0 {
+			next = next.Add(interval)
+			<-rs.clock.NewTimerAt(next).GetC()
+		}
+		// The replay mark precedes the report in the log, so that if the report is dropped again,
+		// its new dead letter follows the mark.
+		id := d.Report.Id
+		if err := rs.deadLetters.Append(deadLetterRecord{Replayed: id}); err != nil {
+			return count, err
+		}
+		rs.recorder.Register(id, rs.Endpoints())
+		if err := rs.replay(queueEntry{d.Report, rs.clock.Now()}); err != nil {
+			rs.recorder.SendFailed(id, rs.endpoint.Name())
+			// Restore the dead letter.
+			if err := rs.deadLetters.Append(deadLetterRecord{DeadLetter: d}); err != nil {
+				glog.Errorf("RetryingSender: error restoring dead letter %v: %+v", id, err)
+			}
+			return count, err
+		}
+		count++
+	}
+	return count, nil
+}
+
+// pendingDeadLetters returns the dead letters that have not been replayed, oldest first.
+func (rs *RetryingSender) pendingDeadLetters() ([]*DeadLetter, error) {
+	var order []*DeadLetter
+	index := make(map[string]int)
+	err := rs.deadLetters.Read(func(data json.RawMessage) error {
+		var record deadLetterRecord
+		if err := json.Unmarshal(data, &record); err != nil {
+			return err
+		}
+		if record.DeadLetter != nil {
+			index[record.DeadLetter.Report.Id] = len(order)
+			order = append(order, record.DeadLetter)
+		} else if i, ok := index[record.Replayed]; ok {
+			// A later record may dead-letter the same report again.
+			order[i] = nil
+			delete(index, record.Replayed)
+		}
+		return nil
+	})
+	if err != nil {
+		return nil, err
+	}
+	pending := order[:0]
+	for _, d := range order {
+		if d != nil {
+			pending = append(pending, d)
+		}
+	}
+	return pending, nil
+}
+
+func (rs *RetryingSender) replay(entry queueEntry) error {
+	rs.closeMutex.RLock()
+	defer rs.closeMutex.RUnlock()
+	if rs.closed {
+		return errors.New("RetryingSender: Replay called on closed sender")
+	}
+	return rs.enqueue(entry)
+}
+
+// ReplayRate returns the default dead letter replay rate, in reports per second.
+func ReplayRate() float64 {
+	return *replayRate
+}
+
+func deadLetterName(name string) string {
+	return path.Join(deadLetterPrefix, name)
+}
@@ -0,0 +1,223 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package senders
+
+import (
+	"errors"
+	"reflect"
+	"testing"
+	"time"
+
+	"github.com/GoogleCloudPlatform/ubbagent/metrics"
+	"github.com/GoogleCloudPlatform/ubbagent/persistence"
+	"github.com/GoogleCloudPlatform/ubbagent/testlib"
+)
+
+func TestDeadLetters(t *testing.T) {
+	newReport := func(id, metric string, start int64) metrics.StampedMetricReport {
+		return metrics.StampedMetricReport{
+			Id: id,
+			MetricReport: metrics.MetricReport{
+				Name:      metric,
+				Value:     metrics.MetricValue{Int64Value: 10},
+				StartTime: time.Unix(start, 0),
+				EndTime:   time.Unix(start+1, 0),
+			},
+		}
+	}
+	report1 := newReport("report1", "int-metric", 0)
+	report2 := newReport("report2", "int-metric", 10)
+	report3 := newReport("report3", "other-metric", 20)
+
+	// setup returns a sender that has given up on report1 and report3 with non-transient errors, and
+	// on report2 after it expired.
+	setup := func(persist persistence.Persistence) (*RetryingSender, *testlib.MockEndpoint) {
+		mc := testlib.NewMockClock()
+		ep := testlib.NewMockEndpoint("mockep")
+		sr := testlib.NewMockStatsRecorder()
+		rs := newRetryingSender(ep, persist, sr, mc, testMinDelay, testMaxDelay, 0)
+		mc.SetNow(time.Unix(4000, 0))
+
+		ep.SetSendErr(errors.New("FATAL"))
+		sr.DoAndWait(t, 1, func() {
+			if err := rs.Send(report1); err != nil {
+				t.Fatalf("Unexpected send error: %+v", err)
+			}
+		})
+		ep.SetSendErr(errors.New("send failure"))
+		if err := rs.Send(report2); err != nil {
+			t.Fatalf("Unexpected send error: %+v", err)
+		}
+		sr.DoAndWait(t, 2, func() {
+			mc.SetNow(time.Unix(100000, 0))
+		})
+		ep.SetSendErr(errors.New("FATAL"))
+		sr.DoAndWait(t, 3, func() {
+			if err := rs.Send(report3); err != nil {
+				t.Fatalf("Unexpected send error: %+v", err)
+			}
+		})
+		ep.SetSendErr(nil)
+		return rs, ep
+	}
+
+	deadLetterIds := func(rs *RetryingSender, f DeadLetterFilter) []string {
+		var ids []string
+		err := rs.DeadLetters(f, func(d DeadLetter) error {
+			ids = append(ids, d.Report.Id)
+			return nil
+		})
+		if err != nil {
+			t.Fatalf("Unexpected error listing dead letters: %+v", err)
+		}
+		return ids
+	}
+
+	t.Run("dropped reports are kept", func(t *testing.T) {
+		rs, _ := setup(persistence.NewMemoryPersistence())
+		defer rs.Release()
+
+		var letters []DeadLetter
+		rs.DeadLetters(DeadLetterFilter{}, func(d DeadLetter) error {
+			letters = append(letters, d)
+			return nil
+		})
+		if want, got := 3, len(letters); want != got {
+			t.Fatalf("len(letters): want=%v, got=%v", want, got)
+		}
+		d := letters[0]
+		if !d.Report.StampedMetricReport.Equal(report1) {
+			t.Fatalf("letters[0].Report: want=%+v, got=%+v", report1, d.Report.StampedMetricReport)
+		}
+		if d.Endpoint != "mockep" || d.ErrorClass != DeadLetterRejected || d.Error != "FATAL" {
+			t.Fatalf("letters[0]: want=(mockep, %v, FATAL), got=(%v, %v, %v)", DeadLetterRejected, d.Endpoint, d.ErrorClass, d.Error)
+		}
+		if want, got := time.Unix(4000, 0), d.SendTime; !want.Equal(got) {
+			t.Fatalf("letters[0].SendTime: want=%v, got=%v", want, got)
+		}
+		if want, got := DeadLetterExpired, letters[1].ErrorClass; want != got {
+			t.Fatalf("letters[1].ErrorClass: want=%v, got=%v", want, got)
+		}
+	})
+
+	t.Run("filters", func(t *testing.T) {
+		rs, _ := setup(persistence.NewMemoryPersistence())
+		defer rs.Release()
+
+		tests := []struct {
+			filter DeadLetterFilter
+			want   []string
+		}{
+			{DeadLetterFilter{}, []string{"report1", "report2", "report3"}},
+			{DeadLetterFilter{ErrorClass: DeadLetterRejected}, []string{"report1", "report3"}},
+			{DeadLetterFilter{ErrorClass: DeadLetterExpired}, []string{"report2"}},
+			{DeadLetterFilter{Metric: "other-metric"}, []string{"report3"}},
+			{DeadLetterFilter{From: time.Unix(5, 0), To: time.Unix(20, 0)}, []string{"report2"}},
+			{DeadLetterFilter{From: time.Unix(5, 0), ErrorClass: DeadLetterRejected}, []string{"report3"}},
+		}
+		for _, test := range tests {
+			if got := deadLetterIds(rs, test.filter); !reflect.DeepEqual(test.want, got) {
+				t.Fatalf("DeadLetters(%+v): want=%v, got=%v", test.filter, test.want, got)
+			}
+		}
+	})
+
+	t.Run("replay", func(t *testing.T) {
+		persist := persistence.NewMemoryPersistence()
+		rs, ep := setup(persist)
+
+		var n int
+		var err error
+		ep.DoAndWait(t, ep.Calls()+2, func() {
+			n, err = rs.Replay(DeadLetterFilter{ErrorClass: DeadLetterRejected}, 0)
+		})
+		if err != nil || n != 2 {
+			t.Fatalf("Replay: want=(2, nil), got=(%v, %v)", n, err)
+		}
+		reports := ep.Reports()
+		if want, got := 2, len(reports); want != got {
+			t.Fatalf("len(ep.Reports()): want=%v, got=%v", want, got)
+		}
+		if !reports[0].StampedMetricReport.Equal(report1) || !reports[1].StampedMetricReport.Equal(report3) {
+			t.Fatalf("replayed reports: want=[%v %v], got=%+v", report1.Id, report3.Id, reports)
+		}
+
+		// Replayed reports are no longer listed or replayed again.
+		if want, got := []string{"report2"}, deadLetterIds(rs, DeadLetterFilter{}); !reflect.DeepEqual(want, got) {
+			t.Fatalf("dead letters after replay: want=%v, got=%v", want, got)
+		}
+		if n, err := rs.Replay(DeadLetterFilter{ErrorClass: DeadLetterRejected}, 0); err != nil || n != 0 {
+			t.Fatalf("second Replay: want=(0, nil), got=(%v, %v)", n, err)
+		}
+		rs.Release()
+
+		// Dead letters and replay marks survive a restart.
+		rs = newRetryingSender(testlib.NewMockEndpoint("mockep"), persist, testlib.NewMockStatsRecorder(), testlib.NewMockClock(), testMinDelay, testMaxDelay, 0)
+		defer rs.Release()
+		if want, got := []string{"report2"}, deadLetterIds(rs, DeadLetterFilter{}); !reflect.DeepEqual(want, got) {
+			t.Fatalf("dead letters after restart: want=%v, got=%v", want, got)
+		}
+	})
+
+	t.Run("replayed report dropped again", func(t *testing.T) {
+		rs, ep := setup(persistence.NewMemoryPersistence())
+		defer rs.Release()
+
+		ep.SetSendErr(errors.New("FATAL"))
+		ep.DoAndWait(t, ep.Calls()+1, func() {
+			if _, err := rs.Replay(DeadLetterFilter{Metric: "other-metric"}, 0); err != nil {
+				t.Fatalf("Unexpected replay error: %+v", err)
+			}
+		})
+		// The report is dead-lettered again shortly after it is sent.
+		for i := 0; i < 100; i++ {
+			if ids := deadLetterIds(rs, DeadLetterFilter{Metric: "other-metric"}); len(ids) == 1 {
+				return
+			}
+			time.Sleep(10 * time.Millisecond)
+		}
+		t.Fatalf("report3 was not dead-lettered again")
+	})
+
+	t.Run("replay is rate limited", func(t *testing.T) {
+		rs, _ := setup(persistence.NewMemoryPersistence())
+		defer rs.Release()
+		mc := rs.clock.(testlib.MockClock)
+		now := mc.Now()
+
+		done := make(chan int)
+		go func() {
+			n, _ := rs.Replay(DeadLetterFilter{}, 2)
+			done <- n
+		}()
+		// The first report is sent immediately, and each following one 500ms after the last.
+		for i := 0; i < 2; i++ {
+			next := now.Add(time.Duration(i+1) * 500 * time.Millisecond)
+			waitForNewTimer(mc, next, next.Add(time.Millisecond), t)
+			mc.SetNow(next)
+		}
+		if want, got := 3, <-done; want != got {
+			t.Fatalf("Replay: want=%v, got=%v", want, got)
+		}
+	})
+
+	t.Run("replay on closed sender", func(t *testing.T) {
+		rs, _ := setup(persistence.NewMemoryPersistence())
+		rs.Release()
+		if _, err := rs.Replay(DeadLetterFilter{}, 0); err == nil {
+			t.Fatal("Replay on closed sender: expected error")
+		}
+	})
+}
@@ -20,30 +20,41 @@ import (
 	"github.com/GoogleCloudPlatform/ubbagent/metrics"
 	"github.com/GoogleCloudPlatform/ubbagent/pipeline"
 	"github.com/GoogleCloudPlatform/ubbagent/stats"
+	"github.com/golang/glog"
 	"github.com/hashicorp/go-multierror"
 )
 
 // Dispatcher is a Sender that fans out to other Sender instances. Generally,
 // this will be a collection of Endpoints wrapped in RetryingSender objects.
+// A Dispatcher created with NewRoutingDispatcher only forwards a report to the senders whose
+// LabelMatcher matches the report's labels.
 type Dispatcher struct {
 	senders  []pipeline.Sender
+	matchers []*LabelMatcher
 	tracker  pipeline.UsageTracker
 	recorder stats.Recorder
 }
 
-// Send fans out to each Sender in parallel and returns any errors. Send blocks
+// Send fans out to each matching Sender in parallel and returns any errors. Send blocks
 // until all sub-sends have finished.
 func (d *Dispatcher) Send(report metrics.StampedMetricReport) error {
+	senders := d.senders
+	if d.matchers != nil {
+		senders = d.route(report.Labels)
+		if len(senders) == 0 {
+			glog.V(2).Infof("dispatcher: report %v matched no routes", report.Id)
+			return nil
+		}
+	}
 
-	// First, register that each report will be handled by this Dispatcher's endpoints.
-	endpoints := d.Endpoints()
-	d.recorder.Register(report.Id, endpoints)
+	// First, register that each report will be handled by the selected endpoints.
+	d.recorder.Register(report.Id, endpointsOf(senders))
 
 	// Next, forward the reports to each subsequent sender.
-	errors := make([]error, len(d.senders))
+	errors := make([]error, len(senders))
 	wg := sync.WaitGroup{}
-	wg.Add(len(d.senders))
-	for i, ps := range d.senders {
+	wg.Add(len(senders))
+	for i, ps := range senders {
 		go func(i int, s pipeline.Sender) {
 			// If the send generates an error, we assume that the downstream sender will register that
 			// error with the stats recorder.
@@ -80,9 +91,24 @@ func (d *Dispatcher) Release() error {
 	})
 }
 
-func (d *Dispatcher) Endpoints() (handlers []string) {
+// route returns the senders whose matchers match the given labels.
+func (d *Dispatcher) route(labels map[string]string) []pipeline.Sender {
+	var matched []pipeline.Sender
+	for i, s := range d.senders {
+		if d.matchers[i].Matches(labels) {
+			matched = append(matched, s)
+		}
+	}
+	return matched
+}
+
+func (d *Dispatcher) Endpoints() []string {
+	return endpointsOf(d.senders)
+}
+
+func endpointsOf(senders []pipeline.Sender) (handlers []string) {
 	seen := make(map[string]bool)
-	for _, s := range d.senders {
+	for _, s := range senders {
 		for _, e := range s.Endpoints() {
 			if _, exists := seen[e]; !exists {
 				seen[e] = true
@@ -94,8 +120,18 @@ func (d *Dispatcher) Endpoints() (handlers []string) {
 }
 
 func NewDispatcher(senders []pipeline.Sender, recorder stats.Recorder) *Dispatcher {
+	return NewRoutingDispatcher(senders, nil, recorder)
+}
+
+// NewRoutingDispatcher creates a Dispatcher that forwards a report to senders[i] only if
+// matchers[i] matches the report's labels. A nil matcher matches every report. If matchers is nil,
+// every report is forwarded to every sender.
+func NewRoutingDispatcher(senders []pipeline.Sender, matchers []*LabelMatcher, recorder stats.Recorder) *Dispatcher {
+	if matchers != nil && len(matchers) != len(senders) {
+		panic("NewRoutingDispatcher: len(matchers) != len(senders)")
+	}
 	for _, s := range senders {
 		s.Use()
 	}
-	return &Dispatcher{senders: senders, recorder: recorder}
+	return &Dispatcher{senders: senders, matchers: matchers, recorder: recorder}
 }
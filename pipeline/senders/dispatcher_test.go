@@ -21,6 +21,7 @@ import (
 	"testing"
 	"time"
 
+	"github.com/GoogleCloudPlatform/ubbagent/config"
 	"github.com/GoogleCloudPlatform/ubbagent/metrics"
 	"github.com/GoogleCloudPlatform/ubbagent/pipeline"
 	"github.com/GoogleCloudPlatform/ubbagent/stats"
@@ -149,4 +150,43 @@ func TestDispatcher(t *testing.T) {
 			t.Fatalf("Recorded stats entries: got=%+v, want=%+v", got, want)
 		}
 	})
+
+	t.Run("routing dispatcher only sends to matching senders", func(t *testing.T) {
+		ms1 := testlib.NewMockSender("sender1")
+		ms2 := testlib.NewMockSender("sender2")
+		msr := testlib.NewMockStatsRecorder()
+		gold := "gold"
+		rule, err := NewLabelRule([]config.LabelPredicate{{Key: "tier", Equals: &gold}})
+		if err != nil {
+			t.Fatalf("unexpected error: %v", err)
+		}
+		ds := NewRoutingDispatcher([]pipeline.Sender{ms1, ms2}, []*LabelMatcher{nil, NewLabelMatcher(rule)}, msr)
+
+		r1 := report
+		r1.Id = "r1"
+		r1.Labels = map[string]string{"tier": "silver"}
+		r2 := report
+		r2.Id = "r2"
+		r2.Labels = map[string]string{"tier": "gold"}
+		if err := ds.Send(r1); err != nil {
+			t.Fatalf("Unexpected send error: %v", err)
+		}
+		if err := ds.Send(r2); err != nil {
+			t.Fatalf("Unexpected send error: %v", err)
+		}
+
+		if want, got := int32(2), ms1.Calls(); want != got {
+			t.Fatalf("ms1.Calls(): want=%v, got=%v", want, got)
+		}
+		if want, got := int32(1), ms2.Calls(); want != got {
+			t.Fatalf("ms2.Calls(): want=%v, got=%v", want, got)
+		}
+		expected := map[string][]string{
+			"r1": {"sender1"},
+			"r2": {"sender1", "sender2"},
+		}
+		if want, got := expected, msr.Registered(); !reflect.DeepEqual(want, got) {
+			t.Fatalf("Recorded stats entries: got=%+v, want=%+v", got, want)
+		}
+	})
 }
@@ -0,0 +1,141 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package senders
+
+import (
+	"regexp"
+	"sort"
+	"strings"
+
+	"github.com/GoogleCloudPlatform/ubbagent/config"
+)
+
+// LabelRule is a compiled config.Route label filter. It matches a label set that satisfies all of
+// its predicates.
+type LabelRule struct {
+	tests []labelTest
+}
+
+// LabelMatcher matches a label set that satisfies any of its rules. A nil LabelMatcher matches
+// every label set.
+type LabelMatcher struct {
+	rules []*LabelRule
+}
+
+// labelTest is a single compiled predicate. Exactly one of its matching fields is set.
+type labelTest struct {
+	key    string
+	equals *string
+	in     map[string]struct{}
+	prefix *string
+	regex  *regexp.Regexp
+}
+
+// Cost ranks of predicate kinds. Cheaper tests run first so that a failing report is usually
+// rejected before any regex is evaluated.
+const (
+	costEquals = iota
+	costIn
+	costPrefix
+	costRegex
+)
+
+// NewLabelRule compiles a list of label predicates. Predicates are assumed to have passed
+// config validation, but regex compilation errors are still returned.
+func NewLabelRule(predicates []config.LabelPredicate) (*LabelRule, error) {
+	r := &LabelRule{tests: make([]labelTest, 0, len(predicates))}
+	for _, p := range predicates {
+		t := labelTest{key: p.Key}
+		switch {
+		case p.Equals != nil:
+			t.equals = p.Equals
+		case p.In != nil:
+			t.in = make(map[string]struct{}, len(p.In))
+			for _, v := range p.In {
+				t.in[v] = struct{}{}
+			}
+		case p.Prefix != nil:
+			t.prefix = p.Prefix
+		case p.Regex != nil:
+			re, err := regexp.Compile(*p.Regex)
+			if err != nil {
+				return nil, err
+			}
+			t.regex = re
+		}
+		r.tests = append(r.tests, t)
+	}
+	sort.SliceStable(r.tests, func(i, j int) bool { return r.tests[i].cost() < r.tests[j].cost() })
+	return r, nil
+}
+
+// Matches returns whether labels satisfies every predicate of the rule.
+func (r *LabelRule) Matches(labels map[string]string) bool {
+	for i := range r.tests {
+		if !r.tests[i].matches(labels) {
+			return false
+		}
+	}
+	return true
+}
+
+// NewLabelMatcher returns a LabelMatcher that matches any of the given rules.
+func NewLabelMatcher(rules ...*LabelRule) *LabelMatcher {
+	return &LabelMatcher{rules: rules}
+}
+
+// Matches returns whether labels satisfies any of the matcher's rules.
+func (m *LabelMatcher) Matches(labels map[string]string) bool {
+	if m == nil {
+		return true
+	}
+	for _, r := range m.rules {
+		if r.Matches(labels) {
+			return true
+		}
+	}
+	return false
+}
+
+func (t *labelTest) cost() int {
+	switch {
+	case t.equals != nil:
+		return costEquals
+	case t.in != nil:
+		return costIn
+	case t.prefix != nil:
+		return costPrefix
+	}
+	return costRegex
+}
+
+func (t *labelTest) matches(labels map[string]string) bool {
+	v, ok := labels[t.key]
+	if !ok {
+		return false
+	}
+	switch {
+	case t.equals != nil:
+		return v == *t.equals
+	case t.in != nil:
+		_, ok := t.in[v]
+		return ok
+	case t.prefix != nil:
+		return strings.HasPrefix(v, *t.prefix)
+	case t.regex != nil:
+		return t.regex.MatchString(v)
+	}
+	return false
+}
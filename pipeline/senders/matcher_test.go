@@ -0,0 +1,79 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package senders
+
+import (
+	"testing"
+
+	"github.com/GoogleCloudPlatform/ubbagent/config"
+)
+
+func TestLabelMatcher(t *testing.T) {
+	gold := "gold"
+	us := "us-"
+	zone := "^[a-c]$"
+	rule, err := NewLabelRule([]config.LabelPredicate{
+		{Key: "zone", Regex: &zone},
+		{Key: "region", Prefix: &us},
+		{Key: "tier", Equals: &gold},
+		{Key: "os", In: []string{"linux", "windows"}},
+	})
+	if err != nil {
+		t.Fatalf("unexpected error: %v", err)
+	}
+
+	// Predicates are reordered cheapest first.
+	for i, want := range []int{costEquals, costIn, costPrefix, costRegex} {
+		if got := rule.tests[i].cost(); want != got {
+			t.Fatalf("rule.tests[%v].cost(): want=%v, got=%v", i, want, got)
+		}
+	}
+
+	tests := []struct {
+		name   string
+		labels map[string]string
+		want   bool
+	}{
+		{"all match", map[string]string{"tier": "gold", "os": "linux", "region": "us-east", "zone": "b"}, true},
+		{"equals fails", map[string]string{"tier": "silver", "os": "linux", "region": "us-east", "zone": "b"}, false},
+		{"in fails", map[string]string{"tier": "gold", "os": "plan9", "region": "us-east", "zone": "b"}, false},
+		{"prefix fails", map[string]string{"tier": "gold", "os": "linux", "region": "eu-west", "zone": "b"}, false},
+		{"regex fails", map[string]string{"tier": "gold", "os": "linux", "region": "us-east", "zone": "d"}, false},
+		{"missing label", map[string]string{"tier": "gold", "os": "linux", "region": "us-east"}, false},
+	}
+	for _, tc := range tests {
+		if got := rule.Matches(tc.labels); tc.want != got {
+			t.Fatalf("%v: rule.Matches: want=%v, got=%v", tc.name, tc.want, got)
+		}
+	}
+
+	silver := "silver"
+	other, err := NewLabelRule([]config.LabelPredicate{{Key: "tier", Equals: &silver}})
+	if err != nil {
+		t.Fatalf("unexpected error: %v", err)
+	}
+	m := NewLabelMatcher(rule, other)
+	if !m.Matches(map[string]string{"tier": "silver"}) {
+		t.Fatal("m.Matches(silver): want=true, got=false")
+	}
+	if m.Matches(map[string]string{"tier": "bronze"}) {
+		t.Fatal("m.Matches(bronze): want=false, got=true")
+	}
+
+	var none *LabelMatcher
+	if !none.Matches(nil) {
+		t.Fatal("nil matcher: want=true, got=false")
+	}
+}
@@ -15,8 +15,11 @@
 package senders
 
 import (
+	"context"
+	"encoding/json"
 	"errors"
 	"flag"
+	"math"
 	"math/rand"
 	"path"
 	"sync"
@@ -37,6 +40,19 @@ const (
 var minRetryDelay = flag.Duration("min_retry_delay", 2*time.Second, "minimum exponential backoff delay")
 var maxRetryDelay = flag.Duration("max_retry_delay", 60*time.Second, "maximum exponential backoff delay")
 var maxQueueTime = flag.Duration("max_queue_time", 3*time.Hour, "maximum amount of time to keep an entry in the retry queue")
+var pressureQueueDepth = flag.Int("pressure_queue_depth", 1000, "retry queue depth at which a sender reports full pressure to adaptive aggregators")
+var packWindow = flag.Duration("pack_window", 0, "if positive, reports queued within this long of each other are sent together when their endpoint supports it, and each report waits up to this long to be sent")
+
+// The most queued entries sent as one pack.
+const maxPackSize = 100
+
+// The weight of each send attempt in a RetryingSender's error rate, a moving average.
+const errorRateWeight = 0.2
+
+// The time over which a RetryingSender's error rate halves when no attempts are made. A sender
+// whose pressure has stretched an aggregation period attempts few sends, so the rate can't rely
+// on later successes to fall.
+const errorRateHalfLife = 5 * time.Second
 
 // RetryingSender is a Sender handles sending reports to remote endpoints.
 // It buffers reports and retries in the event of a send failure, using exponential backoff between
@@ -44,7 +60,9 @@ var maxQueueTime = flag.Duration("max_queue_time", 3*time.Hour, "maximum amount
 // flags.
 type RetryingSender struct {
 	endpoint    pipeline.Endpoint
+	persistence persistence.Persistence
 	queue       persistence.Queue
+	deadLetters persistence.Log
 	recorder    stats.Recorder
 	clock       clock.Clock
 	lastAttempt time.Time
@@ -53,9 +71,28 @@ type RetryingSender struct {
 	maxDelay    time.Duration
 	add         chan addMsg
 	closed      bool
+	closing     bool
 	closeMutex  sync.RWMutex
 	wait        sync.WaitGroup
 	tracker     pipeline.UsageTracker
+
+	// The context of sends, cancelled by Interrupt.
+	ctx    context.Context
+	cancel context.CancelFunc
+
+	packWindow time.Duration
+	// The time the pack at the head of the queue stops accepting entries, if it's waiting for them.
+	packDeadline time.Time
+
+	// The queue depth at which Pressure is 1.
+	pressureQueueDepth int
+	// Health, reported by Pressure. Protected by healthMutex.
+	healthMutex sync.Mutex
+	queueDepth  int
+	errorRate   float64
+	retryDelay  time.Duration
+	// The time errorRate was last updated, from which it decays.
+	errorRateTime time.Time
 }
 
 type addMsg struct {
@@ -70,18 +107,26 @@ type queueEntry struct {
 
 // NewRetryingSender creates a new RetryingSender for endpoint, storing state in persistence.
 func NewRetryingSender(endpoint pipeline.Endpoint, persistence persistence.Persistence, recorder stats.Recorder) *RetryingSender {
-	return newRetryingSender(endpoint, persistence, recorder, clock.NewClock(), *minRetryDelay, *maxRetryDelay)
+	return newRetryingSender(endpoint, persistence, recorder, clock.NewClock(), *minRetryDelay, *maxRetryDelay, *packWindow)
 }
 
-func newRetryingSender(endpoint pipeline.Endpoint, persistence persistence.Persistence, recorder stats.Recorder, clock clock.Clock, minDelay, maxDelay time.Duration) *RetryingSender {
+func newRetryingSender(endpoint pipeline.Endpoint, persistence persistence.Persistence, recorder stats.Recorder, clock clock.Clock, minDelay, maxDelay, packWindow time.Duration) *RetryingSender {
 	rs := &RetryingSender{
-		endpoint: endpoint,
-		queue:    persistence.Queue(persistenceName(endpoint.Name())),
-		recorder: recorder,
-		clock:    clock,
-		minDelay: minDelay,
-		maxDelay: maxDelay,
-		add:      make(chan addMsg, 1),
+		endpoint:    endpoint,
+		persistence: persistence,
+		queue:       persistence.Queue(persistenceName(endpoint.Name())),
+		deadLetters: persistence.Log(deadLetterName(endpoint.Name())),
+		recorder:    recorder,
+		clock:       clock,
+		minDelay:    minDelay,
+		maxDelay:    maxDelay,
+		packWindow:  packWindow,
+		add:         make(chan addMsg, 1),
+	}
+	rs.ctx, rs.cancel = context.WithCancel(context.Background())
+	rs.pressureQueueDepth = *pressureQueueDepth
+	if queued, err := rs.queue.PeekN(math.MaxInt32); err == nil {
+		rs.queueDepth = len(queued)
 	}
 	endpoint.Use()
 	rs.wait.Add(1)
@@ -102,18 +147,27 @@ func (rs *RetryingSender) Send(report metrics.StampedMetricReport) error {
 		return err
 	}
 
+	if err = rs.enqueue(queueEntry{epr, rs.clock.Now()}); err != nil {
+		// Record this immediate failure.
+		rs.recorder.SendFailed(report.Id, rs.endpoint.Name())
+	}
+	return err
+}
+
+// enqueue adds entry to the retry queue and triggers a send attempt. The caller must hold a read
+// lock on closeMutex.
+func (rs *RetryingSender) enqueue(entry queueEntry) error {
 	msg := addMsg{
-		entry:  queueEntry{epr, rs.clock.Now()},
+		entry:  entry,
 		result: make(chan error),
 	}
 	rs.add <- msg
-	err = <-msg.result
+	return <-msg.result
+}
 
-	if err != nil {
-		// Record this immediate failure.
-		rs.recorder.SendFailed(report.Id, rs.endpoint.Name())
-	}
-	return err
+// Endpoint returns the endpoint that this RetryingSender sends to.
+func (rs *RetryingSender) Endpoint() pipeline.Endpoint {
+	return rs.endpoint
 }
 
 func (rs *RetryingSender) Endpoints() []string {
@@ -140,16 +194,28 @@ func (rs *RetryingSender) Release() error {
 		}
 		rs.closeMutex.Unlock()
 		rs.wait.Wait()
+		rs.cancel()
 		return rs.endpoint.Release()
 	})
 }
 
+// Interrupt cancels the RetryingSender's send in progress, if any, and stops it from starting
+// others, so that a Release waiting on a slow or unresponsive endpoint finishes promptly. Reports
+// whose sends are cancelled, and those not yet sent, remain in the persisted queue; they're sent by
+// the next RetryingSender created on the same persistence. Reports are still accepted and queued.
+func (rs *RetryingSender) Interrupt() {
+	rs.cancel()
+}
+
 func (rs *RetryingSender) run(start time.Time) {
 	// Start with an initial call to maybeSend() to start sending any persisted state.
 	rs.maybeSend(start)
 	for {
 		var timer clock.Timer
-		if rs.delay == 0 {
+		if rs.delay == 0 && !rs.packDeadline.IsZero() {
+			// Not retrying, but a pack is waiting for entries.
+			timer = rs.clock.NewTimerAt(rs.packDeadline)
+		} else if rs.delay == 0 {
 			// A delay of 0 means we're not retrying. Disable the retry timer; We'll wakeup when a new
 			// report is sent.
 			timer = clock.NewStoppedTimer()
@@ -164,16 +230,28 @@ func (rs *RetryingSender) run(start time.Time) {
 		case msg, ok := <-rs.add:
 			if ok {
 				err := rs.queue.Enqueue(msg.entry)
+				if err == nil {
+					// The sender becomes responsible for the report once it's accepted, so the queued entry
+					// must be durable first.
+					err = persistence.Commit(rs.persistence)
+				}
 				if err != nil {
 					msg.result <- err
 					break
 				}
 
 				// Successfully queued the message
+				rs.healthMutex.Lock()
+				rs.queueDepth++
+				rs.healthMutex.Unlock()
 				msg.result <- nil
 				rs.maybeSend(msg.entry.SendTime)
 			} else {
-				// Channel was closed.
+				// Channel was closed. A pack waiting for entries won't get more, so send it now.
+				if !rs.packDeadline.IsZero() {
+					rs.closing = true
+					rs.maybeSend(rs.clock.Now())
+				}
 				rs.wait.Done()
 				return
 			}
@@ -190,19 +268,46 @@ func (rs *RetryingSender) maybeSend(now time.Time) {
 		// Not time yet.
 		return
 	}
+	if rs.ctx.Err() != nil {
+		// Interrupted.
+		return
+	}
+	defer rs.updateRetryDelay()
+	rs.packDeadline = time.Time{}
 	for {
-		entry := &queueEntry{}
-		if loaderr := rs.queue.Peek(entry); loaderr == persistence.ErrNotFound {
+		pack, deadline, loaderr := rs.nextPack()
+		if loaderr == persistence.ErrNotFound {
 			break
 		} else if loaderr != nil {
-			// We failed to load from the persistent queue. This isn't recoverable.
-			panic("RetryingSender.maybeSend: loading from retry queue: " + loaderr.Error())
+			// The entry at the head of the queue can't be loaded. Drop it, keeping it as a dead letter,
+			// so that the rest of the queue can be sent.
+			glog.Errorf("RetryingSender.maybeSend: dropping unreadable retry queue entry: %+v", loaderr)
+			rs.deadLetterCorrupt(now, loaderr)
+			if poperr := rs.dequeue(1); poperr != nil {
+				rs.backoff(now, poperr)
+				break
+			}
+			continue
+		}
+		if now.Before(deadline) && !rs.closing {
+			// The pack could still grow; wait for its window to pass.
+			rs.packDeadline = deadline
+			break
+		}
+		senderr := rs.sendPack(pack)
+		if rs.ctx.Err() != nil {
+			// Interrupted. Whatever the outcome, the pack stays queued, to be sent again by the next
+			// RetryingSender; endpoints deduplicate retried reports.
+			glog.Warningf("RetryingSender.maybeSend: interrupted; %v reports remain queued", len(pack))
+			break
 		}
-		if senderr := rs.endpoint.Send(entry.Report); senderr != nil {
+		rs.recordAttempt(senderr != nil)
+		if senderr != nil {
 			// We've encountered a send error. If the error is considered transient and the entry hasn't
 			// reached its maximum queue time, we'll leave it in the queue and retry. Otherwise it's
-			// removed from the queue, logged, and recorded as a failure.
-			expired := rs.clock.Now().Sub(entry.SendTime) > *maxQueueTime
+			// removed from the queue, logged, recorded as a failure, and kept as a dead letter. A pack's
+			// entries are handled together, by the age of the oldest.
+			expired := rs.clock.Now().Sub(pack[0].SendTime) > *maxQueueTime
 			if !expired && rs.endpoint.IsTransient(senderr) {
 				// Set next attempt
 				rs.lastAttempt = now
@@ -211,21 +316,30 @@ func (rs *RetryingSender) maybeSend(now time.Time) {
 				break
 			} else if expired {
 				glog.Errorf("RetryingSender.maybeSend [%[1]T - retry expired]: %[1]s", senderr)
-				rs.recorder.SendFailed(entry.Report.Id, rs.endpoint.Name())
+				for _, entry := range pack {
+					rs.deadLetter(entry, now, DeadLetterExpired, senderr)
+					rs.recorder.SendFailed(entry.Report.Id, rs.endpoint.Name())
+				}
 			} else {
 				glog.Errorf("RetryingSender.maybeSend [%[1]T - will NOT retry]: %[1]s", senderr)
-				rs.recorder.SendFailed(entry.Report.Id, rs.endpoint.Name())
+				for _, entry := range pack {
+					rs.deadLetter(entry, now, DeadLetterRejected, senderr)
+					rs.recorder.SendFailed(entry.Report.Id, rs.endpoint.Name())
+				}
 			}
 		} else {
 			// Send was successful.
-			rs.recorder.SendSucceeded(entry.Report.Id, rs.endpoint.Name())
+			for _, entry := range pack {
+				rs.recorder.SendSucceeded(entry.Report.Id, rs.endpoint.Name())
+			}
 		}
 
-		// At this point we've either successfully sent the report or encountered a non-transient error.
-		// In either scenario, the report is removed from the queue and the retry delay is reset.
-		if poperr := rs.queue.Dequeue(nil); poperr != nil {
-			// We failed to pop the sent entry off the queue. This isn't recoverable.
-			panic("RetryingSender.maybeSend: dequeuing from retry queue: " + poperr.Error())
+		// At this point we've either successfully sent the pack or encountered a non-transient error.
+		// In either scenario, its entries are removed from the queue and the retry delay is reset.
+		if poperr := rs.dequeue(len(pack)); poperr != nil {
+			// We failed to pop the sent entries off the queue. They will be sent again after a delay.
+			rs.backoff(now, poperr)
+			break
 		}
 
 		rs.lastAttempt = now
@@ -233,6 +347,130 @@ func (rs *RetryingSender) maybeSend(now time.Time) {
 	}
 }
 
+// nextPack loads the entry at the head of the queue and, if the endpoint packs reports, the entries
+// after it that can be sent with it: those enqueued within packWindow of it that the endpoint
+// accepts, up to the first that isn't. If the queue ends before such an entry, later entries could
+// still join the pack, and deadline is the end of its window; the pack isn't sent before then.
+// A pack's contents are therefore determined by the queue alone, and don't change across retries
+// or restarts.
+func (rs *RetryingSender) nextPack() (pack []*queueEntry, deadline time.Time, err error) {
+	packer, ok := rs.endpoint.(pipeline.PackingEndpoint)
+	if !ok || rs.packWindow <= 0 {
+		entry := &queueEntry{}
+		if err := rs.queue.Peek(entry); err != nil {
+			return nil, time.Time{}, err
+		}
+		return []*queueEntry{entry}, time.Time{}, nil
+	}
+
+	texts, err := rs.queue.PeekN(maxPackSize)
+	if err != nil {
+		return nil, time.Time{}, err
+	}
+	head := &queueEntry{}
+	if err := json.Unmarshal(texts[0], head); err != nil {
+		return nil, time.Time{}, err
+	}
+	pack = []*queueEntry{head}
+	reports := []pipeline.EndpointReport{head.Report}
+	end := head.SendTime.Add(rs.packWindow)
+	for _, text := range texts[1:] {
+		entry := &queueEntry{}
+		if json.Unmarshal(text, entry) != nil || !entry.SendTime.Before(end) || !packer.CanPack(reports, entry.Report) {
+			return pack, time.Time{}, nil
+		}
+		pack = append(pack, entry)
+		reports = append(reports, entry.Report)
+	}
+	if len(texts) == maxPackSize {
+		return pack, time.Time{}, nil
+	}
+	return pack, end, nil
+}
+
+// sendPack sends the reports of pack, as one unit if there are several.
+func (rs *RetryingSender) sendPack(pack []*queueEntry) error {
+	if len(pack) == 1 {
+		return rs.endpoint.Send(rs.ctx, pack[0].Report)
+	}
+	reports := make([]pipeline.EndpointReport, len(pack))
+	for i, entry := range pack {
+		reports[i] = entry.Report
+	}
+	return rs.endpoint.(pipeline.PackingEndpoint).SendPack(rs.ctx, reports)
+}
+
+// dequeue removes n entries from the front of the queue. They're removed in one operation, so a
+// failure leaves a pack whole, to be resent under the same operation ID.
+func (rs *RetryingSender) dequeue(n int) error {
+	removed, err := rs.queue.DequeueN(n)
+	if err != nil {
+		return err
+	}
+	rs.healthMutex.Lock()
+	rs.queueDepth -= removed
+	rs.healthMutex.Unlock()
+	return nil
+}
+
+// recordAttempt updates the error rate with the outcome of a send attempt.
+func (rs *RetryingSender) recordAttempt(failed bool) {
+	var outcome float64
+	if failed {
+		outcome = 1
+	}
+	now := rs.clock.Now()
+	rs.healthMutex.Lock()
+	rate := rs.decayedErrorRate(now)
+	rs.errorRate = rate + errorRateWeight*(outcome-rate)
+	rs.errorRateTime = now
+	rs.healthMutex.Unlock()
+}
+
+// decayedErrorRate returns the error rate at now, halved for each errorRateHalfLife since the last
+// attempt. Must be called with healthMutex held.
+func (rs *RetryingSender) decayedErrorRate(now time.Time) float64 {
+	elapsed := now.Sub(rs.errorRateTime)
+	if rs.errorRate == 0 || elapsed <= 0 {
+		return rs.errorRate
+	}
+	return rs.errorRate * math.Exp2(-float64(elapsed)/float64(errorRateHalfLife))
+}
+
+// updateRetryDelay publishes the current retry delay to Pressure.
+func (rs *RetryingSender) updateRetryDelay() {
+	rs.healthMutex.Lock()
+	rs.retryDelay = rs.delay
+	rs.healthMutex.Unlock()
+}
+
+// Pressure returns the greatest of the RetryingSender's recent error rate, its retry delay as a
+// fraction of the maximum delay, and its queue depth as a fraction of --pressure_queue_depth, at
+// most 1. A sender that's sending promptly has no pressure; one that has backed off to its maximum
+// delay, or has a full queue, has a pressure of 1. The error rate decays over time, so pressure
+// falls once sends recover even if few are attempted.
+// See pipeline.HealthReporter.
+func (rs *RetryingSender) Pressure() float64 {
+	now := rs.clock.Now()
+	rs.healthMutex.Lock()
+	defer rs.healthMutex.Unlock()
+	pressure := rs.decayedErrorRate(now)
+	if rs.maxDelay > 0 {
+		pressure = math.Max(pressure, float64(rs.retryDelay)/float64(rs.maxDelay))
+	}
+	if rs.pressureQueueDepth > 0 {
+		pressure = math.Max(pressure, float64(rs.queueDepth)/float64(rs.pressureQueueDepth))
+	}
+	return math.Min(pressure, 1)
+}
+
+// backoff delays the next send attempt after a failure to update the retry queue.
+func (rs *RetryingSender) backoff(now time.Time, err error) {
+	glog.Errorf("RetryingSender.maybeSend: updating retry queue: %+v", err)
+	rs.lastAttempt = now
+	rs.delay = bounded(rs.delay*2, rs.minDelay, rs.maxDelay)
+}
+
 func bounded(val, min, max time.Duration) time.Duration {
 	if val < min {
 		return min
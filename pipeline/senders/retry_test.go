@@ -15,13 +15,17 @@
 package senders
 
 import (
+	"context"
+	"encoding/json"
 	"errors"
 	"reflect"
+	"sync"
 	"testing"
 	"time"
 
 	"github.com/GoogleCloudPlatform/ubbagent/metrics"
 	"github.com/GoogleCloudPlatform/ubbagent/persistence"
+	"github.com/GoogleCloudPlatform/ubbagent/pipeline"
 	"github.com/GoogleCloudPlatform/ubbagent/testlib"
 )
 
@@ -63,7 +67,7 @@ func TestRetryingSender(t *testing.T) {
 		persist := persistence.NewMemoryPersistence()
 		mc := testlib.NewMockClock()
 		ep := testlib.NewMockEndpoint("mockep")
-		rs := newRetryingSender(ep, persist, testlib.NewMockStatsRecorder(), mc, testMinDelay, testMaxDelay)
+		rs := newRetryingSender(ep, persist, testlib.NewMockStatsRecorder(), mc, testMinDelay, testMaxDelay, 0)
 		buildErr := errors.New("build failure")
 		ep.SetBuildErr(buildErr)
 		err := rs.Send(report1)
@@ -76,7 +80,7 @@ func TestRetryingSender(t *testing.T) {
 		persist := persistence.NewMemoryPersistence()
 		mc := testlib.NewMockClock()
 		ep := testlib.NewMockEndpoint("mockep")
-		rs := newRetryingSender(ep, persist, testlib.NewMockStatsRecorder(), mc, testMinDelay, testMaxDelay)
+		rs := newRetryingSender(ep, persist, testlib.NewMockStatsRecorder(), mc, testMinDelay, testMaxDelay, 0)
 		mc.SetNow(time.Unix(2000, 0))
 		ep.DoAndWait(t, 1, func() {
 			if err := rs.Send(report1); err != nil {
@@ -94,7 +98,7 @@ func TestRetryingSender(t *testing.T) {
 		mc := testlib.NewMockClock()
 		ep := testlib.NewMockEndpoint("mockep")
 		ep.SetSendErr(errors.New("send failure"))
-		rs := newRetryingSender(ep, persist, testlib.NewMockStatsRecorder(), mc, testMinDelay, testMaxDelay)
+		rs := newRetryingSender(ep, persist, testlib.NewMockStatsRecorder(), mc, testMinDelay, testMaxDelay, 0)
 		now := time.Unix(3000, 0)
 		mc.SetNow(now)
 		if err := rs.Send(report1); err != nil {
@@ -121,7 +125,7 @@ func TestRetryingSender(t *testing.T) {
 		persist := persistence.NewMemoryPersistence()
 		mc := testlib.NewMockClock()
 		ep := testlib.NewMockEndpoint("mockep")
-		rs := newRetryingSender(ep, persist, testlib.NewMockStatsRecorder(), mc, testMinDelay, testMaxDelay)
+		rs := newRetryingSender(ep, persist, testlib.NewMockStatsRecorder(), mc, testMinDelay, testMaxDelay, 0)
 		ep.SetSendErr(errors.New("send failure"))
 		mc.SetNow(time.Unix(4000, 0))
 
@@ -158,7 +162,7 @@ func TestRetryingSender(t *testing.T) {
 		persist := persistence.NewMemoryPersistence()
 		mc := testlib.NewMockClock()
 		ep := testlib.NewMockEndpoint("mockep")
-		rs := newRetryingSender(ep, persist, testlib.NewMockStatsRecorder(), mc, testMinDelay, testMaxDelay)
+		rs := newRetryingSender(ep, persist, testlib.NewMockStatsRecorder(), mc, testMinDelay, testMaxDelay, 0)
 		ep.SetSendErr(errors.New("non-fatal"))
 		mc.SetNow(time.Unix(4000, 0))
 
@@ -210,7 +214,7 @@ func TestRetryingSender(t *testing.T) {
 		mc := testlib.NewMockClock()
 		ep := testlib.NewMockEndpoint("mockep")
 		sr := testlib.NewMockStatsRecorder()
-		rs := newRetryingSender(ep, persist, sr, mc, testMinDelay, testMaxDelay)
+		rs := newRetryingSender(ep, persist, sr, mc, testMinDelay, testMaxDelay, 0)
 		ep.SetSendErr(errors.New("send failure"))
 		mc.SetNow(time.Unix(4000, 0))
 
@@ -258,7 +262,7 @@ func TestRetryingSender(t *testing.T) {
 		persist := persistence.NewMemoryPersistence()
 		mc := testlib.NewMockClock()
 		ep := testlib.NewMockEndpoint("mockep")
-		rs := newRetryingSender(ep, persist, testlib.NewMockStatsRecorder(), mc, testMinDelay, testMaxDelay)
+		rs := newRetryingSender(ep, persist, testlib.NewMockStatsRecorder(), mc, testMinDelay, testMaxDelay, 0)
 		ep.SetSendErr(errors.New("send failure"))
 		mc.SetNow(time.Unix(5000, 0))
 
@@ -274,7 +278,7 @@ func TestRetryingSender(t *testing.T) {
 		ep = testlib.NewMockEndpoint("mockep")
 		ep.DoAndWait(t, 1, func() {
 			mc.SetNow(time.Unix(5500, 0))
-			rs = newRetryingSender(ep, persist, testlib.NewMockStatsRecorder(), mc, testMinDelay, testMaxDelay)
+			rs = newRetryingSender(ep, persist, testlib.NewMockStatsRecorder(), mc, testMinDelay, testMaxDelay, 0)
 		})
 
 		// The sender should have cleared its queue. Our sent chan should be length 2.
@@ -288,7 +292,7 @@ func TestRetryingSender(t *testing.T) {
 		mc := testlib.NewMockClock()
 		ep := testlib.NewMockEndpoint("mockep")
 		sr := testlib.NewMockStatsRecorder()
-		rs := newRetryingSender(ep, persist, sr, mc, testMinDelay, testMaxDelay)
+		rs := newRetryingSender(ep, persist, sr, mc, testMinDelay, testMaxDelay, 0)
 		mc.SetNow(time.Unix(4000, 0))
 
 		if err := rs.Send(report1); err != nil {
@@ -332,10 +336,46 @@ func TestRetryingSender(t *testing.T) {
 		}
 	})
 
+	t.Run("unreadable entry is dropped as a dead letter", func(t *testing.T) {
+		persist := persistence.NewMemoryPersistence()
+		corrupt := json.RawMessage(`{"Report":{"Id":"bad","name":5}}`)
+		if err := persist.Queue(persistenceName("mockep")).Enqueue(corrupt); err != nil {
+			t.Fatalf("Unexpected error enqueuing: %+v", err)
+		}
+		mc := testlib.NewMockClock()
+		ep := testlib.NewMockEndpoint("mockep")
+		sr := testlib.NewMockStatsRecorder()
+		rs := newRetryingSender(ep, persist, sr, mc, testMinDelay, testMaxDelay, 0)
+		defer rs.Release()
+		ep.DoAndWait(t, 1, func() {
+			if err := rs.Send(report1); err != nil {
+				t.Fatalf("Unexpected send error: %+v", err)
+			}
+		})
+		if want, got := 1, len(ep.Reports()); want != got {
+			t.Fatalf("len(ep.Reports()): want=%v, got=%v", want, got)
+		}
+		if want, got := []testlib.RecordedEntry{{Id: "bad", Handler: "mockep"}}, sr.Failed(); !reflect.DeepEqual(want, got) {
+			t.Fatalf("sr.failed: want=%+v, got=%+v", want, got)
+		}
+		var letters []DeadLetter
+		rs.DeadLetters(DeadLetterFilter{}, func(d DeadLetter) error {
+			letters = append(letters, d)
+			return nil
+		})
+		if len(letters) != 1 || letters[0].ErrorClass != DeadLetterCorrupt || letters[0].Report.Id != "bad" || string(letters[0].Raw) != string(corrupt) {
+			t.Fatalf("dead letters: got %+v", letters)
+		}
+		// There's no report to replay.
+		if n, err := rs.Replay(DeadLetterFilter{}, 0); n != 0 || err != nil {
+			t.Fatalf("Replay: got %v, %+v; want 0", n, err)
+		}
+	})
+
 	t.Run("multiple usages", func(t *testing.T) {
 		ep := testlib.NewMockEndpoint("mockep")
 		sr := testlib.NewMockStatsRecorder()
-		rs := newRetryingSender(ep, persistence.NewMemoryPersistence(), sr, testlib.NewMockClock(), testMinDelay, testMaxDelay)
+		rs := newRetryingSender(ep, persistence.NewMemoryPersistence(), sr, testlib.NewMockClock(), testMinDelay, testMaxDelay, 0)
 
 		// Test multiple usages of the RetryingSender.
 		rs.Use()
@@ -354,6 +394,214 @@ func TestRetryingSender(t *testing.T) {
 
 }
 
+func TestRetryingSenderPressure(t *testing.T) {
+	report := metrics.StampedMetricReport{
+		Id: "report1",
+		MetricReport: metrics.MetricReport{
+			Name:      "int-metric",
+			Value:     metrics.MetricValue{Int64Value: 10},
+			StartTime: time.Unix(0, 0),
+			EndTime:   time.Unix(1, 0),
+		},
+	}
+	mc := testlib.NewMockClock()
+	ep := testlib.NewMockEndpoint("mockep")
+	ep.SetSendErr(errors.New("send failure"))
+	rs := newRetryingSender(ep, persistence.NewMemoryPersistence(), testlib.NewMockStatsRecorder(), mc, testMinDelay, testMaxDelay, 0)
+	defer rs.Release()
+	if got := rs.Pressure(); got != 0 {
+		t.Fatalf("Pressure of an idle sender: want=0, got=%v", got)
+	}
+
+	// waitForPressure waits for the sender's pressure to satisfy cond.
+	waitForPressure := func(cond func(float64) bool) float64 {
+		for i := 0; i < 5000; i++ {
+			if p := rs.Pressure(); cond(p) {
+				return p
+			}
+			time.Sleep(time.Millisecond)
+		}
+		t.Fatalf("Pressure: unexpected value %v", rs.Pressure())
+		return 0
+	}
+
+	// Failures raise the error rate, and the retry delay grows.
+	now := time.Unix(9000, 0)
+	mc.SetNow(now)
+	if err := rs.Send(report); err != nil {
+		t.Fatalf("Unexpected send error: %+v", err)
+	}
+	failing := waitForPressure(func(p float64) bool { return p > 0 })
+	for _, delay := range []time.Duration{2, 4, 8} {
+		now = waitForNewTimer(mc, now.Add(delay*time.Second), now.Add(delay*time.Second).Add(time.Second), t)
+		mc.SetNow(now)
+	}
+	now = waitForNewTimer(mc, now.Add(16*time.Second), now.Add(17*time.Second), t)
+	failing = waitForPressure(func(p float64) bool { return p > failing })
+
+	// Success resets the delay, empties the queue, and lowers the error rate.
+	ep.DoAndWait(t, 5, func() {
+		ep.SetSendErr(nil)
+		mc.SetNow(now)
+	})
+	recovered := waitForPressure(func(p float64) bool { return p < failing })
+	if recovered >= 1 {
+		t.Fatalf("Pressure after recovery: got %v", recovered)
+	}
+
+	// With no further sends, the error rate decays well within a typical aggregation period.
+	mc.SetNow(now.Add(30 * time.Second))
+	if got := rs.Pressure(); got > 0.05 {
+		t.Fatalf("Pressure 30s after recovery: got %v", got)
+	}
+}
+
+func TestRetryingSenderPacking(t *testing.T) {
+	report := func(id, name string) metrics.StampedMetricReport {
+		return metrics.StampedMetricReport{
+			Id: id,
+			MetricReport: metrics.MetricReport{
+				Name:      name,
+				Value:     metrics.MetricValue{Int64Value: 10},
+				StartTime: time.Unix(0, 0),
+				EndTime:   time.Unix(1, 0),
+			},
+		}
+	}
+	const window = 10 * time.Second
+
+	t.Run("reports queued together are sent as packs", func(t *testing.T) {
+		mc := testlib.NewMockClock()
+		ep := newPackingEndpoint("mockep")
+		sr := testlib.NewMockStatsRecorder()
+		rs := newRetryingSender(ep, persistence.NewMemoryPersistence(), sr, mc, testMinDelay, testMaxDelay, window)
+		defer rs.Release()
+		now := time.Unix(6000, 0)
+		mc.SetNow(now)
+
+		// The third report is for the same metric as the first, so it starts a new pack.
+		for _, r := range []metrics.StampedMetricReport{report("a1", "a"), report("b1", "b"), report("a2", "a")} {
+			if err := rs.Send(r); err != nil {
+				t.Fatalf("Unexpected send error: %+v", err)
+			}
+		}
+		// The first pack can't grow, so it's sent at once. The second's window is still open, so it
+		// isn't sent until the window passes.
+		waitForNewTimer(mc, now.Add(window), now.Add(window).Add(time.Second), t)
+		if want, got := [][]string{{"a1", "b1"}}, ep.Packs(); !reflect.DeepEqual(want, got) {
+			t.Fatalf("packs: want=%+v, got=%+v", want, got)
+		}
+		sr.DoAndWait(t, 3, func() {
+			mc.SetNow(now.Add(window))
+		})
+
+		if want, got := [][]string{{"a1", "b1"}, {"a2"}}, ep.Packs(); !reflect.DeepEqual(want, got) {
+			t.Fatalf("packs: want=%+v, got=%+v", want, got)
+		}
+		want := []testlib.RecordedEntry{{Id: "a1", Handler: "mockep"}, {Id: "b1", Handler: "mockep"}, {Id: "a2", Handler: "mockep"}}
+		if got := sr.Succeeded(); !reflect.DeepEqual(want, got) {
+			t.Fatalf("sr.succeeded: want=%+v, got=%+v", want, got)
+		}
+	})
+
+	t.Run("a failed pack is retried whole and recorded for each report", func(t *testing.T) {
+		mc := testlib.NewMockClock()
+		ep := newPackingEndpoint("mockep")
+		ep.SetSendErr(errors.New("send failure"))
+		sr := testlib.NewMockStatsRecorder()
+		rs := newRetryingSender(ep, persistence.NewMemoryPersistence(), sr, mc, testMinDelay, testMaxDelay, window)
+		defer rs.Release()
+		now := time.Unix(7000, 0)
+		mc.SetNow(now)
+		for _, r := range []metrics.StampedMetricReport{report("a1", "a"), report("b1", "b")} {
+			if err := rs.Send(r); err != nil {
+				t.Fatalf("Unexpected send error: %+v", err)
+			}
+		}
+		ep.DoAndWait(t, 1, func() {
+			mc.SetNow(now.Add(window))
+		})
+
+		// A report queued after the window doesn't join the pack being retried.
+		if err := rs.Send(report("c1", "c")); err != nil {
+			t.Fatalf("Unexpected send error: %+v", err)
+		}
+		ep.SetSendErr(errors.New("FATAL"))
+		sr.DoAndWait(t, 3, func() {
+			mc.SetNow(now.Add(time.Minute))
+		})
+		if want, got := [][]string{{"a1", "b1"}, {"a1", "b1"}, {"c1"}}, ep.Packs(); !reflect.DeepEqual(want, got) {
+			t.Fatalf("packs: want=%+v, got=%+v", want, got)
+		}
+		want := []testlib.RecordedEntry{{Id: "a1", Handler: "mockep"}, {Id: "b1", Handler: "mockep"}, {Id: "c1", Handler: "mockep"}}
+		if got := sr.Failed(); !reflect.DeepEqual(want, got) {
+			t.Fatalf("sr.failed: want=%+v, got=%+v", want, got)
+		}
+	})
+
+	t.Run("a waiting pack is sent on release", func(t *testing.T) {
+		mc := testlib.NewMockClock()
+		ep := newPackingEndpoint("mockep")
+		rs := newRetryingSender(ep, persistence.NewMemoryPersistence(), testlib.NewMockStatsRecorder(), mc, testMinDelay, testMaxDelay, window)
+		mc.SetNow(time.Unix(8000, 0))
+		if err := rs.Send(report("a1", "a")); err != nil {
+			t.Fatalf("Unexpected send error: %+v", err)
+		}
+		rs.Release()
+		if want, got := 1, len(ep.Reports()); want != got {
+			t.Fatalf("len(ep.Reports()): want=%v, got=%v", want, got)
+		}
+	})
+}
+
+// packingEndpoint is a MockEndpoint that packs reports for different metrics with the same
+// interval, and records the IDs of the reports in each send.
+type packingEndpoint struct {
+	*testlib.MockEndpoint
+	mu    sync.Mutex
+	packs [][]string
+}
+
+func newPackingEndpoint(name string) *packingEndpoint {
+	return &packingEndpoint{MockEndpoint: testlib.NewMockEndpoint(name)}
+}
+
+func (ep *packingEndpoint) CanPack(pack []pipeline.EndpointReport, report pipeline.EndpointReport) bool {
+	for _, r := range pack {
+		if r.Name == report.Name || !r.StartTime.Equal(report.StartTime) || !r.EndTime.Equal(report.EndTime) {
+			return false
+		}
+	}
+	return true
+}
+
+func (ep *packingEndpoint) Send(ctx context.Context, report pipeline.EndpointReport) error {
+	return ep.SendPack(ctx, []pipeline.EndpointReport{report})
+}
+
+func (ep *packingEndpoint) SendPack(ctx context.Context, reports []pipeline.EndpointReport) error {
+	var ids []string
+	for _, r := range reports {
+		ids = append(ids, r.Id)
+	}
+	ep.mu.Lock()
+	ep.packs = append(ep.packs, ids)
+	ep.mu.Unlock()
+	var err error
+	for _, r := range reports {
+		if senderr := ep.MockEndpoint.Send(ctx, r); senderr != nil && err == nil {
+			err = senderr
+		}
+	}
+	return err
+}
+
+func (ep *packingEndpoint) Packs() [][]string {
+	ep.mu.Lock()
+	defer ep.mu.Unlock()
+	return ep.packs
+}
+
 // waitForNewTimer waits for up to ~5 seconds for a timer to be set on mc with a time between [lower,upper).
 func waitForNewTimer(mc testlib.MockClock, lower, upper time.Time, t *testing.T) (result time.Time) {
 	for i := 0; i < 5000; i++ {
@@ -367,3 +615,50 @@ func waitForNewTimer(mc testlib.MockClock, lower, upper time.Time, t *testing.T)
 	t.Fatalf("No timer set for expected time range [%v,%v) after delay", lower, upper)
 	return
 }
+
+func TestRetryingSenderInterrupt(t *testing.T) {
+	report := metrics.StampedMetricReport{
+		Id: "report1",
+		MetricReport: metrics.MetricReport{
+			Name:      "int-metric",
+			Value:     metrics.MetricValue{Int64Value: 10},
+			StartTime: time.Unix(0, 0),
+			EndTime:   time.Unix(1, 0),
+		},
+	}
+	persist := persistence.NewMemoryPersistence()
+	mc := testlib.NewMockClock()
+	mc.SetNow(time.Unix(4000, 0))
+	ep := testlib.NewMockEndpoint("mockep")
+	ep.SetHang(true)
+	rs := newRetryingSender(ep, persist, testlib.NewMockStatsRecorder(), mc, testMinDelay, testMaxDelay, 0)
+	ep.DoAndWait(t, 1, func() {
+		if err := rs.Send(report); err != nil {
+			t.Fatalf("Unexpected send error: %+v", err)
+		}
+	})
+
+	// Release waits for the hanging send until it's interrupted at the deadline.
+	const deadline = 100 * time.Millisecond
+	start := time.Now()
+	timer := time.AfterFunc(deadline, rs.Interrupt)
+	defer timer.Stop()
+	if err := rs.Release(); err != nil {
+		t.Fatalf("Release: unexpected error: %+v", err)
+	}
+	elapsed := time.Since(start)
+	t.Logf("Release with a hanging endpoint, interrupted after %v: %v", deadline, elapsed)
+	if elapsed < deadline || elapsed > deadline+2*time.Second {
+		t.Fatalf("Release: took %v, expected about %v", elapsed, deadline)
+	}
+
+	// The interrupted report remains queued, and is sent by the next sender.
+	ep2 := testlib.NewMockEndpoint("mockep")
+	ep2.DoAndWait(t, 1, func() {
+		rs = newRetryingSender(ep2, persist, testlib.NewMockStatsRecorder(), mc, testMinDelay, testMaxDelay, 0)
+	})
+	defer rs.Release()
+	if reports := ep2.Reports(); len(reports) != 1 || !reports[0].StampedMetricReport.Equal(report) {
+		t.Fatalf("Reports after restart: expected %v, got %v", report, reports)
+	}
+}
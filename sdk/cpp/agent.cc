@@ -19,6 +19,42 @@
 #include "sdk/cpp/api.h"
 
 namespace ubbagent {
+namespace {
+
+// Converts the Go agent status to an AgentStatus, freeing its error message.
+AgentStatus ToAgentStatus(struct CurrentStatus current_status) {
+    AgentStatus agent_status;
+    if (current_status.error_message) {
+        agent_status.status = absl::InternalError(std::string(current_status.error_message));
+    } else {
+        agent_status.status = absl::OkStatus();
+        agent_status.last_report_success = absl::FromUnixSeconds(current_status.last_report_success);
+        agent_status.current_failure_count = current_status.current_failure_count;
+        agent_status.total_failure_count = current_status.total_failure_count;
+        agent_status.version = current_status.version;
+    }
+    free(current_status.error_message);
+    return agent_status;
+}
+
+// Converts the result of a Go agent operation to an absl::Status, freeing its error message.
+absl::Status ToStatus(struct Result result) {
+    absl::Status status;
+    if (!result.error_message) {
+        status = absl::OkStatus();
+    } else if (result.error_code == ERROR_DEADLINE_EXCEEDED) {
+        status = absl::DeadlineExceededError(std::string(result.error_message));
+    } else if (result.error_code == ERROR_RESOURCE_EXHAUSTED) {
+        status = absl::ResourceExhaustedError(std::string(result.error_message));
+    } else {
+        status = absl::InternalError(std::string(result.error_message));
+    }
+    free(result.error_message);
+    return status;
+}
+
+} // namespace
+
 
 Agent::Agent(const std::string& config, const std::string& state_dir, absl::Status* out_status) {
     // Copy the input strings because we need non-const char*.
@@ -64,31 +100,24 @@ Agent::~Agent() {
 absl::Status Agent::AddReport(const std::string& report) {
     char c_report[report.size() + 1];
     strcpy(c_report, report.c_str());
-    struct Result result = AgentAddReport(id_, c_report);
-    absl::Status status;
-    if (result.error_message) {
-        status = absl::InternalError(std::string(result.error_message));
-    } else {
-        status = absl::OkStatus();
-    }
-    free(result.error_message);
-    return status;
+    return ToStatus(AgentAddReport(id_, c_report));
+}
+
+
+absl::Status Agent::TryAddReport(const std::string& report, absl::Duration timeout) {
+    char c_report[report.size() + 1];
+    strcpy(c_report, report.c_str());
+    return ToStatus(AgentTryAddReport(id_, c_report, absl::ToInt64Nanoseconds(timeout)));
 }
 
 
 AgentStatus Agent::GetStatus() {
-    struct CurrentStatus current_status = AgentGetStatus(id_);
-    AgentStatus agent_status;
-    if (current_status.error_message) {
-        agent_status.status = absl::InternalError(std::string(current_status.error_message));
-    } else {
-        agent_status.status = absl::OkStatus();
-        agent_status.last_report_success = absl::FromUnixSeconds(current_status.last_report_success);
-        agent_status.current_failure_count = current_status.current_failure_count;
-        agent_status.total_failure_count = current_status.total_failure_count;
-    }
-    free(current_status.error_message);
-    return agent_status;
+    return ToAgentStatus(AgentGetStatus(id_));
+}
+
+
+AgentStatus Agent::WaitForStatusChange(uint64_t version, absl::Duration timeout) {
+    return ToAgentStatus(AgentWaitForStatusChange(id_, version, absl::ToInt64Milliseconds(timeout)));
 }
 
 } // namespace ubbagent
@@ -15,6 +15,7 @@
 #ifndef SDK_CPP_AGENT_H
 #define SDK_CPP_AGENT_H
 
+#include <cstdint>
 #include <memory>
 
 #include "absl/status/status.h"
@@ -26,6 +27,8 @@ struct AgentStatus {
     absl::Time last_report_success;
     int current_failure_count;
     int total_failure_count;
+    // Increases each time any of the above fields change.
+    uint64_t version;
     absl::Status status;
 };
 
@@ -44,9 +47,20 @@ class Agent {
     // Adds a report to be sent.
     absl::Status AddReport(const std::string& report);
 
+    // Adds a report to be sent, unless the agent can't accept it within timeout. Returns
+    // absl::DeadlineExceededError if the timeout elapses first, or absl::ResourceExhaustedError if
+    // the report exceeds a configured rate limit. In either case the report was not added, and the
+    // caller may retry or drop it.
+    absl::Status TryAddReport(const std::string& report, absl::Duration timeout);
+
     // Gets the status of the agent and the reports it has sent or failed to send.
     AgentStatus GetStatus();
 
+    // Blocks until the agent's status version differs from version, or until timeout elapses, and
+    // then returns the current status. Pass the version of the last status seen to be notified of
+    // the next change; version 0 returns immediately.
+    AgentStatus WaitForStatusChange(uint64_t version, absl::Duration timeout);
+
   private:
     // Private constructor because it could fail. Use the factory method to create Agent.
     Agent(const std::string& config, const std::string& state_dir, absl::Status* out_status);
@@ -16,15 +16,21 @@
 
 #include <chrono>
 #include <ctime>
+#include <fcntl.h>
+#include <filesystem>
 #include <fstream>
+#include <future>
 #include <json/value.h>
 #include <json/reader.h>
 #include <thread>
 
 #include "absl/status/status.h"
+#include "absl/strings/str_replace.h"
 #include "absl/strings/substitute.h"
 #include "dirent.h"
 #include "gtest/gtest.h"
+#include "sys/stat.h"
+#include "unistd.h"
 
 namespace ubbagent {
 
@@ -242,6 +248,108 @@ TEST_F(AgentTest, AddReportSuccess) {
     EXPECT_EQ(CountReportsOnDisk(directory_2_), 50);
 }
 
+TEST_F(AgentTest, TryAddReport) {
+    absl::Status create_status;
+    std::unique_ptr<Agent> agent = Agent::Create(config_, "", &create_status);
+    EXPECT_TRUE(create_status.ok());
+    ASSERT_NE(agent, nullptr);
+
+    // A report is added well within a generous timeout.
+    EXPECT_TRUE(agent->TryAddReport(kReportJson, absl::Seconds(10)).ok());
+
+    // A report can't be handed off within a timeout that has already elapsed.
+    absl::Status report_status = agent->TryAddReport(kReportJson, absl::ZeroDuration());
+    EXPECT_TRUE(absl::IsDeadlineExceeded(report_status));
+
+    // Invalid reports are still rejected as such.
+    report_status = agent->TryAddReport("invalid_json", absl::Seconds(10));
+    EXPECT_FALSE(report_status.ok());
+    EXPECT_FALSE(absl::IsDeadlineExceeded(report_status));
+
+    // Allow time for reports to be sent.
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+
+    // Only the first report was added.
+    EXPECT_EQ(CountReportsOnDisk(directory_), 25);
+}
+
+TEST_F(AgentTest, TryAddReportRateLimited) {
+    absl::Status create_status;
+    std::unique_ptr<Agent> agent = Agent::Create(
+        absl::StrReplaceAll(config_, {{"  type: int\n", "  type: int\n  rateLimit:\n    reportsPerSecond: 0.01\n"}}),
+        "", &create_status);
+    EXPECT_TRUE(create_status.ok());
+    ASSERT_NE(agent, nullptr);
+
+    // The burst of one report is admitted, and the next exceeds the limit.
+    EXPECT_TRUE(agent->TryAddReport(kReportJson, absl::Seconds(10)).ok());
+    EXPECT_TRUE(absl::IsResourceExhausted(agent->TryAddReport(kReportJson, absl::Seconds(10))));
+}
+
+TEST_F(AgentTest, WaitForStatusChange) {
+    absl::Status create_status;
+    std::unique_ptr<Agent> agent = Agent::Create(config_, "", &create_status);
+    EXPECT_TRUE(create_status.ok());
+    ASSERT_NE(agent, nullptr);
+
+    // Version 0 returns the current status immediately.
+    AgentStatus initial = agent->WaitForStatusChange(0, absl::Seconds(10));
+    EXPECT_TRUE(initial.status.ok());
+    EXPECT_GT(initial.version, 0);
+
+    // Without a change, the wait times out and returns the same version.
+    AgentStatus unchanged = agent->WaitForStatusChange(initial.version, absl::Milliseconds(100));
+    EXPECT_TRUE(unchanged.status.ok());
+    EXPECT_EQ(unchanged.version, initial.version);
+
+    // A successful send changes the status.
+    absl::Status report_status = agent->AddReport(kReportJson);
+    EXPECT_TRUE(report_status.ok());
+    AgentStatus changed = agent->WaitForStatusChange(initial.version, absl::Seconds(10));
+    EXPECT_TRUE(changed.status.ok());
+    EXPECT_GT(changed.version, initial.version);
+    EXPECT_GT(changed.last_report_success, absl::FromUnixSeconds(0));
+}
+
+TEST_F(AgentTest, ShutdownDoesNotBlockOtherAgents) {
+    char temp_dir[L_tmpnam + 1];
+    tmpnam(temp_dir);
+    std::string state_dir = absl::StrCat(temp_dir, "/");
+    absl::Status create_status;
+    // A long aggregation period, so that the report is only handed to the retry queue at shutdown.
+    std::unique_ptr<Agent> agent = Agent::Create(
+        absl::StrReplaceAll(config_, {{"bufferSeconds: 1", "bufferSeconds: 3600"}}), state_dir,
+        &create_status);
+    ASSERT_TRUE(create_status.ok()) << create_status;
+    EXPECT_TRUE(agent->AddReport(kReportJson).ok());
+
+    // Writing the retry queue blocks until the FIFO is read, which holds the shutdown in progress.
+    std::string fifo = state_dir + "epqueue/disk.json.tmp";
+    std::filesystem::create_directories(state_dir + "epqueue");
+    ASSERT_EQ(mkfifo(fifo.c_str(), 0600), 0);
+    std::thread shutdown([&agent] { agent.reset(); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    // Another agent can be created and shut down meanwhile.
+    std::future<bool> other = std::async(std::launch::async, [this] {
+        absl::Status status;
+        std::unique_ptr<Agent> agent_2 = Agent::Create(config_2_, "", &status);
+        return status.ok();
+    });
+    bool finished = other.wait_for(std::chrono::seconds(5)) == std::future_status::ready;
+
+    int fd = open(fifo.c_str(), O_RDONLY);
+    ASSERT_GE(fd, 0);
+    char buf[4096];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    close(fd);
+    shutdown.join();
+    EXPECT_TRUE(finished);
+    EXPECT_TRUE(other.get());
+    std::filesystem::remove_all(state_dir);
+}
+
 }  // namespace
 
 } // namespace ubbagent
@@ -23,10 +23,21 @@ struct InitResult {
 	int id;
 };
 
+// Classifies a failed operation's error.
+enum ErrorCode {
+	ERROR_UNKNOWN = 0,
+	// The operation's deadline passed before it completed.
+	ERROR_DEADLINE_EXCEEDED = 1,
+	// A rate limit was exceeded.
+	ERROR_RESOURCE_EXHAUSTED = 2,
+};
+
 struct Result {
 	// If the error_message is a nullptr then the operation was a success. 
 	// If not a nullptr, then error_message contains the error.
 	char* error_message;
+	// If error_message is not a nullptr, error_code classifies the error.
+	enum ErrorCode error_code;
 };
 
 struct CurrentStatus {
@@ -34,6 +45,8 @@ struct CurrentStatus {
 	int total_failure_count;
 	// Unix time UTC
 	long last_report_success;
+	// Increases each time the status changes. See AgentWaitForStatusChange.
+	unsigned long long version;
 	// error_message indicates whether there was an error getting the status of the ubbagent. 
 	char* error_message;
 };
@@ -41,8 +54,13 @@ struct CurrentStatus {
 import "C"
 
 import (
+	"context"
+	"github.com/GoogleCloudPlatform/ubbagent/admission"
 	"github.com/GoogleCloudPlatform/ubbagent/sdk"
+	"github.com/GoogleCloudPlatform/ubbagent/stats"
 	"sync"
+	"sync/atomic"
+	"time"
 )
 
 // We store all current agents in a map keyed by an incrementing integer. Since the c++ side of
@@ -54,6 +72,25 @@ var agents = make(map[C.int]*sdk.Agent)
 // A mutex that protects the agents map against concurrent modification.
 var agentsmu = sync.RWMutex{}
 
+// A copy of the agents map that AgentTryAddReport reads without taking agentsmu, so that it isn't
+// held up by AgentInit or AgentShutdown, which may hold agentsmu for up to --shutdown_timeout.
+// Replaced, never modified, by publishAgents.
+var agentsSnapshot atomic.Value
+
+func init() {
+	agentsSnapshot.Store(map[C.int]*sdk.Agent{})
+}
+
+// publishAgents replaces agentsSnapshot with a copy of agents. Must be called while holding
+// agentsmu.
+func publishAgents() {
+	snapshot := make(map[C.int]*sdk.Agent, len(agents))
+	for num, agent := range agents {
+		snapshot[num] = agent
+	}
+	agentsSnapshot.Store(snapshot)
+}
+
 //export AgentInit
 func AgentInit(config *C.char, state_dir *C.char) C.struct_InitResult {
 	agentsmu.Lock()
@@ -70,6 +107,7 @@ func AgentInit(config *C.char, state_dir *C.char) C.struct_InitResult {
 	}
 
 	agents[num] = agent
+	publishAgents()
 
 	return C.struct_InitResult{ id: num }
 }
@@ -77,13 +115,15 @@ func AgentInit(config *C.char, state_dir *C.char) C.struct_InitResult {
 //export AgentShutdown
 func AgentShutdown(agent_id C.int) {
 	agentsmu.Lock()
-	defer agentsmu.Unlock()
-
 	agent, exists := agents[agent_id]
 	if !exists {
+		agentsmu.Unlock()
 		return
 	}
 	delete(agents, agent_id)
+	publishAgents()
+	// Shutdown can block for up to --shutdown_timeout, so other agents aren't held up meanwhile.
+	agentsmu.Unlock()
 
 	agent.Shutdown()
 }
@@ -101,14 +141,41 @@ func AgentAddReport(agent_id C.int, report *C.char) C.struct_Result {
 		return C.struct_Result{ error_message: C.CString("Agent does not exist") }
 	}
 
-	if err := agent.AddReportJson(goReportData); err != nil {
-		return C.struct_Result{ error_message: C.CString(err.Error()) }
+	return toResult(agent.AddReportJson(goReportData))
+}
+
+
+// AgentTryAddReport adds a report unless the agent can't accept it within timeout_ns nanoseconds.
+// The agent is looked up in agentsSnapshot, so a concurrent AgentInit or AgentShutdown doesn't
+// delay it. A report racing with the agent's shutdown is rejected by the stopped pipeline.
+//export AgentTryAddReport
+func AgentTryAddReport(agent_id C.int, report *C.char, timeout_ns C.longlong) C.struct_Result {
+	ctx, cancel := context.WithTimeout(context.Background(), time.Duration(timeout_ns))
+	defer cancel()
+
+	goReportData := []byte(C.GoString(report))
+
+	agent, exists := agentsSnapshot.Load().(map[C.int]*sdk.Agent)[agent_id]
+	if !exists {
+		return C.struct_Result{ error_message: C.CString("Agent does not exist") }
 	}
 
-	// Added report successfully.
-	return C.struct_Result{}
+	return toResult(agent.AddReportJsonContext(ctx, goReportData))
 }
 
+// toResult converts err, which may be nil, to a Result.
+func toResult(err error) C.struct_Result {
+	if err == nil {
+		return C.struct_Result{}
+	}
+	code := C.enum_ErrorCode(C.ERROR_UNKNOWN)
+	if _, ok := err.(*admission.RateLimitedError); ok {
+		code = C.ERROR_RESOURCE_EXHAUSTED
+	} else if err == context.DeadlineExceeded {
+		code = C.ERROR_DEADLINE_EXCEEDED
+	}
+	return C.struct_Result{ error_message: C.CString(err.Error()), error_code: code }
+}
 
 //export AgentGetStatus
 func AgentGetStatus(agent_id C.int) C.struct_CurrentStatus {
@@ -120,11 +187,31 @@ func AgentGetStatus(agent_id C.int) C.struct_CurrentStatus {
 		return C.struct_CurrentStatus{ error_message: C.CString("Agent does not exist") }
 	}
 
-	stats := agent.GetStatus()
+	return currentStatus(agent.GetStatus())
+}
+
+// AgentWaitForStatusChange blocks until the agent's status version differs from version, or until
+// timeout_ms milliseconds elapse, and returns the current status.
+//export AgentWaitForStatusChange
+func AgentWaitForStatusChange(agent_id C.int, version C.ulonglong, timeout_ms C.long) C.struct_CurrentStatus {
+	// Don't hold the lock while waiting; that would block AgentInit and AgentShutdown.
+	agentsmu.RLock()
+	agent, exists := agents[agent_id]
+	agentsmu.RUnlock()
+	if !exists {
+		return C.struct_CurrentStatus{ error_message: C.CString("Agent does not exist") }
+	}
+
+	ctx, cancel := context.WithTimeout(context.Background(), time.Duration(timeout_ms)*time.Millisecond)
+	defer cancel()
+	return currentStatus(agent.WaitForStatusChange(ctx, uint64(version)))
+}
 
+func currentStatus(stats stats.Snapshot) C.struct_CurrentStatus {
 	return C.struct_CurrentStatus{ current_failure_count: C.int(stats.CurrentFailureCount),
 									total_failure_count: C.int(stats.TotalFailureCount),
-									last_report_success: C.long(stats.LastReportSuccess.Unix()) }
+									last_report_success: C.long(stats.LastReportSuccess.Unix()),
+									version: C.ulonglong(stats.Version) }
 }
 
 // Required empty func
@@ -0,0 +1,235 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdk/cpp/usage_timer.h"
+
+#include <cstdio>
+
+#include "absl/strings/str_cat.h"
+
+namespace ubbagent {
+namespace {
+
+// UsageTimer ids, which index each thread's slot cache. The ids of destroyed timers are reused, so
+// that a process creating and destroying timers doesn't grow every thread's cache without bound.
+struct TimerIds {
+    std::mutex mutex;
+    // Ids released by destroyed timers. Guarded by mutex.
+    std::vector<size_t> free;
+    // The next id never used. Guarded by mutex.
+    size_t next = 0;
+};
+
+// Returns the process's timer ids. They are never destroyed, so timers destroyed during exit can
+// still release their ids.
+TimerIds& Ids() {
+    static TimerIds* ids = new TimerIds;
+    return *ids;
+}
+
+size_t AcquireTimerId() {
+    TimerIds& ids = Ids();
+    std::lock_guard<std::mutex> lock(ids.mutex);
+    if (ids.free.empty()) {
+        return ids.next++;
+    }
+    size_t id = ids.free.back();
+    ids.free.pop_back();
+    return id;
+}
+
+void ReleaseTimerId(size_t id) {
+    TimerIds& ids = Ids();
+    std::lock_guard<std::mutex> lock(ids.mutex);
+    ids.free.push_back(id);
+}
+
+// Source of UsageTimer generations, which are never reused. Zero marks an empty cache entry.
+std::atomic<uint64_t> next_generation{1};
+
+// Returns s as a quoted JSON string.
+std::string JsonString(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[7];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out + "\"";
+}
+
+// Returns t as a quoted RFC 3339 timestamp.
+std::string JsonTime(absl::Time t) {
+    return JsonString(absl::FormatTime("%Y-%m-%dT%H:%M:%E*SZ", t, absl::UTCTimeZone()));
+}
+
+// Returns the number of nanoseconds in one unit of an int report.
+int64_t NanosPerUnit(UsageUnit unit) {
+    switch (unit) {
+        case UsageUnit::kMilliseconds: return 1000000;
+        case UsageUnit::kMicroseconds: return 1000;
+        default: return 1;
+    }
+}
+
+} // namespace
+
+
+std::unique_ptr<UsageTimer> UsageTimer::Create(Agent* agent,
+                                               const std::string& metric,
+                                               const std::map<std::string, std::string>& labels,
+                                               UsageUnit unit,
+                                               absl::Duration flush_interval,
+                                               absl::Status* out_status) {
+    if (agent == nullptr) {
+        *out_status = absl::InvalidArgumentError("agent must not be null");
+        return nullptr;
+    }
+    if (metric.empty()) {
+        *out_status = absl::InvalidArgumentError("metric must not be empty");
+        return nullptr;
+    }
+    if (flush_interval <= absl::ZeroDuration()) {
+        *out_status = absl::InvalidArgumentError("flush_interval must be positive");
+        return nullptr;
+    }
+    // Render everything but the times and value once, so that flushing only formats numbers.
+    std::string prefix = absl::StrCat("{\"name\":", JsonString(metric), ",\"labels\":{");
+    bool first = true;
+    for (const auto& label : labels) {
+        absl::StrAppend(&prefix, first ? "" : ",", JsonString(label.first), ":",
+                        JsonString(label.second));
+        first = false;
+    }
+    prefix += "}";
+    *out_status = absl::OkStatus();
+    // The constructor is private. Use "new".
+    return std::unique_ptr<UsageTimer>(
+        new UsageTimer(agent, std::move(prefix), unit, flush_interval));
+}
+
+
+UsageTimer::UsageTimer(Agent* agent, std::string report_prefix, UsageUnit unit,
+                       absl::Duration flush_interval)
+    : agent_(agent),
+      report_prefix_(std::move(report_prefix)),
+      unit_(unit),
+      flush_interval_(flush_interval),
+      id_(AcquireTimerId()),
+      generation_(next_generation.fetch_add(1)),
+      reported_until_(absl::Now()) {
+    thread_ = std::thread(&UsageTimer::Run, this);
+}
+
+
+UsageTimer::~UsageTimer() {
+    {
+        std::lock_guard<std::mutex> lock(run_mutex_);
+        stopping_ = true;
+    }
+    run_cv_.notify_all();
+    thread_.join();
+    // There is no later flush to retry in, so usage the agent rejects now is dropped.
+    Flush().IgnoreError();
+    ReleaseTimerId(id_);
+}
+
+
+UsageTimer::Slot* UsageTimer::RegisterSlot() {
+    Slot* slot;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        slots_.emplace_back(new Slot);
+        slot = slots_.back().get();
+    }
+    std::vector<CachedSlot>& thread_slots = ThreadSlots();
+    if (thread_slots.size() <= id_) {
+        thread_slots.resize(id_ + 1);
+    }
+    thread_slots[id_].generation = generation_;
+    thread_slots[id_].slot = slot;
+    return slot;
+}
+
+
+absl::Status UsageTimer::Flush() {
+    std::lock_guard<std::mutex> flush_lock(flush_mutex_);
+    int64_t total = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& slot : slots_) {
+            total += slot->nanos.load(std::memory_order_relaxed);
+        }
+    }
+    int64_t delta = total - reported_nanos_;
+    std::string value;
+    if (unit_ == UsageUnit::kSeconds) {
+        value = absl::StrCat("{\"doubleValue\":", static_cast<double>(delta) / 1e9, "}");
+    } else {
+        // Report whole units, leaving the remainder for the next flush.
+        int64_t units = delta / NanosPerUnit(unit_);
+        delta = units * NanosPerUnit(unit_);
+        value = absl::StrCat("{\"int64Value\":", units, "}");
+    }
+    if (delta <= 0) {
+        // Nothing to report. The next report's interval starts where the last one ended.
+        last_flush_status_ = absl::OkStatus();
+        return last_flush_status_;
+    }
+
+    absl::Time now = absl::Now();
+    std::string report = absl::StrCat(report_prefix_, ",\"startTime\":", JsonTime(reported_until_),
+                                      ",\"endTime\":", JsonTime(now), ",\"value\":", value, "}");
+    last_flush_status_ = agent_->AddReport(report);
+    if (last_flush_status_.ok()) {
+        reported_nanos_ += delta;
+        reported_until_ = now;
+    }
+    return last_flush_status_;
+}
+
+
+absl::Status UsageTimer::last_flush_status() {
+    std::lock_guard<std::mutex> lock(flush_mutex_);
+    return last_flush_status_;
+}
+
+
+void UsageTimer::Run() {
+    std::unique_lock<std::mutex> lock(run_mutex_);
+    while (!stopping_) {
+        run_cv_.wait_for(lock, absl::ToChronoNanoseconds(flush_interval_));
+        if (stopping_) {
+            break;
+        }
+        lock.unlock();
+        // A failed flush is recorded in last_flush_status_ and retried on the next interval.
+        Flush().IgnoreError();
+        lock.lock();
+    }
+}
+
+} // namespace ubbagent
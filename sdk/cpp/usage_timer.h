@@ -0,0 +1,176 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SDK_CPP_USAGE_TIMER_H
+#define SDK_CPP_USAGE_TIMER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/time/time.h"
+#include "sdk/cpp/agent.h"
+
+namespace ubbagent {
+
+// The unit in which a UsageTimer reports accumulated time.
+enum class UsageUnit {
+    // Double values, in seconds. For metrics of type double.
+    kSeconds,
+    // Int values, in whole milliseconds. For metrics of type int. Fractions of a unit are carried
+    // into the next report rather than lost.
+    kMilliseconds,
+    // Int values, in whole microseconds. For metrics of type int.
+    kMicroseconds,
+};
+
+// A UsageTimer reports the time spent in scopes, such as compute seconds per tenant, as usage of a
+// single metric and set of labels. The metric and labels are resolved when the timer is created,
+// so timing a scope only reads a monotonic clock and adds to an accumulator owned by the calling
+// thread; no lock is taken. A background thread sums the accumulators and adds one report to the
+// agent each flush interval.
+//
+// A UsageTimer must outlive the ScopedUsage objects that refer to it, and the Agent must outlive
+// the UsageTimer. A UsageTimer is threadsafe.
+class UsageTimer {
+  public:
+    // Factory method to create a UsageTimer reporting to agent. Result of the operation will be
+    // written to out_status.
+    static std::unique_ptr<UsageTimer> Create(Agent* agent,
+                                              const std::string& metric,
+                                              const std::map<std::string, std::string>& labels,
+                                              UsageUnit unit,
+                                              absl::Duration flush_interval,
+                                              absl::Status* out_status);
+
+    // Destructor stops the background thread and flushes any remaining usage.
+    ~UsageTimer();
+
+    UsageTimer(const UsageTimer&) = delete;
+    UsageTimer& operator=(const UsageTimer&) = delete;
+
+    // Adds elapsed time, in nanoseconds, to the calling thread's accumulator.
+    void AddNanoseconds(int64_t nanos) {
+        Slot* slot = LocalSlot();
+        // Only this thread writes the slot, so a relaxed load and store suffices.
+        slot->nanos.store(slot->nanos.load(std::memory_order_relaxed) + nanos,
+                          std::memory_order_relaxed);
+    }
+
+    // Adds elapsed time to the calling thread's accumulator.
+    void Add(absl::Duration elapsed) { AddNanoseconds(absl::ToInt64Nanoseconds(elapsed)); }
+
+    // Reports usage accumulated since the last flush now, rather than waiting for the interval.
+    // Usage that the agent rejects is kept and included in the next flush.
+    absl::Status Flush();
+
+    // The status of the most recent flush.
+    absl::Status last_flush_status();
+
+  private:
+    // A thread's accumulator. Slots are aligned to a cache line so that threads adding to their own
+    // slots don't contend for a shared line.
+    struct alignas(64) Slot {
+        std::atomic<int64_t> nanos{0};
+    };
+
+    // An entry of a thread's slot cache. Timer ids are reused once their timer is destroyed, so an
+    // entry also records the generation of the timer that wrote it, which is never reused; an entry
+    // left behind by a destroyed timer doesn't match its successor and is never dereferenced.
+    struct CachedSlot {
+        uint64_t generation = 0;
+        Slot* slot = nullptr;
+    };
+
+    UsageTimer(Agent* agent, std::string report_prefix, UsageUnit unit,
+               absl::Duration flush_interval);
+
+    // Returns the calling thread's accumulator. The fast path indexes a thread-local cache by the
+    // timer's id. Ids are recycled, so the cache is only as long as the most timers alive at once.
+    Slot* LocalSlot() {
+        std::vector<CachedSlot>& slots = ThreadSlots();
+        if (id_ < slots.size() && slots[id_].generation == generation_) {
+            return slots[id_].slot;
+        }
+        return RegisterSlot();
+    }
+
+    static std::vector<CachedSlot>& ThreadSlots() {
+        static thread_local std::vector<CachedSlot> slots;
+        return slots;
+    }
+
+    Slot* RegisterSlot();
+    void Run();
+
+    Agent* const agent_;
+    // The report JSON up to the start time: the metric name and labels.
+    const std::string report_prefix_;
+    const UsageUnit unit_;
+    const absl::Duration flush_interval_;
+    const size_t id_;
+    const uint64_t generation_;
+
+    std::mutex mutex_;
+    // Accumulators of every thread that has used this timer. Guarded by mutex_.
+    std::vector<std::unique_ptr<Slot>> slots_;
+
+    std::mutex flush_mutex_;
+    // The total nanoseconds already reported, and the end time of the last report. Guarded by
+    // flush_mutex_.
+    int64_t reported_nanos_ = 0;
+    absl::Time reported_until_;
+    absl::Status last_flush_status_;
+
+    std::mutex run_mutex_;
+    std::condition_variable run_cv_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+// ScopedUsage adds the time between its construction and destruction to a UsageTimer.
+//
+//     void HandleRequest(...) {
+//         ubbagent::ScopedUsage usage(compute_timer);
+//         ...
+//     }
+class ScopedUsage {
+  public:
+    explicit ScopedUsage(UsageTimer* timer)
+        : timer_(timer), start_(std::chrono::steady_clock::now()) {}
+
+    ~ScopedUsage() {
+        timer_->AddNanoseconds(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_).count());
+    }
+
+    ScopedUsage(const ScopedUsage&) = delete;
+    ScopedUsage& operator=(const ScopedUsage&) = delete;
+
+  private:
+    UsageTimer* const timer_;
+    const std::chrono::steady_clock::time_point start_;
+};
+
+} // namespace ubbagent
+
+#endif  // SDK_CPP_USAGE_TIMER_H
@@ -0,0 +1,65 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdk/cpp/usage_timer.h"
+
+#include <cstdlib>
+#include <iostream>
+
+#include "benchmark/benchmark.h"
+
+namespace ubbagent {
+namespace {
+
+constexpr char kConfig[] = R"(
+metrics:
+- name: compute-seconds
+  type: double
+  passthrough: {}
+  endpoints:
+  - name: disk
+endpoints:
+- name: disk
+  disk:
+    reportDir: /tmp/usage_timer_benchmark
+    expireSeconds: 60
+)";
+
+// Returns a timer shared by all benchmark threads. It and its agent live until the process exits.
+UsageTimer* SharedTimer() {
+    static UsageTimer* timer = [] {
+        absl::Status status;
+        Agent* agent = Agent::Create(kConfig, "", &status).release();
+        if (!status.ok()) {
+            std::cerr << status << std::endl;
+            std::abort();
+        }
+        return UsageTimer::Create(agent, "compute-seconds", {{"tenant", "benchmark"}},
+                                  UsageUnit::kSeconds, absl::Seconds(10), &status).release();
+    }();
+    return timer;
+}
+
+// Measures the per-scope cost of ScopedUsage: two clock reads and an add to the calling thread's
+// accumulator.
+void BM_ScopedUsage(benchmark::State& state) {
+    UsageTimer* timer = SharedTimer();
+    for (auto _ : state) {
+        ScopedUsage usage(timer);
+    }
+}
+BENCHMARK(BM_ScopedUsage)->ThreadRange(1, 8)->UseRealTime();
+
+}  // namespace
+} // namespace ubbagent
@@ -0,0 +1,241 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdk/cpp/usage_timer.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <json/value.h>
+#include <json/reader.h>
+#include <thread>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/substitute.h"
+#include "dirent.h"
+#include "gtest/gtest.h"
+
+namespace ubbagent {
+
+namespace {
+
+constexpr char kConfig[] = R"(
+metrics:
+- name: compute-ms
+  type: int
+  passthrough: {}
+  endpoints:
+  - name: disk
+- name: compute-seconds
+  type: double
+  passthrough: {}
+  endpoints:
+  - name: disk
+endpoints:
+- name: disk
+  disk:
+    reportDir: $0
+    expireSeconds: 3600
+)";
+
+// Reads the reports for metric written to directory by the agent.
+std::vector<Json::Value> ReadReports(const std::string& directory, const std::string& metric) {
+    std::vector<Json::Value> reports;
+    DIR *dir = opendir(directory.c_str());
+    if (dir == NULL) {
+        return reports;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        std::string name = ent->d_name;
+        if (name.size() < 5 || name.compare(name.size() - 5, 5, ".json") != 0) {
+            continue;
+        }
+        std::ifstream ifs(directory + ent->d_name);
+        std::string content((std::istreambuf_iterator<char>(ifs)),
+                            (std::istreambuf_iterator<char>()));
+        Json::Value root;
+        Json::Reader reader;
+        if (reader.parse(content.c_str(), root) && root.get("name", "").asString() == metric) {
+            reports.push_back(root);
+        }
+    }
+    closedir(dir);
+    return reports;
+}
+
+class UsageTimerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    char temp_dir[L_tmpnam + 1];
+    tmpnam(temp_dir);
+    directory_ = absl::StrCat(temp_dir, "/");
+    absl::Status create_status;
+    agent_ = Agent::Create(absl::Substitute(kConfig, directory_), "", &create_status);
+    ASSERT_TRUE(create_status.ok()) << create_status;
+  }
+
+  void TearDown() override {
+    agent_.reset();
+    DIR *dir = opendir(directory_.c_str());
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        remove((directory_ + ent->d_name).c_str());
+    }
+    remove(directory_.c_str());
+    closedir(dir);
+  }
+
+  // Waits for the agent to write reports for metric, and returns them.
+  std::vector<Json::Value> WaitForReports(const std::string& metric) {
+    for (int i = 0; i < 50; i++) {
+        std::vector<Json::Value> reports = ReadReports(directory_, metric);
+        if (!reports.empty()) {
+            return reports;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    return {};
+  }
+
+  std::string directory_;
+  std::unique_ptr<Agent> agent_;
+};
+
+TEST_F(UsageTimerTest, CreateFail) {
+    absl::Status create_status;
+    std::unique_ptr<UsageTimer> timer = UsageTimer::Create(
+        agent_.get(), "", {}, UsageUnit::kSeconds, absl::Seconds(1), &create_status);
+    EXPECT_TRUE(absl::IsInvalidArgument(create_status));
+    EXPECT_EQ(timer, nullptr);
+
+    timer = UsageTimer::Create(
+        agent_.get(), "compute-seconds", {}, UsageUnit::kSeconds, absl::ZeroDuration(),
+        &create_status);
+    EXPECT_TRUE(absl::IsInvalidArgument(create_status));
+    EXPECT_EQ(timer, nullptr);
+}
+
+TEST_F(UsageTimerTest, FlushSumsThreads) {
+    absl::Status create_status;
+    std::unique_ptr<UsageTimer> timer = UsageTimer::Create(
+        agent_.get(), "compute-ms", {{"tenant", "a \"quoted\" name"}}, UsageUnit::kMilliseconds,
+        absl::Hours(1), &create_status);
+    ASSERT_TRUE(create_status.ok()) << create_status;
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i++) {
+        threads.emplace_back([&timer] {
+            for (int j = 0; j < 1000; j++) {
+                timer->Add(absl::Microseconds(250));
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    // A fraction of a millisecond is carried into the next flush.
+    timer->Add(absl::Microseconds(1500));
+    EXPECT_TRUE(timer->Flush().ok());
+    timer->Add(absl::Microseconds(500));
+    EXPECT_TRUE(timer->Flush().ok());
+    // Nothing new; no report is added.
+    EXPECT_TRUE(timer->Flush().ok());
+
+    std::vector<Json::Value> reports = WaitForReports("compute-ms");
+    // Wait for the second report, which may be written separately.
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    reports = ReadReports(directory_, "compute-ms");
+    ASSERT_EQ(reports.size(), 2u);
+    int64_t total = 0;
+    for (const Json::Value& report : reports) {
+        EXPECT_EQ(report["labels"]["tenant"].asString(), "a \"quoted\" name");
+        total += report["value"]["int64Value"].asInt64();
+    }
+    EXPECT_EQ(total, 1002);
+}
+
+TEST_F(UsageTimerTest, ScopedUsageFlushedOnDestruction) {
+    absl::Status create_status;
+    std::unique_ptr<UsageTimer> timer = UsageTimer::Create(
+        agent_.get(), "compute-seconds", {}, UsageUnit::kSeconds, absl::Hours(1), &create_status);
+    ASSERT_TRUE(create_status.ok()) << create_status;
+    {
+        ScopedUsage usage(timer.get());
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    timer.reset();
+
+    std::vector<Json::Value> reports = WaitForReports("compute-seconds");
+    ASSERT_EQ(reports.size(), 1u);
+    double seconds = reports[0]["value"]["doubleValue"].asDouble();
+    EXPECT_GE(seconds, 0.05);
+    EXPECT_LT(seconds, 5.0);
+}
+
+TEST_F(UsageTimerTest, FlushesOnInterval) {
+    absl::Status create_status;
+    std::unique_ptr<UsageTimer> timer = UsageTimer::Create(
+        agent_.get(), "compute-seconds", {}, UsageUnit::kSeconds, absl::Milliseconds(100),
+        &create_status);
+    ASSERT_TRUE(create_status.ok()) << create_status;
+    timer->Add(absl::Seconds(2));
+
+    std::vector<Json::Value> reports = WaitForReports("compute-seconds");
+    ASSERT_EQ(reports.size(), 1u);
+    EXPECT_DOUBLE_EQ(reports[0]["value"]["doubleValue"].asDouble(), 2.0);
+}
+
+TEST_F(UsageTimerTest, FailedFlushIsRetried) {
+    absl::Status create_status;
+    // The metric is not configured, so the agent rejects its reports.
+    std::unique_ptr<UsageTimer> timer = UsageTimer::Create(
+        agent_.get(), "unknown", {}, UsageUnit::kSeconds, absl::Hours(1), &create_status);
+    ASSERT_TRUE(create_status.ok()) << create_status;
+    timer->Add(absl::Seconds(1));
+    EXPECT_FALSE(timer->Flush().ok());
+    EXPECT_FALSE(timer->last_flush_status().ok());
+    timer->Add(absl::Seconds(1));
+    EXPECT_FALSE(timer->Flush().ok());
+}
+
+TEST_F(UsageTimerTest, ReusedIdGetsNewSlot) {
+    absl::Status create_status;
+    // The first timer's metric is not configured, so its usage is dropped when it's destroyed.
+    std::unique_ptr<UsageTimer> timer = UsageTimer::Create(
+        agent_.get(), "unknown", {}, UsageUnit::kSeconds, absl::Hours(1), &create_status);
+    ASSERT_TRUE(create_status.ok()) << create_status;
+    timer->Add(absl::Seconds(1));
+    timer.reset();
+
+    // The second timer reuses the first's id, but must not use the slot this thread cached for it.
+    timer = UsageTimer::Create(
+        agent_.get(), "compute-seconds", {}, UsageUnit::kSeconds, absl::Hours(1), &create_status);
+    ASSERT_TRUE(create_status.ok()) << create_status;
+    timer->Add(absl::Seconds(2));
+    EXPECT_TRUE(timer->Flush().ok());
+
+    std::vector<Json::Value> reports = WaitForReports("compute-seconds");
+    ASSERT_EQ(reports.size(), 1u);
+    EXPECT_DOUBLE_EQ(reports[0]["value"]["doubleValue"].asDouble(), 2.0);
+}
+
+}  // namespace
+
+} // namespace ubbagent
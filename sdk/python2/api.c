@@ -17,8 +17,11 @@
 
 static PyMethodDef Agent_methods[] = {
     {"shutdown", (PyCFunction)AgentShutdown, METH_NOARGS, "Destroy an agent."},
-    {"add_report", (PyCFunction)AgentAddReport, METH_O, "Add a usage report."},
+    {"add_report", (PyCFunction)AgentAddReport, METH_VARARGS | METH_KEYWORDS,
+     "Add a usage report, given as a JSON string, a dict, or keyword arguments."},
     {"get_status", (PyCFunction)AgentGetStatus, METH_NOARGS, "Get agent status."},
+    {"wait_for_status_change", (PyCFunction)AgentWaitForStatusChange, METH_VARARGS,
+     "Wait up to timeout seconds for the agent status to differ from the given version, then get it."},
     {NULL}
 };
 
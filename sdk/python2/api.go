@@ -26,6 +26,12 @@ static int PyArg_ParseTuple_ss(PyObject *args, char **a, char **b) {
   return PyArg_ParseTuple(args, "ss", a, b);
 }
 
+// Go cannot call C variadic functions. This wrapper allows us to call ParseTuple and expect an
+// unsigned long long and a double.
+static int PyArg_ParseTuple_Kd(PyObject *args, unsigned long long *a, double *b) {
+  return PyArg_ParseTuple(args, "Kd", a, b);
+}
+
 // Go cannot use C macros directly. Py_RETURN_NONE is the standard mechanism for returning the
 // PyNone object after incrementing its ref count.
 static PyObject* none() {
@@ -34,7 +40,9 @@ static PyObject* none() {
 */
 import "C"
 import (
+	"context"
 	"sync"
+	"time"
 	"unsafe"
 
 	"github.com/GoogleCloudPlatform/ubbagent/sdk"
@@ -114,24 +122,25 @@ func AgentDealloc(self *C.Agent) {
 	agent.Shutdown()
 }
 
+// AgentAddReport takes a report as a JSON string, a dict, or keyword arguments. See reportArg.
 //export AgentAddReport
-func AgentAddReport(self *C.Agent, report *C.PyObject) *C.PyObject {
-	var reportStr *C.PyObject = C.PyObject_Str(report)
-	var reportData *C.char = C.PyString_AsString(reportStr)
-	C.Py_DecRef(reportStr)
+func AgentAddReport(self *C.Agent, args *C.PyObject, kwds *C.PyObject) *C.PyObject {
+	report, err := reportArg(args, kwds)
+	if err != nil {
+		setException(err.Error())
+		return nil
+	}
 
 	agentsmu.RLock()
 	defer agentsmu.RUnlock()
 
-	goReportData := []byte(C.GoString(reportData))
-
 	agent, exists := agents[self.agentnum]
 	if !exists {
 		setException("Agent already shutdown")
 		return nil
 	}
 
-	if err := agent.AddReportJson(goReportData); err != nil {
+	if err := agent.AddReport(report); err != nil {
 		setException(err.Error())
 		return nil
 	}
@@ -161,6 +170,41 @@ func AgentGetStatus(self *C.Agent, _ *C.PyObject) *C.PyObject {
 	return C.PyString_FromString(status)
 }
 
+// AgentWaitForStatusChange takes a status version and a timeout in seconds. It blocks until the
+// agent's status version differs from the given one, or the timeout elapses, and returns the
+// current status. The GIL is released while waiting.
+//export AgentWaitForStatusChange
+func AgentWaitForStatusChange(self *C.Agent, args *C.PyObject) *C.PyObject {
+	var version C.ulonglong
+	var timeout C.double
+	if C.PyArg_ParseTuple_Kd(args, &version, &timeout) == 0 {
+		return nil
+	}
+
+	// Don't hold the lock while waiting; that would block init and shutdown.
+	agentsmu.RLock()
+	agent, exists := agents[self.agentnum]
+	agentsmu.RUnlock()
+	if !exists {
+		setException("Agent already shutdown")
+		return nil
+	}
+
+	threadState := C.PyEval_SaveThread()
+	ctx, cancel := context.WithTimeout(context.Background(), time.Duration(float64(timeout)*float64(time.Second)))
+	marshaled, err := sdk.SerializeStatus(agent.WaitForStatusChange(ctx, uint64(version)))
+	cancel()
+	C.PyEval_RestoreThread(threadState)
+	if err != nil {
+		setException(err.Error())
+		return nil
+	}
+
+	status := C.CString(string(marshaled))
+	defer C.free(unsafe.Pointer(status))
+	return C.PyString_FromString(status)
+}
+
 func setException(err string) {
 	errCStr := C.CString(err)
 	defer C.free(unsafe.Pointer(errCStr))
@@ -25,8 +25,9 @@ typedef struct {
 // These declarations must match the exported function definitions generated by api.go.
 int AgentInit(Agent *self, PyObject *args, PyObject *kwds);
 PyObject *AgentShutdown(Agent *self, PyObject *unused);
-PyObject *AgentAddReport(Agent *self, PyObject *report);
+PyObject *AgentAddReport(Agent *self, PyObject *args, PyObject *kwds);
 PyObject *AgentGetStatus(Agent *self, PyObject *unused);
+PyObject *AgentWaitForStatusChange(Agent *self, PyObject *args);
 void AgentDealloc(Agent *self);
 
 // Custom error object used for Agent exceptions.
@@ -0,0 +1,82 @@
+# Copyright 2018 Google LLC
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+'''Compares the cost of adding a report as a JSON string, a dict, and keyword arguments.'''
+
+import datetime
+import json
+import shutil
+import tempfile
+import timeit
+
+import ubbagent
+
+config_template = '''
+metrics:
+- name: requests
+  type: int
+  aggregation:
+    bufferSeconds: 60
+  endpoints:
+  - name: disk
+endpoints:
+- name: disk
+  disk:
+    reportDir: {reportDir}
+    expireSeconds: 3600
+'''
+
+NUMBER = 20000
+
+
+def main():
+  temp_dir = tempfile.mkdtemp('ubbagent-benchmark')
+  agent = ubbagent.Agent(config_template.format(reportDir=temp_dir), '')
+  now = datetime.datetime.utcnow()
+  labels = {'tenant': 'benchmark', 'region': 'us-central1'}
+
+  def add_json():
+    # Serializing is part of the JSON path's cost.
+    agent.add_report(json.dumps({
+        'name': 'requests',
+        'startTime': now.isoformat() + 'Z',
+        'endTime': now.isoformat() + 'Z',
+        'labels': labels,
+        'value': {'int64Value': 1},
+    }))
+
+  def add_dict():
+    agent.add_report({
+        'name': 'requests',
+        'startTime': now,
+        'endTime': now,
+        'labels': labels,
+        'value': {'int64Value': 1},
+    })
+
+  def add_kwargs():
+    agent.add_report(
+        name='requests', start_time=now, end_time=now, labels=labels, value=1)
+
+  try:
+    for name, fn in [('json', add_json), ('dict', add_dict), ('kwargs', add_kwargs)]:
+      seconds = min(timeit.repeat(fn, number=NUMBER, repeat=3))
+      print('%-8s %8.2f us/report' % (name, seconds / NUMBER * 1e6))
+  finally:
+    agent.shutdown()
+    shutil.rmtree(temp_dir)
+
+
+if __name__ == '__main__':
+  main()
@@ -0,0 +1,298 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Python.h must come before any standard header.
+#include "report.h"
+#include <datetime.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Returns whether obj is a string.
+static int is_string(PyObject *obj) {
+    return PyString_Check(obj) || PyUnicode_Check(obj);
+}
+
+// Returns whether obj is an int. A bool is not an int here.
+static int is_int(PyObject *obj) {
+    return (PyInt_Check(obj) || PyLong_Check(obj)) && !PyBool_Check(obj);
+}
+
+// Returns the NUL-terminated UTF-8 data of a string and sets *n to its length, or returns NULL if
+// obj isn't a string. *owned is set to an object to release once the data has been used, or NULL.
+static const char* string_data(PyObject *obj, Py_ssize_t *n, PyObject **owned) {
+    *owned = NULL;
+    if (PyUnicode_Check(obj)) {
+        obj = *owned = PyUnicode_AsUTF8String(obj);
+        if (obj == NULL) {
+            PyErr_Clear();
+            return NULL;
+        }
+    } else if (!PyString_Check(obj)) {
+        return NULL;
+    }
+    char *data;
+    PyString_AsStringAndSize(obj, &data, n);
+    return data;
+}
+
+// A writer appends records to a buffer. Once the buffer is full it only counts the bytes that
+// would have been written, so the caller can retry with a buffer of the right size.
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t len;
+} writer;
+
+static void write_bytes(writer *w, const void *data, size_t n) {
+    if (w->len + n <= w->cap) {
+        memcpy(w->buf + w->len, data, n);
+    }
+    w->len += n;
+}
+
+static void write_tag(writer *w, char tag) {
+    write_bytes(w, &tag, 1);
+}
+
+static void write_uint(writer *w, uint64_t v, int size) {
+    unsigned char b[8];
+    for (int i = 0; i < size; i++) {
+        b[i] = (unsigned char)(v >> (8 * i));
+    }
+    write_bytes(w, b, size);
+}
+
+// Writes a string. Returns -1 if obj isn't a string.
+static int write_string(writer *w, PyObject *obj) {
+    Py_ssize_t n;
+    PyObject *owned;
+    const char *data = string_data(obj, &n, &owned);
+    if (data == NULL) {
+        return -1;
+    }
+    write_uint(w, (uint64_t)n, 4);
+    write_bytes(w, data, (size_t)n);
+    Py_XDECREF(owned);
+    return 0;
+}
+
+// Writes a datetime's fields and UTC offset. Returns -1 if obj isn't a datetime.
+static int write_datetime(writer *w, PyObject *obj) {
+    if (PyDateTimeAPI == NULL) {
+        PyDateTime_IMPORT;
+        if (PyDateTimeAPI == NULL) {
+            PyErr_Clear();
+            return -1;
+        }
+    }
+    if (!PyDateTime_Check(obj)) {
+        return -1;
+    }
+    long long parts[8] = {
+        PyDateTime_GET_YEAR(obj),
+        PyDateTime_GET_MONTH(obj),
+        PyDateTime_GET_DAY(obj),
+        PyDateTime_DATE_GET_HOUR(obj),
+        PyDateTime_DATE_GET_MINUTE(obj),
+        PyDateTime_DATE_GET_SECOND(obj),
+        PyDateTime_DATE_GET_MICROSECOND(obj),
+        0,
+    };
+    if (((_PyDateTime_BaseTZInfo *)obj)->hastzinfo) {
+        PyObject *offset = PyObject_CallMethod(obj, "utcoffset", NULL);
+        if (offset == NULL) {
+            PyErr_Clear();
+            return -1;
+        }
+        if (PyDelta_Check(offset)) {
+            PyDateTime_Delta *delta = (PyDateTime_Delta *)offset;
+            parts[7] = ((long long)delta->days * 86400 + delta->seconds) * 1000000 +
+                       delta->microseconds;
+        }
+        Py_DECREF(offset);
+    }
+    for (int i = 0; i < 8; i++) {
+        write_uint(w, (uint64_t)parts[i], 8);
+    }
+    return 0;
+}
+
+// Writes a time given as an RFC 3339 string or a datetime.
+static int write_time(writer *w, PyObject *obj, char string_tag, char datetime_tag) {
+    if (is_string(obj)) {
+        write_tag(w, string_tag);
+        return write_string(w, obj);
+    }
+    write_tag(w, datetime_tag);
+    return write_datetime(w, obj);
+}
+
+// Writes a number as an int64 or double value.
+static int write_number(writer *w, PyObject *obj, int allow_int, int allow_float) {
+    if (allow_int && is_int(obj)) {
+        long long v = PyLong_AsLongLong(obj);
+        if (v == -1 && PyErr_Occurred()) {
+            PyErr_Clear();
+            return -1;
+        }
+        write_tag(w, REPORT_INT64_VALUE);
+        write_uint(w, (uint64_t)v, 8);
+        return 0;
+    }
+    if (allow_float && (PyFloat_Check(obj) || is_int(obj))) {
+        double v = PyFloat_AsDouble(obj);
+        if (v == -1.0 && PyErr_Occurred()) {
+            PyErr_Clear();
+            return -1;
+        }
+        uint64_t bits;
+        memcpy(&bits, &v, 8);
+        write_tag(w, REPORT_DOUBLE_VALUE);
+        write_uint(w, bits, 8);
+        return 0;
+    }
+    return -1;
+}
+
+// Returns whether name is the given camelCase field name or its snake_case form.
+static int name_is(const char *name, const char *camel, const char *snake) {
+    return strcmp(name, camel) == 0 || (snake != NULL && strcmp(name, snake) == 0);
+}
+
+// Writes a value given as a dict like {'int64Value': 10}, or as a bare int or float.
+static int write_value(writer *w, PyObject *obj) {
+    if (!PyDict_Check(obj)) {
+        return write_number(w, obj, 1, 1);
+    }
+    Py_ssize_t pos = 0;
+    PyObject *key, *value;
+    while (PyDict_Next(obj, &pos, &key, &value)) {
+        Py_ssize_t n;
+        PyObject *owned;
+        const char *name = string_data(key, &n, &owned);
+        int err = -1;
+        if (name != NULL && name_is(name, "int64Value", "int64_value")) {
+            err = write_number(w, value, 1, 0);
+        } else if (name != NULL && name_is(name, "doubleValue", "double_value")) {
+            err = write_number(w, value, 0, 1);
+        }
+        Py_XDECREF(owned);
+        if (err != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int write_labels(writer *w, PyObject *obj) {
+    if (!PyDict_Check(obj)) {
+        return -1;
+    }
+    Py_ssize_t pos = 0;
+    PyObject *key, *value;
+    while (PyDict_Next(obj, &pos, &key, &value)) {
+        write_tag(w, REPORT_LABEL);
+        if (write_string(w, key) != 0 || write_string(w, value) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Writes one field of a report. Returns an error message, or NULL.
+static const char* write_field(writer *w, const char *name, PyObject *value) {
+    if (name_is(name, "name", NULL)) {
+        write_tag(w, REPORT_NAME);
+        if (write_string(w, value) != 0) {
+            return "must be a string";
+        }
+    } else if (name_is(name, "startTime", "start_time")) {
+        if (write_time(w, value, REPORT_START_STRING, REPORT_START_DATETIME) != 0) {
+            return "must be a datetime or an RFC 3339 string";
+        }
+    } else if (name_is(name, "endTime", "end_time")) {
+        if (write_time(w, value, REPORT_END_STRING, REPORT_END_DATETIME) != 0) {
+            return "must be a datetime or an RFC 3339 string";
+        }
+    } else if (name_is(name, "labels", NULL)) {
+        if (write_labels(w, value) != 0) {
+            return "must be a dict of strings to strings";
+        }
+    } else if (name_is(name, "value", NULL)) {
+        if (write_value(w, value) != 0) {
+            return "must be an int, a float, or a dict with an int64Value or doubleValue";
+        }
+    } else if (name_is(name, "idempotencyKey", "idempotency_key")) {
+        write_tag(w, REPORT_IDEMPOTENCY_KEY);
+        if (write_string(w, value) != 0) {
+            return "must be a string";
+        }
+    } else {
+        return "is not a report field";
+    }
+    return NULL;
+}
+
+static int read_fields(PyObject *fields, char *buf, size_t cap, size_t *len) {
+    writer w = {buf, cap, 0};
+    Py_ssize_t pos = 0;
+    PyObject *key, *value;
+    while (PyDict_Next(fields, &pos, &key, &value)) {
+        Py_ssize_t n;
+        PyObject *owned;
+        const char *name = string_data(key, &n, &owned);
+        if (name == NULL) {
+            snprintf(buf, cap, "report field names must be strings");
+            return READ_REPORT_ERROR;
+        }
+        const char *err = write_field(&w, name, value);
+        if (err != NULL) {
+            snprintf(buf, cap, "%s %s", name, err);
+        }
+        Py_XDECREF(owned);
+        if (err != NULL) {
+            return READ_REPORT_ERROR;
+        }
+    }
+    *len = w.len;
+    return w.len > cap ? READ_REPORT_TOO_SMALL : READ_REPORT_FIELDS;
+}
+
+int read_report(PyObject *args, PyObject *kwds, char *buf, size_t cap, size_t *len) {
+    Py_ssize_t nargs = args == NULL ? 0 : PyTuple_Size(args);
+    Py_ssize_t nkwds = kwds == NULL ? 0 : PyDict_Size(kwds);
+    if (nargs == 0 && nkwds > 0) {
+        return read_fields(kwds, buf, cap, len);
+    }
+    if (nargs == 1 && nkwds == 0) {
+        PyObject *arg = PyTuple_GetItem(args, 0);
+        if (PyDict_Check(arg)) {
+            return read_fields(arg, buf, cap, len);
+        }
+        Py_ssize_t n;
+        PyObject *owned;
+        const char *data = string_data(arg, &n, &owned);
+        if (data != NULL) {
+            *len = (size_t)n;
+            if (*len <= cap) {
+                memcpy(buf, data, *len);
+            }
+            Py_XDECREF(owned);
+            return *len <= cap ? READ_REPORT_JSON : READ_REPORT_TOO_SMALL;
+        }
+    }
+    snprintf(buf, cap, "add_report takes a JSON string, a dict, or keyword arguments");
+    return READ_REPORT_ERROR;
+}
@@ -0,0 +1,136 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package main
+
+/*
+#cgo pkg-config: python2
+#include "report.h"
+*/
+import "C"
+import (
+	"encoding/binary"
+	"errors"
+	"math"
+	"sync"
+	"time"
+	"unsafe"
+
+	"github.com/GoogleCloudPlatform/ubbagent/metrics"
+	"github.com/GoogleCloudPlatform/ubbagent/sdk"
+)
+
+// reportArg converts the arguments of add_report to a metrics.MetricReport. A report is either a
+// single JSON string, a single dict, or keyword arguments. A dict's fields are read by a single
+// call to read_report rather than through a JSON intermediate; see report.h. Times may be datetime
+// objects, naive ones taken as UTC, or RFC 3339 strings, and a value may be a dict like
+// {'int64Value': 10} or a bare int or float.
+func reportArg(args, kwds *C.PyObject) (metrics.MetricReport, error) {
+	pooled := reportBufs.Get().(*[]byte)
+	defer reportBufs.Put(pooled)
+	buf := *pooled
+	var n C.size_t
+	result := C.read_report(args, kwds, (*C.char)(unsafe.Pointer(&buf[0])), C.size_t(len(buf)), &n)
+	if result == C.READ_REPORT_TOO_SMALL {
+		buf = make([]byte, int(n))
+		result = C.read_report(args, kwds, (*C.char)(unsafe.Pointer(&buf[0])), C.size_t(len(buf)), &n)
+	}
+	switch result {
+	case C.READ_REPORT_FIELDS:
+		return decodeReport(buf[:n])
+	case C.READ_REPORT_JSON:
+		return sdk.ParseReport(buf[:n])
+	default:
+		return metrics.MetricReport{}, errors.New(C.GoString((*C.char)(unsafe.Pointer(&buf[0]))))
+	}
+}
+
+// Buffers for read_report, which are reused because a report is decoded into new strings.
+var reportBufs = sync.Pool{
+	New: func() interface{} {
+		buf := make([]byte, 512)
+		return &buf
+	},
+}
+
+// decodeReport decodes the records written by read_report.
+func decodeReport(buf []byte) (report metrics.MetricReport, err error) {
+	r := reportReader{buf: buf}
+	for r.more() {
+		switch r.tag() {
+		case C.REPORT_NAME:
+			report.Name = r.string()
+		case C.REPORT_START_STRING:
+			report.StartTime, err = time.Parse(time.RFC3339Nano, r.string())
+		case C.REPORT_END_STRING:
+			report.EndTime, err = time.Parse(time.RFC3339Nano, r.string())
+		case C.REPORT_START_DATETIME:
+			report.StartTime = r.datetime()
+		case C.REPORT_END_DATETIME:
+			report.EndTime = r.datetime()
+		case C.REPORT_LABEL:
+			if report.Labels == nil {
+				report.Labels = make(map[string]string)
+			}
+			k := r.string()
+			report.Labels[k] = r.string()
+		case C.REPORT_INT64_VALUE:
+			report.Value.Int64Value = int64(r.uint64())
+		case C.REPORT_DOUBLE_VALUE:
+			report.Value.DoubleValue = math.Float64frombits(r.uint64())
+		case C.REPORT_IDEMPOTENCY_KEY:
+			report.IdempotencyKey = r.string()
+		}
+		if err != nil {
+			return
+		}
+	}
+	return
+}
+
+type reportReader struct {
+	buf []byte
+	pos int
+}
+
+func (r *reportReader) more() bool {
+	return r.pos < len(r.buf)
+}
+
+func (r *reportReader) tag() byte {
+	r.pos++
+	return r.buf[r.pos-1]
+}
+
+func (r *reportReader) uint64() uint64 {
+	r.pos += 8
+	return binary.LittleEndian.Uint64(r.buf[r.pos-8:])
+}
+
+func (r *reportReader) string() string {
+	n := int(binary.LittleEndian.Uint32(r.buf[r.pos:]))
+	r.pos += 4 + n
+	return string(r.buf[r.pos-n : r.pos])
+}
+
+// datetime decodes a datetime's fields and converts it to UTC.
+func (r *reportReader) datetime() time.Time {
+	var parts [8]int
+	for i := range parts {
+		parts[i] = int(int64(r.uint64()))
+	}
+	t := time.Date(parts[0], time.Month(parts[1]), parts[2], parts[3], parts[4], parts[5],
+		parts[6]*int(time.Microsecond), time.UTC)
+	return t.Add(-time.Duration(parts[7]) * time.Microsecond)
+}
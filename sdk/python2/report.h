@@ -0,0 +1,52 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unlike api.h, this doesn't define Py_LIMITED_API. Reading datetime fields and cached UTF-8 data
+// directly, rather than through attribute lookups and new objects, is most of what makes a dict
+// cheaper to add than JSON.
+#include <Python.h>
+
+// read_report writes the fields of a report to a buffer as a sequence of records, each a one-byte
+// tag followed by its value. A string is a 4-byte length followed by its UTF-8 bytes, and a number
+// is 8 bytes. Integers are little-endian.
+enum {
+    REPORT_NAME = 'n',             // string
+    REPORT_START_STRING = 's',     // string, in RFC 3339 format
+    REPORT_END_STRING = 'e',       // string, in RFC 3339 format
+    REPORT_START_DATETIME = 'S',   // 8 numbers: see read_report
+    REPORT_END_DATETIME = 'E',     // 8 numbers: see read_report
+    REPORT_LABEL = 'l',            // two strings: the label's name and value
+    REPORT_INT64_VALUE = 'i',      // int64
+    REPORT_DOUBLE_VALUE = 'd',     // IEEE 754 double
+    REPORT_IDEMPOTENCY_KEY = 'k',  // string
+};
+
+// Results of read_report.
+enum {
+    READ_REPORT_ERROR = -1,    // buf holds a NUL-terminated error message
+    READ_REPORT_FIELDS = 0,    // buf holds the report's records
+    READ_REPORT_JSON = 1,      // buf holds the report as JSON
+    READ_REPORT_TOO_SMALL = 2, // buf is too small; *len is the size required
+};
+
+// The smallest buffer read_report accepts, which is enough for any error message.
+#define REPORT_MIN_BUFFER 256
+
+// Reads the report passed to add_report, given its positional and keyword arguments, into buf,
+// which holds cap bytes, and sets *len to the number of bytes used. The report is a single JSON
+// string, a single dict of its fields, or its fields as keyword arguments. Field names match the
+// report's JSON fields, in either camelCase or snake_case. A datetime is written as its year,
+// month, day, hour, minute, second and microsecond, then its UTC offset in microseconds (0 if it
+// is naive).
+int read_report(PyObject *args, PyObject *kwds, char *buf, size_t cap, size_t *len);
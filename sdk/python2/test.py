@@ -126,6 +126,62 @@ class AgentSdkTest(unittest.TestCase):
         found_requests2,
         'Did not find a "requests" report for agent 2 with value 1000')
 
+  def testWaitForStatusChange(self):
+    # Version 0 returns the current status immediately.
+    initial = json.loads(self.agent1.wait_for_status_change(0, 10))
+    self.assertGreater(initial['version'], 0)
+
+    # Without a change, the wait times out and returns the same version.
+    unchanged = json.loads(
+        self.agent1.wait_for_status_change(initial['version'], 0.1))
+    self.assertEqual(initial['version'], unchanged['version'])
+
+    # The heartbeat's next successful send changes the status.
+    changed = json.loads(
+        self.agent1.wait_for_status_change(initial['version'], 10))
+    self.assertGreater(changed['version'], initial['version'])
+
+  def testAddReportDict(self):
+    now = datetime.datetime.utcnow()
+    self.agent1.add_report({
+        'name': 'requests',
+        'startTime': now,
+        'endTime': now,
+        'labels': {'tenant': 'a'},
+        'value': {'int64Value': 10},
+    })
+    self.agent1.add_report(
+        name=u'requests', start_time=now, end_time=now, labels={u'tenant': u'a'},
+        value=20)
+    # Times may also be RFC 3339 strings.
+    self.agent1.add_report(
+        name='requests', start_time=now.isoformat() + 'Z',
+        end_time=now.isoformat() + 'Z', labels={'tenant': 'a'}, value=30)
+
+    for bad in [
+        {'name': 'requests', 'startTime': 5, 'endTime': now, 'value': 1},
+        {'name': 'requests', 'startTime': now, 'endTime': now, 'value': '1'},
+        {'name': 'requests', 'startTime': now, 'endTime': now, 'value': 1,
+         'labels': {'tenant': 1}},
+        {'name': 'requests', 'start': now, 'endTime': now, 'value': 1},
+    ]:
+      with self.assertRaises(ubbagent.AgentError):
+        self.agent1.add_report(bad)
+    with self.assertRaises(ubbagent.AgentError):
+      self.agent1.add_report([])
+
+    # Sleep to give the aggregator time to send the reports.
+    time.sleep(2)
+
+    total = 0
+    for report_file in os.listdir(self.reportDir1):
+      with open(path.join(self.reportDir1, report_file)) as f:
+        report = json.load(f)
+      if report['name'] == 'requests':
+        self.assertEqual({'tenant': 'a'}, report['labels'])
+        total += report['value']['int64Value']
+    self.assertEqual(60, total)
+
 
 if __name__ == '__main__':
   unittest.main()
@@ -14,11 +14,64 @@
 
 #include <Python.h>
 #include "api.h"
+#include "worker.h"
+
+// Each method checks whether the agent belongs to an ancestor process before calling into Go, which
+// a forked process must never do. See worker.h.
+
+static PyObject* agent_forked_unsupported(const char *method) {
+    PyErr_Format(AgentError, "%s is not supported in a forked process", method);
+    return NULL;
+}
+
+static PyObject* agent_shutdown(Agent *self, PyObject *unused) {
+    return agent_forked(self) ? worker_shutdown(self) : AgentShutdown(self, unused);
+}
+
+static PyObject* agent_add_report(Agent *self, PyObject *args, PyObject *kwds) {
+    return agent_forked(self) ? worker_add_report(self, args, kwds) : AgentAddReport(self, args, kwds);
+}
+
+static PyObject* agent_get_status(Agent *self, PyObject *unused) {
+    return agent_forked(self) ? worker_get_status(self) : AgentGetStatus(self, unused);
+}
+
+static PyObject* agent_wait_for_status_change(Agent *self, PyObject *args) {
+    return agent_forked(self)
+        ? agent_forked_unsupported("wait_for_status_change")
+        : AgentWaitForStatusChange(self, args);
+}
+
+static PyObject* agent_add_report_async(Agent *self, PyObject *args, PyObject *kwds) {
+    return agent_forked(self)
+        ? agent_forked_unsupported("add_report_async")
+        : AgentAddReportAsync(self, args, kwds);
+}
+
+static PyObject* agent_complete_async(Agent *self, PyObject *unused) {
+    return agent_forked(self) ? agent_forked_unsupported("_complete_async") : AgentCompleteAsync(self, unused);
+}
+
+static void agent_dealloc(Agent *self) {
+    if (agent_forked(self)) {
+        worker_dealloc(self);
+    } else {
+        AgentDealloc(self);
+    }
+}
 
 static PyMethodDef Agent_methods[] = {
-    {"shutdown", (PyCFunction)AgentShutdown, METH_NOARGS, "Destroy an agent."},
-    {"add_report", (PyCFunction)AgentAddReport, METH_O, "Add a usage report."},
-    {"get_status", (PyCFunction)AgentGetStatus, METH_NOARGS, "Get agent status."},
+    {"shutdown", (PyCFunction)agent_shutdown, METH_NOARGS,
+     "Destroy an agent. In a forked process, only disconnect from it."},
+    {"add_report", (PyCFunction)agent_add_report, METH_VARARGS | METH_KEYWORDS,
+     "Add a usage report, given as a JSON string, a dict, or keyword arguments."},
+    {"get_status", (PyCFunction)agent_get_status, METH_NOARGS, "Get agent status."},
+    {"wait_for_status_change", (PyCFunction)agent_wait_for_status_change, METH_VARARGS,
+     "Wait up to timeout seconds for the agent status to differ from the given version, then get it."},
+    {"add_report_async", (PyCFunction)agent_add_report_async, METH_VARARGS | METH_KEYWORDS,
+     "Add a usage report without blocking. Must be called on a running asyncio event loop; returns a future for the result."},
+    {"_complete_async", (PyCFunction)agent_complete_async, METH_NOARGS,
+     "Resolve the futures of finished add_report_async calls. Called by the event loop."},
     {NULL}
 };
 
@@ -27,7 +80,7 @@ static PyTypeObject Agent_type = {
     "ubbagent.Agent",             // tp_name
     sizeof(Agent),                // tp_basicsize
     0,                            // tp_itemsize
-    (destructor)AgentDealloc,     // tp_dealloc
+    (destructor)agent_dealloc,    // tp_dealloc
     0,                            // tp_vectorcall_offset
     0,                            // tp_getattr
     0,                            // tp_setattr
@@ -101,5 +154,10 @@ PyMODINIT_FUNC PyInit_ubbagent(void) {
   Py_INCREF(AgentError);
   PyModule_AddObject(m, "AgentError", AgentError);
 
+  if (register_fork_hooks() != 0) {
+    Py_DECREF(m);
+    return 0;
+  }
+
   return m;
 }
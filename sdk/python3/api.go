@@ -19,6 +19,7 @@ package main
 #define Py_LIMITED_API
 #include <Python.h>
 #include "api.h"
+#include "worker.h"
 
 // Go cannot call C variadic functions. This simple wrapper allows us to call ParseTuple and expect
 // two strings.
@@ -26,6 +27,99 @@ static int PyArg_ParseTuple_ss(PyObject *args, char **a, char **b) {
   return PyArg_ParseTuple(args, "ss", a, b);
 }
 
+// Go cannot call C variadic functions. This wrapper allows us to call ParseTuple and expect an
+// unsigned long long and a double.
+static int PyArg_ParseTuple_Kd(PyObject *args, unsigned long long *a, double *b) {
+  return PyArg_ParseTuple(args, "Kd", a, b);
+}
+
+// Go cannot call C variadic functions. This wrapper calls obj.name(), or obj.name(arg) if arg is
+// not NULL, and returns a new reference to the result.
+static PyObject* call_method(PyObject *obj, const char *name, PyObject *arg) {
+  PyObject *method = PyObject_GetAttrString(obj, name);
+  if (method == NULL) {
+    return NULL;
+  }
+  PyObject *result = arg == NULL
+      ? PyObject_CallFunctionObjArgs(method, NULL)
+      : PyObject_CallFunctionObjArgs(method, arg, NULL);
+  Py_DecRef(method);
+  return result;
+}
+
+// Returns a new reference to the running asyncio event loop. Before Python 3.7, which lacks
+// get_running_loop, returns the current event loop.
+static PyObject* event_loop() {
+  PyObject *asyncio = PyImport_ImportModule("asyncio");
+  if (asyncio == NULL) {
+    return NULL;
+  }
+  PyObject *loop = PyObject_HasAttrString(asyncio, "get_running_loop")
+      ? call_method(asyncio, "get_running_loop", NULL)
+      : call_method(asyncio, "get_event_loop", NULL);
+  Py_DecRef(asyncio);
+  return loop;
+}
+
+// Returns a new future created by loop.
+static PyObject* create_future(PyObject *loop) {
+  return call_method(loop, "create_future", NULL);
+}
+
+// Calls loop.add_reader(fd, agent._complete_async).
+static int add_reader(PyObject *loop, int fd, Agent *agent) {
+  PyObject *callback = PyObject_GetAttrString((PyObject *)agent, "_complete_async");
+  if (callback == NULL) {
+    return -1;
+  }
+  PyObject *result = PyObject_CallMethod(loop, "add_reader", "iO", fd, callback);
+  Py_DecRef(callback);
+  if (result == NULL) {
+    return -1;
+  }
+  Py_DecRef(result);
+  return 0;
+}
+
+// Returns whether loop is closed. Errors are ignored.
+static int loop_closed(PyObject *loop) {
+  PyObject *closed = call_method(loop, "is_closed", NULL);
+  int result = closed != NULL && PyObject_IsTrue(closed);
+  Py_DecRef(closed);
+  PyErr_Clear();
+  return result;
+}
+
+// Calls loop.remove_reader(fd), unless the loop is closed. Errors are ignored.
+static void remove_reader(PyObject *loop, int fd) {
+  PyObject *closed = call_method(loop, "is_closed", NULL);
+  if (closed != NULL && !PyObject_IsTrue(closed)) {
+    PyObject *result = PyObject_CallMethod(loop, "remove_reader", "i", fd);
+    Py_DecRef(result);
+  }
+  Py_DecRef(closed);
+  PyErr_Clear();
+}
+
+// Resolves future with None, or with an AgentError carrying message if it is not NULL. A future
+// that was cancelled is left alone. Errors are ignored.
+static void resolve_future(PyObject *future, const char *message) {
+  PyObject *cancelled = call_method(future, "cancelled", NULL);
+  if (cancelled != NULL && !PyObject_IsTrue(cancelled)) {
+    PyObject *result;
+    if (message == NULL) {
+      result = call_method(future, "set_result", Py_None);
+    } else {
+      PyObject *error = PyObject_CallFunction(AgentError, "s", message);
+      result = error == NULL ? NULL : call_method(future, "set_exception", error);
+      Py_DecRef(error);
+    }
+    Py_DecRef(result);
+  }
+  Py_DecRef(cancelled);
+  PyErr_Clear();
+}
+
 // Go cannot use C macros directly. Py_RETURN_NONE is the standard mechanism for returning the
 // PyNone object after incrementing its ref count.
 static PyObject* none() {
@@ -34,7 +128,10 @@ static PyObject* none() {
 */
 import "C"
 import (
+	"context"
 	"sync"
+	"syscall"
+	"time"
 	"unsafe"
 
 	"github.com/GoogleCloudPlatform/ubbagent/sdk"
@@ -49,6 +146,10 @@ var agents = make(map[C.int]*sdk.Agent)
 // A mutex that protects the agents map against concurrent modification.
 var agentsmu = sync.RWMutex{}
 
+// The asyncio state of each agent that has used add_report_async, keyed like agents. Protected by
+// agentsmu.
+var asyncs = make(map[C.int]*asyncAgent)
+
 //export AgentInit
 func AgentInit(self *C.Agent, args *C.PyObject, _ *C.PyObject) C.int {
 	var cConfigData *C.char
@@ -73,7 +174,9 @@ func AgentInit(self *C.Agent, args *C.PyObject, _ *C.PyObject) C.int {
 	}
 
 	agents[num] = agent
+	agentObjects[num] = self
 	self.agentnum = num
+	self.generation = C.fork_generation
 
 	return 0
 }
@@ -89,6 +192,8 @@ func AgentShutdown(self *C.Agent, _ *C.PyObject) *C.PyObject {
 		return nil
 	}
 	delete(agents, self.agentnum)
+	closeAsync(self.agentnum)
+	closeWorkerServer(self.agentnum)
 
 	err := agent.Shutdown()
 	if err != nil {
@@ -109,29 +214,32 @@ func AgentDealloc(self *C.Agent) {
 		return
 	}
 	delete(agents, self.agentnum)
+	closeAsync(self.agentnum)
+	closeWorkerServer(self.agentnum)
 
 	// Ignore any shutdown errors
 	agent.Shutdown()
 }
 
+// AgentAddReport takes a report as a JSON string, a dict, or keyword arguments. See reportArg.
 //export AgentAddReport
-func AgentAddReport(self *C.Agent, report *C.PyObject) *C.PyObject {
-	var reportStr *C.PyObject = C.PyUnicode_AsEncodedString(report, C.CString("UTF-8"), C.CString("strict"))
-	var reportData *C.char = C.PyBytes_AsString(reportStr)
-	C.Py_DecRef(reportStr)
+func AgentAddReport(self *C.Agent, args *C.PyObject, kwds *C.PyObject) *C.PyObject {
+	report, err := reportArg(args, kwds)
+	if err != nil {
+		setException(err.Error())
+		return nil
+	}
 
 	agentsmu.RLock()
 	defer agentsmu.RUnlock()
 
-	goReportData := []byte(C.GoString(reportData))
-
 	agent, exists := agents[self.agentnum]
 	if !exists {
 		setException("Agent already shutdown")
 		return nil
 	}
 
-	if err := agent.AddReportJson(goReportData); err != nil {
+	if err := agent.AddReport(report); err != nil {
 		setException(err.Error())
 		return nil
 	}
@@ -161,6 +269,280 @@ func AgentGetStatus(self *C.Agent, _ *C.PyObject) *C.PyObject {
 	return C.PyUnicode_FromString(status)
 }
 
+// AgentWaitForStatusChange takes a status version and a timeout in seconds. It blocks until the
+// agent's status version differs from the given one, or the timeout elapses, and returns the
+// current status. The GIL is released while waiting.
+//export AgentWaitForStatusChange
+func AgentWaitForStatusChange(self *C.Agent, args *C.PyObject) *C.PyObject {
+	var version C.ulonglong
+	var timeout C.double
+	if C.PyArg_ParseTuple_Kd(args, &version, &timeout) == 0 {
+		return nil
+	}
+
+	// Don't hold the lock while waiting; that would block init and shutdown.
+	agentsmu.RLock()
+	agent, exists := agents[self.agentnum]
+	agentsmu.RUnlock()
+	if !exists {
+		setException("Agent already shutdown")
+		return nil
+	}
+
+	threadState := C.PyEval_SaveThread()
+	ctx, cancel := context.WithTimeout(context.Background(), time.Duration(float64(timeout)*float64(time.Second)))
+	marshaled, err := sdk.SerializeStatus(agent.WaitForStatusChange(ctx, uint64(version)))
+	cancel()
+	C.PyEval_RestoreThread(threadState)
+	if err != nil {
+		setException(err.Error())
+		return nil
+	}
+
+	status := C.CString(string(marshaled))
+	defer C.free(unsafe.Pointer(status))
+	return C.PyUnicode_FromString(status)
+}
+
+// AgentAddReportAsync takes a report like AgentAddReport, but returns an asyncio future rather than
+// blocking. The report is added on its own goroutine; see asyncAgent.
+//export AgentAddReportAsync
+func AgentAddReportAsync(self *C.Agent, args *C.PyObject, kwds *C.PyObject) *C.PyObject {
+	report, err := reportArg(args, kwds)
+	if err != nil {
+		setException(err.Error())
+		return nil
+	}
+
+	loop := C.event_loop()
+	if loop == nil {
+		return nil
+	}
+	defer C.Py_DecRef(loop)
+
+	agentsmu.Lock()
+	defer agentsmu.Unlock()
+
+	agent, exists := agents[self.agentnum]
+	if !exists {
+		setException("Agent already shutdown")
+		return nil
+	}
+	a := asyncs[self.agentnum]
+	if a == nil {
+		var err error
+		if a, err = newAsyncAgent(); err != nil {
+			setException(err.Error())
+			return nil
+		}
+		asyncs[self.agentnum] = a
+	}
+	if !a.bind(self, loop) {
+		return nil
+	}
+
+	future := C.create_future(loop)
+	if future == nil {
+		return nil
+	}
+	id := a.start(future)
+	go func() {
+		a.finish(id, agent.AddReport(report))
+	}()
+	return future
+}
+
+// AgentCompleteAsync is registered as the event loop's reader callback for an agent's completion
+// pipe. It resolves the futures of every add_report_async call that has finished.
+//export AgentCompleteAsync
+func AgentCompleteAsync(self *C.Agent, _ *C.PyObject) *C.PyObject {
+	agentsmu.RLock()
+	a := asyncs[self.agentnum]
+	agentsmu.RUnlock()
+	if a != nil {
+		a.resolve()
+	}
+	return C.none()
+}
+
+// asyncAgent delivers the results of add_report_async calls to an asyncio event loop. Each report
+// is added on its own goroutine, so any number may be in flight without tying up threads. A
+// finished report's result is queued, and the first result queued after the loop last drained
+// the queue writes a byte to a non-blocking pipe that is registered with the loop via add_reader.
+// The loop's callback then resolves all queued futures at once. Go never calls into Python off the
+// loop's thread, so no GIL is acquired per report.
+type asyncAgent struct {
+	readFd, writeFd int
+	// The loop the pipe is registered with. Only accessed while holding the GIL.
+	loop *C.PyObject
+
+	// inflight counts reports whose goroutines haven't finished.
+	inflight sync.WaitGroup
+
+	mutex    sync.Mutex
+	nextId   uint64
+	futures  map[uint64]*C.PyObject
+	finished []asyncResult
+	// signaled is true if a byte has been written to the pipe since the queue was last drained.
+	signaled bool
+}
+
+type asyncResult struct {
+	id  uint64
+	err error
+}
+
+func newAsyncAgent() (*asyncAgent, error) {
+	var fds [2]int
+	if err := syscall.Pipe(fds[:]); err != nil {
+		return nil, err
+	}
+	for _, fd := range fds {
+		syscall.CloseOnExec(fd)
+		if err := syscall.SetNonblock(fd, true); err != nil {
+			syscall.Close(fds[0])
+			syscall.Close(fds[1])
+			return nil, err
+		}
+	}
+	return &asyncAgent{readFd: fds[0], writeFd: fds[1], futures: make(map[uint64]*C.PyObject)}, nil
+}
+
+// bind registers the completion pipe with loop, if it isn't already. An agent serves one loop at a
+// time; it moves to a new loop only when none of its futures are pending, or when the old loop is
+// closed, whose futures no one can await. Returns false with a Python exception set on failure.
+// Must be called while holding the GIL.
+func (a *asyncAgent) bind(self *C.Agent, loop *C.PyObject) bool {
+	if a.loop == loop {
+		return true
+	}
+	if a.loop != nil && C.loop_closed(a.loop) != 0 {
+		a.abandon()
+	}
+	a.mutex.Lock()
+	pending := len(a.futures)
+	a.mutex.Unlock()
+	if pending > 0 {
+		setException("add_report_async: agent has pending reports on another event loop")
+		return false
+	}
+	a.unbind()
+	if C.add_reader(loop, C.int(a.readFd), self) != 0 {
+		return false
+	}
+	C.Py_IncRef(loop)
+	a.loop = loop
+	return true
+}
+
+func (a *asyncAgent) unbind() {
+	if a.loop != nil {
+		C.remove_reader(a.loop, C.int(a.readFd))
+		C.Py_DecRef(a.loop)
+		a.loop = nil
+	}
+}
+
+// abandon resolves the finished futures of the loop the agent is bound to, and forgets the rest; the
+// results of their reports are dropped when they finish. Must be called while holding the GIL.
+func (a *asyncAgent) abandon() {
+	a.resolve()
+	a.mutex.Lock()
+	futures := a.futures
+	a.futures = make(map[uint64]*C.PyObject)
+	a.mutex.Unlock()
+	for _, future := range futures {
+		C.Py_DecRef(future)
+	}
+	a.unbind()
+}
+
+// start records a future for a report about to be added, taking a reference to it, and returns
+// its id.
+func (a *asyncAgent) start(future *C.PyObject) uint64 {
+	C.Py_IncRef(future)
+	a.inflight.Add(1)
+	a.mutex.Lock()
+	defer a.mutex.Unlock()
+	id := a.nextId
+	a.nextId++
+	a.futures[id] = future
+	return id
+}
+
+// finish queues the result of a report and wakes the loop if needed. It doesn't require the GIL.
+func (a *asyncAgent) finish(id uint64, err error) {
+	defer a.inflight.Done()
+	a.mutex.Lock()
+	defer a.mutex.Unlock()
+	a.finished = append(a.finished, asyncResult{id, err})
+	if !a.signaled {
+		a.signaled = true
+		syscall.Write(a.writeFd, []byte{0})
+	}
+}
+
+// resolve drains the pipe and resolves the futures of all finished reports. Must be called while
+// holding the GIL.
+func (a *asyncAgent) resolve() {
+	a.mutex.Lock()
+	var buf [64]byte
+	for {
+		if n, _ := syscall.Read(a.readFd, buf[:]); n <= 0 {
+			break
+		}
+	}
+	finished := a.finished
+	a.finished = nil
+	a.signaled = false
+	futures := make([]*C.PyObject, len(finished))
+	for i, r := range finished {
+		futures[i] = a.futures[r.id]
+		delete(a.futures, r.id)
+	}
+	a.mutex.Unlock()
+
+	for i, r := range finished {
+		if futures[i] == nil {
+			// Abandoned with its loop.
+			continue
+		}
+		if r.err == nil {
+			C.resolve_future(futures[i], nil)
+		} else {
+			message := C.CString(r.err.Error())
+			C.resolve_future(futures[i], message)
+			C.free(unsafe.Pointer(message))
+		}
+		C.Py_DecRef(futures[i])
+	}
+}
+
+// closeAsync waits for an agent's in-flight reports, resolves their futures, and releases its
+// asyncio state. Must be called while holding the GIL and agentsmu.
+func closeAsync(num C.int) {
+	a := asyncs[num]
+	if a == nil {
+		return
+	}
+	delete(asyncs, num)
+	a.inflight.Wait()
+	a.resolve()
+	a.unbind()
+	syscall.Close(a.readFd)
+	syscall.Close(a.writeFd)
+}
+
+// AgentBeforeFork is registered with os.register_at_fork to run just before the process forks. It
+// shares each agent with the forked process; see worker.h.
+//export AgentBeforeFork
+func AgentBeforeFork(module *C.PyObject, _ *C.PyObject) *C.PyObject {
+	agentsmu.Lock()
+	defer agentsmu.Unlock()
+	startWorkerServers()
+	return C.none()
+}
+
 func setException(err string) {
 	errCStr := C.CString(err)
 	defer C.free(unsafe.Pointer(errCStr))
@@ -12,22 +12,38 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#ifndef UBBAGENT_API_H
+#define UBBAGENT_API_H
+
 #define Py_LIMITED_API
 #include <Python.h>
 
-// PyAgent is our Agent object type. The only state is an agent number which maps back to state
-// stored on the Go side.
+// PyAgent is our Agent object type. Its state is an agent number which maps back to state stored on
+// the Go side, and what a forked process needs to reach the agent; see worker.h.
 typedef struct {
     PyObject_HEAD
     int agentnum;
+    // The fork generation the agent was created in.
+    unsigned long generation;
+    // The path of the socket the agent's process listens on for forked workers, or NULL if it hasn't
+    // forked. Owned by the Go side.
+    char *owneraddr;
+    // A forked worker's connection to the agent's process, or NULL.
+    struct worker *worker;
 } Agent;
 
 // These declarations must match the exported function definitions generated by api.go.
 int AgentInit(Agent *self, PyObject *args, PyObject *kwds);
 PyObject *AgentShutdown(Agent *self, PyObject *unused);
-PyObject *AgentAddReport(Agent *self, PyObject *report);
+PyObject *AgentAddReport(Agent *self, PyObject *args, PyObject *kwds);
 PyObject *AgentGetStatus(Agent *self, PyObject *unused);
+PyObject *AgentWaitForStatusChange(Agent *self, PyObject *args);
+PyObject *AgentAddReportAsync(Agent *self, PyObject *args, PyObject *kwds);
+PyObject *AgentCompleteAsync(Agent *self, PyObject *unused);
 void AgentDealloc(Agent *self);
+PyObject *AgentBeforeFork(PyObject *module, PyObject *unused);
 
 // Custom error object used for Agent exceptions.
 PyObject *AgentError;
+
+#endif  // UBBAGENT_API_H
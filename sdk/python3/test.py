@@ -12,6 +12,7 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+import asyncio
 import datetime
 import json
 import os
@@ -19,6 +20,7 @@ from os import path
 import shutil
 import tempfile
 import time
+import traceback
 import unittest
 
 import ubbagent
@@ -126,6 +128,170 @@ class AgentSdkTest(unittest.TestCase):
         found_requests2,
         'Did not find a "requests" report for agent 2 with value 1000')
 
+  def testWaitForStatusChange(self):
+    # Version 0 returns the current status immediately.
+    initial = json.loads(self.agent1.wait_for_status_change(0, 10))
+    self.assertGreater(initial['version'], 0)
+
+    # Without a change, the wait times out and returns the same version.
+    unchanged = json.loads(
+        self.agent1.wait_for_status_change(initial['version'], 0.1))
+    self.assertEqual(initial['version'], unchanged['version'])
+
+    # The heartbeat's next successful send changes the status.
+    changed = json.loads(
+        self.agent1.wait_for_status_change(initial['version'], 10))
+    self.assertGreater(changed['version'], initial['version'])
+
+  def testAddReportDict(self):
+    now = datetime.datetime.utcnow()
+    self.agent1.add_report({
+        'name': 'requests',
+        'startTime': now,
+        'endTime': now,
+        'labels': {'tenant': 'a'},
+        'value': {'int64Value': 10},
+    })
+    self.agent1.add_report(
+        name='requests', start_time=now, end_time=now, labels={'tenant': 'a'},
+        value=20)
+    # Aware datetimes are converted to UTC; strings are RFC 3339.
+    aware = now.replace(tzinfo=datetime.timezone(datetime.timedelta(hours=-7)))
+    self.agent1.add_report(
+        name='requests', start_time=now.isoformat() + 'Z',
+        end_time=aware - datetime.timedelta(hours=7), labels={'tenant': 'a'},
+        value=30)
+
+    for bad in [
+        {'name': 'requests', 'startTime': 5, 'endTime': now, 'value': 1},
+        {'name': 'requests', 'startTime': now, 'endTime': now, 'value': '1'},
+        {'name': 'requests', 'startTime': now, 'endTime': now, 'value': 1,
+         'labels': {'tenant': 1}},
+        {'name': 'requests', 'start': now, 'endTime': now, 'value': 1},
+    ]:
+      with self.assertRaises(ubbagent.AgentError):
+        self.agent1.add_report(bad)
+    with self.assertRaises(ubbagent.AgentError):
+      self.agent1.add_report([])
+
+    # Sleep to give the aggregator time to send the reports.
+    time.sleep(2)
+
+    total = 0
+    for report_file in os.listdir(self.reportDir1):
+      with open(path.join(self.reportDir1, report_file)) as f:
+        report = json.load(f)
+      if report['name'] == 'requests':
+        self.assertEqual({'tenant': 'a'}, report['labels'])
+        total += report['value']['int64Value']
+    self.assertEqual(60, total)
+
+  def testAddReportAsync(self):
+    async def add_reports():
+      # Many reports in flight at once, all resolved by the event loop.
+      await asyncio.gather(*[
+          self.agent1.add_report_async(report_now('requests', 1))
+          for _ in range(1000)])
+      with self.assertRaises(ubbagent.AgentError):
+        await self.agent1.add_report_async('invalid_json')
+
+    loop = asyncio.new_event_loop()
+    try:
+      loop.run_until_complete(add_reports())
+    finally:
+      loop.close()
+
+    # Sleep to give the aggregator time to send the reports.
+    time.sleep(2)
+
+    total = 0
+    for report_file in os.listdir(self.reportDir1):
+      with open(path.join(self.reportDir1, report_file)) as f:
+        report = json.load(f)
+      if report['name'] == 'requests':
+        total += report['value']['int64Value']
+    self.assertEqual(1000, total)
+
+    # The agent can move to a new event loop once the old one is finished.
+    async def add_report():
+      await self.agent1.add_report_async(report_now('requests', 1))
+
+    loop = asyncio.new_event_loop()
+    try:
+      loop.run_until_complete(add_report())
+    finally:
+      loop.close()
+
+  def testAddReportAsyncAfterClosedLoop(self):
+    # A loop closed while one of its reports is pending doesn't hold the agent.
+    async def add_report_without_waiting():
+      self.agent1.add_report_async(report_now('requests', 1))
+
+    loop = asyncio.new_event_loop()
+    try:
+      loop.run_until_complete(add_report_without_waiting())
+    finally:
+      loop.close()
+
+    async def add_report():
+      await self.agent1.add_report_async(report_now('requests', 2))
+
+    loop = asyncio.new_event_loop()
+    try:
+      loop.run_until_complete(add_report())
+    finally:
+      loop.close()
+
+  def testForkedWorkers(self):
+    def worker():
+      # A forked process adds reports through the agent of the process that forked it.
+      self.agent1.add_report(report_now('requests', 1))
+      self.agent1.add_report(
+          name='requests', start_time=datetime.datetime.utcnow(),
+          end_time=datetime.datetime.utcnow(), value=2)
+      json.loads(self.agent1.get_status())
+      with self.assertRaises(ubbagent.AgentError):
+        self.agent1.add_report('invalid_json')
+      with self.assertRaises(ubbagent.AgentError):
+        self.agent1.wait_for_status_change(0, 1)
+      # So does a process forked by a forked process.
+      run_forked(lambda: self.agent1.add_report(report_now('requests', 4)))
+      # Shutting down only disconnects the worker.
+      self.agent1.shutdown()
+      with self.assertRaises(ubbagent.AgentError):
+        self.agent1.add_report(report_now('requests', 1000))
+
+    for _ in range(3):
+      run_forked(worker)
+    self.agent1.add_report(report_now('requests', 100))
+
+    # Sleep to give the aggregator time to send the reports.
+    time.sleep(2)
+
+    total = 0
+    for report_file in os.listdir(self.reportDir1):
+      with open(path.join(self.reportDir1, report_file)) as f:
+        report = json.load(f)
+      if report['name'] == 'requests':
+        total += report['value']['int64Value']
+    self.assertEqual(3 * 7 + 100, total)
+
+
+def run_forked(fn):
+  '''Runs fn in a forked process and waits for it to exit. Fails if fn raises.'''
+  pid = os.fork()
+  if pid == 0:
+    code = 0
+    try:
+      fn()
+    except BaseException:
+      traceback.print_exc()
+      code = 1
+    os._exit(code)
+  _, status = os.waitpid(pid, 0)
+  if status != 0:
+    raise AssertionError('forked process failed with status %d' % status)
+
 
 if __name__ == '__main__':
   unittest.main()
@@ -0,0 +1,353 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "worker.h"
+#include "report.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// How long a worker waits for the owner to accept or answer a request. The owner only blocks while
+// adding a report, so this is reached only if it has stopped responding.
+#define WORKER_TIMEOUT_SECONDS 30
+
+// The largest reply a worker accepts.
+#define WORKER_MAX_REPLY (16 << 20)
+
+unsigned long fork_generation = 0;
+
+// A worker's connection to its agent's owner.
+struct worker {
+    // The fork generation the connection was made in.
+    unsigned long generation;
+    // Serializes requests from the worker's threads.
+    pthread_mutex_t mutex;
+    // The connection, or -1 if there is none yet or the last request failed.
+    int fd;
+    // Whether the worker has shut down the agent.
+    int shutdown;
+};
+
+static PyObject* after_fork_in_child(PyObject *module, PyObject *unused) {
+    fork_generation++;
+    Py_RETURN_NONE;
+}
+
+// The hooks are inherited by forked processes, which must not call into Go. Only the process that
+// loaded the module, in fork generation 0, owns agents and shares them.
+static PyObject* before_fork(PyObject *module, PyObject *unused) {
+    if (fork_generation != 0) {
+        Py_RETURN_NONE;
+    }
+    return AgentBeforeFork(module, unused);
+}
+
+static PyMethodDef before_fork_def = {"_before_fork", before_fork, METH_NOARGS, NULL};
+static PyMethodDef after_fork_in_child_def = {"_after_fork_in_child", after_fork_in_child,
+                                              METH_NOARGS, NULL};
+
+int register_fork_hooks(void) {
+    PyObject *os = PyImport_ImportModule("os");
+    if (os == NULL) {
+        return -1;
+    }
+    PyObject *register_at_fork = PyObject_GetAttrString(os, "register_at_fork");
+    Py_DECREF(os);
+    if (register_at_fork == NULL) {
+        PyErr_Clear();
+        return 0;
+    }
+    PyObject *before = PyCFunction_New(&before_fork_def, NULL);
+    PyObject *after = PyCFunction_New(&after_fork_in_child_def, NULL);
+    PyObject *args = PyTuple_New(0);
+    PyObject *kwds = before == NULL || after == NULL
+        ? NULL
+        : Py_BuildValue("{sOsO}", "before", before, "after_in_child", after);
+    PyObject *result = args == NULL || kwds == NULL ? NULL : PyObject_Call(register_at_fork, args, kwds);
+    Py_XDECREF(result);
+    Py_XDECREF(kwds);
+    Py_XDECREF(args);
+    Py_XDECREF(after);
+    Py_XDECREF(before);
+    Py_DECREF(register_at_fork);
+    return result == NULL ? -1 : 0;
+}
+
+// Returns self's connection state in this process, or NULL with a Python exception set.
+static struct worker* get_worker(Agent *self) {
+    struct worker *w = self->worker;
+    int shutdown = 0;
+    if (w != NULL && w->generation != fork_generation) {
+        // Inherited from a worker that forked. Its mutex may be held by a thread that doesn't exist in
+        // this process, so it's abandoned rather than destroyed.
+        if (w->fd >= 0) {
+            close(w->fd);
+        }
+        shutdown = w->shutdown;
+        free(w);
+        w = self->worker = NULL;
+    }
+    if (w == NULL) {
+        w = calloc(1, sizeof(struct worker));
+        if (w == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        w->generation = fork_generation;
+        pthread_mutex_init(&w->mutex, NULL);
+        w->fd = -1;
+        w->shutdown = shutdown;
+        self->worker = w;
+    }
+    return w;
+}
+
+static int connect_owner(const char *addr) {
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(addr) >= sizeof(sa.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(sa.sun_path, addr);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct timeval timeout = {WORKER_TIMEOUT_SECONDS, 0};
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0 ||
+        connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+static int write_all(int fd, const char *data, size_t n) {
+    while (n > 0) {
+        ssize_t written = write(fd, data, n);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        data += written;
+        n -= (size_t)written;
+    }
+    return 0;
+}
+
+// Reads exactly n bytes. Returns -1 with errno 0 if the connection was closed.
+static int read_all(int fd, char *data, size_t n) {
+    while (n > 0) {
+        ssize_t read_ = read(fd, data, n);
+        if (read_ < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_ == 0) {
+            errno = 0;
+        }
+        if (read_ <= 0) {
+            return -1;
+        }
+        data += read_;
+        n -= (size_t)read_;
+    }
+    return 0;
+}
+
+static void put_header(char *header, char op, size_t len) {
+    header[0] = op;
+    for (int i = 0; i < 4; i++) {
+        header[1 + i] = (char)(len >> (8 * i));
+    }
+}
+
+static size_t get_length(const char *header) {
+    size_t len = 0;
+    for (int i = 0; i < 4; i++) {
+        len |= (size_t)(unsigned char)header[1 + i] << (8 * i);
+    }
+    return len;
+}
+
+// Sends a request and reads its reply. The reply's payload is NUL-terminated and must be freed. On
+// failure, closes the connection and writes an error message to err. Called without the GIL.
+static char* exchange(struct worker *w, const char *addr, char op, const char *payload, size_t len,
+                      char *reply_op, size_t *reply_len, char *err, size_t err_cap) {
+    const char *stage = "connecting to the agent's process";
+    char header[5];
+    char *reply = NULL;
+    if (w->fd < 0 && (w->fd = connect_owner(addr)) < 0) {
+        goto fail;
+    }
+    stage = "sending to the agent's process";
+    put_header(header, op, len);
+    if (write_all(w->fd, header, sizeof(header)) != 0 || write_all(w->fd, payload, len) != 0) {
+        goto fail;
+    }
+    stage = "reading from the agent's process";
+    if (read_all(w->fd, header, sizeof(header)) != 0) {
+        goto fail;
+    }
+    *reply_op = header[0];
+    *reply_len = get_length(header);
+    if (*reply_len > WORKER_MAX_REPLY || (reply = malloc(*reply_len + 1)) == NULL) {
+        errno = ENOMEM;
+        goto fail;
+    }
+    if (read_all(w->fd, reply, *reply_len) != 0) {
+        goto fail;
+    }
+    reply[*reply_len] = 0;
+    return reply;
+
+fail:
+    snprintf(err, err_cap, "%s: %s", stage, errno == 0 ? "connection closed" : strerror(errno));
+    free(reply);
+    if (w->fd >= 0) {
+        close(w->fd);
+        w->fd = -1;
+    }
+    return NULL;
+}
+
+// Sends a request to self's owner, releasing the GIL while waiting. Returns the reply's payload, which
+// must be freed, or NULL with a Python exception set. An error reply raises AgentError.
+static char* request(Agent *self, char op, const char *payload, size_t len, size_t *reply_len) {
+    struct worker *w = get_worker(self);
+    if (w == NULL) {
+        return NULL;
+    }
+    if (w->shutdown) {
+        PyErr_SetString(AgentError, "Agent already shutdown");
+        return NULL;
+    }
+    const char *addr = self->owneraddr;
+    if (addr == NULL) {
+        PyErr_SetString(AgentError,
+                        "Agent's process did not share it before forking; see os.register_at_fork");
+        return NULL;
+    }
+
+    char *reply;
+    char reply_op = 0;
+    char err[256];
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&w->mutex);
+    reply = exchange(w, addr, op, payload, len, &reply_op, reply_len, err, sizeof(err));
+    pthread_mutex_unlock(&w->mutex);
+    Py_END_ALLOW_THREADS
+
+    if (reply == NULL) {
+        PyErr_SetString(AgentError, err);
+        return NULL;
+    }
+    if (reply_op != WORKER_OK) {
+        PyErr_SetString(AgentError, reply);
+        free(reply);
+        return NULL;
+    }
+    return reply;
+}
+
+PyObject* worker_add_report(Agent *self, PyObject *args, PyObject *kwds) {
+    char stack[512];
+    char *buf = stack;
+    size_t n;
+    int result = read_report(args, kwds, buf, sizeof(stack), &n);
+    if (result == READ_REPORT_TOO_SMALL) {
+        if ((buf = malloc(n)) == NULL) {
+            return PyErr_NoMemory();
+        }
+        result = read_report(args, kwds, buf, n, &n);
+    }
+
+    char *reply = NULL;
+    if (result == READ_REPORT_ERROR) {
+        PyErr_SetString(AgentError, buf);
+    } else {
+        char op = result == READ_REPORT_JSON ? WORKER_REPORT_JSON : WORKER_REPORT_FIELDS;
+        size_t reply_len;
+        reply = request(self, op, buf, n, &reply_len);
+    }
+    if (buf != stack) {
+        free(buf);
+    }
+    if (reply == NULL) {
+        return NULL;
+    }
+    free(reply);
+    Py_RETURN_NONE;
+}
+
+PyObject* worker_get_status(Agent *self) {
+    size_t len;
+    char *reply = request(self, WORKER_GET_STATUS, NULL, 0, &len);
+    if (reply == NULL) {
+        return NULL;
+    }
+    PyObject *status = PyUnicode_FromStringAndSize(reply, (Py_ssize_t)len);
+    free(reply);
+    return status;
+}
+
+PyObject* worker_shutdown(Agent *self) {
+    struct worker *w = get_worker(self);
+    if (w == NULL) {
+        return NULL;
+    }
+    if (w->shutdown) {
+        PyErr_SetString(AgentError, "Agent already shutdown");
+        return NULL;
+    }
+    // Waits for a request in flight on another thread, which doesn't need the GIL to finish.
+    pthread_mutex_lock(&w->mutex);
+    if (w->fd >= 0) {
+        close(w->fd);
+        w->fd = -1;
+    }
+    w->shutdown = 1;
+    pthread_mutex_unlock(&w->mutex);
+    Py_RETURN_NONE;
+}
+
+void worker_dealloc(Agent *self) {
+    struct worker *w = self->worker;
+    if (w == NULL) {
+        return;
+    }
+    if (w->generation == fork_generation) {
+        pthread_mutex_destroy(&w->mutex);
+    }
+    if (w->fd >= 0) {
+        close(w->fd);
+    }
+    free(w);
+    self->worker = NULL;
+}
@@ -0,0 +1,212 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package main
+
+/*
+#cgo pkg-config: python3
+#include <stdlib.h>
+#include "worker.h"
+*/
+import "C"
+import (
+	"bufio"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"net"
+	"os"
+	"path/filepath"
+	"sync"
+	"unsafe"
+
+	"github.com/GoogleCloudPlatform/ubbagent/sdk"
+)
+
+// The largest request a worker server accepts.
+const maxWorkerRequest = 16 << 20
+
+// The agent objects of the agents in the agents map, which let startWorkerServers publish each server's
+// address to the processes it forks. Protected by agentsmu.
+var agentObjects = make(map[C.int]*C.Agent)
+
+// The worker server of each agent whose process has forked, keyed like agents. Protected by
+// agentsmu.
+var workerServers = make(map[C.int]*workerServer)
+
+// startWorkerServers starts a worker server for each agent that lacks one. An agent whose server
+// can't be started is left unshared, and its workers' calls fail. Must be called while holding the
+// GIL and agentsmu.
+func startWorkerServers() {
+	for num, agent := range agents {
+		if workerServers[num] != nil {
+			continue
+		}
+		s, err := newWorkerServer(agent)
+		if err != nil {
+			fmt.Fprintf(os.Stderr, "ubbagent: not sharing agent with forked processes: %v\n", err)
+			continue
+		}
+		workerServers[num] = s
+		agentObjects[num].owneraddr = s.addr
+	}
+}
+
+// closeWorkerServer stops an agent's worker server, if it has one, and waits for the requests it is
+// handling. Must be called while holding the GIL and agentsmu.
+func closeWorkerServer(num C.int) {
+	if self := agentObjects[num]; self != nil {
+		self.owneraddr = nil
+		delete(agentObjects, num)
+	}
+	if s := workerServers[num]; s != nil {
+		delete(workerServers, num)
+		s.close()
+	}
+}
+
+// workerServer handles the calls of an agent's forked workers. It listens on a Unix socket in a
+// private temporary directory, and serves each connection on its own goroutine. The protocol is
+// described in worker.h.
+type workerServer struct {
+	agent    *sdk.Agent
+	dir      string
+	listener *net.UnixListener
+	// The socket's path, which the agent object points to. Freed by close.
+	addr *C.char
+
+	mutex sync.Mutex
+	conns map[*net.UnixConn]bool
+	wg    sync.WaitGroup
+}
+
+func newWorkerServer(agent *sdk.Agent) (*workerServer, error) {
+	dir, err := ioutil.TempDir("", "ubbagent")
+	if err != nil {
+		return nil, err
+	}
+	path := filepath.Join(dir, "agent.sock")
+	listener, err := net.ListenUnix("unix", &net.UnixAddr{Name: path, Net: "unix"})
+	if err != nil {
+		os.RemoveAll(dir)
+		return nil, err
+	}
+	s := &workerServer{
+		agent:    agent,
+		dir:      dir,
+		listener: listener,
+		addr:     C.CString(path),
+		conns:    make(map[*net.UnixConn]bool),
+	}
+	s.wg.Add(1)
+	go s.accept()
+	return s, nil
+}
+
+func (s *workerServer) accept() {
+	defer s.wg.Done()
+	for {
+		conn, err := s.listener.AcceptUnix()
+		if err != nil {
+			return
+		}
+		s.mutex.Lock()
+		if s.conns == nil {
+			// Closed.
+			s.mutex.Unlock()
+			conn.Close()
+			return
+		}
+		s.conns[conn] = true
+		s.wg.Add(1)
+		s.mutex.Unlock()
+		go s.serve(conn)
+	}
+}
+
+func (s *workerServer) serve(conn *net.UnixConn) {
+	defer s.wg.Done()
+	defer func() {
+		s.mutex.Lock()
+		delete(s.conns, conn)
+		s.mutex.Unlock()
+		conn.CloseWrite()
+		conn.Close()
+	}()
+	r := bufio.NewReader(conn)
+	var header [5]byte
+	for {
+		if _, err := io.ReadFull(r, header[:]); err != nil {
+			return
+		}
+		n := binary.LittleEndian.Uint32(header[1:])
+		if n > maxWorkerRequest {
+			return
+		}
+		payload := make([]byte, n)
+		if _, err := io.ReadFull(r, payload); err != nil {
+			return
+		}
+		reply, err := s.handle(header[0], payload)
+		header[0] = C.WORKER_OK
+		if err != nil {
+			header[0] = C.WORKER_ERROR
+			reply = []byte(err.Error())
+		}
+		binary.LittleEndian.PutUint32(header[1:], uint32(len(reply)))
+		if _, err := conn.Write(append(header[:], reply...)); err != nil {
+			return
+		}
+	}
+}
+
+func (s *workerServer) handle(op byte, payload []byte) ([]byte, error) {
+	switch op {
+	case C.WORKER_REPORT_FIELDS:
+		report, err := decodeReport(payload)
+		if err != nil {
+			return nil, err
+		}
+		return nil, s.agent.AddReport(report)
+	case C.WORKER_REPORT_JSON:
+		report, err := sdk.ParseReport(payload)
+		if err != nil {
+			return nil, err
+		}
+		return nil, s.agent.AddReport(report)
+	case C.WORKER_GET_STATUS:
+		return s.agent.GetStatusJson()
+	default:
+		return nil, errors.New("unknown request")
+	}
+}
+
+// close stops accepting connections, disconnects the workers and waits for the requests being
+// handled. Workers may hold copies of the server's sockets, inherited when they forked, so
+// connections are shut down rather than only closed, and the socket's path is removed so that no
+// new connection can reach the listener. A request being handled still gets its reply.
+func (s *workerServer) close() {
+	s.listener.Close()
+	os.RemoveAll(s.dir)
+	s.mutex.Lock()
+	for conn := range s.conns {
+		conn.CloseRead()
+	}
+	s.conns = nil
+	s.mutex.Unlock()
+	s.wg.Wait()
+	C.free(unsafe.Pointer(s.addr))
+}
@@ -0,0 +1,56 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// An agent belongs to the process that created it, its owner. The Go runtime doesn't survive fork,
+// so a forked process (a worker, such as a gunicorn or uWSGI worker) must never call into Go.
+// Instead, just before the owner forks, each of its agents starts listening on a Unix socket, and a
+// worker's calls are sent over a connection to it and handled by the owner's agent. A worker
+// therefore costs no Go runtime, pipeline or state directory of its own.
+//
+// Forks are detected with os.register_at_fork: its before hook starts the listeners, and its
+// after_in_child hook increments fork_generation, so an agent whose generation differs belongs to
+// an ancestor process. Forked processes inherit the hooks, so the before hook does nothing in a
+// process whose fork_generation isn't 0.
+#include "api.h"
+
+// A request is a one-byte op, a 4-byte little-endian payload length, and the payload. Each request
+// gets one reply, in the same format, whose op is WORKER_OK or WORKER_ERROR.
+enum {
+    WORKER_REPORT_FIELDS = 'f',  // a report written by read_report as fields
+    WORKER_REPORT_JSON = 'j',    // a report as JSON
+    WORKER_GET_STATUS = 's',     // no payload; the reply holds the status as JSON
+    WORKER_OK = 'k',
+    WORKER_ERROR = 'x',          // the payload is an error message
+};
+
+// The number of forks between the interpreter's start and this process.
+extern unsigned long fork_generation;
+
+// Returns whether self was created by an ancestor of this process.
+static inline int agent_forked(Agent *self) {
+    return self->generation != fork_generation;
+}
+
+// Registers the fork hooks with os.register_at_fork. Does nothing before Python 3.7, which lacks it.
+int register_fork_hooks(void);
+
+// A worker's versions of add_report and get_status.
+PyObject *worker_add_report(Agent *self, PyObject *args, PyObject *kwds);
+PyObject *worker_get_status(Agent *self);
+
+// Closes a worker's connection. Later calls fail as though the agent had been shut down.
+PyObject *worker_shutdown(Agent *self);
+
+// Releases a worker's connection, if it has one.
+void worker_dealloc(Agent *self);
@@ -15,23 +15,43 @@
 package sdk
 
 import (
+	"context"
 	"encoding/json"
+	"errors"
+	"flag"
+	"fmt"
+	"time"
 
+	"github.com/GoogleCloudPlatform/ubbagent/admission"
 	"github.com/GoogleCloudPlatform/ubbagent/config"
 	"github.com/GoogleCloudPlatform/ubbagent/metrics"
 	"github.com/GoogleCloudPlatform/ubbagent/persistence"
 	"github.com/GoogleCloudPlatform/ubbagent/pipeline"
 	"github.com/GoogleCloudPlatform/ubbagent/pipeline/builder"
+	"github.com/GoogleCloudPlatform/ubbagent/pipeline/endpoints"
+	"github.com/GoogleCloudPlatform/ubbagent/pipeline/inputs"
+	"github.com/GoogleCloudPlatform/ubbagent/pipeline/senders"
 	"github.com/GoogleCloudPlatform/ubbagent/stats"
 )
 
+var shutdownTimeout = flag.Duration("shutdown_timeout", 10*time.Second, "how long Shutdown waits for reports in flight to be sent before cancelling them; cancelled and unsent reports stay in the state directory and are sent after a restart")
+
 // Agent is a convenience type that encapsulates a pipeline.Input and a stats.Provider and provides
 // programmatic interfaces similar to those provided by the standalone agent: init, add report,
 // get status, shutdown. Agent is used by the various language-specific SDK implementations
 // contained under this package.
 type Agent struct {
-	input    pipeline.Input
-	provider stats.Provider
+	input       pipeline.Input
+	provider    stats.Watcher
+	cardinality *stats.Cardinality
+	dedup       *inputs.DedupInput
+	queryable   []endpoints.QueryableEndpoint
+	senders     []*senders.RetryingSender
+	admission   *admission.Controller
+	persistence persistence.Persistence
+	handoff     *pipeline.Handoff
+	// Whether state is kept in a state directory, where another process can take it over.
+	durable bool
 }
 
 // NewAgent creates a new Agent. The configuration is passed as YAML or JSON in configData. The
@@ -54,35 +74,110 @@ func NewAgent(configData []byte, stateDir string) (*Agent, error) {
 	}
 
 	basic := stats.NewBasic()
-	input, err := builder.Build(cfg, p, basic)
+	cardinality := stats.NewCardinality()
+	handoff := &pipeline.Handoff{}
+	input, retrying, err := builder.Build(cfg, p, basic, cardinality, handoff)
+	if err != nil {
+		return nil, err
+	}
+	var queryable []endpoints.QueryableEndpoint
+	for _, rs := range retrying {
+		if q, ok := rs.Endpoint().(endpoints.QueryableEndpoint); ok {
+			queryable = append(queryable, q)
+		}
+	}
+	dedup, err := inputs.NewDedupInput(input, p)
 	if err != nil {
+		input.Release()
 		return nil, err
 	}
 
-	return &Agent{input, basic}, nil
+	return &Agent{dedup, basic, cardinality, dedup, queryable, retrying, admission.NewController(cfg), p, handoff, stateDir != ""}, nil
 }
 
-// Shutdown terminates this agent.
+// Shutdown terminates this agent. It waits up to --shutdown_timeout for reports being sent to be
+// sent; see ShutdownContext.
 func (agent *Agent) Shutdown() error {
+	ctx, cancel := context.WithTimeout(context.Background(), *shutdownTimeout)
+	defer cancel()
+	return agent.ShutdownContext(ctx)
+}
+
+// ShutdownContext terminates this agent. If ctx is done before the agent's endpoints finish sending
+// reports, for example because an endpoint's service doesn't respond, the sends are cancelled and
+// ShutdownContext returns promptly. Those reports, and any not yet sent, remain in the persisted
+// retry queues, and are sent by the next agent created on the same state directory.
+func (agent *Agent) ShutdownContext(ctx context.Context) error {
+	released := make(chan struct{})
+	defer close(released)
+	go func() {
+		select {
+		case <-ctx.Done():
+			for _, rs := range agent.senders {
+				rs.Interrupt()
+			}
+		case <-released:
+		}
+	}()
 	err := agent.input.Release()
 	if err != nil {
 		return err
 	}
-	return nil
+	// Write state that the pipeline stored in the background.
+	return agent.persistence.Flush()
 }
 
-// AddReport adds a new usage report.
+// ShutdownForHandoff terminates this agent so that another process can take over its state
+// directory. Unlike Shutdown, reports being aggregated are left in the state directory with their
+// aggregation periods in progress, rather than sent early; the next agent created on the directory
+// resumes them. An agent without a state directory sends them as Shutdown does.
+func (agent *Agent) ShutdownForHandoff() error {
+	if agent.durable {
+		agent.handoff.Begin()
+	}
+	return agent.Shutdown()
+}
+
+// AddReport adds a new usage report. If the report carries an IdempotencyKey that was accepted
+// recently, the report is dropped and nil is returned. If the report exceeds a configured rate
+// limit, an *admission.RateLimitedError is returned and the report may be retried later.
 func (agent *Agent) AddReport(report metrics.MetricReport) error {
-	return agent.input.AddReport(report)
+	return agent.AddReportFrom(admission.LocalClient, report)
+}
+
+// AddReportFrom adds a new usage report on behalf of the given client, whose reports are subject to
+// the configured per-client rate limit. See AddReport.
+func (agent *Agent) AddReportFrom(client string, report metrics.MetricReport) error {
+	return agent.addReport(context.Background(), client, report)
+}
+
+// AddReportContext is like AddReport, but gives up if the pipeline can't accept the report before
+// ctx is done, returning ctx's error. The report is then not added, and may be retried or dropped.
+// See pipeline.ContextInput.
+func (agent *Agent) AddReportContext(ctx context.Context, report metrics.MetricReport) error {
+	return agent.addReport(ctx, admission.LocalClient, report)
+}
+
+func (agent *Agent) addReport(ctx context.Context, client string, report metrics.MetricReport) error {
+	if err := agent.admission.Admit(client, report.Name); err != nil {
+		return err
+	}
+	return pipeline.AddReportContext(ctx, agent.input, report)
 }
 
 // AddReportJson adds a new usage report after fist unmarshalling it from JSON.
 func (agent *Agent) AddReportJson(reportData []byte) error {
+	return agent.AddReportJsonContext(context.Background(), reportData)
+}
+
+// AddReportJsonContext adds a new usage report, unmarshalled from JSON, within ctx. See
+// AddReportContext.
+func (agent *Agent) AddReportJsonContext(ctx context.Context, reportData []byte) error {
 	report, err := ParseReport(reportData)
 	if err != nil {
 		return err
 	}
-	return agent.AddReport(report)
+	return agent.AddReportContext(ctx, report)
 }
 
 // GetStatus returns a stats.Snapshot object containing current agent status.
@@ -96,6 +191,137 @@ func (agent *Agent) GetStatusJson() ([]byte, error) {
 	return SerializeStatus(status)
 }
 
+// WaitForStatusChange blocks until the agent's status differs from the given version, as found in
+// stats.Snapshot.Version, or until ctx is done, and then returns the current status. Version 0
+// returns the current status immediately.
+func (agent *Agent) WaitForStatusChange(ctx context.Context, version uint64) stats.Snapshot {
+	return agent.provider.WaitForChange(ctx, version)
+}
+
+// GetCardinality returns the current label cardinality sketches for each metric.
+func (agent *Agent) GetCardinality() stats.CardinalitySnapshot {
+	return agent.cardinality.Snapshot()
+}
+
+// GetCardinalityJson returns a stats.CardinalitySnapshot object serialized as JSON.
+func (agent *Agent) GetCardinalityJson() ([]byte, error) {
+	return json.Marshal(agent.GetCardinality())
+}
+
+// GetDedup returns the state of the agent's idempotency key deduplication.
+func (agent *Agent) GetDedup() inputs.DedupSnapshot {
+	return agent.dedup.Snapshot()
+}
+
+// GetDedupJson returns an inputs.DedupSnapshot object serialized as JSON.
+func (agent *Agent) GetDedupJson() ([]byte, error) {
+	return json.Marshal(agent.GetDedup())
+}
+
+// GetAdmission returns the configured rate limits and the number of reports each has rejected.
+func (agent *Agent) GetAdmission() admission.Snapshot {
+	return agent.admission.Snapshot()
+}
+
+// GetAdmissionJson returns an admission.Snapshot object serialized as JSON.
+func (agent *Agent) GetAdmissionJson() ([]byte, error) {
+	return json.Marshal(agent.GetAdmission())
+}
+
+// GetCaptures returns the requests sampled by the named endpoint, or by every endpoint that
+// captures requests if endpoint is empty, keyed by endpoint name.
+func (agent *Agent) GetCaptures(endpoint string) (map[string][]endpoints.Capture, error) {
+	captures := make(map[string][]endpoints.Capture)
+	for _, rs := range agent.senders {
+		ep := rs.Endpoint()
+		if endpoint != "" && ep.Name() != endpoint {
+			continue
+		}
+		if c, ok := ep.(endpoints.CapturingEndpoint); ok {
+			captures[ep.Name()] = c.Captures()
+		} else if endpoint != "" {
+			return nil, fmt.Errorf("captures: endpoint does not capture requests: %v", endpoint)
+		}
+	}
+	if endpoint != "" && len(captures) == 0 {
+		return nil, fmt.Errorf("captures: endpoint does not exist: %v", endpoint)
+	}
+	return captures, nil
+}
+
+// GetCapturesJson returns the result of GetCaptures serialized as JSON.
+func (agent *Agent) GetCapturesJson(endpoint string) ([]byte, error) {
+	captures, err := agent.GetCaptures(endpoint)
+	if err != nil {
+		return nil, err
+	}
+	return json.Marshal(captures)
+}
+
+// Query calls fn for each report retained by the named endpoint that matches q. The endpoint may
+// be omitted if the agent has exactly one endpoint that retains reports, such as a disk endpoint.
+func (agent *Agent) Query(endpoint string, q endpoints.ReportQuery, fn func(metrics.StampedMetricReport) error) error {
+	var target endpoints.QueryableEndpoint
+	for _, ep := range agent.queryable {
+		if ep.Name() == endpoint || (endpoint == "" && len(agent.queryable) == 1) {
+			target = ep
+		}
+	}
+	if target == nil {
+		if endpoint == "" {
+			return errors.New("query: endpoint must be specified")
+		}
+		return fmt.Errorf("query: endpoint does not exist or cannot be queried: %v", endpoint)
+	}
+	return target.Query(q, fn)
+}
+
+// DeadLetters calls fn for each report that the named endpoint, or every endpoint if endpoint is
+// empty, gave up sending and that matches f. Reports that have been replayed are omitted.
+func (agent *Agent) DeadLetters(endpoint string, f senders.DeadLetterFilter, fn func(senders.DeadLetter) error) error {
+	targets, err := agent.deadLetterSenders(endpoint)
+	if err != nil {
+		return err
+	}
+	for _, rs := range targets {
+		if err := rs.DeadLetters(f, fn); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// ReplayDeadLetters re-sends the dead letters of the named endpoint, or every endpoint if endpoint
+// is empty, that match f, at no more than rate reports per second per endpoint. It returns the
+// number of reports re-sent.
+func (agent *Agent) ReplayDeadLetters(endpoint string, f senders.DeadLetterFilter, rate float64) (int, error) {
+	targets, err := agent.deadLetterSenders(endpoint)
+	if err != nil {
+		return 0, err
+	}
+	total := 0
+	for _, rs := range targets {
+		n, err := rs.Replay(f, rate)
+		total += n
+		if err != nil {
+			return total, err
+		}
+	}
+	return total, nil
+}
+
+func (agent *Agent) deadLetterSenders(endpoint string) ([]*senders.RetryingSender, error) {
+	if endpoint == "" {
+		return agent.senders, nil
+	}
+	for _, rs := range agent.senders {
+		if rs.Endpoint().Name() == endpoint {
+			return []*senders.RetryingSender{rs}, nil
+		}
+	}
+	return nil, fmt.Errorf("dead letters: endpoint does not exist: %v", endpoint)
+}
+
 // ParseReport parses the given JSON data and returns a metrics.MetricReport, or an error.
 func ParseReport(reportData []byte) (report metrics.MetricReport, err error) {
 	err = json.Unmarshal(reportData, &report)
@@ -15,6 +15,7 @@
 package stats
 
 import (
+	"context"
 	"flag"
 	"math"
 	"sync"
@@ -26,7 +27,7 @@ import (
 // The maximum number of pending sends to track before old items are dropped.
 var maxPendingSends = flag.Int("max_pending_sends", 1000, "maximum number of pending sends that are tracked for agent stats")
 
-// Basic is a stats.Recorder and stats.Provider that records and provides stats.Snapshot values.
+// Basic is a stats.Recorder and stats.Watcher that records and provides stats.Snapshot values.
 // Storage is in-memory and all stats are reset when the agent is restarted.
 type Basic struct {
 	clock        clock.Clock
@@ -34,6 +35,9 @@ type Basic struct {
 	pending      map[string]*pendingSend
 	pendingCount int64
 	current      Snapshot
+
+	// changed is closed, and replaced, each time current changes.
+	changed chan struct{}
 }
 
 func (s *Basic) Register(id string, handlers []string) {
@@ -76,6 +80,7 @@ func (s *Basic) SendSucceeded(id string, handler string) {
 		s.current.CurrentFailureCount = 0
 		// Set the last success time
 		s.current.LastReportSuccess = s.clock.Now()
+		s.changedLocked()
 	}
 }
 
@@ -88,6 +93,7 @@ func (s *Basic) SendFailed(id string, handler string) {
 		delete(s.pending, id)
 		s.current.CurrentFailureCount++
 		s.current.TotalFailureCount++
+		s.changedLocked()
 	} else {
 		glog.Warningf("stats.Basic: ignoring SendFailed from handler %v of unknown report id %v", handler, id)
 	}
@@ -99,12 +105,42 @@ func (s *Basic) Snapshot() Snapshot {
 	return s.current
 }
 
+// WaitForChange blocks until the Snapshot's version differs from version, or until ctx is done.
+// See stats.Watcher.
+func (s *Basic) WaitForChange(ctx context.Context, version uint64) Snapshot {
+	for {
+		s.mutex.RLock()
+		current, changed := s.current, s.changed
+		s.mutex.RUnlock()
+		if current.Version != version {
+			return current
+		}
+		select {
+		case <-changed:
+		case <-ctx.Done():
+			return current
+		}
+	}
+}
+
+// changedLocked bumps the snapshot version and wakes watchers. The mutex must be held.
+func (s *Basic) changedLocked() {
+	s.current.Version++
+	close(s.changed)
+	s.changed = make(chan struct{})
+}
+
 func NewBasic() *Basic {
 	return newBasic(clock.NewClock())
 }
 
 func newBasic(clock clock.Clock) *Basic {
-	return &Basic{pending: make(map[string]*pendingSend), clock: clock}
+	return &Basic{
+		pending: make(map[string]*pendingSend),
+		clock:   clock,
+		current: Snapshot{Version: 1},
+		changed: make(chan struct{}),
+	}
 }
 
 type pendingSend struct {
@@ -15,6 +15,7 @@
 package stats
 
 import (
+	"context"
 	"fmt"
 	"testing"
 	"time"
@@ -110,3 +111,44 @@ func TestSimple(t *testing.T) {
 		t.Fatalf("Pending set length should have been trimmed to %v, but was %v", *maxPendingSends, len(s.pending))
 	}
 }
+
+func TestWaitForChange(t *testing.T) {
+	mc := testlib.NewMockClock()
+	s := newBasic(mc)
+
+	// Version 0 is never current, so the first wait returns immediately.
+	snap := s.WaitForChange(context.Background(), 0)
+	if want, got := uint64(1), snap.Version; want != got {
+		t.Fatalf("snap.Version: want=%v, got=%v", want, got)
+	}
+
+	// A canceled wait returns the unchanged snapshot.
+	ctx, cancel := context.WithCancel(context.Background())
+	cancel()
+	if got := s.WaitForChange(ctx, snap.Version); got != snap {
+		t.Fatalf("canceled wait: want=%+v, got=%+v", snap, got)
+	}
+
+	// A waiter is woken by a change.
+	result := make(chan Snapshot)
+	go func() {
+		result <- s.WaitForChange(context.Background(), snap.Version)
+	}()
+	s.Register("report1", []string{"handler1"})
+	s.SendFailed("report1", "handler1")
+	select {
+	case got := <-result:
+		if got.Version != 2 || got.TotalFailureCount != 1 {
+			t.Fatalf("changed snapshot: want=(version 2, 1 failure), got=%+v", got)
+		}
+	case <-time.After(5 * time.Second):
+		t.Fatal("timeout waiting for change")
+	}
+
+	// A report that isn't yet complete changes nothing.
+	s.Register("report2", []string{"handler1", "handler2"})
+	s.SendSucceeded("report2", "handler1")
+	if want, got := uint64(2), s.Snapshot().Version; want != got {
+		t.Fatalf("snap.Version: want=%v, got=%v", want, got)
+	}
+}
@@ -0,0 +1,185 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package stats
+
+import (
+	"flag"
+	"sync"
+
+	"github.com/GoogleCloudPlatform/ubbagent/metrics"
+)
+
+var cardinalityTopK = flag.Int("cardinality_top_k", 10, "number of heaviest label sets reported per metric by the cardinality sketches")
+var cardinalityMaxLabelKeys = flag.Int("cardinality_max_label_keys", 32, "maximum number of distinct label keys tracked per metric by the cardinality sketches")
+
+// Cardinality maintains streaming sketches of the label sets seen by each metric: distinct counts
+// of label sets and of the values of each label key, and the heaviest label sets by report count
+// and by value. Memory use is bounded per metric regardless of how many label sets are seen.
+type Cardinality struct {
+	mutex   sync.RWMutex
+	metrics map[string]*MetricCardinality
+}
+
+// CardinalitySnapshot is a point-in-time view of a Cardinality's sketches, keyed by metric name.
+type CardinalitySnapshot struct {
+	Metrics map[string]MetricCardinalitySnapshot `json:"metrics"`
+}
+
+// MetricCardinalitySnapshot is a point-in-time view of a single metric's sketches. Distinct counts
+// are estimates with a standard error of roughly 3%.
+type MetricCardinalitySnapshot struct {
+	// The number of reports observed.
+	Reports int64 `json:"reports"`
+
+	// The estimated number of distinct label sets.
+	DistinctLabelSets uint64 `json:"distinctLabelSets"`
+
+	// The estimated number of distinct values of each tracked label key.
+	LabelKeys map[string]uint64 `json:"labelKeys"`
+
+	// The number of reports that carried a label key beyond the tracked key limit.
+	UntrackedLabelKeyReports int64 `json:"untrackedLabelKeyReports"`
+
+	// The label sets with the most reports.
+	TopByCount []LabelSetWeight `json:"topByCount"`
+
+	// The label sets with the largest summed values.
+	TopByValue []LabelSetWeight `json:"topByValue"`
+}
+
+// LabelSetWeight is a heavy-hitter entry. Weight overestimates the label set's true total by at
+// most Error.
+type LabelSetWeight struct {
+	Labels map[string]string `json:"labels"`
+	Weight float64           `json:"weight"`
+	Error  float64           `json:"error"`
+}
+
+// MetricCardinality holds the sketches for a single metric.
+type MetricCardinality struct {
+	mutex      sync.Mutex
+	reports    int64
+	labelSets  HyperLogLog
+	labelKeys  map[string]*HyperLogLog
+	untracked  int64
+	topByCount *TopK
+	topByValue *TopK
+}
+
+func NewCardinality() *Cardinality {
+	return &Cardinality{metrics: make(map[string]*MetricCardinality)}
+}
+
+// Metric returns the sketches for the named metric, creating them if necessary. Callers on the
+// ingest path should resolve this once and retain the result.
+func (c *Cardinality) Metric(name string) *MetricCardinality {
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+	m, ok := c.metrics[name]
+	if !ok {
+		// Space-Saving is only accurate for the heaviest keys, so track twice as many as we report.
+		m = &MetricCardinality{
+			labelKeys:  make(map[string]*HyperLogLog),
+			topByCount: NewTopK(2 * *cardinalityTopK),
+			topByValue: NewTopK(2 * *cardinalityTopK),
+		}
+		c.metrics[name] = m
+	}
+	return m
+}
+
+func (c *Cardinality) Snapshot() CardinalitySnapshot {
+	c.mutex.RLock()
+	defer c.mutex.RUnlock()
+	snap := CardinalitySnapshot{Metrics: make(map[string]MetricCardinalitySnapshot, len(c.metrics))}
+	for name, m := range c.metrics {
+		snap.Metrics[name] = m.Snapshot()
+	}
+	return snap
+}
+
+// Observe records a report in the metric's sketches.
+func (m *MetricCardinality) Observe(report metrics.MetricReport) {
+	// Hash the label set in sorted key order so that equal maps hash equally. Most reports carry
+	// only a few labels, so the key slice normally lives on the stack.
+	var keyBuf [8]string
+	keys := keyBuf[:0]
+	for k := range report.Labels {
+		// Insertion sort; sort.Strings would force keys onto the heap.
+		i := len(keys)
+		keys = append(keys, k)
+		for ; i > 0 && keys[i-1] > k; i-- {
+			keys[i] = keys[i-1]
+		}
+		keys[i] = k
+	}
+	setHash := uint64(fnvOffset)
+	for _, k := range keys {
+		setHash = mix64(setHash ^ hashString(k))
+		setHash = mix64(setHash ^ hashString(report.Labels[k]))
+	}
+	value := float64(report.Value.Int64Value) + report.Value.DoubleValue
+	if value < 0 {
+		value = 0
+	}
+
+	m.mutex.Lock()
+	defer m.mutex.Unlock()
+	m.reports++
+	m.labelSets.AddHash(setHash)
+	untracked := false
+	for _, k := range keys {
+		hll, ok := m.labelKeys[k]
+		if !ok {
+			if len(m.labelKeys) >= *cardinalityMaxLabelKeys {
+				untracked = true
+				continue
+			}
+			hll = &HyperLogLog{}
+			m.labelKeys[k] = hll
+		}
+		hll.AddHash(hashString(report.Labels[k]))
+	}
+	if untracked {
+		m.untracked++
+	}
+	m.topByCount.Add(setHash, 1, report.Labels)
+	m.topByValue.Add(setHash, value, report.Labels)
+}
+
+func (m *MetricCardinality) Snapshot() MetricCardinalitySnapshot {
+	m.mutex.Lock()
+	defer m.mutex.Unlock()
+	snap := MetricCardinalitySnapshot{
+		Reports:                  m.reports,
+		DistinctLabelSets:        m.labelSets.Estimate(),
+		LabelKeys:                make(map[string]uint64, len(m.labelKeys)),
+		UntrackedLabelKeyReports: m.untracked,
+		TopByCount:               labelSetWeights(m.topByCount.Top(*cardinalityTopK)),
+		TopByValue:               labelSetWeights(m.topByValue.Top(*cardinalityTopK)),
+	}
+	for k, hll := range m.labelKeys {
+		snap.LabelKeys[k] = hll.Estimate()
+	}
+	return snap
+}
+
+func labelSetWeights(entries []TopKEntry) []LabelSetWeight {
+	weights := make([]LabelSetWeight, len(entries))
+	for i, e := range entries {
+		weights[i] = LabelSetWeight{Labels: e.Labels, Weight: e.Weight, Error: e.Error}
+	}
+	return weights
+}
@@ -0,0 +1,87 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package stats
+
+import (
+	"math"
+	"math/bits"
+)
+
+const (
+	// hllPrecision is the number of hash bits used to select a register. 2^10 one-byte registers
+	// give a standard error of roughly 3.25% in 1KiB of memory.
+	hllPrecision = 10
+	hllRegisters = 1 << hllPrecision
+)
+
+// HyperLogLog estimates the number of distinct values added to it using a fixed amount of memory.
+// Values are added as 64-bit hashes; see hashString. A HyperLogLog is not threadsafe.
+type HyperLogLog struct {
+	registers [hllRegisters]uint8
+}
+
+// AddHash adds a 64-bit hash of some value to the estimator.
+func (h *HyperLogLog) AddHash(hash uint64) {
+	idx := hash >> (64 - hllPrecision)
+	// The rank is the position of the leftmost 1 bit in the remaining bits. The low guard bit keeps
+	// the rank bounded when the remaining bits are all zero.
+	rank := uint8(bits.LeadingZeros64(hash<<hllPrecision|1<<(hllPrecision-1)) + 1)
+	if rank > h.registers[idx] {
+		h.registers[idx] = rank
+	}
+}
+
+// Estimate returns the estimated number of distinct hashes added.
+func (h *HyperLogLog) Estimate() uint64 {
+	m := float64(hllRegisters)
+	sum := 0.0
+	zeros := 0
+	for _, r := range h.registers {
+		sum += 1.0 / float64(uint64(1)<<r)
+		if r == 0 {
+			zeros++
+		}
+	}
+	alpha := 0.7213 / (1 + 1.079/m)
+	estimate := alpha * m * m / sum
+	if estimate <= 2.5*m && zeros > 0 {
+		// Small range correction: linear counting is more accurate here.
+		estimate = m * math.Log(m/float64(zeros))
+	}
+	return uint64(estimate + 0.5)
+}
+
+const fnvOffset = 14695981039346656037
+
+// hashString returns a well-mixed 64-bit hash of s without allocating. It is FNV-1a followed by
+// the murmur3 finalizer, which spreads FNV's weak high bits across the whole word.
+func hashString(s string) uint64 {
+	h := uint64(fnvOffset)
+	for i := 0; i < len(s); i++ {
+		h ^= uint64(s[i])
+		h *= 1099511628211
+	}
+	return mix64(h)
+}
+
+// mix64 is the murmur3 64-bit finalizer.
+func mix64(h uint64) uint64 {
+	h ^= h >> 33
+	h *= 0xff51afd7ed558ccd
+	h ^= h >> 33
+	h *= 0xc4ceb9fe1a85ec53
+	h ^= h >> 33
+	return h
+}
@@ -0,0 +1,46 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package stats
+
+import (
+	"fmt"
+	"math"
+	"testing"
+)
+
+func TestHyperLogLog(t *testing.T) {
+	for _, n := range []int{0, 1, 10, 100, 1000, 10000, 100000} {
+		t.Run(fmt.Sprintf("%v distinct", n), func(t *testing.T) {
+			h := HyperLogLog{}
+			for i := 0; i < n; i++ {
+				// Add each value twice; duplicates must not affect the estimate.
+				h.AddHash(hashString(fmt.Sprintf("value-%v", i)))
+				h.AddHash(hashString(fmt.Sprintf("value-%v", i)))
+			}
+			// Allow 4 standard errors.
+			got := float64(h.Estimate())
+			if math.Abs(got-float64(n)) > 0.13*float64(n)+1 {
+				t.Fatalf("Estimate: want~%v, got=%v", n, got)
+			}
+		})
+	}
+}
+
+func BenchmarkHyperLogLog_AddHash(b *testing.B) {
+	h := HyperLogLog{}
+	for i := 0; i < b.N; i++ {
+		h.AddHash(hashString("customer-1234"))
+	}
+}
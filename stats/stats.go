@@ -14,7 +14,10 @@
 
 package stats
 
-import "time"
+import (
+	"context"
+	"time"
+)
 
 // A Recorder records the result of sending a metrics.StampedMetricReport to one or more endpoints.
 //
@@ -40,6 +43,15 @@ type Provider interface {
 	Snapshot() Snapshot
 }
 
+// A Watcher is a Provider that can notify callers when its Snapshot changes.
+type Watcher interface {
+	Provider
+
+	// WaitForChange blocks until the Snapshot's Version differs from version, or until ctx is done,
+	// and then returns the current Snapshot.
+	WaitForChange(ctx context.Context, version uint64) Snapshot
+}
+
 // Snapshot encapsulates a point-in-time snapshot of agent send stats.
 type Snapshot struct {
 	// The last time a send succeeded.
@@ -50,6 +62,10 @@ type Snapshot struct {
 
 	// The number of failures since the last success.
 	TotalFailureCount int `json:"totalFailureCount"`
+
+	// Version increases each time any of the other fields change. It starts at 1, so a watcher
+	// waiting on version 0 receives the current Snapshot immediately.
+	Version uint64 `json:"version"`
 }
 
 // NewNoopRecorder returns a Recorder that does nothing.
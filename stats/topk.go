@@ -0,0 +1,98 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package stats
+
+import (
+	"sort"
+)
+
+// TopK tracks the heaviest label sets in a weighted stream using the Space-Saving algorithm. It
+// holds at most a fixed number of counters. When a new key arrives and all counters are in use, the
+// counter with the smallest weight is reassigned to the new key, which inherits that weight as its
+// error bound. Any key whose true weight exceeds total/capacity is guaranteed to be tracked.
+// A TopK is not threadsafe.
+type TopK struct {
+	capacity int
+	counters map[uint64]*topKCounter
+}
+
+type topKCounter struct {
+	labels map[string]string
+	weight float64
+	error  float64
+}
+
+// TopKEntry is a single entry returned by TopK.Top.
+type TopKEntry struct {
+	// Labels is a copy of the label set passed to Add when the key was most recently (re)admitted.
+	Labels map[string]string
+	// Weight is an overestimate of the key's total weight.
+	Weight float64
+	// Error is the maximum amount by which Weight overestimates the key's true total weight.
+	Error float64
+}
+
+// NewTopK creates a TopK that tracks at most capacity keys.
+func NewTopK(capacity int) *TopK {
+	return &TopK{capacity: capacity, counters: make(map[uint64]*topKCounter, capacity)}
+}
+
+// Add adds weight to the label set identified by key, which is typically a hash of labels. The
+// labels are copied only when the key is not already tracked.
+func (t *TopK) Add(key uint64, weight float64, labels map[string]string) {
+	if c, ok := t.counters[key]; ok {
+		c.weight += weight
+		return
+	}
+	if len(t.counters) < t.capacity {
+		t.counters[key] = &topKCounter{labels: copyLabels(labels), weight: weight}
+		return
+	}
+	// Evict the smallest counter. Capacities are small, so a linear scan is cheaper than keeping a
+	// heap up to date on every increment.
+	var minKey uint64
+	var min *topKCounter
+	for k, c := range t.counters {
+		if min == nil || c.weight < min.weight {
+			minKey, min = k, c
+		}
+	}
+	delete(t.counters, minKey)
+	min.labels = copyLabels(labels)
+	min.error = min.weight
+	min.weight += weight
+	t.counters[key] = min
+}
+
+// Top returns up to n tracked entries in decreasing order of weight.
+func (t *TopK) Top(n int) []TopKEntry {
+	entries := make([]TopKEntry, 0, len(t.counters))
+	for _, c := range t.counters {
+		entries = append(entries, TopKEntry{Labels: c.labels, Weight: c.weight, Error: c.error})
+	}
+	sort.Slice(entries, func(i, j int) bool { return entries[i].Weight > entries[j].Weight })
+	if len(entries) > n {
+		entries = entries[:n]
+	}
+	return entries
+}
+
+func copyLabels(labels map[string]string) map[string]string {
+	copied := make(map[string]string, len(labels))
+	for k, v := range labels {
+		copied[k] = v
+	}
+	return copied
+}
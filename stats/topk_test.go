@@ -0,0 +1,103 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package stats
+
+import (
+	"fmt"
+	"testing"
+
+	"github.com/GoogleCloudPlatform/ubbagent/metrics"
+)
+
+func TestTopK(t *testing.T) {
+	topk := NewTopK(4)
+	add := func(key string, weight float64) {
+		topk.Add(hashString(key), weight, map[string]string{"key": key})
+	}
+
+	// Two heavy hitters mixed with a long tail of light keys.
+	for i := 0; i < 100; i++ {
+		add("heavy1", 10)
+		add("heavy2", 5)
+		add(fmt.Sprintf("light%v", i), 1)
+	}
+
+	top := topk.Top(2)
+	if len(top) != 2 {
+		t.Fatalf("len(Top(2)): want=2, got=%v", len(top))
+	}
+	if want, got := "heavy1", top[0].Labels["key"]; want != got {
+		t.Fatalf("top[0]: want=%v, got=%v", want, got)
+	}
+	if want, got := "heavy2", top[1].Labels["key"]; want != got {
+		t.Fatalf("top[1]: want=%v, got=%v", want, got)
+	}
+	for _, e := range top {
+		if e.Weight-e.Error > 1000 {
+			t.Fatalf("entry %v: lower bound %v exceeds the true weight", e.Labels, e.Weight-e.Error)
+		}
+	}
+	if len(topk.Top(10)) != 4 {
+		t.Fatalf("expected TopK to hold at most 4 counters")
+	}
+}
+
+func TestCardinality(t *testing.T) {
+	c := NewCardinality()
+	m := c.Metric("requests")
+	if c.Metric("requests") != m {
+		t.Fatalf("expected Metric to return the same sketch for the same name")
+	}
+
+	for i := 0; i < 1000; i++ {
+		m.Observe(metrics.MetricReport{
+			Name:   "requests",
+			Labels: map[string]string{"tier": fmt.Sprintf("tier%v", i%3), "consumer": fmt.Sprintf("c%v", i)},
+			Value:  metrics.MetricValue{Int64Value: 1},
+		})
+	}
+	m.Observe(metrics.MetricReport{
+		Name:   "requests",
+		Labels: map[string]string{"tier": "tier0", "consumer": "whale"},
+		Value:  metrics.MetricValue{Int64Value: 5000},
+	})
+
+	snap := c.Snapshot().Metrics["requests"]
+	if want, got := int64(1001), snap.Reports; want != got {
+		t.Fatalf("Reports: want=%v, got=%v", want, got)
+	}
+	if got := snap.DistinctLabelSets; got < 900 || got > 1100 {
+		t.Fatalf("DistinctLabelSets: want~1001, got=%v", got)
+	}
+	if want, got := uint64(3), snap.LabelKeys["tier"]; want != got {
+		t.Fatalf("LabelKeys[tier]: want=%v, got=%v", want, got)
+	}
+	if len(snap.TopByValue) == 0 || snap.TopByValue[0].Labels["consumer"] != "whale" {
+		t.Fatalf("TopByValue: expected whale first, got %+v", snap.TopByValue)
+	}
+}
+
+func BenchmarkMetricCardinality_Observe(b *testing.B) {
+	m := NewCardinality().Metric("requests")
+	report := metrics.MetricReport{
+		Name:   "requests",
+		Labels: map[string]string{"tier": "enterprise", "consumer": "c1234", "region": "us-east1"},
+		Value:  metrics.MetricValue{Int64Value: 1},
+	}
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		m.Observe(report)
+	}
+}
@@ -15,6 +15,7 @@
 package testlib
 
 import (
+	"context"
 	"sync"
 	"sync/atomic"
 	"testing"
@@ -173,6 +174,7 @@ type MockEndpoint struct {
 	name     string
 	sendErr  error
 	buildErr error
+	hang     bool
 	mu       sync.Mutex
 }
 
@@ -180,8 +182,14 @@ func (ep *MockEndpoint) Name() string {
 	return ep.name
 }
 
-func (ep *MockEndpoint) Send(report pipeline.EndpointReport) error {
+func (ep *MockEndpoint) Send(ctx context.Context, report pipeline.EndpointReport) error {
 	ep.mu.Lock()
+	if ep.hang {
+		ep.mu.Unlock()
+		ep.called()
+		<-ctx.Done()
+		return ctx.Err()
+	}
 	err := ep.sendErr
 	if err == nil {
 		ep.reports = append(ep.reports, report)
@@ -225,6 +233,14 @@ func (ep *MockEndpoint) SetSendErr(err error) {
 	ep.mu.Unlock()
 }
 
+// SetHang makes Send block until its context is done, like an endpoint whose service doesn't
+// respond.
+func (ep *MockEndpoint) SetHang(hang bool) {
+	ep.mu.Lock()
+	ep.hang = hang
+	ep.mu.Unlock()
+}
+
 func (ep *MockEndpoint) SetBuildErr(err error) {
 	ep.mu.Lock()
 	ep.buildErr = err